@@ -0,0 +1,65 @@
+#ifndef BIOS_H_
+#define BIOS_H_
+
+/* BIOS Image
+ *
+ * The interrupt vectors, the BIOS data area and the system BIOS ROM start
+ * out the same in every machine, so mkbios lays them out at build time as
+ * constant arrays in biosimage.h, and system_init() copies them in.
+ * Anything that is fixed from power on belongs in mkbios rather than in
+ * system_init().
+ *
+ * The ROM holds a stub for each interrupt the emulator services: trap nn,
+ * then RETF 2 to hand back the flags the service set, so that a program
+ * that hooks a vector can chain to the one it found there. Other BIOS and
+ * DOS vectors, up to 5Fh, point at a bare IRET, except those that point at
+ * tables, which are left null as there are no tables. 60h and up are left
+ * null for programs to claim, apart from 67h, which EMS drivers are found
+ * through. INT instructions still go straight to the emulator whatever the
+ * vectors say.
+ *
+ * The CPU starts at FFFF:0000, where the ROM asks for INT 19h, the
+ * bootstrap, and halts. Nothing emulates INT 19h, so a machine reset with
+ * no program loaded stops with an error rather than running off into
+ * empty ROM.
+ */
+
+#define BIOS_MEMORY_KB 256 /* conventional memory, as the BIOS data area reports it */
+
+#define BDA_EQUIPMENT 0x410u /* 0040:0010 equipment list */
+#define BDA_MEMORY 0x413u /* 0040:0013 conventional memory in K */
+#define BDA_HARDDISKS 0x475u /* 0040:0075 number of hard disks */
+#define BDA_TICK 0x46Cu /* 0040:006C timer ticks since midnight */
+#define BDA_MIDNIGHT 0x470u /* 0040:0070 timer rolled over midnight */
+#define BDA_VIDEO_MODE 0x449u /* 0040:0049 current video mode */
+#define BDA_COLUMNS 0x44Au /* 0040:004A text columns */
+#define BDA_CURSOR 0x450u /* 0040:0050 cursor column and row, for 8 pages */
+#define BDA_PAGE 0x462u /* 0040:0062 active display page */
+#define BDA_ROWS 0x484u /* 0040:0084 text rows, less one */
+#define BDA_END 0x500u /* the image of low memory stops here */
+
+#define EQUIPMENT_FLOPPY 0x01 /* bits 6-7 hold how many, less one */
+#define EQUIPMENT_COLOR80 0x20 /* initial video mode 80x25 colour */
+
+#define BIOS_SEG 0xF000u
+#define BIOS_EMMNAME 0x000Au /* F000:000A "EMMXXXX0", found through the INT 67h vector */
+#define BIOS_INT67 0x0012u /* F000:0012 INT 67h handler */
+#define BIOS_XMS 0x0017u /* F000:0017 XMS driver entry point */
+#define BIOS_IRET 0x001Au /* F000:001A IRET, for vectors nothing services */
+#define BIOS_STUBS 0x0020u /* F000:0020 stubs for BIOS_SERVICES, in order */
+#define BIOS_STUB 5 /* bytes in each */
+#define BIOS_RESET 0xFFF0u /* F000:FFF0, the same byte as FFFF:0000 */
+#define BIOS_DATE 0xFFF5u /* F000:FFF5 release date, MM/DD/YY */
+#define BIOS_MODEL 0xFFFEu /* F000:FFFE machine model, FEh for an XT */
+
+/* the vectors initiate_irq() services, apart from 67h */
+#define BIOS_SERVICES 0x10, 0x13, 0x16, 0x1A, 0x20, 0x21, 0x2F
+/* the BIOS and DOS vectors that point at tables */
+#define BIOS_TABLES 0x1D, 0x1E, 0x1F, 0x41, 0x43, 0x46
+#define BIOS_VECTORS 0x60 /* vectors below this are filled in */
+
+/* Emulator traps, F1 nn: an opcode that does nothing useful on an 8086,
+ * found only in our own ROM. Trap nn runs interrupt nn, except for these.
+ */
+#define TRAP_XMS 0x00
+#endif
@@ -0,0 +1,122 @@
+/* generated by mkbios from bios.h, do not edit */
+static const BYTE bios_low[1280] = {
+	0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0,
+	0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0,
+	0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0,
+	0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0,
+	0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0,
+	0x1A, 0x00, 0x00, 0xF0, 0x20, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0,
+	0x1A, 0x00, 0x00, 0xF0, 0x25, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0,
+	0x1A, 0x00, 0x00, 0xF0, 0x2A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0,
+	0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0, 0x2F, 0x00, 0x00, 0xF0,
+	0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x34, 0x00, 0x00, 0xF0,
+	0x39, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0,
+	0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0,
+	0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0,
+	0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0,
+	0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0, 0x3E, 0x00, 0x00, 0xF0,
+	0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0,
+	0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0,
+	0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0,
+	0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0,
+	0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0,
+	0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0, 0x00, 0x00, 0x00, 0x00,
+	0x1A, 0x00, 0x00, 0xF0, 0x00, 0x00, 0x00, 0x00, 0x1A, 0x00, 0x00, 0xF0,
+	0x1A, 0x00, 0x00, 0xF0, 0x00, 0x00, 0x00, 0x00, 0x1A, 0x00, 0x00, 0xF0,
+	0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0,
+	0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0,
+	0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0,
+	0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0,
+	0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0,
+	0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0,
+	0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0,
+	0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0, 0x1A, 0x00, 0x00, 0xF0,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x12, 0x00, 0x00, 0xF0, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x20, 0x00, 0x00, 0x00,
+	0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+static const BYTE bios_rom[67] = {
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x45, 0x4D,
+	0x4D, 0x58, 0x58, 0x58, 0x58, 0x30, 0xF1, 0x67, 0xCA, 0x02, 0x00, 0xF1,
+	0x00, 0xCB, 0xCF, 0x00, 0x00, 0x00, 0x00, 0x00, 0xF1, 0x10, 0xCA, 0x02,
+	0x00, 0xF1, 0x13, 0xCA, 0x02, 0x00, 0xF1, 0x16, 0xCA, 0x02, 0x00, 0xF1,
+	0x1A, 0xCA, 0x02, 0x00, 0xF1, 0x20, 0xCA, 0x02, 0x00, 0xF1, 0x21, 0xCA,
+	0x02, 0x00, 0xF1, 0x2F, 0xCA, 0x02, 0x00,
+};
+static const BYTE bios_reset[16] = {
+	0xF1, 0x19, 0xFA, 0xF4, 0x00, 0x30, 0x31, 0x2F, 0x31, 0x30, 0x2F, 0x38,
+	0x36, 0x00, 0xFE, 0x00,
+};
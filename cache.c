@@ -0,0 +1,370 @@
+#define _GNU_SOURCE
+#include "cache.h"
+#include "system.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Result Cache
+ *
+ * A batch run of the same program, with the same arguments and input, on
+ * the same build of the emulator, prints the same thing every time. Given a
+ * cache directory, a run is first looked up there by a hash of the program
+ * image, the guest's command line, the files it can see, everything on
+ * standard input and the monk binary itself. monk's own options are not part
+ * of it, as none that a cached run may have change what the guest prints. A
+ * hit writes out the stored console output, the line DOS gave on stderr when
+ * the program terminated, and the result, without starting a machine at all.
+ * A miss runs as usual, with the console going to stdout and into a buffer,
+ * and a run that ends with the program terminating is stored for next time.
+ *
+ * Standard input is read to its end before the run and the guest is given it
+ * from memory, so a pipe has to be closed by whatever feeds it; a terminal
+ * is never read ahead, and runs from one are not cached. The files under the
+ * root directory are hashed by name, size and modification time rather than
+ * read, which is enough to see any change a program could make to them.
+ *
+ * Each entry is a file named by its hash. A hit sets the time on it, so the
+ * oldest is the least recently used, and after an entry is stored the oldest
+ * are removed until the directory is back within its size cap.
+ */
+
+#define CACHE_MAGIC "monk-cache 2\n"
+#define CACHE_NAME 32 /* hex digits in the name of an entry */
+#define CACHE_DEPTH 16 /* deepest directory hashed, as deep as DOS paths go */
+
+typedef unsigned __int128 HASH;
+
+static const char *dir; /* NULL unless this run is to be stored */
+static char name[CACHE_NAME + 1];
+static HASH key;
+static int input = -1; /* standard input, read ahead */
+static FILE *console;
+static char *output;
+static size_t outlen, outsize;
+
+/* FNV-1a, 128-bit */
+static void
+hash_bytes(const void *buf, size_t len)
+{
+	const HASH prime = ((HASH)1 << 88) | 0x13b;
+	const unsigned char *p = buf;
+
+	while (len--)
+		key = (key ^ *p++) * prime;
+}
+
+/* each field is followed by its length, so that they cannot run together */
+static void
+hash_end(uint64_t len)
+{
+	hash_bytes(&len, sizeof(len));
+}
+
+/* hash what fd has left to read, copying it to copy unless that is -1 */
+static int
+hash_fd(int fd, int copy)
+{
+	char buf[65536];
+	uint64_t len = 0;
+	ssize_t r;
+
+	while ((r = read(fd, buf, sizeof(buf))) != 0) {
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0 || (copy >= 0 && write(copy, buf, r) != r))
+			return -1;
+		hash_bytes(buf, r);
+		len += r;
+	}
+	hash_end(len);
+
+	return 0;
+}
+
+static int
+hash_file(const char *path)
+{
+	int fd = open(path, O_RDONLY), r;
+
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+	r = hash_fd(fd, -1);
+	if (r)
+		perror(path);
+	close(fd);
+
+	return r;
+}
+
+/* the console goes to stdout and is kept, to be stored */
+static ssize_t
+console_write(void *cookie, const char *buf, size_t len)
+{
+	size_t size;
+	char *p;
+
+	(void)cookie;
+	if (outlen + len > outsize) {
+		for (size = outsize ? outsize : 4096; size < outlen + len; size *= 2)
+			;
+		p = realloc(output, size);
+		if (!p)
+			return -1;
+		output = p;
+		outsize = size;
+	}
+	memcpy(output + outlen, buf, len);
+	outlen += len;
+
+	return fwrite(buf, 1, len, stdout) == len ? (ssize_t)len : -1;
+}
+
+/* the names, sizes and times of everything under the directory fd, in
+ * name order, leaving out the cache itself
+ */
+static int
+hash_tree(int fd, const struct stat *skip, unsigned depth)
+{
+	struct dirent **list;
+	struct stat st;
+	int i, n, sub, r = 0;
+
+	n = scandirat(fd, ".", &list, NULL, alphasort);
+	if (n < 0)
+		return -1;
+	for (i = 0; i < n; i++) {
+		if (!r && strcmp(list[i]->d_name, ".") && strcmp(list[i]->d_name, "..") &&
+			!fstatat(fd, list[i]->d_name, &st, AT_SYMLINK_NOFOLLOW) &&
+			(st.st_dev != skip->st_dev || st.st_ino != skip->st_ino)) {
+			hash_bytes(list[i]->d_name, strlen(list[i]->d_name));
+			hash_end(strlen(list[i]->d_name));
+			hash_end(st.st_mode);
+			hash_end(st.st_size);
+			hash_end(st.st_mtim.tv_sec);
+			hash_end(st.st_mtim.tv_nsec);
+			if (S_ISDIR(st.st_mode) && depth < CACHE_DEPTH) {
+				sub = openat(fd, list[i]->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+				r = sub < 0 ? -1 : hash_tree(sub, skip, depth + 1);
+				if (sub >= 0)
+					close(sub);
+			}
+		}
+		free(list[i]);
+	}
+	free(list);
+	hash_end(n);
+
+	return r;
+}
+
+/* write out the entry in f if it is one, returning its result through result */
+static int
+replay_entry(FILE *f, int *result)
+{
+	char message[256], buf[65536];
+	unsigned long long len;
+	struct stat st;
+	size_t n;
+
+	/* the magic; the result, the exit code, which the message below already
+	 * gives, and the length of the output; the message the termination
+	 * printed on stderr, on a line of its own; then the output
+	 */
+	if (!fgets(buf, sizeof(buf), f) || strcmp(buf, CACHE_MAGIC) ||
+		!fgets(buf, sizeof(buf), f) || sscanf(buf, "%d %*d %llu", result, &len) != 2 ||
+		!fgets(message, sizeof(message), f) || !strchr(message, '\n') ||
+		fstat(fileno(f), &st) || (unsigned long long)st.st_size != (unsigned long long)ftello(f) + len)
+		return 0;
+	while ((n = fread(buf, 1, sizeof(buf), f)))
+		fwrite(buf, 1, n, stdout);
+	fflush(stdout);
+	if (message[0] != '\n')
+		fputs(message, stderr);
+
+	return 1;
+}
+
+/* Look a run up in a cache directory: root is the directory the guest's
+ * files are in, and argv the program image followed by its arguments.
+ * Returns 1 on a hit, once the stored output has been written and result
+ * set, 0 on a miss, or -1 if standard input could not be read. On a miss,
+ * call cache_attach() once the machine is up and cache_store() when the run
+ * is over.
+ */
+int
+cache_lookup(const char *cachedir, const char *root, int argc, char *argv[], int *result)
+{
+	static const HASH basis = ((HASH)0x6c62272e07bb0142ull << 64) | 0x62b821756295c58dull;
+	char path[4096];
+	struct stat self;
+	unsigned i;
+	FILE *f;
+	int fd, r, hit;
+
+	key = basis;
+	if (hash_file("/proc/self/exe") || hash_file(argv[0]))
+		return 0;
+	for (i = 1; i < (unsigned)argc; i++) {
+		hash_bytes(argv[i], strlen(argv[i]));
+		hash_end(strlen(argv[i]));
+	}
+	hash_end(argc);
+	if (stat(cachedir, &self))
+		memset(&self, 0, sizeof(self));
+	fd = open(root, O_RDONLY | O_DIRECTORY);
+	r = fd < 0 ? -1 : hash_tree(fd, &self, 0);
+	if (fd >= 0)
+		close(fd);
+	if (r || isatty(STDIN_FILENO))
+		return 0;
+	input = memfd_create("input", 0);
+	if (input < 0 || hash_fd(STDIN_FILENO, input)) {
+		perror("input");
+		return -1;
+	}
+	lseek(input, 0, SEEK_SET);
+
+	for (i = 0; i < CACHE_NAME; i++)
+		name[i] = "0123456789abcdef"[(unsigned)(key >> (CACHE_NAME - 1 - i) * 4) & 15];
+	snprintf(path, sizeof(path), "%s/%s", cachedir, name);
+	f = fopen(path, "rb");
+	if (f) {
+		hit = replay_entry(f, result);
+		fclose(f);
+		if (hit) {
+			utimensat(AT_FDCWD, path, NULL, 0);
+			return 1;
+		}
+	}
+	dir = cachedir;
+
+	return 0;
+}
+
+/* give the machine the input read ahead and the console that is kept */
+void
+cache_attach(void)
+{
+	static const cookie_io_functions_t io = { .write = console_write };
+
+	if (input >= 0)
+		system_setinput(input);
+	if (!dir)
+		return;
+	console = fopencookie(NULL, "w", io);
+	if (!console) {
+		dir = NULL;
+		return;
+	}
+	/* as stdout would be to a terminal */
+	setvbuf(console, NULL, _IOLBF, 0);
+	system_setconsole(console);
+}
+
+struct entry {
+	char name[CACHE_NAME + 1];
+	off_t size;
+	struct timespec used;
+};
+
+static int
+entry_cmp(const void *a, const void *b)
+{
+	const struct timespec *x = &((const struct entry*)a)->used, *y = &((const struct entry*)b)->used;
+
+	if (x->tv_sec != y->tv_sec)
+		return x->tv_sec < y->tv_sec ? -1 : 1;
+	return x->tv_nsec < y->tv_nsec ? -1 : x->tv_nsec > y->tv_nsec;
+}
+
+/* remove the least recently used entries until the rest fit in kb */
+static void
+evict(unsigned long kb)
+{
+	struct entry *v = NULL, *p;
+	size_t n = 0, size = 0, i;
+	unsigned long long total = 0;
+	struct dirent *e;
+	struct stat st;
+	DIR *d;
+
+	d = opendir(dir);
+	if (!d)
+		return;
+	while ((e = readdir(d))) {
+		if (strlen(e->d_name) != CACHE_NAME ||
+			strspn(e->d_name, "0123456789abcdef") != CACHE_NAME ||
+			fstatat(dirfd(d), e->d_name, &st, 0))
+			continue;
+		if (n == size) {
+			size = size ? size * 2 : 64;
+			p = realloc(v, size * sizeof(*v));
+			if (!p)
+				break;
+			v = p;
+		}
+		strcpy(v[n].name, e->d_name);
+		v[n].size = st.st_size;
+		v[n].used = st.st_mtim;
+		total += st.st_size;
+		n++;
+	}
+	if (total > kb * 1024ull) {
+		qsort(v, n, sizeof(*v), entry_cmp);
+		for (i = 0; i < n && total > kb * 1024ull; i++)
+			if (!unlinkat(dirfd(d), v[i].name, 0) || errno == ENOENT)
+				total -= v[i].size;
+	}
+	closedir(d);
+	free(v);
+}
+
+/* Finish a run that missed: result is what it came to, and a program that
+ * terminated has its output stored, within a cap of kb on the directory.
+ */
+void
+cache_store(int result, unsigned long kb)
+{
+	char path[4096], tmp[4096];
+	FILE *f;
+	int bad;
+
+	if (!dir)
+		return;
+	bad = fclose(console) != 0;
+	system_setconsole(stdout);
+	console = NULL;
+	if (bad || result != 1)
+		goto done;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	snprintf(tmp, sizeof(tmp), "%s/%s.%ld.tmp", dir, name, (long)getpid());
+	f = fopen(tmp, "wb");
+	if (!f) {
+		perror(tmp);
+		goto done;
+	}
+	fprintf(f, CACHE_MAGIC "%d %d %zu\n%s\n", result, system_exitcode(), outlen, system_exitmessage());
+	bad = fwrite(output, 1, outlen, f) != outlen;
+	if (fclose(f) | bad || rename(tmp, path)) {
+		perror(path);
+		unlink(tmp);
+		goto done;
+	}
+	evict(kb);
+
+done:
+	free(output);
+	output = NULL;
+	outlen = outsize = 0;
+	dir = NULL;
+}
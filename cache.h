@@ -0,0 +1,9 @@
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#define CACHE_KB 65536 /* default size cap of a cache directory */
+
+int cache_lookup(const char *dir, const char *root, int argc, char *argv[], int *result);
+void cache_attach(void);
+void cache_store(int result, unsigned long kb);
+#endif
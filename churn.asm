@@ -0,0 +1,40 @@
+	; A benchmark that keeps the interpreter busy with nothing but
+	; arithmetic, register moves and memory writes: 19 passes over 56K of
+	; words, then 64 letters made from what was left there. Exits with
+	; code 0. Compare builds or probes with
+	;	time monk -u churn.com
+	org 100h
+
+	mov cx, 19		; passes
+	mov ax, 1
+	mov si, 2
+pass:
+	push cx
+	mov di, 1000h
+	mov cx, 6ffbh		; words in each
+next:
+	push ax			; ax = ax * 5 + 1
+	pop bx
+	add ax, ax
+	add ax, ax
+	add ax, bx
+	add ax, 1
+	add [di], ax
+	add di, si
+	loop next
+	pop cx
+	loop pass
+	mov si, 1000h		; a letter from every 421st byte
+	mov bp, 1a5h
+	mov cx, 64
+letter:
+	mov al, [si]
+	and al, 0fh
+	add al, 'A'
+	mov dl, al
+	mov ah, 2
+	int 21h
+	add si, bp
+	loop letter
+	mov ax, 4c00h
+	int 21h
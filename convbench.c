@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "convert.h"
+
+/* Conversion Benchmark
+ *
+ * Runs every set of kernels this CPU has over random frames of each guest
+ * format, checks they match the scalar reference exactly, and reports how
+ * many frames a second each manages.
+ */
+
+#define BENCH_NS 200000000ull /* time spent on each case */
+
+static const char *const sets[] = { "scalar", "sse2", "avx2" };
+
+static const struct bench_case {
+	const char *name;
+	enum screen_format format;
+	unsigned width, height, pitch, interleave, scale;
+} cases[] = {
+	{ "CGA 640x200 1bpp", SCREEN_1BPP, 640, 200, 80, 0x2000, 1 },
+	{ "CGA 320x200 2bpp", SCREEN_2BPP, 320, 200, 80, 0x2000, 1 },
+	{ "EGA 320x200 planar", SCREEN_PLANAR4, 320, 200, 40, 0, 1 },
+	{ "VGA 640x480 planar", SCREEN_PLANAR4, 640, 480, 80, 0, 1 },
+	{ "VGA 320x200 8bpp", SCREEN_8BPP, 320, 200, 320, 0, 1 },
+	{ "VGA 320x200 8bpp x2", SCREEN_8BPP, 320, 200, 320, 0, 2 },
+	{ "VGA 320x200 8bpp x3", SCREEN_8BPP, 320, 200, 320, 0, 3 },
+	{ "VGA 640x480 planar x2", SCREEN_PLANAR4, 640, 480, 80, 0, 2 },
+};
+
+static struct screen_frame frame;
+static uint32_t pixels[SCREEN_MAXWIDTH * SCREEN_MAXHEIGHT];
+static uint32_t scaled[SCREEN_MAXWIDTH * SCREEN_MAXHEIGHT * SCREEN_MAXSCALE * SCREEN_MAXSCALE];
+static uint32_t reference[SCREEN_MAXWIDTH * SCREEN_MAXHEIGHT * SCREEN_MAXSCALE * SCREEN_MAXSCALE];
+
+static unsigned long long
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* one frame through the selected kernels, returning where it ended up */
+static const uint32_t *
+run(const struct bench_case *c)
+{
+	convert_frame(&frame, pixels);
+	if (c->scale == 1)
+		return pixels;
+	convert_scale(scaled, pixels, c->width, c->height, c->scale);
+	return scaled;
+}
+
+int
+main(void)
+{
+	const struct bench_case *c;
+	unsigned long long start, elapsed, n;
+	size_t i, len;
+	unsigned k;
+	int failed = 0;
+
+	srand(1);
+	for (i = 0; i < SCREEN_VRAM; i++)
+		frame.vram[i] = rand();
+	for (i = 0; i < 256; i++)
+		frame.palette[i] = rand() & 0xffffffu;
+
+	printf("%-24s", "");
+	for (k = 0; k < sizeof(sets) / sizeof(*sets); k++)
+		printf("%12s", sets[k]);
+	printf("   frames/s\n");
+
+	for (c = cases; c < cases + sizeof(cases) / sizeof(*cases); c++) {
+		frame.format = c->format;
+		frame.width = c->width;
+		frame.height = c->height;
+		frame.pitch = c->pitch;
+		frame.interleave = c->interleave;
+		len = (size_t)c->width * c->height * c->scale * c->scale;
+
+		convert_select("scalar");
+		memcpy(reference, run(c), len * sizeof(*reference));
+
+		printf("%-24s", c->name);
+		for (k = 0; k < sizeof(sets) / sizeof(*sets); k++) {
+			if (convert_select(sets[k])) {
+				printf("%12s", "-");
+				continue;
+			}
+			if (memcmp(run(c), reference, len * sizeof(*reference))) {
+				printf("%12s", "MISMATCH");
+				failed = 1;
+				continue;
+			}
+			start = now_ns();
+			for (n = 0; (elapsed = now_ns() - start) < BENCH_NS; n++)
+				run(c);
+			printf("%12.0f", n * 1e9 / elapsed);
+		}
+		printf("\n");
+	}
+
+	return failed;
+}
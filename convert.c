@@ -0,0 +1,151 @@
+#include "convert.h"
+#include <string.h>
+
+/* Pixel Conversion
+ *
+ * Frames arrive as guest video memory and a palette, and leave as 32-bit
+ * host pixels, maybe scaled up by a whole number. Each step is a kernel
+ * that handles one line, in a table per instruction set. The plain C table
+ * here is the reference the others must match bit for bit; convert_select()
+ * picks the widest one the CPU has, asking CPUID, unless told otherwise.
+ */
+
+static const struct convert_kernels *kernels;
+
+static void
+expand_1bpp(uint32_t *out, const unsigned char *s, unsigned width, const uint32_t *pal)
+{
+	unsigned x;
+
+	for (x = 0; x < width; x++)
+		out[x] = pal[(s[x >> 3] >> (7 - (x & 7))) & 1];
+}
+
+static void
+expand_2bpp(uint32_t *out, const unsigned char *s, unsigned width, const uint32_t *pal)
+{
+	unsigned x;
+
+	for (x = 0; x < width; x++)
+		out[x] = pal[(s[x >> 2] >> (6 - 2 * (x & 3))) & 3];
+}
+
+static void
+expand_planar4(uint32_t *out, const unsigned char *s, unsigned width, const uint32_t *pal)
+{
+	unsigned x, p, c;
+
+	for (x = 0; x < width; x++) {
+		for (p = 0, c = 0; p < 4; p++)
+			c |= ((s[p * SCREEN_PLANE + (x >> 3)] >> (7 - (x & 7))) & 1) << p;
+		out[x] = pal[c];
+	}
+}
+
+static void
+expand_8bpp(uint32_t *out, const unsigned char *s, unsigned width, const uint32_t *pal)
+{
+	unsigned x;
+
+	for (x = 0; x < width; x++)
+		out[x] = pal[s[x]];
+}
+
+static void
+scale_row(uint32_t *out, const uint32_t *in, unsigned width, unsigned scale)
+{
+	unsigned x, i;
+
+	for (x = 0; x < width; x++)
+		for (i = 0; i < scale; i++)
+			*out++ = in[x];
+}
+
+const struct convert_kernels convert_scalar = {
+	"scalar", expand_1bpp, expand_2bpp, expand_planar4, expand_8bpp, scale_row,
+};
+
+/* Use the kernels called name, or the best there are for NULL. Returns -1
+ * if there is no such set, or the CPU cannot run it.
+ */
+int
+convert_select(const char *name)
+{
+	const struct convert_kernels *k = &convert_scalar;
+
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2") && (!name || !strcmp(name, convert_avx2.name)))
+		k = &convert_avx2;
+	else if (__builtin_cpu_supports("sse2") && (!name || !strcmp(name, convert_sse2.name)))
+		k = &convert_sse2;
+#endif
+	if (name && strcmp(name, k->name))
+		return -1;
+	kernels = k;
+
+	return 0;
+}
+
+const char *
+convert_name(void)
+{
+	if (!kernels)
+		convert_select(NULL);
+	return kernels->name;
+}
+
+/* start of line y in a plane, for modes that store odd lines apart */
+static const unsigned char *
+line(const struct screen_frame *f, unsigned y)
+{
+	if (f->interleave)
+		return f->vram + (y & 1) * f->interleave + (y >> 1) * f->pitch;
+	return f->vram + y * f->pitch;
+}
+
+/* write f as width * height pixels */
+void
+convert_frame(const struct screen_frame *f, uint32_t *out)
+{
+	void (*expand)(uint32_t *, const unsigned char *, unsigned, const uint32_t *);
+	unsigned y;
+
+	if (!kernels)
+		convert_select(NULL);
+	switch (f->format) {
+	case SCREEN_1BPP:
+		expand = kernels->expand_1bpp;
+		break;
+	case SCREEN_2BPP:
+		expand = kernels->expand_2bpp;
+		break;
+	case SCREEN_PLANAR4:
+		expand = kernels->expand_planar4;
+		break;
+	case SCREEN_8BPP:
+		expand = kernels->expand_8bpp;
+		break;
+	default:
+		return;
+	}
+	for (y = 0; y < f->height; y++, out += f->width)
+		expand(out, line(f, y), f->width, f->palette);
+}
+
+/* make each pixel of in a square of scale pixels on a side in out */
+void
+convert_scale(uint32_t *out, const uint32_t *in, unsigned width, unsigned height, unsigned scale)
+{
+	size_t pitch = (size_t)width * scale;
+	unsigned y, i;
+
+	if (!kernels)
+		convert_select(NULL);
+	for (y = 0; y < height; y++, in += width) {
+		kernels->scale_row(out, in, width, scale);
+		for (i = 1; i < scale; i++)
+			memcpy(out + i * pitch, out, pitch * sizeof(*out));
+		out += pitch * scale;
+	}
+}
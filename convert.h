@@ -0,0 +1,27 @@
+#ifndef CONVERT_H_
+#define CONVERT_H_
+#include "screen.h"
+
+/* Kernels for one line. Expanders take the line's bytes, or the first
+ * plane's for planar frames, and write width 0x00RRGGBB pixels. scale_row
+ * repeats each of width pixels scale times.
+ */
+struct convert_kernels {
+	const char *name;
+	void (*expand_1bpp)(uint32_t *out, const unsigned char *src, unsigned width, const uint32_t *palette);
+	void (*expand_2bpp)(uint32_t *out, const unsigned char *src, unsigned width, const uint32_t *palette);
+	void (*expand_planar4)(uint32_t *out, const unsigned char *src, unsigned width, const uint32_t *palette);
+	void (*expand_8bpp)(uint32_t *out, const unsigned char *src, unsigned width, const uint32_t *palette);
+	void (*scale_row)(uint32_t *out, const uint32_t *in, unsigned width, unsigned scale);
+};
+
+extern const struct convert_kernels convert_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+extern const struct convert_kernels convert_sse2, convert_avx2;
+#endif
+
+int convert_select(const char *name);
+const char *convert_name(void);
+void convert_frame(const struct screen_frame *f, uint32_t *out);
+void convert_scale(uint32_t *out, const uint32_t *in, unsigned width, unsigned height, unsigned scale);
+#endif
@@ -0,0 +1,112 @@
+#include "convert.h"
+#if defined(__x86_64__) || defined(__i386__)
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+/* AVX2 Kernels
+ *
+ * Eight pixels to a register. Variable shifts pull each pixel's index out
+ * of its byte, and with sixteen colors or fewer the whole palette fits in
+ * two registers, so the lookup is a permute and never touches memory. 256
+ * color pixels use a gather. Frames always carry a 256 entry palette, so
+ * loading its first sixteen entries is safe whatever the format.
+ */
+
+static void
+expand_1bpp(uint32_t *out, const unsigned char *s, unsigned width, const uint32_t *pal)
+{
+	const __m256i shifts = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0), one = _mm256_set1_epi32(1);
+	const __m256i colors = _mm256_loadu_si256((const __m256i*)pal);
+	unsigned x;
+	__m256i idx;
+
+	for (x = 0; x + 8 <= width; x += 8, out += 8) {
+		idx = _mm256_and_si256(_mm256_srlv_epi32(_mm256_set1_epi32(*s++), shifts), one);
+		_mm256_storeu_si256((__m256i*)out, _mm256_permutevar8x32_epi32(colors, idx));
+	}
+	convert_scalar.expand_1bpp(out, s, width - x, pal);
+}
+
+static void
+expand_2bpp(uint32_t *out, const unsigned char *s, unsigned width, const uint32_t *pal)
+{
+	const __m256i shifts = _mm256_setr_epi32(6, 4, 2, 0, 14, 12, 10, 8), three = _mm256_set1_epi32(3);
+	const __m256i colors = _mm256_loadu_si256((const __m256i*)pal);
+	unsigned x;
+	__m256i idx;
+
+	for (x = 0; x + 8 <= width; x += 8, s += 2, out += 8) {
+		idx = _mm256_and_si256(_mm256_srlv_epi32(_mm256_set1_epi32(s[0] | s[1] << 8), shifts), three);
+		_mm256_storeu_si256((__m256i*)out, _mm256_permutevar8x32_epi32(colors, idx));
+	}
+	convert_scalar.expand_2bpp(out, s, width - x, pal);
+}
+
+/* bit of plane p for each of eight pixels, moved to bit p */
+#define PLANE_BITS(s, p) _mm256_slli_epi32(_mm256_and_si256( \
+	_mm256_srlv_epi32(_mm256_set1_epi32((s)[(p) * SCREEN_PLANE]), shifts), one), (p))
+
+static void
+expand_planar4(uint32_t *out, const unsigned char *s, unsigned width, const uint32_t *pal)
+{
+	const __m256i shifts = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0), one = _mm256_set1_epi32(1);
+	const __m256i seven = _mm256_set1_epi32(7);
+	const __m256i lo = _mm256_loadu_si256((const __m256i*)pal), hi = _mm256_loadu_si256((const __m256i*)(pal + 8));
+	unsigned x;
+	__m256i idx;
+
+	for (x = 0; x + 8 <= width; x += 8, s++, out += 8) {
+		idx = _mm256_or_si256(_mm256_or_si256(PLANE_BITS(s, 0), PLANE_BITS(s, 1)),
+			_mm256_or_si256(PLANE_BITS(s, 2), PLANE_BITS(s, 3)));
+		_mm256_storeu_si256((__m256i*)out, _mm256_blendv_epi8(_mm256_permutevar8x32_epi32(lo, idx),
+			_mm256_permutevar8x32_epi32(hi, idx), _mm256_cmpgt_epi32(idx, seven)));
+	}
+	convert_scalar.expand_planar4(out, s, width - x, pal);
+}
+
+static void
+expand_8bpp(uint32_t *out, const unsigned char *s, unsigned width, const uint32_t *pal)
+{
+	unsigned x;
+	__m256i idx;
+
+	for (x = 0; x + 8 <= width; x += 8) {
+		idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(s + x)));
+		_mm256_storeu_si256((__m256i*)(out + x), _mm256_i32gather_epi32((const int*)pal, idx, 4));
+	}
+	convert_scalar.expand_8bpp(out + x, s + x, width - x, pal);
+}
+
+static void
+scale_row(uint32_t *out, const uint32_t *in, unsigned width, unsigned scale)
+{
+	const __m256i d0 = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3), d1 = _mm256_setr_epi32(4, 4, 5, 5, 6, 6, 7, 7);
+	const __m256i t0 = _mm256_setr_epi32(0, 0, 0, 1, 1, 1, 2, 2), t1 = _mm256_setr_epi32(2, 3, 3, 3, 4, 4, 4, 5);
+	const __m256i t2 = _mm256_setr_epi32(5, 5, 6, 6, 6, 7, 7, 7);
+	unsigned x = 0;
+	__m256i v;
+
+	switch (scale) {
+	case 2:
+		for (; x + 8 <= width; x += 8, out += 16) {
+			v = _mm256_loadu_si256((const __m256i*)(in + x));
+			_mm256_storeu_si256((__m256i*)out, _mm256_permutevar8x32_epi32(v, d0));
+			_mm256_storeu_si256((__m256i*)out + 1, _mm256_permutevar8x32_epi32(v, d1));
+		}
+		break;
+	case 3:
+		for (; x + 8 <= width; x += 8, out += 24) {
+			v = _mm256_loadu_si256((const __m256i*)(in + x));
+			_mm256_storeu_si256((__m256i*)out, _mm256_permutevar8x32_epi32(v, t0));
+			_mm256_storeu_si256((__m256i*)out + 1, _mm256_permutevar8x32_epi32(v, t1));
+			_mm256_storeu_si256((__m256i*)out + 2, _mm256_permutevar8x32_epi32(v, t2));
+		}
+		break;
+	}
+	convert_scalar.scale_row(out, in + x, width - x, scale);
+}
+
+const struct convert_kernels convert_avx2 = {
+	"avx2", expand_1bpp, expand_2bpp, expand_planar4, expand_8bpp, scale_row,
+};
+#endif
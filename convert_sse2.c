@@ -0,0 +1,123 @@
+#include "convert.h"
+#if defined(__x86_64__) || defined(__i386__)
+#pragma GCC target("sse2")
+#include <emmintrin.h>
+
+/* SSE2 Kernels
+ *
+ * Four pixels to a register. Packed pixels are pulled apart by testing each
+ * pixel's bits against a mask per lane, and with four colors or fewer the
+ * color is chosen by masking rather than looked up. Planar pixels get their
+ * indices built eight at a time, but SSE2 has no gather, so they and 256
+ * color pixels are still looked up one by one. Whatever is left of a line
+ * goes to the scalar kernels.
+ */
+
+/* a where m is all ones, b where it is zero */
+static inline __m128i
+pick(__m128i m, __m128i a, __m128i b)
+{
+	return _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, b));
+}
+
+static inline __m128i
+bitset(__m128i v, __m128i bits)
+{
+	return _mm_cmpeq_epi32(_mm_and_si128(v, bits), bits);
+}
+
+static void
+expand_1bpp(uint32_t *out, const unsigned char *s, unsigned width, const uint32_t *pal)
+{
+	const __m128i hi = _mm_setr_epi32(0x80, 0x40, 0x20, 0x10), lo = _mm_setr_epi32(0x08, 0x04, 0x02, 0x01);
+	const __m128i c0 = _mm_set1_epi32(pal[0]), c1 = _mm_set1_epi32(pal[1]);
+	unsigned x;
+	__m128i v;
+
+	for (x = 0; x + 8 <= width; x += 8, out += 8) {
+		v = _mm_set1_epi32(*s++);
+		_mm_storeu_si128((__m128i*)out, pick(bitset(v, hi), c1, c0));
+		_mm_storeu_si128((__m128i*)out + 1, pick(bitset(v, lo), c1, c0));
+	}
+	convert_scalar.expand_1bpp(out, s, width - x, pal);
+}
+
+static void
+expand_2bpp(uint32_t *out, const unsigned char *s, unsigned width, const uint32_t *pal)
+{
+	const __m128i hi = _mm_setr_epi32(0x80, 0x20, 0x08, 0x02), lo = _mm_setr_epi32(0x40, 0x10, 0x04, 0x01);
+	const __m128i c0 = _mm_set1_epi32(pal[0]), c1 = _mm_set1_epi32(pal[1]);
+	const __m128i c2 = _mm_set1_epi32(pal[2]), c3 = _mm_set1_epi32(pal[3]);
+	unsigned x;
+	__m128i v, l;
+
+	for (x = 0; x + 4 <= width; x += 4, out += 4) {
+		v = _mm_set1_epi32(*s++);
+		l = bitset(v, lo);
+		_mm_storeu_si128((__m128i*)out, pick(bitset(v, hi), pick(l, c3, c2), pick(l, c1, c0)));
+	}
+	convert_scalar.expand_2bpp(out, s, width - x, pal);
+}
+
+static void
+expand_planar4(uint32_t *out, const unsigned char *s, unsigned width, const uint32_t *pal)
+{
+	const __m128i bits = _mm_setr_epi16(0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+	unsigned x, p, i;
+	uint16_t idx[8];
+	__m128i v, c;
+
+	for (x = 0; x + 8 <= width; x += 8, s++, out += 8) {
+		c = _mm_setzero_si128();
+		for (p = 0; p < 4; p++) {
+			v = _mm_and_si128(_mm_set1_epi16(s[p * SCREEN_PLANE]), bits);
+			c = _mm_or_si128(c, _mm_and_si128(_mm_cmpeq_epi16(v, bits), _mm_set1_epi16(1 << p)));
+		}
+		_mm_storeu_si128((__m128i*)idx, c);
+		for (i = 0; i < 8; i++)
+			out[i] = pal[idx[i]];
+	}
+	convert_scalar.expand_planar4(out, s, width - x, pal);
+}
+
+static void
+expand_8bpp(uint32_t *out, const unsigned char *s, unsigned width, const uint32_t *pal)
+{
+	unsigned x;
+
+	for (x = 0; x + 4 <= width; x += 4)
+		_mm_storeu_si128((__m128i*)(out + x),
+			_mm_setr_epi32(pal[s[x]], pal[s[x + 1]], pal[s[x + 2]], pal[s[x + 3]]));
+	convert_scalar.expand_8bpp(out + x, s + x, width - x, pal);
+}
+
+static void
+scale_row(uint32_t *out, const uint32_t *in, unsigned width, unsigned scale)
+{
+	unsigned x = 0;
+	__m128i v;
+
+	switch (scale) {
+	case 2:
+		for (; x + 4 <= width; x += 4, out += 8) {
+			v = _mm_loadu_si128((const __m128i*)(in + x));
+			_mm_storeu_si128((__m128i*)out, _mm_unpacklo_epi32(v, v));
+			_mm_storeu_si128((__m128i*)out + 1, _mm_unpackhi_epi32(v, v));
+		}
+		break;
+	case 3:
+		for (; x + 4 <= width; x += 4, out += 12) {
+			v = _mm_loadu_si128((const __m128i*)(in + x));
+			_mm_storeu_si128((__m128i*)out, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 0, 0)));
+			_mm_storeu_si128((__m128i*)out + 1, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 2, 1, 1)));
+			_mm_storeu_si128((__m128i*)out + 2, _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 2)));
+		}
+		break;
+	}
+	convert_scalar.scale_row(out, in + x, width - x, scale);
+}
+
+const struct convert_kernels convert_sse2 = {
+	"sse2", expand_1bpp, expand_2bpp, expand_planar4, expand_8bpp, scale_row,
+};
+#endif
@@ -0,0 +1,65 @@
+#include "delta.h"
+#include <string.h>
+
+/* XOR Deltas
+ *
+ * The difference between two buffers is their XOR, which is mostly zeros
+ * when little has changed, so it is stored run-length encoded: a 16-bit
+ * count of zero bytes, a 16-bit count of literal bytes, then the literals,
+ * repeated. Applying a delta flips the bytes that differ, which takes a
+ * buffer from either version to the other.
+ */
+
+#define RUN_MIN 4 /* zeros worth ending a literal run for */
+#define RUN_MAX 0xffffu
+
+static void
+put16(BYTE *p, unsigned v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+/* encode a ^ b into out, returning its size, which is 0 if they are the same */
+size_t
+delta_encode(BYTE *out, const BYTE *a, const BYTE *b, size_t len)
+{
+	size_t pos = 0, n = 0, zeros, lits, z;
+
+	while (pos < len) {
+		for (zeros = 0; pos + zeros < len && zeros < RUN_MAX && a[pos + zeros] == b[pos + zeros]; zeros++)
+			;
+		if (pos + zeros == len)
+			break;
+		pos += zeros;
+		/* literals run until a stretch of RUN_MIN equal bytes, or the end */
+		for (lits = 0, z = 0; pos + lits < len && lits < RUN_MAX; lits++) {
+			if (a[pos + lits] != b[pos + lits])
+				z = 0;
+			else if (++z == RUN_MIN)
+				break;
+		}
+		if (z == RUN_MIN)
+			lits -= RUN_MIN - 1;
+		put16(out + n, zeros);
+		put16(out + n + 2, lits);
+		for (n += 4, z = 0; z < lits; z++)
+			out[n++] = a[pos + z] ^ b[pos + z];
+		pos += lits;
+	}
+
+	return n;
+}
+
+void
+delta_apply(BYTE *dst, const BYTE *delta, size_t size)
+{
+	size_t n = 0, lits;
+
+	while (n + 4 <= size) {
+		dst += delta[n] | (delta[n + 1] << 8);
+		lits = delta[n + 2] | (delta[n + 3] << 8);
+		for (n += 4; lits--; n++)
+			*dst++ ^= delta[n];
+	}
+}
@@ -0,0 +1,11 @@
+#ifndef DELTA_H_
+#define DELTA_H_
+#include <stddef.h>
+#include "system.h"
+
+/* most bytes delta_encode() writes for len bytes of input */
+#define DELTA_MAX(len) ((len) + (len) / 2 + 8)
+
+size_t delta_encode(BYTE *out, const BYTE *a, const BYTE *b, size_t len);
+void delta_apply(BYTE *dst, const BYTE *delta, size_t size);
+#endif
@@ -0,0 +1,405 @@
+#include "dirindex.h"
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Directory Index
+ *
+ * DOS sees a host directory through an index built once per directory:
+ * every entry gets an 8.3 name, long or odd host names are mangled to
+ * NAME~N.EXT, and the entries are kept sorted by name with a hash table on
+ * top. Looking up a name is a hash probe and a wildcard search only visits
+ * the run of entries sharing the pattern's literal prefix.
+ *
+ * An index stays valid for as long as the directory's mtime does not move,
+ * which is checked with one fstat() each time it is fetched. Anything we
+ * change ourselves invalidates it explicitly.
+ */
+
+#define DIRINDEX_MAX 16 /* directories kept */
+
+struct entry {
+	char fcb[FCBNAME];
+	char *host;
+};
+
+struct dirindex {
+	int fd; /* our own descriptor for the directory, -1 if the slot is free */
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	unsigned gen;
+	unsigned long lastuse;
+	struct entry *ent; /* sorted by fcb */
+	unsigned n;
+	unsigned *hash; /* entry index + 1, 0 if empty */
+	unsigned hashmask;
+};
+
+static struct dirindex cache[DIRINDEX_MAX] = {
+	[0 ... DIRINDEX_MAX - 1] = { .fd = -1 },
+};
+static unsigned long usecount;
+static unsigned gencount;
+
+static int
+dosvalid(int c)
+{
+	return isalnum(c) || (c > 127) || strchr("!#$%&'()-@^_`{}~", c);
+}
+
+/* convert a DOS file name (or pattern) to FCB form, truncating as DOS does */
+void
+fcbname(const char *name, char fcb[FCBNAME])
+{
+	int i, c;
+
+	memset(fcb, ' ', FCBNAME);
+	for (i = 0; *name && *name != '.'; name++) {
+		c = toupper((unsigned char)*name);
+		if (c == '*') {
+			while (i < 8)
+				fcb[i++] = '?';
+		} else if (i < 8) {
+			fcb[i++] = c;
+		}
+	}
+	if (*name == '.')
+		name++;
+	for (i = 8; *name; name++) {
+		c = toupper((unsigned char)*name);
+		if (c == '*') {
+			while (i < FCBNAME)
+				fcb[i++] = '?';
+		} else if (i < FCBNAME) {
+			fcb[i++] = c;
+		}
+	}
+}
+
+/* FCB form back to NAME.EXT */
+static void
+fcb_to_dos(const char fcb[FCBNAME], char dosname[13])
+{
+	int i, n = 0;
+
+	for (i = 0; i < 8 && fcb[i] != ' '; i++)
+		dosname[n++] = fcb[i];
+	if (fcb[8] != ' ') {
+		dosname[n++] = '.';
+		for (i = 8; i < FCBNAME && fcb[i] != ' '; i++)
+			dosname[n++] = fcb[i];
+	}
+	dosname[n] = 0;
+}
+
+/* FCB form of a host name, or -1 if it is not a valid 8.3 name */
+static int
+fcb_from_host(const char *host, char fcb[FCBNAME])
+{
+	const char *dot = strchr(host, '.');
+	size_t base = dot ? (size_t)(dot - host) : strlen(host);
+	size_t i;
+
+	if (!base || base > 8 || (dot && (strchr(dot + 1, '.') || !dot[1] || strlen(dot + 1) > 3)))
+		return -1;
+	for (i = 0; host[i]; i++)
+		if (host + i != dot && !dosvalid((unsigned char)host[i]))
+			return -1;
+	fcbname(host, fcb);
+	return 0;
+}
+
+static unsigned
+fcbhash(const char fcb[FCBNAME])
+{
+	unsigned h = 2166136261u;
+	int i;
+
+	for (i = 0; i < FCBNAME; i++)
+		h = (h ^ (unsigned char)fcb[i]) * 16777619u;
+	return h;
+}
+
+static int
+entry_find(const struct dirindex *d, const char fcb[FCBNAME])
+{
+	unsigned i, e;
+
+	for (i = fcbhash(fcb) & d->hashmask; (e = d->hash[i]); i = (i + 1) & d->hashmask)
+		if (!memcmp(d->ent[e - 1].fcb, fcb, FCBNAME))
+			return e - 1;
+	return -1;
+}
+
+static int
+entry_cmp(const void *a, const void *b)
+{
+	return memcmp(((const struct entry *)a)->fcb, ((const struct entry *)b)->fcb, FCBNAME);
+}
+
+static void
+dirindex_free(struct dirindex *d)
+{
+	unsigned i;
+
+	for (i = 0; i < d->n; i++)
+		free(d->ent[i].host);
+	free(d->ent);
+	free(d->hash);
+	d->ent = NULL;
+	d->hash = NULL;
+	d->n = 0;
+}
+
+static void
+hash_insert(struct dirindex *d, unsigned e)
+{
+	unsigned i;
+
+	for (i = fcbhash(d->ent[e].fcb) & d->hashmask; d->hash[i]; i = (i + 1) & d->hashmask)
+		;
+	d->hash[i] = e + 1;
+}
+
+/* Give every entry its 8.3 name: valid names first, so that they keep
+ * their own name, then the rest mangled to something still free.
+ */
+static void
+assign_names(struct dirindex *d, unsigned char *mangle)
+{
+	unsigned i, n, k;
+	const char *dot;
+	char fcb[FCBNAME], num[8];
+	size_t j, len;
+
+	for (i = 0; i < d->n; i++) {
+		mangle[i] = fcb_from_host(d->ent[i].host, fcb) || entry_find(d, fcb) >= 0;
+		if (!mangle[i]) {
+			memcpy(d->ent[i].fcb, fcb, FCBNAME);
+			hash_insert(d, i);
+		}
+	}
+
+	for (i = 0; i < d->n; i++) {
+		if (!mangle[i])
+			continue;
+		dot = strrchr(d->ent[i].host, '.');
+		if (dot == d->ent[i].host)
+			dot = NULL;
+		memset(fcb, ' ', FCBNAME);
+		for (k = 8, j = 1; dot && dot[j] && k < FCBNAME; j++)
+			if (dosvalid((unsigned char)dot[j]))
+				fcb[k++] = toupper((unsigned char)dot[j]);
+		for (n = 1; ; n++) {
+			len = sprintf(num, "~%u", n);
+			for (k = 0, j = 0; d->ent[i].host + j != dot && d->ent[i].host[j] && k < 8 - len; j++)
+				if (dosvalid((unsigned char)d->ent[i].host[j]))
+					fcb[k++] = toupper((unsigned char)d->ent[i].host[j]);
+			memset(fcb + k, ' ', 8 - k);
+			memcpy(fcb + k, num, len);
+			if (entry_find(d, fcb) < 0)
+				break;
+		}
+		memcpy(d->ent[i].fcb, fcb, FCBNAME);
+		hash_insert(d, i);
+	}
+}
+
+static int
+dirindex_build(struct dirindex *d)
+{
+	struct dirent *de;
+	unsigned char *mangle;
+	unsigned cap = 0, i;
+	DIR *dir;
+	int fd;
+
+	dirindex_free(d);
+	fd = dup(d->fd);
+	if (fd < 0)
+		return -1;
+	dir = fdopendir(fd);
+	if (!dir) {
+		close(fd);
+		return -1;
+	}
+	rewinddir(dir); /* the offset is shared with d->fd */
+	while ((de = readdir(dir))) {
+		if (de->d_name[0] == '.') /* also leaves out . and .. */
+			continue;
+		if (d->n == cap) {
+			struct entry *e = realloc(d->ent, (cap = cap ? cap * 2 : 16) * sizeof(*e));
+
+			if (!e)
+				break;
+			d->ent = e;
+		}
+		d->ent[d->n].host = strdup(de->d_name);
+		if (d->ent[d->n].host)
+			d->n++;
+	}
+	closedir(dir);
+
+	for (d->hashmask = 15; d->hashmask < d->n * 2; d->hashmask = d->hashmask * 2 + 1)
+		;
+	d->hash = calloc(d->hashmask + 1, sizeof(*d->hash));
+	mangle = malloc(d->n + 1);
+	if (!d->hash || !mangle) {
+		free(mangle);
+		dirindex_free(d);
+		return -1;
+	}
+	assign_names(d, mangle);
+	free(mangle);
+
+	/* sort, then rebuild the hash to point at the new positions */
+	qsort(d->ent, d->n, sizeof(*d->ent), entry_cmp);
+	memset(d->hash, 0, (d->hashmask + 1) * sizeof(*d->hash));
+	for (i = 0; i < d->n; i++)
+		hash_insert(d, i);
+	d->gen = ++gencount;
+
+	return 0;
+}
+
+/* the index for an open directory, built or rebuilt if needed */
+struct dirindex *
+dirindex_get(int dirfd)
+{
+	struct dirindex *d, *victim = NULL;
+	struct stat st;
+	unsigned i;
+
+	if (fstat(dirfd, &st))
+		return NULL;
+
+	for (i = 0; i < DIRINDEX_MAX; i++) {
+		d = &cache[i];
+		if (d->fd >= 0 && d->dev == st.st_dev && d->ino == st.st_ino)
+			break;
+		if (!victim || d->fd < 0 || (victim->fd >= 0 && d->lastuse < victim->lastuse))
+			victim = d;
+	}
+
+	if (i == DIRINDEX_MAX) {
+		d = victim;
+		if (d->fd >= 0) {
+			close(d->fd);
+			dirindex_free(d);
+		}
+		d->fd = dup(dirfd);
+		if (d->fd < 0)
+			return NULL;
+		d->dev = st.st_dev;
+		d->ino = st.st_ino;
+		d->gen = 0;
+	}
+
+	if (!d->gen || d->mtime.tv_sec != st.st_mtim.tv_sec || d->mtime.tv_nsec != st.st_mtim.tv_nsec) {
+		d->mtime = st.st_mtim;
+		if (dirindex_build(d)) {
+			d->gen = 0;
+			return NULL;
+		}
+	}
+	d->lastuse = ++usecount;
+
+	return d;
+}
+
+/* the index an earlier search was using, if it has not changed since */
+struct dirindex *
+dirindex_resume(unsigned slot, unsigned gen)
+{
+	if (slot >= DIRINDEX_MAX || cache[slot].fd < 0 || !gen || cache[slot].gen != gen)
+		return NULL;
+	return &cache[slot];
+}
+
+void
+dirindex_id(const struct dirindex *d, unsigned *slot, unsigned *gen)
+{
+	*slot = d - cache;
+	*gen = d->gen;
+}
+
+void
+dirindex_invalidate(struct dirindex *d)
+{
+	d->gen = 0;
+}
+
+void
+dirindex_done(void)
+{
+	unsigned i;
+
+	for (i = 0; i < DIRINDEX_MAX; i++) {
+		if (cache[i].fd >= 0) {
+			close(cache[i].fd);
+			dirindex_free(&cache[i]);
+			cache[i].fd = -1;
+		}
+	}
+}
+
+/* host name for a DOS name, or NULL */
+const char *
+dirindex_lookup(struct dirindex *d, const char *dosname)
+{
+	char fcb[FCBNAME];
+	int e;
+
+	fcbname(dosname, fcb);
+	e = entry_find(d, fcb);
+	return e < 0 ? NULL : d->ent[e].host;
+}
+
+/* Find the next entry from *pos on matching a pattern in FCB form, where
+ * '?' matches any character. Directories are only included if dirs is set.
+ * Returns 0 with the entry's name and host attributes, -1 if none is left.
+ */
+int
+dirindex_match(struct dirindex *d, const char pattern[FCBNAME], int dirs,
+	unsigned *pos, char dosname[13], struct stat *st)
+{
+	unsigned lo, hi, mid, prefix, i;
+	const struct entry *e;
+
+	for (prefix = 0; prefix < FCBNAME && pattern[prefix] != '?'; prefix++)
+		;
+
+	/* start no earlier than the first name that could share the prefix */
+	lo = *pos;
+	hi = d->n;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (memcmp(d->ent[mid].fcb, pattern, prefix) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < d->n; lo++) {
+		e = &d->ent[lo];
+		if (memcmp(e->fcb, pattern, prefix))
+			break;
+		for (i = prefix; i < FCBNAME && (pattern[i] == '?' || pattern[i] == e->fcb[i]); i++)
+			;
+		if (i < FCBNAME || fstatat(d->fd, e->host, st, AT_SYMLINK_NOFOLLOW))
+			continue;
+		if (S_ISDIR(st->st_mode) ? !dirs : !S_ISREG(st->st_mode))
+			continue;
+		fcb_to_dos(e->fcb, dosname);
+		*pos = lo + 1;
+		return 0;
+	}
+	*pos = d->n;
+
+	return -1;
+}
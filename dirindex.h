@@ -0,0 +1,19 @@
+#ifndef DIRINDEX_H_
+#define DIRINDEX_H_
+#include <sys/stat.h>
+
+/* names are kept FCB style: 8 name and 3 extension characters, space padded */
+#define FCBNAME 11
+
+struct dirindex;
+
+struct dirindex *dirindex_get(int dirfd);
+struct dirindex *dirindex_resume(unsigned slot, unsigned gen);
+void dirindex_id(const struct dirindex *d, unsigned *slot, unsigned *gen);
+void dirindex_invalidate(struct dirindex *d);
+void dirindex_done(void);
+void fcbname(const char *name, char fcb[FCBNAME]);
+const char *dirindex_lookup(struct dirindex *d, const char *dosname);
+int dirindex_match(struct dirindex *d, const char pattern[FCBNAME], int dirs,
+	unsigned *pos, char dosname[13], struct stat *st);
+#endif
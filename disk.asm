@@ -0,0 +1,78 @@
+	; Disk images through INT 13h: write a sector to the diskette in A:,
+	; read it back and compare, then check that a sector past the end of
+	; the track is refused. Prints a line and exits with code 0, or exits
+	; with the number of the check that failed. Writes to the image, so
+	; give it a blank one:
+	;	truncate -s 1440k fd.img && monk -a fd.img disk.com
+	org 100h
+
+%macro	expect 2		; condition that has to hold, else exit with code %2
+	j%1 %%ok
+	mov ax, 4c00h + %2
+	int 21h
+%%ok:
+%endmacro
+
+	mov ah, 0		; reset
+	mov dl, 0
+	int 13h
+	expect nc, 1
+	mov ah, 8		; a 1.44M diskette, 18 sectors a track
+	mov dl, 0
+	int 13h
+	expect nc, 2
+	and cl, 3fh
+	cmp cl, 18
+	expect e, 2
+	push ds			; which left ES at the parameter table
+	pop es
+	mov di, wbuf		; fill a sector with a pattern
+	mov cx, 512
+	mov al, 0
+fill:
+	mov [di], al
+	add al, 7
+	inc di
+	loop fill
+	mov ax, 0301h		; write it to cylinder 0, head 0, sector 2
+	mov cx, 0002h
+	mov dx, 0000h
+	mov bx, wbuf
+	int 13h
+	expect nc, 3
+	mov ax, 0201h		; and read it back
+	mov cx, 0002h
+	mov dx, 0000h
+	mov bx, rbuf
+	int 13h
+	expect nc, 4
+	mov si, wbuf
+	mov di, rbuf
+	mov cx, 512
+compare:
+	mov al, [si]
+	cmp al, [di]
+	expect e, 5
+	inc si
+	inc di
+	loop compare
+	mov ax, 0201h		; sector 19 is past the end of the track
+	mov cx, 0013h
+	mov dx, 0000h
+	mov bx, rbuf
+	int 13h
+	expect c, 6
+	mov ah, 1		; and the status says so
+	mov dl, 0
+	int 13h
+	cmp ah, 4
+	expect e, 7
+	mov ah, 9
+	mov dx, pass
+	int 21h
+	mov ax, 4c00h
+	int 21h
+
+pass:	db "Disk OK", 13, 10, "$"
+wbuf:	times 512 db 0
+rbuf:	times 512 db 0
@@ -0,0 +1,291 @@
+#include "disk.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Disk Images
+ *
+ * A raw image is mapped MAP_PRIVATE, so the mapping doubles as the sector
+ * cache: reads copy straight out of the page cache and writes land in
+ * private pages without touching the file. Written sectors are tracked in a
+ * bitmap and written back in runs by disk_flush().
+ *
+ * Seek latency is modelled, not slept: disk_seek() returns how long the
+ * access would have taken for the caller to charge to the virtual clock.
+ */
+
+#define DISK_MAX 4 /* A: B: and two hard disks */
+
+struct disk {
+	int fd;
+	int readonly;
+	BYTE *map;
+	unsigned long sectors;
+	unsigned cyls, heads, spt;
+	unsigned cyl; /* where the heads are now */
+	unsigned char *dirty; /* one bit per sector */
+};
+
+/* microseconds, per kind of drive */
+struct timing {
+	unsigned step; /* per cylinder moved */
+	unsigned settle; /* after any seek */
+	unsigned rev; /* one revolution */
+};
+
+static const struct timing floppy_timing = { 6000, 15000, 200000 }; /* 300 RPM */
+static const struct timing hd_timing = { 200, 3000, 16667 }; /* 3600 RPM */
+
+static struct disk disks[DISK_MAX];
+static int realistic_latency;
+
+/* floppy formats, identified by image size */
+static const struct {
+	unsigned cyls, heads, spt;
+} floppy_formats[] = {
+	{ 40, 1, 8 }, /* 160K */
+	{ 40, 1, 9 }, /* 180K */
+	{ 40, 2, 8 }, /* 320K */
+	{ 40, 2, 9 }, /* 360K */
+	{ 80, 2, 9 }, /* 720K */
+	{ 80, 2, 15 }, /* 1.2M */
+	{ 80, 2, 18 }, /* 1.44M */
+	{ 80, 2, 36 }, /* 2.88M */
+};
+
+static struct disk *
+disk_get(int drive)
+{
+	int i;
+
+	if (drive >= 0x80)
+		i = drive - 0x80 + 2;
+	else
+		i = drive;
+	if (i < 0 || i >= DISK_MAX || (drive < 0x80 && i >= 2) || !disks[i].map)
+		return NULL;
+	return &disks[i];
+}
+
+static int
+disk_setgeometry(struct disk *d, int floppy)
+{
+	unsigned i;
+
+	if (floppy) {
+		for (i = 0; i < sizeof(floppy_formats) / sizeof(*floppy_formats); i++) {
+			d->cyls = floppy_formats[i].cyls;
+			d->heads = floppy_formats[i].heads;
+			d->spt = floppy_formats[i].spt;
+			if ((unsigned long)d->cyls * d->heads * d->spt == d->sectors)
+				return 0;
+		}
+		return -1;
+	}
+
+	/* the usual translation for disks up to the 8GB CHS limit */
+	d->heads = 16;
+	d->spt = 63;
+	d->cyls = d->sectors / (d->heads * d->spt);
+	if (d->cyls > 1024)
+		d->cyls = 1024;
+	return d->cyls ? 0 : -1;
+}
+
+int
+disk_attach(int drive, const char *filename)
+{
+	struct disk *d;
+	struct stat st;
+	int i;
+
+	i = drive >= 0x80 ? drive - 0x80 + 2 : drive;
+	if (i < 0 || i >= DISK_MAX || (drive < 0x80 && i >= 2)) {
+		fprintf(stderr, "%s: no such drive %02X\n", filename, drive);
+		return -1;
+	}
+	d = &disks[i];
+	disk_detach(drive);
+
+	d->readonly = 0;
+	d->fd = open(filename, O_RDWR);
+	if (d->fd < 0) {
+		d->readonly = 1;
+		d->fd = open(filename, O_RDONLY);
+	}
+	if (d->fd < 0) {
+		perror(filename);
+		return -1;
+	}
+	if (fstat(d->fd, &st) || st.st_size < DISK_SECTOR) {
+		fprintf(stderr, "%s: not a disk image\n", filename);
+		goto fail;
+	}
+	d->sectors = st.st_size / DISK_SECTOR;
+	if (disk_setgeometry(d, drive < 0x80)) {
+		fprintf(stderr, "%s: unknown geometry for %lu sectors\n", filename, d->sectors);
+		goto fail;
+	}
+
+	d->map = mmap(NULL, d->sectors * DISK_SECTOR, PROT_READ | PROT_WRITE, MAP_PRIVATE, d->fd, 0);
+	if (d->map == MAP_FAILED) {
+		d->map = NULL;
+		perror(filename);
+		goto fail;
+	}
+	d->dirty = calloc((d->sectors + 7) / 8, 1);
+	if (!d->dirty) {
+		perror(filename);
+		munmap(d->map, d->sectors * DISK_SECTOR);
+		d->map = NULL;
+		goto fail;
+	}
+	d->cyl = 0;
+
+	fprintf(stderr, "Disk %02X: %s, %u/%u/%u%s\n", drive, filename,
+		d->cyls, d->heads, d->spt, d->readonly ? " (read-only)" : "");
+
+	return 0;
+fail:
+	close(d->fd);
+	return -1;
+}
+
+/* write back every run of dirty sectors */
+int
+disk_flush(int drive)
+{
+	struct disk *d = disk_get(drive);
+	unsigned long s, e;
+	int result = 0;
+
+	if (!d)
+		return -1;
+
+	for (s = 0; s < d->sectors; s = e) {
+		if (!(d->dirty[s / 8] & (1u << (s % 8)))) {
+			e = s + 1;
+			continue;
+		}
+		for (e = s; e < d->sectors && (d->dirty[e / 8] & (1u << (e % 8))); e++)
+			d->dirty[e / 8] &= ~(1u << (e % 8));
+		if (pwrite(d->fd, d->map + s * DISK_SECTOR, (e - s) * DISK_SECTOR,
+			(off_t)s * DISK_SECTOR) != (ssize_t)((e - s) * DISK_SECTOR)) {
+			perror("disk write-back");
+			result = -1;
+		}
+	}
+
+	return result;
+}
+
+void
+disk_detach(int drive)
+{
+	struct disk *d = disk_get(drive);
+
+	if (!d)
+		return;
+	disk_flush(drive);
+	munmap(d->map, d->sectors * DISK_SECTOR);
+	free(d->dirty);
+	close(d->fd);
+	d->map = NULL;
+	d->dirty = NULL;
+}
+
+void
+disk_setlatency(int realistic)
+{
+	realistic_latency = realistic;
+}
+
+int
+disk_present(int drive)
+{
+	return disk_get(drive) != NULL;
+}
+
+int
+disk_readonly(int drive)
+{
+	struct disk *d = disk_get(drive);
+
+	return !d || d->readonly;
+}
+
+unsigned long
+disk_sectors(int drive)
+{
+	struct disk *d = disk_get(drive);
+
+	return d ? d->sectors : 0;
+}
+
+void
+disk_geometry(int drive, unsigned *cyls, unsigned *heads, unsigned *spt)
+{
+	struct disk *d = disk_get(drive);
+
+	*cyls = d ? d->cyls : 0;
+	*heads = d ? d->heads : 0;
+	*spt = d ? d->spt : 0;
+}
+
+/* Move the heads to lba and return the microseconds the access would take:
+ * the seek, half a revolution on average to find the sector, then the
+ * transfer itself.
+ */
+unsigned long
+disk_seek(int drive, unsigned long lba, unsigned count)
+{
+	struct disk *d = disk_get(drive);
+	const struct timing *t;
+	unsigned cyl;
+	unsigned long us = 0;
+
+	if (!d)
+		return 0;
+	cyl = lba / (d->heads * d->spt);
+	if (!realistic_latency) {
+		d->cyl = cyl;
+		return 0;
+	}
+
+	t = drive < 0x80 ? &floppy_timing : &hd_timing;
+	if (cyl != d->cyl)
+		us += t->settle + t->step * (cyl > d->cyl ? cyl - d->cyl : d->cyl - cyl);
+	us += t->rev / 2;
+	us += (unsigned long)t->rev * count / d->spt;
+	d->cyl = cyl;
+
+	return us;
+}
+
+/* pointer to count sectors starting at lba, or NULL if out of range */
+const BYTE *
+disk_map(int drive, unsigned long lba, unsigned count)
+{
+	struct disk *d = disk_get(drive);
+
+	if (!d || lba >= d->sectors || count > d->sectors - lba)
+		return NULL;
+	return d->map + lba * DISK_SECTOR;
+}
+
+/* same as disk_map(), for sectors about to be written */
+BYTE *
+disk_mapwrite(int drive, unsigned long lba, unsigned count)
+{
+	struct disk *d = disk_get(drive);
+	unsigned long s;
+
+	if (!d || d->readonly || lba >= d->sectors || count > d->sectors - lba)
+		return NULL;
+	for (s = lba; s < lba + count; s++)
+		d->dirty[s / 8] |= 1u << (s % 8);
+	return d->map + lba * DISK_SECTOR;
+}
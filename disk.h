@@ -0,0 +1,19 @@
+#ifndef DISK_H_
+#define DISK_H_
+#include "system.h"
+
+#define DISK_SECTOR 512u
+
+/* drive numbers are the BIOS ones: 00h, 01h floppies, 80h, 81h hard disks */
+int disk_attach(int drive, const char *filename);
+void disk_detach(int drive);
+int disk_flush(int drive);
+void disk_setlatency(int realistic);
+int disk_present(int drive);
+int disk_readonly(int drive);
+unsigned long disk_sectors(int drive);
+void disk_geometry(int drive, unsigned *cyls, unsigned *heads, unsigned *spt);
+unsigned long disk_seek(int drive, unsigned long lba, unsigned count);
+const BYTE *disk_map(int drive, unsigned long lba, unsigned count);
+BYTE *disk_mapwrite(int drive, unsigned long lba, unsigned count);
+#endif
@@ -0,0 +1,540 @@
+#include "dosfile.h"
+#include "dirindex.h"
+#include "replay.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* DOS File Handles
+ *
+ * Each open handle is a host descriptor plus the DOS file pointer. All I/O
+ * is positional (pread/pwrite) on the caller's buffer, so data moves between
+ * the file and guest RAM without an intermediate copy.
+ *
+ * Every path is resolved inside a sandbox root directory. The walk goes one
+ * component at a time through openat() with O_NOFOLLOW, after ".." has been
+ * folded away, so a guest cannot name anything outside the root. Names are
+ * matched through the directory index, which maps 8.3 names to host names.
+ *
+ * What these calls return is input to the guest from outside, so it goes
+ * into a recording, and a replay answers from the log without the host.
+ *
+ * A rewind can put the file pointers back, which is enough to read the same
+ * data again, but not undo a change to the files themselves, so each one is
+ * counted for it to see whether it has to refuse.
+ */
+
+#define DOSPATH_MAX 128
+#define DOSPATH_DEPTH 16
+
+static struct dosfile {
+	int fd; /* -1 when free */
+	int mode; /* 0 read, 1 write, 2 read/write */
+	off_t pos;
+} files[DOSFILE_MAX] = {
+	[0 ... DOSFILE_MAX - 1] = { .fd = -1 },
+};
+
+static int rootfd = -1;
+static unsigned long changes; /* opens, closes, writes and truncations */
+
+static int host_close(int handle);
+
+int
+dosfile_setroot(const char *dir)
+{
+	int fd = open(dir, O_RDONLY | O_DIRECTORY);
+
+	if (fd < 0) {
+		perror(dir);
+		return -1;
+	}
+	if (rootfd >= 0)
+		close(rootfd);
+	rootfd = fd;
+
+	return 0;
+}
+
+void
+dosfile_done(void)
+{
+	int i;
+
+	for (i = DOSFILE_FIRST; i < DOSFILE_MAX; i++)
+		host_close(i);
+	if (rootfd >= 0)
+		close(rootfd);
+	rootfd = -1;
+	dirindex_done();
+}
+
+/* Resolve a DOS path to the descriptor of the directory it is in, with the
+ * last component, upper-cased, left in name. Returns the descriptor, or a
+ * negated DOS error.
+ */
+static int
+resolve(const char *dospath, char name[DOSPATH_MAX])
+{
+	char path[DOSPATH_MAX], *comp[DOSPATH_DEPTH], *p;
+	const char *host;
+	struct dirindex *d;
+	int n = 0, i, dirfd, fd;
+
+	if (rootfd < 0 && dosfile_setroot("."))
+		return -DOSERR_NOPATH;
+	if (strlen(dospath) >= sizeof(path))
+		return -DOSERR_NOPATH;
+
+	/* drop the drive letter, then split into upper-case components */
+	if (isalpha((unsigned char)dospath[0]) && dospath[1] == ':')
+		dospath += 2;
+	for (i = 0; dospath[i]; i++)
+		path[i] = toupper((unsigned char)dospath[i]);
+	path[i] = 0;
+	for (p = strtok(path, "\\/"); p; p = strtok(NULL, "\\/")) {
+		if (!strcmp(p, "."))
+			continue;
+		if (!strcmp(p, "..")) {
+			if (n)
+				n--;
+			continue;
+		}
+		if (n == DOSPATH_DEPTH)
+			return -DOSERR_NOPATH;
+		comp[n++] = p;
+	}
+	if (!n)
+		return -DOSERR_NOFILE;
+
+	dirfd = dup(rootfd);
+	for (i = 0; dirfd >= 0 && i < n - 1; i++) {
+		d = dirindex_get(dirfd);
+		host = d ? dirindex_lookup(d, comp[i]) : NULL;
+		if (!host) {
+			close(dirfd);
+			return -DOSERR_NOPATH;
+		}
+		fd = openat(dirfd, host, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		close(dirfd);
+		dirfd = fd;
+	}
+	if (dirfd < 0)
+		return -DOSERR_NOPATH;
+	strcpy(name, comp[n - 1]);
+
+	return dirfd;
+}
+
+static int
+dos_errno(void)
+{
+	switch (errno) {
+	case ENOENT:
+		return -DOSERR_NOFILE;
+	case ENOTDIR:
+	case ELOOP:
+		return -DOSERR_NOPATH;
+	case EMFILE:
+	case ENFILE:
+		return -DOSERR_NOHANDLES;
+	default:
+		return -DOSERR_ACCESS;
+	}
+}
+
+static int
+dosfile_new(const char *dospath, int flags, int mode)
+{
+	char name[DOSPATH_MAX];
+	const char *host;
+	struct dirindex *d;
+	int h, dirfd, fd;
+
+	for (h = DOSFILE_FIRST; h < DOSFILE_MAX && files[h].fd >= 0; h++)
+		;
+	if (h == DOSFILE_MAX)
+		return -DOSERR_NOHANDLES;
+
+	dirfd = resolve(dospath, name);
+	if (dirfd < 0)
+		return dirfd;
+	d = dirindex_get(dirfd);
+	host = d ? dirindex_lookup(d, name) : NULL;
+	if (!host && !(flags & O_CREAT)) {
+		close(dirfd);
+		return -DOSERR_NOFILE;
+	}
+	fd = openat(dirfd, host ? host : name, flags | O_NOFOLLOW, 0666);
+	close(dirfd);
+	if (fd < 0)
+		return dos_errno();
+	if (!host && d)
+		dirindex_invalidate(d);
+
+	files[h].fd = fd;
+	files[h].mode = mode;
+	files[h].pos = 0;
+	changes++;
+
+	return h;
+}
+
+static struct dosfile *
+dosfile_get(int handle)
+{
+	if (handle < DOSFILE_FIRST || handle >= DOSFILE_MAX || files[handle].fd < 0)
+		return NULL;
+	return &files[handle];
+}
+
+/* mode is the access code from AL: 0 read, 1 write, 2 read/write */
+static int
+host_open(const char *dospath, int mode)
+{
+	static const int flags[3] = { O_RDONLY, O_WRONLY, O_RDWR };
+
+	if (mode < 0 || mode > 2)
+		return -DOSERR_MODE;
+	return dosfile_new(dospath, flags[mode], mode);
+}
+
+static int
+host_create(const char *dospath)
+{
+	return dosfile_new(dospath, O_RDWR | O_CREAT | O_TRUNC, 2);
+}
+
+static int
+host_close(int handle)
+{
+	struct dosfile *f = dosfile_get(handle);
+
+	if (!f)
+		return -DOSERR_HANDLE;
+	close(f->fd);
+	f->fd = -1;
+	changes++;
+
+	return 0;
+}
+
+static long
+host_read(int handle, void *buf, size_t len)
+{
+	struct dosfile *f = dosfile_get(handle);
+	ssize_t n;
+
+	if (!f)
+		return -DOSERR_HANDLE;
+	if (f->mode == 1)
+		return -DOSERR_ACCESS;
+	n = pread(f->fd, buf, len, f->pos);
+	if (n < 0)
+		return -DOSERR_ACCESS;
+	f->pos += n;
+
+	return n;
+}
+
+static long
+host_write(int handle, const void *buf, size_t len)
+{
+	struct dosfile *f = dosfile_get(handle);
+	ssize_t n;
+
+	if (!f)
+		return -DOSERR_HANDLE;
+	if (f->mode == 0)
+		return -DOSERR_ACCESS;
+	n = pwrite(f->fd, buf, len, f->pos);
+	if (n < 0)
+		return -DOSERR_ACCESS;
+	f->pos += n;
+	changes++;
+
+	return n;
+}
+
+/* a zero-length write truncates the file at the file pointer */
+static int
+host_truncate(int handle)
+{
+	struct dosfile *f = dosfile_get(handle);
+
+	if (!f)
+		return -DOSERR_HANDLE;
+	if (f->mode == 0 || ftruncate(f->fd, f->pos))
+		return -DOSERR_ACCESS;
+	changes++;
+
+	return 0;
+}
+
+/* whence is the method from AL: 0 start, 1 current, 2 end */
+static long
+host_seek(int handle, long offset, int whence)
+{
+	struct dosfile *f = dosfile_get(handle);
+	struct stat st;
+	off_t base;
+
+	if (!f)
+		return -DOSERR_HANDLE;
+	switch (whence) {
+	case 0:
+		base = 0;
+		break;
+	case 1:
+		base = f->pos;
+		break;
+	case 2:
+		if (fstat(f->fd, &st))
+			return -DOSERR_ACCESS;
+		base = st.st_size;
+		break;
+	default:
+		return -DOSERR_FUNCTION;
+	}
+	if (base + offset < 0)
+		return -DOSERR_FUNCTION;
+	f->pos = base + offset;
+
+	return f->pos;
+}
+
+/* DOS packs the date and time of a file into two words */
+static void
+dos_datetime(time_t t, BYTE *p)
+{
+	struct tm tm;
+	unsigned v;
+
+	localtime_r(&t, &tm);
+	if (tm.tm_year < 80) { /* nothing before 1980 */
+		memset(&tm, 0, sizeof(tm));
+		tm.tm_year = 80;
+		tm.tm_mday = 1;
+	}
+	v = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+	p[0] = v;
+	p[1] = v >> 8;
+	v = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+	p[2] = v;
+	p[3] = v >> 8;
+}
+
+/* Fill in the next match for the search recorded in the DTA. The reserved
+ * area at the start of the DTA holds the index slot and generation, the
+ * position to carry on from, the attributes and the pattern.
+ */
+static int
+dosfile_findmatch(struct dirindex *d, BYTE dta[DOSFIND_SIZE])
+{
+	unsigned pos = dta[5] | (dta[6] << 8);
+	char dosname[13];
+	struct stat st;
+
+	if (dirindex_match(d, (const char *)dta + 8, dta[7] & 0x10, &pos, dosname, &st))
+		return -DOSERR_NOMORE;
+
+	dta[5] = pos;
+	dta[6] = pos >> 8;
+	dta[0x15] = S_ISDIR(st.st_mode) ? 0x10 : (st.st_mode & S_IWUSR) ? 0x20 : 0x21;
+	dos_datetime(st.st_mtime, dta + 0x16);
+	dta[0x1A] = st.st_size;
+	dta[0x1B] = st.st_size >> 8;
+	dta[0x1C] = st.st_size >> 16;
+	dta[0x1D] = st.st_size >> 24;
+	memset(dta + 0x1E, 0, 13);
+	strcpy((char *)dta + 0x1E, dosname);
+
+	return 0;
+}
+
+static int
+host_findfirst(const char *spec, int attr, BYTE dta[DOSFIND_SIZE])
+{
+	char name[DOSPATH_MAX];
+	struct dirindex *d;
+	unsigned slot, gen;
+	int dirfd;
+
+	dirfd = resolve(spec, name);
+	if (dirfd < 0)
+		return dirfd == -DOSERR_NOFILE ? -DOSERR_NOMORE : dirfd;
+	d = dirindex_get(dirfd);
+	close(dirfd);
+	if (!d)
+		return -DOSERR_NOPATH;
+
+	dirindex_id(d, &slot, &gen);
+	dta[0] = slot;
+	dta[1] = gen;
+	dta[2] = gen >> 8;
+	dta[3] = gen >> 16;
+	dta[4] = gen >> 24;
+	dta[5] = dta[6] = 0;
+	dta[7] = attr;
+	fcbname(name, (char *)dta + 8);
+
+	return dosfile_findmatch(d, dta);
+}
+
+static int
+host_findnext(BYTE dta[DOSFIND_SIZE])
+{
+	struct dirindex *d;
+
+	d = dirindex_resume(dta[0], dta[1] | (dta[2] << 8) | (dta[3] << 16) | ((unsigned)dta[4] << 24));
+	if (!d)
+		return -DOSERR_NOMORE;
+	return dosfile_findmatch(d, dta);
+}
+
+/* in a replay, the result the call had when it was recorded */
+static int
+replayed(long *r, void *data, size_t len)
+{
+	uint64_t t;
+
+	if (replay_mode() != REPLAY_PLAY)
+		return 0;
+	if (replay_next(REPLAY_FILE, &t) || t != replay_now()) {
+		replay_diverged("file call");
+		*r = -DOSERR_ACCESS;
+	} else {
+		*r = replay_take(REPLAY_FILE, data, len);
+	}
+	return 1;
+}
+
+static long
+recorded(long r, const void *data, size_t len)
+{
+	if (replay_mode() == REPLAY_RECORD)
+		replay_put(REPLAY_FILE, replay_now(), r, r >= 0 ? data : NULL, len);
+	return r;
+}
+
+int
+dosfile_open(const char *dospath, int mode)
+{
+	long r;
+
+	if (replayed(&r, NULL, 0))
+		return r;
+	return recorded(host_open(dospath, mode), NULL, 0);
+}
+
+int
+dosfile_create(const char *dospath)
+{
+	long r;
+
+	if (replayed(&r, NULL, 0))
+		return r;
+	return recorded(host_create(dospath), NULL, 0);
+}
+
+int
+dosfile_close(int handle)
+{
+	long r;
+
+	if (replayed(&r, NULL, 0))
+		return r;
+	return recorded(host_close(handle), NULL, 0);
+}
+
+long
+dosfile_read(int handle, void *buf, size_t len)
+{
+	long r;
+
+	if (replayed(&r, buf, len))
+		return r;
+	r = host_read(handle, buf, len);
+	return recorded(r, buf, r > 0 ? (size_t)r : 0);
+}
+
+long
+dosfile_write(int handle, const void *buf, size_t len)
+{
+	long r;
+
+	if (replayed(&r, NULL, 0))
+		return r;
+	return recorded(host_write(handle, buf, len), NULL, 0);
+}
+
+int
+dosfile_truncate(int handle)
+{
+	long r;
+
+	if (replayed(&r, NULL, 0))
+		return r;
+	return recorded(host_truncate(handle), NULL, 0);
+}
+
+long
+dosfile_seek(int handle, long offset, int whence)
+{
+	long r;
+
+	if (replayed(&r, NULL, 0))
+		return r;
+	return recorded(host_seek(handle, offset, whence), NULL, 0);
+}
+
+int
+dosfile_findfirst(const char *spec, int attr, BYTE dta[DOSFIND_SIZE])
+{
+	long r;
+
+	if (replayed(&r, dta, DOSFIND_SIZE))
+		return r;
+	return recorded(host_findfirst(spec, attr, dta), dta, DOSFIND_SIZE);
+}
+
+int
+dosfile_findnext(BYTE dta[DOSFIND_SIZE])
+{
+	long r;
+
+	if (replayed(&r, dta, DOSFIND_SIZE))
+		return r;
+	return recorded(host_findnext(dta), dta, DOSFIND_SIZE);
+}
+
+void
+dosfile_save(struct dosfile_state *s)
+{
+	int h;
+
+	for (h = 0; h < DOSFILE_MAX; h++)
+		s->pos[h] = files[h].pos;
+	s->changes = changes;
+}
+
+/* true if a file has changed since s was saved, which a rewind cannot undo */
+int
+dosfile_changed(const struct dosfile_state *s)
+{
+	return s->changes != changes;
+}
+
+void
+dosfile_restore(const struct dosfile_state *s)
+{
+	int h;
+
+	for (h = 0; h < DOSFILE_MAX; h++)
+		files[h].pos = s->pos[h];
+}
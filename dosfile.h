@@ -0,0 +1,48 @@
+#ifndef DOSFILE_H_
+#define DOSFILE_H_
+#include <stddef.h>
+#include "system.h"
+
+/* handles 0 to 4 are the standard devices, owned by the caller */
+#define DOSFILE_STDIN 0
+#define DOSFILE_STDOUT 1
+#define DOSFILE_STDERR 2
+#define DOSFILE_FIRST 5
+#define DOSFILE_MAX 20 /* FILES=20 */
+
+/* DOS error codes, returned negated */
+#define DOSERR_FUNCTION 0x01
+#define DOSERR_NOFILE 0x02
+#define DOSERR_NOPATH 0x03
+#define DOSERR_NOHANDLES 0x04
+#define DOSERR_ACCESS 0x05
+#define DOSERR_HANDLE 0x06
+#define DOSERR_MODE 0x0C
+#define DOSERR_NOMORE 0x12
+
+/* disk transfer area filled in by a search */
+#define DOSFIND_SIZE 43
+
+/* the file pointers as of a checkpoint, and how many times a file had been
+ * opened, closed, written or truncated by then
+ */
+struct dosfile_state {
+	long pos[DOSFILE_MAX];
+	unsigned long changes;
+};
+
+int dosfile_setroot(const char *dir);
+void dosfile_done(void);
+int dosfile_open(const char *dospath, int mode);
+int dosfile_create(const char *dospath);
+int dosfile_close(int handle);
+long dosfile_read(int handle, void *buf, size_t len);
+long dosfile_write(int handle, const void *buf, size_t len);
+int dosfile_truncate(int handle);
+long dosfile_seek(int handle, long offset, int whence);
+int dosfile_findfirst(const char *spec, int attr, BYTE dta[DOSFIND_SIZE]);
+int dosfile_findnext(BYTE dta[DOSFIND_SIZE]);
+void dosfile_save(struct dosfile_state *s);
+int dosfile_changed(const struct dosfile_state *s);
+void dosfile_restore(const struct dosfile_state *s);
+#endif
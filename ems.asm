@@ -0,0 +1,99 @@
+	; Expanded memory through INT 67h: allocate two pages, map each in turn
+	; into the frame and write to it, then map both and read back what was
+	; written. Prints a line and exits with code 0, or exits with the number
+	; of the check that failed.
+	;	monk ems.com
+	org 100h
+
+%macro	expect 2		; condition that has to hold, else exit with code %2
+	j%1 %%ok
+	mov ax, 4c00h + %2
+	int 21h
+%%ok:
+%endmacro
+
+	mov ah, 40h		; status
+	int 67h
+	or ah, ah
+	expect z, 1
+	mov ah, 41h		; page frame
+	int 67h
+	or ah, ah
+	expect z, 2
+	push bx			; no MOV to a segment register yet
+	pop es
+	mov ah, 43h		; two pages
+	mov bx, 2
+	int 67h
+	or ah, ah
+	expect z, 3
+	mov [handle], dx
+	xor di, di
+	mov ax, 4400h		; logical page 0 at physical page 0
+	xor bx, bx
+	int 67h
+	or ah, ah
+	expect z, 4
+	mov al, 'A'
+	mov [es:di], al
+	mov ax, 4400h		; logical page 1 in its place
+	mov bx, 1
+	mov dx, [handle]
+	int 67h
+	or ah, ah
+	expect z, 4
+	mov al, 'B'
+	mov [es:di], al
+	mov ax, 4400h		; page 0 back
+	xor bx, bx
+	int 67h
+	mov al, [es:di]
+	cmp al, 'A'
+	expect e, 5
+	mov ax, 4401h		; page 1 at physical page 1 as well
+	mov bx, 1
+	int 67h
+	or ah, ah
+	expect z, 6
+	mov al, [es:di + 4000h]
+	cmp al, 'B'
+	expect e, 6
+	mov ax, 4404h		; there are only four physical pages
+	int 67h
+	or ah, ah
+	expect nz, 7
+	mov ax, 5001h		; page 0 by segment, at physical page 1
+	mov cx, 1
+	mov dx, [handle]
+	mov si, frame
+	int 67h
+	or ah, ah
+	expect z, 8
+	mov al, [es:di + 4000h]
+	cmp al, 'A'
+	expect e, 8
+	mov ax, 5001h		; but not at a segment between pages
+	mov si, between
+	int 67h
+	cmp ah, 8bh
+	expect e, 8
+	mov ah, 45h		; release
+	mov dx, [handle]
+	int 67h
+	or ah, ah
+	expect z, 9
+	mov ah, 45h		; and not twice
+	int 67h
+	cmp ah, 83h
+	expect e, 9
+	mov ah, 9
+	mov dx, pass
+	int 21h
+	mov ax, 4c00h
+	int 21h
+
+	; logical page and segment pairs for mapping by segment
+frame:	dw 0, 0e400h
+between:	dw 0, 0e200h
+handle:	dw 0
+pass:	db "EMS OK", 13, 10, "$"
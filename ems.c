@@ -0,0 +1,251 @@
+#include "ems.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Expanded Memory (LIM EMS 4.0)
+ *
+ * Expanded memory is one pool of 16K pages. A handle owns a list of pool
+ * pages, and mapping a logical page into the frame only records which pool
+ * page is there: the caller points its page table at ems_frame() and no
+ * data is ever copied.
+ */
+
+#define EMS_HANDLES 32
+#define UNMAPPED 0xffffu
+
+struct handle {
+	int used;
+	unsigned npages;
+	WORD *pages; /* logical page to pool page */
+	int saved;
+	WORD savemap[EMS_FRAME_PAGES];
+};
+
+static BYTE *pool;
+static unsigned char *pool_used;
+static unsigned pool_pages, pool_free;
+static struct handle handles[EMS_HANDLES];
+static WORD frame[EMS_FRAME_PAGES] = { UNMAPPED, UNMAPPED, UNMAPPED, UNMAPPED };
+
+int
+ems_init(unsigned pages)
+{
+	ems_done();
+	if (!pages)
+		return 0;
+	pool = calloc(pages, EMS_PAGE);
+	pool_used = calloc(pages, 1);
+	if (!pool || !pool_used) {
+		ems_done();
+		return -1;
+	}
+	pool_pages = pool_free = pages;
+	handles[0].used = 1; /* the system handle, which owns no pages */
+
+	return 0;
+}
+
+void
+ems_done(void)
+{
+	unsigned i;
+
+	for (i = 0; i < EMS_HANDLES; i++) {
+		free(handles[i].pages);
+		memset(&handles[i], 0, sizeof(handles[i]));
+	}
+	for (i = 0; i < EMS_FRAME_PAGES; i++)
+		frame[i] = UNMAPPED;
+	free(pool);
+	free(pool_used);
+	pool = NULL;
+	pool_used = NULL;
+	pool_pages = pool_free = 0;
+}
+
+unsigned
+ems_total(void)
+{
+	return pool_pages;
+}
+
+unsigned
+ems_free(void)
+{
+	return pool_free;
+}
+
+unsigned
+ems_handles(void)
+{
+	unsigned i, n = 0;
+
+	for (i = 0; i < EMS_HANDLES; i++)
+		n += handles[i].used;
+	return n;
+}
+
+static struct handle *
+handle_get(int handle)
+{
+	if (handle < 0 || handle >= EMS_HANDLES || !handles[handle].used)
+		return NULL;
+	return &handles[handle];
+}
+
+/* grow or shrink a handle's page list, taking pages from the pool */
+static int
+handle_resize(struct handle *h, unsigned pages)
+{
+	unsigned i, p = 0;
+	WORD *list;
+
+	if (pages > pool_pages)
+		return -EMSERR_TOTAL;
+	if (pages > h->npages && pages - h->npages > pool_free)
+		return -EMSERR_FREE;
+
+	while (h->npages > pages) {
+		pool_used[h->pages[--h->npages]] = 0;
+		pool_free++;
+	}
+	if (pages > h->npages) {
+		list = realloc(h->pages, pages * sizeof(*list));
+		if (!list)
+			return -EMSERR_INTERNAL;
+		h->pages = list;
+		for (i = h->npages; i < pages; i++) {
+			while (pool_used[p])
+				p++;
+			pool_used[p] = 1;
+			memset(pool + (size_t)p * EMS_PAGE, 0, EMS_PAGE);
+			h->pages[i] = p;
+		}
+		pool_free -= pages - h->npages;
+		h->npages = pages;
+	}
+
+	return 0;
+}
+
+int
+ems_alloc(unsigned pages)
+{
+	int i, e;
+
+	for (i = 1; i < EMS_HANDLES && handles[i].used; i++)
+		;
+	if (i == EMS_HANDLES)
+		return -EMSERR_NOHANDLES;
+	handles[i].used = 1;
+	e = handle_resize(&handles[i], pages);
+	if (e) {
+		handles[i].used = 0;
+		return e;
+	}
+
+	return i;
+}
+
+int
+ems_realloc(int handle, unsigned pages)
+{
+	struct handle *h = handle_get(handle);
+
+	if (!h)
+		return -EMSERR_HANDLE;
+	return handle_resize(h, pages);
+}
+
+int
+ems_release(int handle)
+{
+	struct handle *h = handle_get(handle);
+	unsigned i, j;
+
+	if (!h)
+		return -EMSERR_HANDLE;
+	if (h->saved)
+		return -EMSERR_SAVED;
+
+	/* anything of ours still in the frame goes away with it */
+	for (i = 0; i < EMS_FRAME_PAGES; i++)
+		for (j = 0; j < h->npages; j++)
+			if (h->pages[j] == frame[i])
+				frame[i] = UNMAPPED;
+	handle_resize(h, 0);
+	free(h->pages);
+	h->pages = NULL;
+	if (handle)
+		h->used = 0;
+
+	return 0;
+}
+
+int
+ems_pages(int handle)
+{
+	struct handle *h = handle_get(handle);
+
+	return h ? (int)h->npages : -EMSERR_HANDLE;
+}
+
+/* map a handle's logical page into the frame, or unmap it if logical is FFFFh */
+int
+ems_map(unsigned phys, int handle, unsigned logical)
+{
+	struct handle *h = handle_get(handle);
+
+	if (!h)
+		return -EMSERR_HANDLE;
+	if (phys >= EMS_FRAME_PAGES)
+		return -EMSERR_PHYSICAL;
+	if (logical == UNMAPPED) {
+		frame[phys] = UNMAPPED;
+		return 0;
+	}
+	if (logical >= h->npages)
+		return -EMSERR_LOGICAL;
+	frame[phys] = h->pages[logical];
+
+	return 0;
+}
+
+/* host memory for a physical page, NULL if nothing is mapped there */
+BYTE *
+ems_frame(unsigned phys)
+{
+	if (phys >= EMS_FRAME_PAGES || frame[phys] == UNMAPPED)
+		return NULL;
+	return pool + (size_t)frame[phys] * EMS_PAGE;
+}
+
+int
+ems_save(int handle)
+{
+	struct handle *h = handle_get(handle);
+
+	if (!h)
+		return -EMSERR_HANDLE;
+	if (h->saved)
+		return -EMSERR_SAVED;
+	memcpy(h->savemap, frame, sizeof(frame));
+	h->saved = 1;
+
+	return 0;
+}
+
+int
+ems_restore(int handle)
+{
+	struct handle *h = handle_get(handle);
+
+	if (!h)
+		return -EMSERR_HANDLE;
+	if (!h->saved)
+		return -EMSERR_NOSAVE;
+	memcpy(frame, h->savemap, sizeof(frame));
+	h->saved = 0;
+
+	return 0;
+}
@@ -0,0 +1,33 @@
+#ifndef EMS_H_
+#define EMS_H_
+#include "system.h"
+
+#define EMS_PAGE 16384u
+#define EMS_FRAME_PAGES 4 /* physical pages in the page frame */
+
+/* EMS status codes, returned negated */
+#define EMSERR_INTERNAL 0x80
+#define EMSERR_HANDLE 0x83
+#define EMSERR_FUNCTION 0x84
+#define EMSERR_NOHANDLES 0x85
+#define EMSERR_SAVED 0x86
+#define EMSERR_TOTAL 0x87
+#define EMSERR_FREE 0x88
+#define EMSERR_LOGICAL 0x8A
+#define EMSERR_PHYSICAL 0x8B
+#define EMSERR_NOSAVE 0x8E
+
+int ems_init(unsigned pages);
+void ems_done(void);
+unsigned ems_total(void);
+unsigned ems_free(void);
+unsigned ems_handles(void);
+int ems_alloc(unsigned pages);
+int ems_realloc(int handle, unsigned pages);
+int ems_release(int handle);
+int ems_pages(int handle);
+int ems_map(unsigned phys, int handle, unsigned logical);
+BYTE *ems_frame(unsigned phys);
+int ems_save(int handle);
+int ems_restore(int handle);
+#endif
@@ -0,0 +1,93 @@
+	; DOS file handles: create a file, write to it, seek back, read it
+	; again, and find it by name. Prints a line and exits with code 0, or
+	; exits with the number of the check that failed. Leaves FILEIO.TMP in
+	; the directory given with -r.
+	;	monk -r dir fileio.com
+	org 100h
+
+%macro	expect 2		; condition that has to hold, else exit with code %2
+	j%1 %%ok
+	mov ax, 4c00h + %2
+	int 21h
+%%ok:
+%endmacro
+
+	mov ah, 3ch		; create
+	xor cx, cx
+	mov dx, name
+	int 21h
+	expect nc, 1
+	mov bx, ax
+	mov ah, 40h		; write
+	mov cx, datalen
+	mov dx, data
+	int 21h
+	expect nc, 2
+	cmp ax, datalen
+	expect e, 2
+	mov ax, 4200h		; back to the start
+	xor cx, cx
+	xor dx, dx
+	int 21h
+	expect nc, 3
+	or ax, ax
+	expect z, 3
+	mov ah, 3fh		; read more than there is
+	mov cx, buflen
+	mov dx, buf
+	int 21h
+	expect nc, 4
+	cmp ax, datalen
+	expect e, 4
+	mov si, data
+	mov di, buf
+	mov cx, datalen
+compare:
+	mov al, [si]
+	cmp al, [di]
+	expect e, 5
+	inc si
+	inc di
+	loop compare
+	mov ax, 4202h		; the end is at the size
+	xor cx, cx
+	xor dx, dx
+	int 21h
+	expect nc, 6
+	cmp ax, datalen
+	expect e, 6
+	or dx, dx
+	expect z, 6
+	mov ah, 3eh		; close
+	int 21h
+	expect nc, 7
+	mov ah, 3eh		; and not twice
+	int 21h
+	expect c, 7
+	mov ah, 1ah
+	mov dx, dta
+	int 21h
+	mov ah, 4eh		; find it, with its size
+	xor cx, cx
+	mov dx, name
+	int 21h
+	expect nc, 8
+	mov cx, [dta + 1ah]
+	cmp cx, datalen
+	expect e, 8
+	mov ah, 4fh		; and nothing else by that name
+	int 21h
+	expect c, 9
+	mov ah, 9
+	mov dx, pass
+	int 21h
+	mov ax, 4c00h
+	int 21h
+
+name:	db "FILEIO.TMP", 0
+data:	db "monk file handle test", 13, 10
+datalen	equ $ - data
+pass:	db "File I/O OK", 13, 10, "$"
+dta:	times 43 db 0
+buflen	equ 64
+buf:	times buflen db 0
@@ -0,0 +1,40 @@
+	; arithmetic whose flags are all checked, for stepping under --gdb:
+	; each flag should show as computed at every step. Exits with code 0,
+	; or with the number of the check that failed.
+	org 100h
+	mov ax, 0ffffh
+	add ax, 1
+	jnc fail1		; carry out of bit 15
+	jnz fail1
+	mov bx, 7fffh
+	add bx, 1
+	jno fail2		; signed overflow
+	jns fail2
+	mov al, 5
+	cmp al, 7
+	ja fail3
+	jae fail3
+	mov cl, 10h
+	sub cl, al
+	cmp cl, 0bh
+	jnz fail4
+	inc cl
+	cmp cl, 0ch
+	jnz fail5
+	mov cx, 1000
+again:	add ax, 1
+	add bx, 1
+	dec cx
+	jnz again
+	mov ax, 4c00h
+	int 21h
+fail1:	mov ax, 4c01h
+	int 21h
+fail2:	mov ax, 4c02h
+	int 21h
+fail3:	mov ax, 4c03h
+	int 21h
+fail4:	mov ax, 4c04h
+	int 21h
+fail5:	mov ax, 4c05h
+	int 21h
@@ -0,0 +1,504 @@
+#include "gdbstub.h"
+#include "system.h"
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* GDB Stub
+ *
+ * Serves the GDB remote serial protocol to one debugger, on a TCP address
+ * given as host:port, or :port for localhost, or on a Unix socket at any
+ * other path. The guest starts stopped at its first instruction.
+ *
+ * GDB has no real mode target, so use "set architecture i8086". Registers
+ * are the i386 ones holding 16-bit values, and addresses are linear, so the
+ * next instruction is at $cs*16+$eip. Breakpoints are taken at linear
+ * addresses, and watchpoints catch stores only.
+ *
+ * Supported: ? g G p P m M c s Z0-Z2 z0-z2 D k, Ctrl-C while running, and
+ * QStartNoAckMode. Anything else gets the empty reply that means it is not.
+ */
+
+#define PACKET_MAX 4096 /* largest packet either way, as hex that is half the data */
+
+static int conn = -1;
+static int noack;
+static unsigned char inbuf[PACKET_MAX];
+static size_t inlen, inpos;
+
+static const char hexdigits[] = "0123456789abcdef";
+
+static int
+hexval(int c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/* next byte from the debugger, -1 at the end, or -2 if none in timeout_ms */
+static int
+getbyte(int timeout_ms)
+{
+	struct pollfd pfd = { conn, POLLIN, 0 };
+	ssize_t r;
+
+	if (inpos == inlen) {
+		if (timeout_ms >= 0 && poll(&pfd, 1, timeout_ms) <= 0)
+			return -2;
+		do
+			r = read(conn, inbuf, sizeof(inbuf));
+		while (r < 0 && errno == EINTR);
+		if (r <= 0)
+			return -1;
+		inlen = r;
+		inpos = 0;
+	}
+
+	return inbuf[inpos++];
+}
+
+/* MSG_NOSIGNAL, so a debugger that has gone away is an error and not SIGPIPE */
+static int
+write_full(const void *buf, size_t len)
+{
+	ssize_t r;
+
+	while (len) {
+		r = send(conn, buf, len, MSG_NOSIGNAL);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		buf = (const char*)buf + r;
+		len -= r;
+	}
+
+	return 0;
+}
+
+static int
+putpacket(const char *s)
+{
+	char buf[PACKET_MAX + 4];
+	size_t len = strlen(s), i;
+	unsigned sum = 0;
+	int c;
+
+	buf[0] = '$';
+	for (i = 0; i < len; i++)
+		sum += (unsigned char)(buf[i + 1] = s[i]);
+	buf[len + 1] = '#';
+	buf[len + 2] = hexdigits[(sum >> 4) & 15];
+	buf[len + 3] = hexdigits[sum & 15];
+	for (;;) {
+		if (write_full(buf, len + 4))
+			return -1;
+		if (noack)
+			return 0;
+		/* anything but an ack or a nak is noise from before */
+		while ((c = getbyte(-1)) != '+' && c != '-')
+			if (c == -1)
+				return -1;
+		if (c == '+')
+			return 0;
+	}
+}
+
+/* read a packet's contents into buf, acking it, and return their length or -1 */
+static int
+getpacket(char *buf)
+{
+	unsigned sum;
+	int c, len, hi, lo;
+
+	for (;;) {
+		while ((c = getbyte(-1)) != '$')
+			if (c == -1)
+				return -1;
+		for (len = 0, sum = 0; (c = getbyte(-1)) != '#'; sum += c) {
+			if (c == -1)
+				return -1;
+			if (len == PACKET_MAX - 1)
+				break;
+			buf[len++] = c;
+		}
+		buf[len] = 0;
+		hi = hexval(getbyte(-1));
+		lo = hexval(getbyte(-1));
+		if (noack)
+			return len;
+		if (c == '#' && hi >= 0 && lo >= 0 && (unsigned)(hi << 4 | lo) == (sum & 0xff)) {
+			if (write_full("+", 1))
+				return -1;
+			return len;
+		}
+		if (write_full("-", 1))
+			return -1;
+	}
+}
+
+/* whether the debugger has sent a Ctrl-C, waiting up to timeout_ms for one */
+static int
+interrupted(int timeout_ms)
+{
+	int c;
+
+	while ((c = getbyte(timeout_ms)) >= 0) {
+		if (c == 0x03)
+			return 1;
+		timeout_ms = 0;
+	}
+
+	return c == -1; /* a debugger that went away is as good as a Ctrl-C */
+}
+
+static DWORD
+gethex(const char **p)
+{
+	DWORD v = 0;
+	int d;
+
+	while ((d = hexval(**p)) >= 0) {
+		v = (v << 4) | d;
+		(*p)++;
+	}
+
+	return v;
+}
+
+static void
+puthex(char *out, const void *buf, size_t len)
+{
+	const unsigned char *b = buf;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		out[2 * i] = hexdigits[b[i] >> 4];
+		out[2 * i + 1] = hexdigits[b[i] & 15];
+	}
+	out[2 * len] = 0;
+}
+
+/* a register, as the 4 bytes of a little endian i386 one */
+static void
+putreg(char *out, DWORD v)
+{
+	unsigned char b[4] = { v, v >> 8, v >> 16, v >> 24 };
+
+	puthex(out, b, sizeof(b));
+}
+
+static DWORD
+getreg(const char *p)
+{
+	DWORD v = 0;
+	int i;
+
+	for (i = 3; i >= 0; i--)
+		v = (v << 8) | (hexval(p[2 * i]) << 4) | hexval(p[2 * i + 1]);
+
+	return v;
+}
+
+/* Run the guest until something stops it, or for one instruction, and put
+ * the stop reply in out. Returns the reason it stopped.
+ */
+static enum system_reason
+resume(int step, unsigned long budget, char *out)
+{
+	uint64_t start = system_insns();
+	struct system_wait w;
+	struct pollfd pfd[2];
+	enum system_reason r;
+	DWORD a;
+
+	for (;;) {
+		r = system_run(step ? 1 : budget, &w);
+		switch (r) {
+		case SYSTEM_HALTED:
+			sprintf(out, "W%02x", system_exitcode() & 0xff);
+			return r;
+		case SYSTEM_ERROR:
+			strcpy(out, "S04"); /* SIGILL */
+			return r;
+		case SYSTEM_BREAK:
+			if (system_watchhit(&a))
+				sprintf(out, "T05watch:%lx;", (unsigned long)a);
+			else
+				strcpy(out, "S05");
+			return r;
+		default:
+			break;
+		}
+		if (step && system_insns() != start) {
+			strcpy(out, "S05"); /* SIGTRAP */
+			return r;
+		}
+		if (r == SYSTEM_BUDGET) {
+			if (interrupted(0))
+				break;
+			continue;
+		}
+		/* sleep through the guest's wait, but not through a Ctrl-C */
+		pfd[0].fd = conn;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = w.fd;
+		pfd[1].events = POLLIN;
+		if (inpos < inlen || poll(pfd, w.fd >= 0 ? 2 : 1, (w.timeout_us + 999) / 1000) > 0) {
+			if ((inpos < inlen || pfd[0].revents) && interrupted(0))
+				break;
+		}
+	}
+	strcpy(out, "S02"); /* SIGINT */
+
+	return SYSTEM_BREAK;
+}
+
+/* open addr for one debugger to connect to */
+static int
+listen_on(const char *addr)
+{
+	struct addrinfo hints, *res, *ai;
+	struct sockaddr_un sa;
+	const char *colon = strrchr(addr, ':');
+	char host[256];
+	int fd = -1, one = 1;
+
+	if (!colon || strchr(addr, '/')) {
+		if (strlen(addr) >= sizeof(sa.sun_path)) {
+			fprintf(stderr, "%s: socket path too long\n", addr);
+			return -1;
+		}
+		memset(&sa, 0, sizeof(sa));
+		sa.sun_family = AF_UNIX;
+		strcpy(sa.sun_path, addr);
+		unlink(addr);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0 || bind(fd, (struct sockaddr*)&sa, sizeof(sa)) || listen(fd, 1)) {
+			perror(addr);
+			if (fd >= 0)
+				close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	snprintf(host, sizeof(host), "%.*s", (int)(colon - addr), addr);
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(*host ? host : "localhost", colon + 1, &hints, &res)) {
+		fprintf(stderr, "%s: unknown address\n", addr);
+		return -1;
+	}
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (!bind(fd, ai->ai_addr, ai->ai_addrlen) && !listen(fd, 1))
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd < 0)
+		perror(addr);
+
+	return fd;
+}
+
+/* Handle one packet while stopped. Returns 's' or 'c' to resume, 'D' to
+ * detach, 'k' to kill, or 0 to wait for the next.
+ */
+static int
+command(char *p, char *out)
+{
+	DWORD regs[SYSTEM_REGS], a, len, n;
+	unsigned char mem[PACKET_MAX / 2];
+	const char *q = p + 1;
+	unsigned i;
+	int type;
+
+	*out = 0;
+	switch (*p) {
+	case 'g':
+		system_getregs(regs);
+		for (i = 0; i < SYSTEM_REGS; i++)
+			putreg(out + 8 * i, regs[i]);
+		break;
+	case 'G':
+		if (strlen(q) < 8 * SYSTEM_REGS) {
+			strcpy(out, "E01");
+			break;
+		}
+		for (i = 0; i < SYSTEM_REGS; i++)
+			regs[i] = getreg(q + 8 * i);
+		system_setregs(regs);
+		strcpy(out, "OK");
+		break;
+	case 'p':
+		n = gethex(&q);
+		if (n >= SYSTEM_REGS) {
+			strcpy(out, "E01");
+			break;
+		}
+		system_getregs(regs);
+		putreg(out, regs[n]);
+		break;
+	case 'P':
+		n = gethex(&q);
+		if (n >= SYSTEM_REGS || *q++ != '=' || strlen(q) < 8) {
+			strcpy(out, "E01");
+			break;
+		}
+		system_getregs(regs);
+		regs[n] = getreg(q);
+		system_setregs(regs);
+		strcpy(out, "OK");
+		break;
+	case 'm':
+		a = gethex(&q);
+		len = *q++ == ',' ? gethex(&q) : 0;
+		if (len > sizeof(mem))
+			len = sizeof(mem);
+		len = system_peek(a, mem, len);
+		if (len)
+			puthex(out, mem, len);
+		else
+			strcpy(out, "E01");
+		break;
+	case 'M':
+		a = gethex(&q);
+		len = *q++ == ',' ? gethex(&q) : 0;
+		if (*q++ != ':' || len > sizeof(mem) || strlen(q) < 2 * len) {
+			strcpy(out, "E01");
+			break;
+		}
+		for (i = 0; i < len; i++)
+			mem[i] = hexval(q[2 * i]) << 4 | hexval(q[2 * i + 1]);
+		strcpy(out, system_poke(a, mem, len) == len ? "OK" : "E01");
+		break;
+	case 'c':
+	case 's':
+		/* resuming somewhere else is a new $eip, in the same CS */
+		if (*q) {
+			system_getregs(regs);
+			regs[8] = gethex(&q);
+			system_setregs(regs);
+		}
+		return *p;
+	case 'Z':
+	case 'z':
+		type = gethex(&q);
+		a = *q++ == ',' ? gethex(&q) : 0;
+		len = *q++ == ',' ? gethex(&q) : 0;
+		if (type == 0 || type == 1)
+			strcpy(out, system_setbreak(a, *p == 'Z') ? "E01" : "OK");
+		else if (type == 2)
+			strcpy(out, system_setwatch(a, len, *p == 'Z') ? "E01" : "OK");
+		break;
+	case 'q':
+		if (!strncmp(p, "qSupported", 10))
+			sprintf(out, "PacketSize=%x;QStartNoAckMode+", PACKET_MAX);
+		else if (!strcmp(p, "qAttached"))
+			strcpy(out, "1");
+		else if (!strcmp(p, "qC"))
+			strcpy(out, "QC1");
+		else if (!strcmp(p, "qfThreadInfo"))
+			strcpy(out, "m1");
+		else if (!strcmp(p, "qsThreadInfo"))
+			strcpy(out, "l");
+		break;
+	case 'Q':
+		if (!strcmp(p, "QStartNoAckMode")) {
+			putpacket("OK");
+			noack = 1;
+			return 0;
+		}
+		break;
+	case 'H':
+	case 'T':
+		strcpy(out, "OK");
+		break;
+	case 'v':
+		if (!strcmp(p, "vKill;1"))
+			return 'k';
+		break;
+	case 'D':
+		strcpy(out, "OK");
+		return 'D';
+	case 'k':
+		return 'k';
+	}
+
+	return putpacket(out) ? 'k' : 0;
+}
+
+/* Wait for a debugger on addr and let it drive the guest, budget
+ * instructions between looks for a Ctrl-C. Returns 1 if the program
+ * terminated, 0 if the debugger detached and the guest should carry on,
+ * and -1 if it was killed or the connection failed.
+ */
+int
+gdbstub(const char *addr, unsigned long budget)
+{
+	static char packet[PACKET_MAX], out[PACKET_MAX + 1];
+	char stopped[32] = "S05";
+	enum system_reason r = SYSTEM_BUDGET;
+	int lfd, what = 0;
+
+	lfd = listen_on(addr);
+	if (lfd < 0)
+		return -1;
+	fprintf(stderr, "GDB: waiting on %s\n", addr);
+	do
+		conn = accept(lfd, NULL, NULL);
+	while (conn < 0 && errno == EINTR);
+	close(lfd);
+	if (strchr(addr, '/') || !strchr(addr, ':'))
+		unlink(addr);
+	if (conn < 0) {
+		perror(addr);
+		return -1;
+	}
+	setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &(int){ 1 }, sizeof(int));
+	system_setdebugger(1);
+
+	while (getpacket(packet) >= 0) {
+		if (*packet == '?') {
+			if (putpacket(stopped))
+				break;
+			continue;
+		}
+		what = command(packet, out);
+		if (what == 'k' || what == 'D')
+			break;
+		if (!what)
+			continue;
+		r = resume(what == 's', budget, stopped);
+		if (putpacket(stopped) || r == SYSTEM_HALTED)
+			break;
+	}
+	if (what == 'D')
+		putpacket(out);
+	close(conn);
+	conn = -1;
+	system_setdebugger(0);
+
+	if (what == 'D')
+		return 0;
+	return r == SYSTEM_HALTED ? 1 : -1;
+}
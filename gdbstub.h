@@ -0,0 +1,5 @@
+#ifndef GDBSTUB_H_
+#define GDBSTUB_H_
+
+int gdbstub(const char *addr, unsigned long budget);
+#endif
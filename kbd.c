@@ -0,0 +1,207 @@
+#include "kbd.h"
+#include "replay.h"
+#include <poll.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+/* Keyboard
+ *
+ * Keys come from the host's standard input. When that is a terminal it is put
+ * into non-canonical mode so that keys arrive one at a time, without echo.
+ * Nothing here ever blocks: callers that need to wait for a key should poll
+ * kbd_fd() themselves, alongside whatever else they are waiting for.
+ *
+ * Keys are recorded as they reach the buffer. On replay they come from the
+ * log instead, at the first poll on or after the instruction they arrived.
+ * A rewind can put back keys the guest has taken since, but not those that
+ * have come from the host, which cannot be read twice.
+ */
+
+static WORD keybuf[KBD_BUFSIZE];
+static unsigned keyhead, keytail;
+static int keyfd = -1, keyeof;
+static int tty_saved;
+static struct termios tty_orig;
+static BYTE scancode[128];
+
+/* US layout, one string per row of the keyboard, unshifted then shifted */
+static const struct {
+	BYTE first;
+	const char *keys, *shifted;
+} rows[] = {
+	{ 0x02, "1234567890-=", "!@#$%^&*()_+" },
+	{ 0x10, "qwertyuiop[]", "QWERTYUIOP{}" },
+	{ 0x1E, "asdfghjkl;'`", "ASDFGHJKL:\"~" },
+	{ 0x2B, "\\zxcvbnm,./", "|ZXCVBNM<>?" },
+};
+
+static void
+scancode_init(void)
+{
+	unsigned i, j;
+
+	for (i = 0; i < sizeof(rows) / sizeof(*rows); i++) {
+		for (j = 0; rows[i].keys[j]; j++) {
+			scancode[(BYTE)rows[i].keys[j]] = rows[i].first + j;
+			scancode[(BYTE)rows[i].shifted[j]] = rows[i].first + j;
+		}
+	}
+	/* control characters share the scan code of their letter */
+	for (i = 1; i < 27; i++)
+		scancode[i] = scancode['a' + i - 1];
+	scancode[0x1B] = 0x01; /* Esc */
+	scancode['\b'] = 0x0E;
+	scancode[0x7F] = 0x0E;
+	scancode['\t'] = 0x0F;
+	scancode['\r'] = 0x1C;
+	scancode['\n'] = 0x1C;
+	scancode[' '] = 0x39;
+}
+
+/* move whatever the host has ready into the type-ahead buffer,
+ * returning the number of new keys */
+int
+kbd_poll(void)
+{
+	struct pollfd pfd;
+	unsigned char c;
+	unsigned n = keytail;
+	uint64_t t;
+	long key;
+
+	if (replay_mode() == REPLAY_PLAY) {
+		while (!keyeof && keytail - keyhead < KBD_BUFSIZE &&
+			!replay_next(REPLAY_KEY, &t) && t <= replay_now()) {
+			key = replay_take(REPLAY_KEY, NULL, 0);
+			if (key < 0)
+				keyeof = 1;
+			else
+				keybuf[keytail++ % KBD_BUFSIZE] = key;
+		}
+		return keytail - n;
+	}
+
+	while (keyfd >= 0 && keytail - keyhead < KBD_BUFSIZE) {
+		pfd.fd = keyfd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 0) <= 0)
+			break;
+		if (read(keyfd, &c, 1) != 1) {
+			keyeof = 1;
+			keyfd = -1;
+			if (replay_mode() == REPLAY_RECORD)
+				replay_put(REPLAY_KEY, replay_now(), -1, NULL, 0);
+			break;
+		}
+		if (c == '\n') /* DOS programs expect Enter as CR */
+			c = '\r';
+		key = ((WORD)scancode[c & 0x7f] << 8) | c;
+		keybuf[keytail++ % KBD_BUFSIZE] = key;
+		if (replay_mode() == REPLAY_RECORD)
+			replay_put(REPLAY_KEY, replay_now(), key, NULL, 0);
+	}
+
+	return keytail - n;
+}
+
+int
+kbd_init(void)
+{
+	struct termios t;
+
+	scancode_init();
+	keyfd = replay_mode() == REPLAY_PLAY ? -1 : STDIN_FILENO; /* the log has the keys */
+	keyeof = 0;
+	keyhead = keytail = 0;
+
+	if (isatty(keyfd) && !tcgetattr(keyfd, &tty_orig)) {
+		t = tty_orig;
+		t.c_lflag &= ~(ICANON | ECHO);
+		t.c_cc[VMIN] = 1;
+		t.c_cc[VTIME] = 0;
+		if (!tcsetattr(keyfd, TCSANOW, &t))
+			tty_saved = 1;
+	}
+
+	return 0;
+}
+
+void
+kbd_done(void)
+{
+	if (tty_saved) {
+		tcsetattr(STDIN_FILENO, TCSANOW, &tty_orig);
+		tty_saved = 0;
+	}
+}
+
+/* take keys from another descriptor, or from nothing if fd is -1 */
+void
+kbd_setinput(int fd)
+{
+	kbd_done();
+	keyfd = fd;
+	keyeof = fd < 0;
+	keyhead = keytail = 0;
+}
+
+/* descriptor to wait on for more keys, or -1 if none can arrive: the input
+ * has ended, or the buffer is full and the guest has to take some first
+ */
+int
+kbd_fd(void)
+{
+	return keytail - keyhead < KBD_BUFSIZE ? keyfd : -1;
+}
+
+/* true once the buffer is empty and the input source is exhausted */
+int
+kbd_eof(void)
+{
+	kbd_poll();
+	return keyeof && keyhead == keytail;
+}
+
+int
+kbd_peek(WORD *key)
+{
+	kbd_poll();
+	if (keyhead == keytail)
+		return 0;
+	*key = keybuf[keyhead % KBD_BUFSIZE];
+	return 1;
+}
+
+int
+kbd_read(WORD *key)
+{
+	if (!kbd_peek(key))
+		return 0;
+	keyhead++;
+	return 1;
+}
+
+void
+kbd_save(struct kbd_state *s)
+{
+	memcpy(s->keys, keybuf, sizeof(keybuf));
+	s->head = keyhead;
+	s->tail = keytail;
+	s->eof = keyeof;
+}
+
+/* true if input has arrived since s was saved */
+int
+kbd_changed(const struct kbd_state *s)
+{
+	return s->tail != keytail || s->eof != keyeof;
+}
+
+void
+kbd_restore(const struct kbd_state *s)
+{
+	memcpy(keybuf, s->keys, sizeof(keybuf));
+	keyhead = s->head;
+	keytail = s->tail;
+}
@@ -0,0 +1,28 @@
+#ifndef KBD_H_
+#define KBD_H_
+#include "system.h"
+
+#define KBD_BUFSIZE 16 /* same depth as the BIOS type-ahead buffer */
+
+/* keys are in BIOS format: scan code in the high byte, ASCII in the low byte */
+int kbd_init(void);
+void kbd_done(void);
+void kbd_setinput(int fd);
+int kbd_fd(void);
+int kbd_eof(void);
+int kbd_poll(void);
+int kbd_peek(WORD *key);
+int kbd_read(WORD *key);
+
+/* the type-ahead buffer as of a checkpoint; tail counts every key that has
+ * reached it
+ */
+struct kbd_state {
+	WORD keys[KBD_BUFSIZE];
+	unsigned head, tail;
+	int eof;
+};
+void kbd_save(struct kbd_state *s);
+int kbd_changed(const struct kbd_state *s);
+void kbd_restore(const struct kbd_state *s);
+#endif
@@ -0,0 +1,60 @@
+	; Lockstep: the things a fast path is most likely to get wrong next to
+	; the reference copy. Flags carried from one instruction into the next,
+	; code that rewrites itself, the PIT read while polling, and a wait on
+	; the tick count that the busy-wait detection skips. Prints a line and
+	; exits with code 0, or exits with the number of the check that failed.
+	;	monk --lockstep lockstep.com < /dev/null
+	org 100h
+
+%macro	expect 2		; condition that has to hold, else exit with code %2
+	j%1 %%ok
+	mov ax, 4c00h + %2
+	int 21h
+%%ok:
+%endmacro
+
+	mov cx, 1000		; flags: carries and decimal adjusts in a chain
+	mov ax, 1234h
+	mov dx, 0
+	mov si, 0
+arith:
+	add al, 99h
+	daa
+	adc dx, ax
+	sbb si, dx
+	rcl ax, 1
+	xor ax, si
+	sub al, 17h
+	das
+	loop arith
+	mov bl, 0		; code that patches the next instruction
+again:
+	mov [patch + 1], bl
+patch:
+	mov cl, 0
+	cmp cl, bl
+	expect e, 1
+	add bl, 5
+	cmp bl, 15
+	jne again
+	mov cx, 100		; the PIT, which moves on between reads
+poll:
+	in al, 40h
+	in al, 40h
+	loop poll
+	mov ax, 40h		; two ticks of busy-waiting
+	push ax
+	pop es
+	mov bx, 6ch		; no MOV AX from an address yet
+	mov ax, [es:bx]
+	add ax, 2
+tick:
+	cmp ax, [es:bx]
+	jne tick
+	mov ah, 9
+	mov dx, pass
+	int 21h
+	mov ax, 4c00h
+	int 21h
+
+pass:	db "Lockstep OK", 13, 10, "$"
@@ -0,0 +1,320 @@
+#define _GNU_SOURCE
+#include "lockstep.h"
+#include "system.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Lockstep Mode
+ *
+ * Checks the interpreter's fast paths against the plain interpreter. The
+ * loaded machine is forked twice: a reference that takes no shortcuts, with
+ * its output thrown away, and the machine as it usually runs. Both stop at
+ * the end of every basic block and send the instruction count and a hash of
+ * their state down a pipe, and the streams are compared record by record.
+ * At the first difference both are killed, then forked again from the same
+ * start and run to the block where they parted, and the full state of each
+ * is printed: the registers side by side, and every byte of RAM that
+ * differs.
+ *
+ * The copies run unthrottled, and standard input is read ahead and given
+ * to each in memory, so that both see the same keys at the same
+ * instructions. A guest that reads back a file it wrote may see the other
+ * copy's writes, and part company with it for that reason alone. Disk
+ * images are not written back by either copy.
+ */
+
+#define LOCKSTEP_BUDGET 100000 /* instructions per system_run(), if no block ends sooner */
+#define LOCKSTEP_RAM 0x40000u /* bytes of memory compared in a dump */
+#define LOCKSTEP_DIFFS 32 /* differing bytes listed */
+
+/* sent for every block, and once more for how the run ended */
+struct record {
+	uint64_t insns;
+	uint64_t hash;
+	uint64_t reason; /* SYSTEM_BLOCK, or what system_run() stopped for */
+};
+
+/* one copy's side of a dump */
+struct dump {
+	struct record at;
+	DWORD regs[SYSTEM_REGS];
+	BYTE ram[LOCKSTEP_RAM];
+};
+
+static const char *const regnames[] = {
+	"AX", "CX", "DX", "BX", "SP", "BP", "SI", "DI", "IP", "FLAGS", "CS", "SS", "DS", "ES",
+};
+
+static char *input; /* standard input, read ahead */
+static size_t inputlen;
+
+static int
+write_full(int fd, const void *buf, size_t len)
+{
+	ssize_t r;
+
+	while (len) {
+		r = write(fd, buf, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		buf = (const char*)buf + r;
+		len -= r;
+	}
+
+	return 0;
+}
+
+static int
+read_full(int fd, void *buf, size_t len)
+{
+	ssize_t r;
+
+	while (len) {
+		r = read(fd, buf, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		buf = (char*)buf + r;
+		len -= r;
+	}
+
+	return 0;
+}
+
+/* the whole of standard input, unless it is a terminal */
+static int
+read_input(void)
+{
+	size_t size = 0;
+	ssize_t r;
+	char *p;
+
+	if (isatty(STDIN_FILENO))
+		return 0;
+	for (;;) {
+		if (inputlen == size) {
+			size = size ? size * 2 : 4096;
+			p = realloc(input, size);
+			if (!p)
+				return -1;
+			input = p;
+		}
+		r = read(STDIN_FILENO, input + inputlen, size - inputlen);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0) {
+			perror("input");
+			return -1;
+		}
+		if (!r)
+			return 0;
+		inputlen += r;
+	}
+}
+
+/* Run one copy, sending a record down fd for every block. With stop set it
+ * is a rerun, sending nothing until the stop-th record, and then that
+ * record, its registers and its RAM.
+ */
+static void
+engine(int fd, int reference, uint64_t stop)
+{
+	static struct dump d;
+	struct system_wait w;
+	enum system_reason r;
+	struct pollfd pfd;
+	uint64_t n = 0;
+	int null, in = -1;
+
+	if (reference || stop) {
+		null = open("/dev/null", O_WRONLY);
+		dup2(null, STDOUT_FILENO);
+		dup2(null, STDERR_FILENO);
+	}
+	if (input) {
+		in = memfd_create("input", 0);
+		if (in < 0 || write_full(in, input, inputlen))
+			return;
+		lseek(in, 0, SEEK_SET);
+	}
+	system_setinput(in);
+	system_setthrottle(0);
+	system_setlockstep(reference);
+
+	for (;;) {
+		r = system_run(LOCKSTEP_BUDGET, &w);
+		if (r == SYSTEM_BUDGET || r == SYSTEM_BREAK)
+			continue;
+		if (r != SYSTEM_BLOCK && r != SYSTEM_HALTED && r != SYSTEM_ERROR) {
+			pfd.fd = w.fd;
+			pfd.events = POLLIN;
+			poll(&pfd, w.fd >= 0, (w.timeout_us + 999) / 1000);
+			continue;
+		}
+		d.at.insns = system_insns();
+		d.at.hash = system_statehash();
+		d.at.reason = r;
+		n++;
+		if (!stop) {
+			if (write_full(fd, &d.at, sizeof(d.at)) || r != SYSTEM_BLOCK)
+				return;
+		} else if (n == stop || r != SYSTEM_BLOCK) {
+			system_getregs(d.regs);
+			system_peek(0, d.ram, sizeof(d.ram));
+			write_full(fd, &d, sizeof(d));
+			return;
+		}
+	}
+}
+
+/* fork a copy of the machine to run engine(), reading what it sends from *fd */
+static pid_t
+spawn(int reference, uint64_t stop, int *fd)
+{
+	int p[2];
+	pid_t pid;
+
+	if (pipe(p)) {
+		perror("pipe");
+		return -1;
+	}
+	fflush(NULL); /* or the copy writes out our buffers again */
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		close(p[0]);
+		close(p[1]);
+		return -1;
+	}
+	if (!pid) {
+		close(p[0]);
+		prctl(PR_SET_PDEATHSIG, SIGKILL);
+		engine(p[1], reference, stop);
+		close(p[1]);
+		/* neither copy writes its disks back, or the two would race on
+		 * the images; only the console is flushed
+		 */
+		fflush(NULL);
+		_exit(0);
+	}
+	close(p[1]);
+	*fd = p[0];
+
+	return pid;
+}
+
+/* wait for a copy, killing it first unless it is finishing on its own */
+static void
+reap(pid_t pid, int stop)
+{
+	if (pid <= 0)
+		return;
+	if (stop)
+		kill(pid, SIGKILL);
+	while (waitpid(pid, NULL, 0) < 0 && errno == EINTR)
+		;
+}
+
+/* print both copies as they were at the end of block k */
+static void
+dump(uint64_t k)
+{
+	static struct dump d[2];
+	pid_t pid[2];
+	int fd[2], ok[2];
+	unsigned i, diffs = 0;
+	DWORD a;
+
+	for (i = 0; i < 2; i++) {
+		pid[i] = spawn(!i, k, &fd[i]);
+		ok[i] = pid[i] > 0 && !read_full(fd[i], &d[i], sizeof(d[i]));
+		if (pid[i] > 0)
+			close(fd[i]);
+		reap(pid[i], 1);
+	}
+	if (!ok[0] || !ok[1]) {
+		fprintf(stderr, "Lockstep: could not rerun to block %llu\n", (unsigned long long)k);
+		return;
+	}
+
+	fprintf(stderr, "%-10s%18s%18s\n", "", "reference", "fast");
+	fprintf(stderr, "%-10s%18llu%18llu%s\n", "insns", (unsigned long long)d[0].at.insns,
+		(unsigned long long)d[1].at.insns, d[0].at.insns != d[1].at.insns ? "  <" : "");
+	fprintf(stderr, "%-10s%18llx%18llx%s\n", "hash", (unsigned long long)d[0].at.hash,
+		(unsigned long long)d[1].at.hash, d[0].at.hash != d[1].at.hash ? "  <" : "");
+	for (i = 0; i < sizeof(regnames) / sizeof(*regnames); i++)
+		fprintf(stderr, "%-10s%18.4X%18.4X%s\n", regnames[i], (unsigned)d[0].regs[i],
+			(unsigned)d[1].regs[i], d[0].regs[i] != d[1].regs[i] ? "  <" : "");
+	for (a = 0; a < LOCKSTEP_RAM; a++) {
+		if (d[0].ram[a] == d[1].ram[a])
+			continue;
+		if (diffs++ < LOCKSTEP_DIFFS)
+			fprintf(stderr, "%05X     %18.2X%18.2X  <\n", (unsigned)a, d[0].ram[a], d[1].ram[a]);
+	}
+	fprintf(stderr, "Memory: %u bytes differ\n", diffs);
+}
+
+/* Run the loaded guest twice in lockstep. Returns 1 if both copies ran the
+ * program to its end, and -1 if either failed or they parted company.
+ */
+int
+lockstep(void)
+{
+	struct record rec[2];
+	uint64_t k, last = 0;
+	pid_t pid[2] = { -1, -1 };
+	int fd[2] = { -1, -1 }, result = -1, diverged = 0;
+	unsigned i;
+
+	if (read_input())
+		return -1;
+	for (i = 0; i < 2; i++)
+		if ((pid[i] = spawn(!i, 0, &fd[i])) < 0)
+			goto out;
+
+	for (k = 1; ; k++) {
+		if (read_full(fd[0], &rec[0], sizeof(rec[0])) ||
+			read_full(fd[1], &rec[1], sizeof(rec[1]))) {
+			fprintf(stderr, "Lockstep: a copy stopped without a word, after block %llu\n",
+				(unsigned long long)k - 1);
+			goto out;
+		}
+		if (memcmp(&rec[0], &rec[1], sizeof(rec[0]))) {
+			diverged = 1;
+			break;
+		}
+		if (rec[0].reason != SYSTEM_BLOCK)
+			break;
+		last = rec[0].insns;
+	}
+	fprintf(stderr, "Lockstep: %llu blocks matched\n", (unsigned long long)k - diverged);
+	if (!diverged)
+		result = rec[0].reason == SYSTEM_HALTED ? 1 : -1;
+
+out:
+	for (i = 0; i < 2; i++) {
+		if (fd[i] >= 0)
+			close(fd[i]);
+		reap(pid[i], result < 0);
+	}
+	if (diverged) {
+		fprintf(stderr, "Lockstep: diverged in block %llu, after instruction %llu\n",
+			(unsigned long long)k, (unsigned long long)last);
+		dump(k);
+	}
+	free(input);
+	input = NULL;
+
+	return result;
+}
@@ -0,0 +1,5 @@
+#ifndef LOCKSTEP_H_
+#define LOCKSTEP_H_
+
+int lockstep(void);
+#endif
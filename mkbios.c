@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <string.h>
+#include "bios.h"
+
+/* BIOS Image Generator
+ *
+ * Writes biosimage.h to stdout: low memory up to BDA_END, the ROM from
+ * F000:0000 to the last stub, and its last 16 bytes, as laid out in
+ * bios.h.
+ */
+
+static unsigned char low[BDA_END];
+static unsigned char rom[0x10000];
+static size_t romlen; /* bytes from F000:0000 in use */
+
+static void
+put(size_t a, const void *p, size_t len)
+{
+	memcpy(rom + a, p, len);
+	if (a < BIOS_RESET && a + len > romlen)
+		romlen = a + len;
+}
+
+static void
+setvector(unsigned n, unsigned ofs)
+{
+	low[n * 4] = ofs;
+	low[n * 4 + 1] = ofs >> 8;
+	low[n * 4 + 2] = BIOS_SEG & 0xFF;
+	low[n * 4 + 3] = BIOS_SEG >> 8;
+}
+
+static void
+array(const char *name, const unsigned char *p, size_t len)
+{
+	size_t i;
+
+	printf("static const BYTE %s[%zu] = {", name, len);
+	for (i = 0; i < len; i++)
+		printf("%s0x%02X,", i % 12 ? " " : "\n\t", p[i]);
+	printf("\n};\n");
+}
+
+int
+main(void)
+{
+	static const unsigned char services[] = { BIOS_SERVICES };
+	static const unsigned char tables[] = { BIOS_TABLES };
+	static const unsigned char int67[] = { 0xF1, 0x67, 0xCA, 0x02, 0x00 }; /* trap 67h; RETF 2 */
+	static const unsigned char xms[] = { 0xF1, TRAP_XMS, 0xCB }; /* trap XMS; RETF */
+	static const unsigned char iret[] = { 0xCF };
+	static const unsigned char reset[] = { 0xF1, 0x19, 0xFA, 0xF4 }; /* trap 19h; CLI; HLT */
+	unsigned char stub[BIOS_STUB] = { 0xF1, 0x00, 0xCA, 0x02, 0x00 }; /* trap nn; RETF 2 */
+	unsigned i;
+
+	for (i = 0; i < BIOS_VECTORS; i++)
+		setvector(i, BIOS_IRET);
+	for (i = 0; i < sizeof(tables); i++)
+		memset(low + tables[i] * 4, 0, 4);
+	for (i = 0; i < sizeof(services); i++) {
+		stub[1] = services[i];
+		put(BIOS_STUBS + i * BIOS_STUB, stub, sizeof(stub));
+		setvector(services[i], BIOS_STUBS + i * BIOS_STUB);
+	}
+	put(BIOS_IRET, iret, sizeof(iret));
+	put(BIOS_EMMNAME, "EMMXXXX0", 8);
+	put(BIOS_INT67, int67, sizeof(int67));
+	put(BIOS_XMS, xms, sizeof(xms));
+	setvector(0x67, BIOS_INT67);
+
+	low[BDA_EQUIPMENT] = EQUIPMENT_COLOR80;
+	low[BDA_MEMORY] = BIOS_MEMORY_KB & 0xFF;
+	low[BDA_MEMORY + 1] = BIOS_MEMORY_KB >> 8;
+
+	put(BIOS_RESET, reset, sizeof(reset));
+	put(BIOS_DATE, "01/10/86", 8);
+	rom[BIOS_MODEL] = 0xFE;
+
+	printf("/* generated by mkbios from bios.h, do not edit */\n");
+	array("bios_low", low, sizeof(low));
+	array("bios_rom", rom, romlen);
+	array("bios_reset", rom + BIOS_RESET, sizeof(rom) - BIOS_RESET);
+
+	return ferror(stdout) || fflush(stdout) ? 1 : 0;
+}
@@ -1,12 +1,345 @@
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+#include "cache.h"
+#include "gdbstub.h"
+#include "lockstep.h"
 #include "screen.h"
+#include "serve.h"
 #include "system.h"
 
+#define RUN_BUDGET 10000 /* instructions between looks at the host */
+#define REWIND_STEP 3000000u /* instructions Ctrl-\ goes back, about 5 seconds */
+#define REWIND_KB 4096 /* default memory for rewinding */
+#define STATS_MS 1000 /* how often the stats file is rewritten */
+
+static volatile sig_atomic_t rewind_requested, metrics_requested;
+static const char *statsfile;
+static struct timespec stats_due;
+
+static void
+rewind_signal(int sig)
+{
+	(void)sig;
+	rewind_requested = 1;
+}
+
+/* go back REWIND_STEP instructions, or as far as the checkpoints reach */
+static void
+rewind_step(void)
+{
+	uint64_t now = system_insns(), to = now > REWIND_STEP ? now - REWIND_STEP : 0;
+
+	rewind_requested = 0;
+	while (system_rewind(to) && to < now)
+		to += (now - to + 1) / 2;
+	fprintf(stderr, "Rewind: back %llu instructions\n", (unsigned long long)(now - system_insns()));
+}
+
+static void
+metrics_signal(int sig)
+{
+	(void)sig;
+	metrics_requested = 1;
+}
+
+/* replace the stats file with the metrics as they are now */
+static void
+stats_write(void)
+{
+	char tmp[4096];
+	FILE *f;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", statsfile);
+	f = fopen(tmp, "w");
+	if (!f) {
+		perror(tmp);
+		return;
+	}
+	if (system_writemetrics(f) | fclose(f) || rename(tmp, statsfile)) {
+		perror(statsfile);
+		unlink(tmp);
+	}
+}
+
+/* Export the metrics if SIGUSR1 asked for them, or the stats file is due.
+ * Returns the milliseconds until it is next due, or -1 if there is none.
+ */
+static int
+metrics_poll(void)
+{
+	struct timespec now;
+	long ms;
+
+	if (metrics_requested) {
+		metrics_requested = 0;
+		system_writemetrics(stderr);
+	}
+	if (!statsfile)
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (stats_due.tv_sec - now.tv_sec) * 1000 + (stats_due.tv_nsec - now.tv_nsec) / 1000000;
+	if (ms > 0)
+		return ms;
+	stats_write();
+	stats_due = now;
+	stats_due.tv_sec += STATS_MS / 1000;
+	return STATS_MS;
+}
+
+/* Drive the guest from an event loop: run it until it waits, then sleep
+ * in epoll until whatever it waits for is ready or its time is up.
+ */
+static int
+run(void)
+{
+	struct epoll_event ev;
+	struct system_wait w;
+	enum system_reason r;
+	int epfd, watched = -1, due, timeout;
+
+	epfd = epoll_create1(0);
+	if (epfd < 0) {
+		perror("epoll");
+		return -1;
+	}
+
+	while ((r = system_run(RUN_BUDGET, &w)) != SYSTEM_HALTED && r != SYSTEM_ERROR) {
+		if (rewind_requested)
+			rewind_step();
+		due = metrics_poll();
+		if (r == SYSTEM_BUDGET || r == SYSTEM_BREAK)
+			continue;
+		if (w.fd != watched) {
+			if (watched >= 0)
+				epoll_ctl(epfd, EPOLL_CTL_DEL, watched, NULL);
+			watched = w.fd;
+			ev.events = EPOLLIN;
+			ev.data.fd = w.fd;
+			/* files cannot be watched: whatever they had was read
+			 * when the guest polled, so just sleep out the timeout
+			 */
+			if (w.fd >= 0 && epoll_ctl(epfd, EPOLL_CTL_ADD, w.fd, &ev)) {
+				if (errno != EPERM)
+					perror("epoll");
+				watched = -1;
+			}
+		}
+		timeout = (w.timeout_us + 999) / 1000;
+		if (due >= 0 && due < timeout)
+			timeout = due;
+		epoll_wait(epfd, &ev, 1, timeout);
+	}
+	close(epfd);
+	if (statsfile)
+		stats_write();
+
+	return r == SYSTEM_HALTED ? 1 : -1;
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-u] [-s] [-a floppy.img] [-c disk.img] [-r dir] [-R | -P log] [-k ms [-K kb]] [-A out.wav] [-V out.y4m] [-z n] [-m stats] [-T out.tpl] [-b | yourfile.com [args...]]\n", prog);
+	fprintf(stderr, "       %s [-u] [-s] [-a floppy.img] [-c disk.img] [-r dir] [-R | -P log] -t in.tpl [args...]\n", prog);
+	fprintf(stderr, "       %s --serve socket [--workers n] [options] [-t in.tpl | yourfile.com [args...]]\n", prog);
+	fprintf(stderr, "       %s --gdb [host]:port|socket [options] [-t in.tpl | -b | yourfile.com [args...]]\n", prog);
+	fprintf(stderr, "       %s --lockstep [options] [-t in.tpl | -b | yourfile.com [args...]]\n", prog);
+	fprintf(stderr, "       %s --cache dir [--cache-kb n] [-u] [-s] [-r dir] [-m stats] yourfile.com [args...] < input\n", prog);
+	fprintf(stderr, "  -u  unthrottled: never sleep, skip idle time instantly\n");
+	fprintf(stderr, "  -s  simulate realistic disk seek and rotation times\n");
+	fprintf(stderr, "  -a  attach a floppy image as A:\n");
+	fprintf(stderr, "  -c  attach a hard disk image as C:\n");
+	fprintf(stderr, "  -r  directory the guest sees as its files (default .)\n");
+	fprintf(stderr, "  -b  boot from A:, or C: if there is no A:\n");
+	fprintf(stderr, "  -T  save the loaded program as a template and exit\n");
+	fprintf(stderr, "  -t  start from a template, sharing its memory with other instances\n");
+	fprintf(stderr, "  -R  record keys, wait times and file contents to a log\n");
+	fprintf(stderr, "  -P  replay a recorded log, without sleeping or host input\n");
+	fprintf(stderr, "  -k  checkpoint every ms of guest time, so Ctrl-\\ can rewind\n");
+	fprintf(stderr, "  -K  memory kept for rewinding, in K (default %u)\n", REWIND_KB);
+	fprintf(stderr, "  -A  write PC speaker sound to a WAV file, - for stdout\n");
+	fprintf(stderr, "  -V  save the screen as Y4M, - for stdout, or as PPMs named with a %%u (BACKEND=capture)\n");
+	fprintf(stderr, "  -z  show each guest pixel n times as wide and high (1 to %u)\n", SCREEN_MAXSCALE);
+	fprintf(stderr, "  -m  rewrite a file with the metrics every second; SIGUSR1 prints them any time\n");
+	fprintf(stderr, "  --serve    run jobs sent to a Unix socket on a pool of warm machines\n");
+	fprintf(stderr, "  --workers  number of machines kept waiting (default 4)\n");
+	fprintf(stderr, "  --gdb      wait for GDB on a TCP port, or a Unix socket, before starting\n");
+	fprintf(stderr, "  --lockstep run a reference copy alongside, and stop where the two differ\n");
+	fprintf(stderr, "  --cache    reuse the output of an earlier run with the same program, arguments and input\n");
+	fprintf(stderr, "  --cache-kb size the cache directory is kept within, in K (default %u)\n", CACHE_KB);
+	fprintf(stderr, "  --heatmap  write guest memory access counts to prefix-heat.csv, -heat.ppm and -ws.csv (HEATMAP=n)\n");
+}
+
 int
 main(int argc, char *argv[])
 {
-	int result;
+	static const struct option longopts[] = {
+		{ "serve", required_argument, NULL, 'S' },
+		{ "workers", required_argument, NULL, 'W' },
+		{ "gdb", required_argument, NULL, 'G' },
+		{ "cache", required_argument, NULL, 'C' },
+		{ "lockstep", no_argument, NULL, 'D' },
+		{ "cache-kb", required_argument, NULL, 'L' },
+		{ "heatmap", required_argument, NULL, 'H' },
+		{ NULL, 0, NULL, 0 },
+	};
+	const char *floppy = NULL, *harddisk = NULL, *savetemplate = NULL, *template = NULL;
+	const char *sockpath = NULL, *audio = NULL, *capture = NULL, *gdb = NULL, *cachedir = NULL;
+	const char *heatmap = NULL, *root = ".";
+	FILE *report = stdout;
+	unsigned workers = 4, checkpoint_ms = 0;
+	unsigned long rewind_kb = REWIND_KB, cache_kb = CACHE_KB;
+	int result, c, boot = 0, logged = 0, differential = 0;
+	struct sigaction sa;
+
+	/* stop at the program name, anything after it belongs to the guest */
+	while ((c = getopt_long(argc, argv, "+usa:c:r:bT:t:R:P:k:K:A:V:z:m:", longopts, NULL)) != -1) {
+		switch (c) {
+		case 'S':
+			sockpath = optarg;
+			break;
+		case 'G':
+			gdb = optarg;
+			break;
+		case 'C':
+			cachedir = optarg;
+			break;
+		case 'L':
+			cache_kb = strtoul(optarg, NULL, 0);
+			break;
+		case 'D':
+			differential = 1;
+			break;
+		case 'H':
+			if (system_setheatmap(optarg))
+				return 1;
+			heatmap = optarg;
+			break;
+		case 'W':
+			workers = strtoul(optarg, NULL, 0);
+			if (!workers) {
+				usage(argv[0]);
+				return -1;
+			}
+			break;
+		case 'u':
+			system_setthrottle(0);
+			break;
+		case 's':
+			system_setdisklatency(1);
+			break;
+		case 'a':
+			floppy = optarg;
+			break;
+		case 'c':
+			harddisk = optarg;
+			break;
+		case 'r':
+			if (system_setroot(optarg))
+				return 1;
+			root = optarg;
+			break;
+		case 'b':
+			boot = 1;
+			break;
+		case 'T':
+			savetemplate = optarg;
+			break;
+		case 't':
+			template = optarg;
+			break;
+		case 'R':
+			if (system_record(optarg))
+				return 1;
+			logged = 1;
+			break;
+		case 'P':
+			if (system_replay(optarg))
+				return 1;
+			logged = 1;
+			break;
+		case 'k':
+			checkpoint_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'K':
+			rewind_kb = strtoul(optarg, NULL, 0);
+			break;
+		case 'A':
+			audio = optarg;
+			break;
+		case 'V':
+			screen_setoutput(optarg);
+			capture = optarg;
+			break;
+		case 'm':
+			statsfile = optarg;
+			break;
+		case 'z':
+			if (screen_setscale(strtoul(optarg, NULL, 0))) {
+				usage(argv[0]);
+				return -1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+	/* the speaker's thread would not survive the daemon forking its machines,
+	 * and a debugger has no one machine to attach to
+	 */
+	if ((audio || capture || gdb) && sockpath) {
+		usage(argv[0]);
+		return -1;
+	}
+	if (audio && !strcmp(audio, "-") && capture && !strcmp(capture, "-")) {
+		usage(argv[0]);
+		return -1;
+	}
+	/* the two copies in lockstep must see the same machine and nothing else */
+	if (differential && (sockpath || gdb || audio || capture || logged || checkpoint_ms || cachedir)) {
+		usage(argv[0]);
+		return -1;
+	}
+	/* one machine's accesses, counted by the one that runs it */
+	if (heatmap && (sockpath || differential || cachedir)) {
+		usage(argv[0]);
+		return -1;
+	}
+	/* a cached run is a program, its arguments and its input, and nothing else */
+	if (cachedir && (sockpath || gdb || audio || capture || boot || template || savetemplate ||
+		floppy || harddisk || logged || checkpoint_ms)) {
+		usage(argv[0]);
+		return -1;
+	}
+	if (cachedir) {
+		char *hello[] = { "hello.com", NULL };
+
+		result = optind < argc ? cache_lookup(cachedir, root, argc - optind, argv + optind, &c) :
+			cache_lookup(cachedir, root, 1, hello, &c);
+		if (result < 0)
+			return -1;
+		if (result) {
+			fprintf(report, "result=%d\n", c);
+			return 0;
+		}
+	}
+	system_setrewind(checkpoint_ms, rewind_kb);
+	/* Ctrl-\ rewinds instead of quitting, both without SA_RESTART to leave epoll */
+	memset(&sa, 0, sizeof(sa));
+	if (checkpoint_ms) {
+		sa.sa_handler = rewind_signal;
+		sigaction(SIGQUIT, &sa, NULL);
+	}
+	sa.sa_handler = metrics_signal;
+	sigaction(SIGUSR1, &sa, NULL);
 
 	if (screen_init())
 		return 1;
@@ -16,23 +349,61 @@ main(int argc, char *argv[])
 		return 1;
 	atexit(system_done);
 
-	if (argc == 1) {
+	if (audio && system_setspeaker(audio))
+		return 1;
+	cache_attach();
+	/* stdout is the sound, or the pictures */
+	if ((audio && !strcmp(audio, "-")) || (capture && !strcmp(capture, "-"))) {
+		system_setconsole(stderr);
+		report = stderr;
+	}
+
+	if (floppy && system_attachdisk(0x00, floppy))
+		return 1;
+	if (harddisk && system_attachdisk(0x80, harddisk))
+		return 1;
+
+	if (sockpath) {
+		/* whatever is loaded now is there, warm, for every job */
+		result = 0;
+		if (template)
+			result = system_loadtemplate(template);
+		else if (optind < argc && !(result = system_loadfile(argv[optind])))
+			system_setargs(argc - optind - 1, argv + optind + 1);
+		if (result)
+			return -1;
+		return serve(sockpath, workers, template || optind < argc) ? 1 : 0;
+	}
+
+	if (template) {
+		result = system_loadtemplate(template);
+		if (!result && optind < argc)
+			system_setargs(argc - optind, argv + optind);
+	} else if (boot) {
+		result = system_boot(floppy ? 0x00 : 0x80);
+	} else if (optind == argc) {
 		result = system_loadfile("hello.com");
 	} else {
-		if (argv[1][0] == '-') { /* treat any flags as an error */
-			fprintf(stderr, "usage: %s [yourfile.com]\n", argv[0]);
-			return -1;
-		}
-		result = system_loadfile(argv[1]);
-		system_setargs(argc - 2, argv + 2);
+		result = system_loadfile(argv[optind]);
+		system_setargs(argc - optind - 1, argv + optind + 1);
 	}
 
 	if (result) {
 		return -1;
 	}
 
-	result = system_tick(100);
-	printf("result=%d\n", result);
+	if (savetemplate)
+		return system_savetemplate(savetemplate) ? 1 : 0;
+
+	if (differential) {
+		result = lockstep();
+	} else {
+		result = gdb ? gdbstub(gdb, RUN_BUDGET) : 0;
+		if (!result)
+			result = run();
+	}
+	cache_store(result, cache_kb);
+	fprintf(report, "result=%d\n", result);
 
 	return 0;
 }
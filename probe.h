@@ -0,0 +1,74 @@
+#ifndef PROBE_H_
+#define PROBE_H_
+#include <stdint.h>
+
+/* Tracing Probes
+ *
+ * Static tracepoints in the style of SystemTap's sys/sdt.h, for perf,
+ * bpftrace and the like to attach to a running monk without rebuilding
+ * it. A probe is a single NOP in the code, with a note in .note.stapsdt
+ * saying where it is, its provider and name, and where its arguments are
+ * to be found, so it costs next to nothing until a tracer replaces the NOP
+ * with a breakpoint. The provider is monk, for example:
+ *
+ *	bpftrace -e 'usdt:./monk:monk:dos { @[arg0] = count(); }'
+ *
+ * sys/sdt.h is used where it is installed. Elsewhere, on x86-64 and
+ * AArch64 with GCC or Clang, the same notes are written out here. Building
+ * with PROBES=0, or on anything else, leaves no trace of them.
+ *
+ * Arguments are all 64 bits and unsigned.
+ */
+
+#if !defined(NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBE1(name, a) STAP_PROBE1(monk, name, (uint64_t)(a))
+#define PROBE3(name, a, b, c) STAP_PROBE3(monk, name, (uint64_t)(a), (uint64_t)(b), (uint64_t)(c))
+#define PROBE4(name, a, b, c, d) \
+	STAP_PROBE4(monk, name, (uint64_t)(a), (uint64_t)(b), (uint64_t)(c), (uint64_t)(d))
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__aarch64__))
+/* version 3 of the note, as sys/sdt.h writes it: the probe's address, the
+ * base it is relative to after prelinking, a semaphore, which these do not
+ * have, then the provider, the name and the arguments
+ */
+#define PROBE_NOTE(name, args) \
+	"990: nop\n" \
+	".pushsection .note.stapsdt,\"\",\"note\"\n" \
+	".balign 4\n" \
+	".4byte 992f-991f, 994f-993f, 3\n" \
+	"991: .asciz \"stapsdt\"\n" \
+	"992: .balign 4\n" \
+	"993: .8byte 990b\n" \
+	".8byte _.stapsdt.base\n" \
+	".8byte 0\n" \
+	".asciz \"monk\"\n" \
+	".asciz \"" #name "\"\n" \
+	".asciz \"" args "\"\n" \
+	"994: .balign 4\n" \
+	".popsection\n" \
+	".ifndef _.stapsdt.base\n" \
+	".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+	".weak _.stapsdt.base\n" \
+	".hidden _.stapsdt.base\n" \
+	"_.stapsdt.base: .space 1\n" \
+	".size _.stapsdt.base, 1\n" \
+	".popsection\n" \
+	".endif\n"
+#define PROBE_ARG(x) "nor"((uint64_t)(x))
+#define PROBE1(name, a) \
+	__asm__ __volatile__(PROBE_NOTE(name, "8@%0") :: PROBE_ARG(a))
+#define PROBE3(name, a, b, c) \
+	__asm__ __volatile__(PROBE_NOTE(name, "8@%0 8@%1 8@%2") :: PROBE_ARG(a), PROBE_ARG(b), PROBE_ARG(c))
+#define PROBE4(name, a, b, c, d) \
+	__asm__ __volatile__(PROBE_NOTE(name, "8@%0 8@%1 8@%2 8@%3") :: \
+		PROBE_ARG(a), PROBE_ARG(b), PROBE_ARG(c), PROBE_ARG(d))
+#endif
+#endif
+
+#ifndef PROBE1
+#define PROBE1(name, a) ((void)0)
+#define PROBE3(name, a, b, c) ((void)0)
+#define PROBE4(name, a, b, c, d) ((void)0)
+#endif
+#endif
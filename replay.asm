@@ -0,0 +1,93 @@
+	; Record and replay: echo keys up to Enter, wait for the timer to tick,
+	; then print the tick count and a checksum of this program's own file.
+	; A replay has to print the same line as the recording, without the
+	; keys or the file:
+	;	echo hello | monk -R replay.log replay.com
+	;	monk -P replay.log replay.com < /dev/null
+	; Exits with code 0, or with the number of the check that failed.
+	org 100h
+
+%macro	expect 2		; condition that has to hold, else exit with code %2
+	j%1 %%ok
+	mov ax, 4c00h + %2
+	int 21h
+%%ok:
+%endmacro
+
+%macro	hex 1			; print a word register in hex, no near CALL yet
+	mov bx, %1
+	mov cx, 4
+%%digit:
+	push cx
+	mov cl, 4
+	rol bx, cl
+	mov dl, bl
+	and dl, 0fh
+	add dl, '0'
+	cmp dl, '9'
+	jbe %%print
+	add dl, 7
+%%print:
+	mov ah, 2
+	int 21h
+	pop cx
+	loop %%digit
+%endmacro
+
+key:
+	mov ah, 8		; a key, without echo
+	int 21h
+	mov dl, al
+	mov ah, 2
+	int 21h
+	cmp dl, 13
+	jne key
+	mov dl, 10
+	mov ah, 2
+	int 21h
+	mov ax, 40h		; wait for a tick
+	push ax
+	pop es
+	mov bx, 6ch		; no MOV AX from an address yet
+	mov ax, [es:bx]
+tick:
+	cmp ax, [es:bx]
+	je tick
+	mov ah, 0		; and read the count
+	int 1ah
+	hex dx
+	mov dl, ' '
+	mov ah, 2
+	int 21h
+	mov ax, 3d00h		; this program
+	mov dx, name
+	int 21h
+	expect nc, 1
+	mov bx, ax
+	mov ah, 3fh
+	mov cx, 256
+	mov dx, buf
+	int 21h
+	expect nc, 2
+	cmp ax, 0
+	expect ne, 2
+	mov cx, ax
+	mov si, buf
+	mov dx, 0
+sum:
+	mov al, [si]
+	mov ah, 0
+	add dx, ax
+	inc si
+	loop sum
+	hex dx
+	mov dl, 13
+	mov ah, 2
+	int 21h
+	mov dl, 10
+	int 21h
+	mov ax, 4c00h
+	int 21h
+
+name:	db "REPLAY.COM", 0
+buf:	times 256 db 0
@@ -0,0 +1,220 @@
+#include "replay.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Record and Replay
+ *
+ * Given the same program and disks, a run is decided by a few inputs from
+ * outside: which keys arrive when, how long waits last in host time, and
+ * what host files contain. A recording logs each of them stamped with the
+ * retired instruction count, and a replay hands them back at the same
+ * count without touching the host or sleeping.
+ *
+ * A replay reads the whole log up front and keeps one cursor per stream,
+ * so a stream only has to come back in its own order. The log is in host
+ * byte order, with each record's data padded to keep the next one aligned.
+ */
+
+#define REPLAY_MAGIC "MONKLOG1"
+#define PADDED(n) (((n) + 7) & ~(size_t)7)
+
+struct record {
+	uint64_t stamp;
+	int32_t result;
+	uint32_t len; /* bytes of data following */
+	uint8_t stream;
+	uint8_t pad[7];
+};
+
+static int mode = REPLAY_OFF;
+static const uint64_t *now;
+static FILE *out;
+static const char *outname;
+static char *logbuf; /* a replay's whole log */
+static struct record **records[REPLAY_STREAMS];
+static size_t count[REPLAY_STREAMS], cursor[REPLAY_STREAMS];
+static int failed;
+
+int
+replay_record(const char *filename, const uint64_t *clock)
+{
+	out = fopen(filename, "wb");
+	if (!out || fwrite(REPLAY_MAGIC, 8, 1, out) != 1) {
+		perror(filename);
+		if (out)
+			fclose(out);
+		out = NULL;
+		return -1;
+	}
+	outname = filename;
+	now = clock;
+	mode = REPLAY_RECORD;
+
+	return 0;
+}
+
+int
+replay_play(const char *filename, const uint64_t *clock)
+{
+	struct record *r, **list;
+	size_t size = 0, cap = 0, n, pos, have[REPLAY_STREAMS] = { 0 };
+	FILE *f;
+
+	f = fopen(filename, "rb");
+	if (!f) {
+		perror(filename);
+		return -1;
+	}
+	do {
+		if (size == cap) {
+			char *p = realloc(logbuf, cap = cap ? cap * 2 : 65536);
+
+			if (!p)
+				goto fail;
+			logbuf = p;
+		}
+		n = fread(logbuf + size, 1, cap - size, f);
+		size += n;
+	} while (n);
+	if (ferror(f)) {
+		perror(filename);
+		goto fail;
+	}
+	fclose(f);
+	f = NULL;
+	if (size < 8 || memcmp(logbuf, REPLAY_MAGIC, 8)) {
+		fprintf(stderr, "%s: not a replay log\n", filename);
+		goto fail;
+	}
+
+	for (pos = 8; pos + sizeof(*r) <= size; pos += sizeof(*r) + PADDED(r->len)) {
+		r = (struct record*)(logbuf + pos);
+		if (r->stream >= REPLAY_STREAMS || PADDED(r->len) > size - pos - sizeof(*r))
+			break;
+		if (count[r->stream] == have[r->stream]) {
+			n = have[r->stream] ? have[r->stream] * 2 : 256;
+			list = realloc(records[r->stream], n * sizeof(*list));
+			if (!list)
+				goto fail;
+			records[r->stream] = list;
+			have[r->stream] = n;
+		}
+		records[r->stream][count[r->stream]++] = r;
+	}
+	if (pos != size)
+		fprintf(stderr, "%s: log is cut short\n", filename);
+	now = clock;
+	mode = REPLAY_PLAY;
+
+	return 0;
+
+fail:
+	if (f)
+		fclose(f);
+	replay_done();
+	return -1;
+}
+
+void
+replay_done(void)
+{
+	int s;
+
+	if (out && fclose(out))
+		perror(outname);
+	out = NULL;
+	for (s = 0; s < REPLAY_STREAMS; s++) {
+		free(records[s]);
+		records[s] = NULL;
+		count[s] = cursor[s] = 0;
+	}
+	free(logbuf);
+	logbuf = NULL;
+	mode = REPLAY_OFF;
+}
+
+int
+replay_mode(void)
+{
+	return mode;
+}
+
+/* the instruction count records are stamped with */
+uint64_t
+replay_now(void)
+{
+	return now ? *now : 0;
+}
+
+/* Append a record to the log. If it cannot be written the recording
+ * stops there, and replay_failed() says so from then on.
+ */
+int
+replay_put(enum replay_stream s, uint64_t stamp, long result, const void *data, size_t len)
+{
+	static const char zero[8];
+	struct record r;
+	size_t pad;
+
+	if (!out)
+		return -1;
+	memset(&r, 0, sizeof(r));
+	r.stamp = stamp;
+	r.result = result;
+	r.len = data ? len : 0;
+	r.stream = s;
+	pad = PADDED(r.len) - r.len;
+	if (fwrite(&r, sizeof(r), 1, out) != 1 ||
+		fwrite(data ? data : zero, 1, r.len, out) != r.len ||
+		fwrite(zero, 1, pad, out) != pad) {
+		perror(outname);
+		fclose(out);
+		out = NULL;
+		failed = 1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* stamp of the next record in a stream, -1 if there is none */
+int
+replay_next(enum replay_stream s, uint64_t *stamp)
+{
+	if (cursor[s] >= count[s])
+		return -1;
+	*stamp = records[s][cursor[s]]->stamp;
+	return 0;
+}
+
+/* take the next record in a stream, copying up to len bytes of its data */
+long
+replay_take(enum replay_stream s, void *data, size_t len)
+{
+	struct record *r;
+
+	if (cursor[s] >= count[s]) {
+		replay_diverged("log exhausted");
+		return -1;
+	}
+	r = records[s][cursor[s]++];
+	if (data)
+		memcpy(data, r + 1, r->len < len ? r->len : len);
+	return r->result;
+}
+
+void
+replay_diverged(const char *what)
+{
+	if (!failed)
+		fprintf(stderr, "Replay diverged at instruction %llu: %s\n",
+			(unsigned long long)replay_now(), what);
+	failed = 1;
+}
+
+int
+replay_failed(void)
+{
+	return failed;
+}
@@ -0,0 +1,28 @@
+#ifndef REPLAY_H_
+#define REPLAY_H_
+#include <stddef.h>
+#include <stdint.h>
+
+#define REPLAY_OFF 0
+#define REPLAY_RECORD 1
+#define REPLAY_PLAY 2
+
+/* each kind of input is replayed in its own order */
+enum replay_stream {
+	REPLAY_KEY, /* a key reaching the type-ahead buffer, or -1 for the end of input */
+	REPLAY_WAIT, /* how many clocks a wait lasted */
+	REPLAY_FILE, /* the result of a host file call, with any data read */
+	REPLAY_STREAMS
+};
+
+int replay_record(const char *filename, const uint64_t *clock);
+int replay_play(const char *filename, const uint64_t *clock);
+void replay_done(void);
+int replay_mode(void);
+uint64_t replay_now(void);
+int replay_put(enum replay_stream s, uint64_t stamp, long result, const void *data, size_t len);
+int replay_next(enum replay_stream s, uint64_t *stamp);
+long replay_take(enum replay_stream s, void *data, size_t len);
+void replay_diverged(const char *what);
+int replay_failed(void);
+#endif
@@ -1,12 +1,131 @@
 #include "screen.h"
+#include "convert.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <time.h>
+
+/* Render Thread
+ *
+ * Turning guest video memory into host pixels, and showing them, happens
+ * on a thread of its own so that emulation never waits for the display.
+ * The CPU thread fills a frame at each vertical retrace and publishes it
+ * through a triple buffer: three frames, one being filled, one being shown
+ * and one waiting, whose owners swap by exchanging a single index. Neither
+ * side ever blocks. A frame the render thread did not get to in time is
+ * simply replaced by the next one, unless the backend is one that must see
+ * every frame, when the CPU thread waits for it to be taken instead.
+ */
+
+#define FRESH 4 /* set in latest until the render thread takes it */
+#define RENDER_NAP 4000000 /* ns to sleep when no frame is waiting */
+#define LOSSLESS_NAP 50000 /* the same, when the CPU thread may be waiting on us */
+
+static struct screen_frame frames[3];
+static unsigned back = 0, front = 2; /* owned by the CPU and render threads */
+static atomic_uint latest = 1;
+static atomic_int stopping;
+static pthread_t renderer;
+static int running;
+static unsigned scale = 1;
+static const char *output; /* for backends that write frames somewhere */
+static uint32_t pixels[SCREEN_MAXWIDTH * SCREEN_MAXHEIGHT];
+static uint32_t scaled[SCREEN_MAXWIDTH * SCREEN_MAXHEIGHT * SCREEN_MAXSCALE * SCREEN_MAXSCALE];
+
+static void *
+render_thread(void *arg)
+{
+	const struct timespec nap = { 0, screen_backend_lossless ? LOSSLESS_NAP : RENDER_NAP };
+	const struct screen_frame *f;
+	uint64_t us;
+
+	(void)arg;
+	for (;;) {
+		/* show the last frame before stopping, it may be what a capture is for */
+		if (!(atomic_load_explicit(&latest, memory_order_acquire) & FRESH)) {
+			if (atomic_load_explicit(&stopping, memory_order_relaxed))
+				break;
+			nanosleep(&nap, NULL);
+			continue;
+		}
+		front = atomic_exchange_explicit(&latest, front, memory_order_acq_rel) & 3;
+		f = &frames[front];
+		if (f->format == SCREEN_NONE || f->width > SCREEN_MAXWIDTH || f->height > SCREEN_MAXHEIGHT)
+			continue;
+		us = f->clock_hz ? f->cycles * 1000000 / f->clock_hz : 0;
+		convert_frame(f, pixels);
+		if (scale == 1) {
+			screen_backend_present(pixels, f->width, f->height, us);
+			continue;
+		}
+		convert_scale(scaled, pixels, f->width, f->height, scale);
+		screen_backend_present(scaled, f->width * scale, f->height * scale, us);
+	}
+
+	return NULL;
+}
 
 int
 screen_init(void)
 {
+	if (screen_backend_init(output))
+		return -1;
+	convert_select(NULL);
+	atomic_store(&stopping, 0);
+	if (pthread_create(&renderer, NULL, render_thread, NULL)) {
+		perror("screen");
+		screen_backend_done();
+		return -1;
+	}
+	running = 1;
+
 	return 0;
 }
 
 void
 screen_done(void)
 {
+	if (!running)
+		return;
+	atomic_store(&stopping, 1);
+	pthread_join(renderer, NULL);
+	running = 0;
+	screen_backend_done();
+}
+
+/* show each guest pixel as n by n host pixels, set before screen_init() */
+int
+screen_setscale(unsigned n)
+{
+	if (n < 1 || n > SCREEN_MAXSCALE)
+		return -1;
+	scale = n;
+
+	return 0;
+}
+
+/* where a capturing backend writes, set before screen_init() */
+void
+screen_setoutput(const char *path)
+{
+	output = path;
+}
+
+/* the frame the CPU thread may fill */
+struct screen_frame *
+screen_back(void)
+{
+	return &frames[back];
+}
+
+/* hand the filled frame to the render thread and take another to fill */
+void
+screen_publish(void)
+{
+	const struct timespec nap = { 0, LOSSLESS_NAP };
+
+	while (screen_backend_lossless && running
+		&& (atomic_load_explicit(&latest, memory_order_acquire) & FRESH))
+		nanosleep(&nap, NULL);
+	back = atomic_exchange_explicit(&latest, back | FRESH, memory_order_acq_rel) & 3;
 }
@@ -1,5 +1,51 @@
 #ifndef SCREEN_H_
 #define SCREEN_H_
+#include <stdint.h>
+
+#define SCREEN_VRAM 0x40000u /* four planes of 64K */
+#define SCREEN_PLANE 0x10000u
+#define SCREEN_MAXWIDTH 640
+#define SCREEN_MAXHEIGHT 480
+#define SCREEN_MAXSCALE 4
+
+/* how guest pixels are laid out in a frame */
+enum screen_format {
+	SCREEN_NONE, /* nothing to show, as in the text modes */
+	SCREEN_1BPP, /* CGA 640x200, 8 pixels a byte */
+	SCREEN_2BPP, /* CGA 320x200, 4 pixels a byte */
+	SCREEN_PLANAR4, /* EGA/VGA 16 colors, one bit a pixel in each of four planes */
+	SCREEN_8BPP, /* VGA 320x200 in 256 colors, a byte a pixel */
+};
+
+/* a snapshot of guest video memory, taken at vertical retrace */
+struct screen_frame {
+	enum screen_format format;
+	unsigned width, height;
+	unsigned pitch; /* bytes from one line to the next, in a plane */
+	unsigned interleave; /* offset of the odd lines, 0 if they follow the even ones */
+	uint64_t cycles; /* virtual time it was taken */
+	unsigned long clock_hz; /* cycles in a second */
+	uint32_t palette[256]; /* 0x00RRGGBB */
+	unsigned char vram[SCREEN_VRAM]; /* planes SCREEN_PLANE apart */
+};
+
 int screen_init(void);
 void screen_done(void);
+int screen_setscale(unsigned n);
+void screen_setoutput(const char *path);
+struct screen_frame *screen_back(void);
+void screen_publish(void);
+
+/* Implemented by each screen_$(BACKEND).c. screen_backend_init() and
+ * screen_backend_done() are called on the thread calling screen_init() and
+ * screen_done(), before the render thread starts and after it has been
+ * joined; screen_backend_present() only ever on the render thread. Anything
+ * that has to belong to the render thread is created on first use in
+ * screen_backend_present(), and screen_backend_done() may only release it,
+ * the thread being gone by then.
+ */
+extern const int screen_backend_lossless; /* publishing waits for the render thread */
+int screen_backend_init(const char *output);
+void screen_backend_done(void);
+void screen_backend_present(const uint32_t *pixels, unsigned width, unsigned height, uint64_t us);
 #endif
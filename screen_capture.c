@@ -0,0 +1,229 @@
+#include "screen.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Capture Backend
+ *
+ * Writes frames to a file instead of a window, so that graphical programs
+ * can run where there is no display. A name with a %u in it gets a PPM
+ * per frame, numbered by the printf format, and anything else gets one
+ * Y4M stream in 4:4:4, - meaning stdout.
+ *
+ * Output runs at CAPTURE_FPS frames a second of virtual time, each showing
+ * the last guest frame that arrived during it. A Y4M stream needs every
+ * frame, so one held through several is written again for each; numbered
+ * PPMs are numbered by the output frame they belong to, and a gap in the
+ * numbers means nothing changed. Guest frames are hashed, and one the same
+ * as the last costs nothing more, so a still screen is almost free. A guest
+ * left idle unthrottled can pass hours of virtual time in a moment, so a
+ * frame is held for CAPTURE_HOLD at most and the rest of the wait is cut.
+ *
+ * Every guest frame is kept: the guest waits for the render thread rather
+ * than have one replaced, and the render thread waits on the file.
+ */
+
+#define CAPTURE_FPS 30
+#define CAPTURE_HOLD (CAPTURE_FPS * 10) /* most output frames one guest frame fills */
+#define CAPTURE_DEFAULT "capture.y4m"
+const int screen_backend_lossless = 1;
+
+#define CAPTURE_MAX (SCREEN_MAXWIDTH * SCREEN_MAXSCALE * SCREEN_MAXHEIGHT * SCREEN_MAXSCALE * 3)
+
+static FILE *out;
+static const char *pattern; /* for PPM names, NULL when writing Y4M */
+static unsigned width, height; /* of the pending frame, and of a Y4M stream once started */
+static int started;
+static unsigned char *pending; /* the frame waiting for the next to arrive, encoded */
+static int have_pending;
+static uint64_t pending_at; /* output frame it belongs to */
+static uint64_t pending_hash;
+static uint64_t cut; /* output frames left out of long holds */
+static int failed;
+
+static uint64_t
+frame_hash(const uint32_t *pixels, unsigned w, unsigned h)
+{
+	uint64_t x = 0xcbf29ce484222325ull ^ w ^ ((uint64_t)h << 32);
+	size_t i, n = (size_t)w * h;
+
+	for (i = 0; i < n; i++)
+		x = (x ^ pixels[i]) * 0x100000001b3ull;
+	return x;
+}
+
+/* Y4M planes, cropped or padded with black to the size of the stream */
+static void
+encode_yuv(const uint32_t *pixels, unsigned w, unsigned h)
+{
+	size_t plane = (size_t)width * height, i;
+	unsigned x, y, r, g, b;
+	uint32_t p;
+
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++) {
+			p = x < w && y < h ? pixels[y * w + x] : 0;
+			r = (p >> 16) & 0xff;
+			g = (p >> 8) & 0xff;
+			b = p & 0xff;
+			i = (size_t)y * width + x;
+			/* BT.601, studio range, kept positive for the shifts */
+			pending[i] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+			pending[plane + i] = ((112 * b - 38 * r - 74 * g + 32896) >> 8);
+			pending[2 * plane + i] = ((112 * r - 94 * g - 18 * b + 32896) >> 8);
+		}
+	}
+}
+
+static void
+encode_rgb(const uint32_t *pixels, unsigned w, unsigned h)
+{
+	size_t i, n = (size_t)w * h;
+
+	for (i = 0; i < n; i++) {
+		pending[i * 3] = pixels[i] >> 16;
+		pending[i * 3 + 1] = pixels[i] >> 8;
+		pending[i * 3 + 2] = pixels[i];
+	}
+}
+
+static int
+write_ppm(uint64_t n)
+{
+	char name[4096];
+	FILE *f;
+	int bad;
+
+	snprintf(name, sizeof(name), pattern, (unsigned)n);
+	f = fopen(name, "wb");
+	if (!f) {
+		perror(name);
+		return -1;
+	}
+	fprintf(f, "P6\n%u %u\n255\n", width, height);
+	bad = fwrite(pending, 3, (size_t)width * height, f) != (size_t)width * height;
+	if (fclose(f) || bad) {
+		perror(name);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* write the pending frame for output frames up to, but not including, until */
+static void
+flush(uint64_t until)
+{
+	size_t len = (size_t)width * height * 3;
+
+	if (!have_pending || failed)
+		return;
+	if (pattern) {
+		failed = write_ppm(pending_at);
+		return;
+	}
+	if (!started) {
+		fprintf(out, "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C444\n", width, height, CAPTURE_FPS);
+		started = 1;
+	}
+	do {
+		if (fputs("FRAME\n", out) == EOF || fwrite(pending, 1, len, out) != len) {
+			perror("capture");
+			failed = 1;
+			return;
+		}
+	} while (++pending_at < until);
+}
+
+/* PPM names take one %u, maybe with a width, and nothing else for printf */
+static int
+ppm_pattern(const char *s)
+{
+	const char *p = strchr(s, '%');
+
+	p += strspn(p + 1, "0123456789") + 1;
+	return *p == 'u' && !strchr(p, '%');
+}
+
+int
+screen_backend_init(const char *output)
+{
+	if (!output)
+		output = CAPTURE_DEFAULT;
+	pending = malloc(CAPTURE_MAX);
+	if (!pending) {
+		perror("capture");
+		return -1;
+	}
+	if (strchr(output, '%')) {
+		if (!ppm_pattern(output)) {
+			fprintf(stderr, "%s: expected one %%u for the frame number\n", output);
+			free(pending);
+			pending = NULL;
+			return -1;
+		}
+		pattern = output;
+		return 0;
+	}
+	out = strcmp(output, "-") ? fopen(output, "wb") : stdout;
+	if (!out) {
+		perror(output);
+		free(pending);
+		pending = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+screen_backend_done(void)
+{
+	flush(0);
+	if (out && out != stdout)
+		fclose(out);
+	else if (out)
+		fflush(out);
+	out = NULL;
+	free(pending);
+	pending = NULL;
+	have_pending = 0;
+}
+
+void
+screen_backend_present(const uint32_t *pixels, unsigned w, unsigned h, uint64_t us)
+{
+	uint64_t at = us * CAPTURE_FPS / 1000000, hash;
+
+	if (failed)
+		return;
+	at = at > cut ? at - cut : 0;
+	/* after a rewind, carry on from where the output is */
+	if (have_pending && at < pending_at)
+		at = pending_at;
+	hash = frame_hash(pixels, w, h);
+	if (have_pending && hash == pending_hash)
+		return;
+	/* a later frame in the same output frame takes the place of this one */
+	if (have_pending && at > pending_at) {
+		if (at - pending_at > CAPTURE_HOLD) {
+			cut += at - pending_at - CAPTURE_HOLD;
+			at = pending_at + CAPTURE_HOLD;
+		}
+		flush(at);
+	}
+	if (!started) {
+		width = w;
+		height = h;
+	}
+	if (pattern) {
+		width = w;
+		height = h;
+		encode_rgb(pixels, w, h);
+	} else {
+		encode_yuv(pixels, w, h);
+	}
+	have_pending = 1;
+	pending_at = at;
+	pending_hash = hash;
+}
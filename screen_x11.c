@@ -1 +1,30 @@
 #include "screen.h"
+#include <stdio.h>
+
+const int screen_backend_lossless = 0;
+
+/* X11 backend: no window yet, frames are converted and dropped */
+
+int
+screen_backend_init(const char *output)
+{
+	if (output) {
+		fprintf(stderr, "%s: this build shows frames, rebuild with BACKEND=capture to save them\n", output);
+		return -1;
+	}
+	return 0;
+}
+
+void
+screen_backend_done(void)
+{
+}
+
+void
+screen_backend_present(const uint32_t *pixels, unsigned width, unsigned height, uint64_t us)
+{
+	(void)pixels;
+	(void)width;
+	(void)height;
+	(void)us;
+}
@@ -0,0 +1,312 @@
+#define _GNU_SOURCE
+#include "serve.h"
+#include "system.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Daemon Mode
+ *
+ * The daemon keeps a pool of machines that have already been through
+ * screen_init() and system_init(), and maybe had a program loaded, waiting
+ * on a Unix socket. Each machine is a forked worker that takes one job and
+ * exits. The daemon forks a replacement from its own warm state as soon as
+ * one does, so a job costs little more than the guest run itself. Workers
+ * leave without running exit handlers, so sectors a job wrote are never
+ * flushed into the disk images the pool shares, and every job starts from
+ * the same state. A fork that fails is tried again every SPAWN_RETRY
+ * seconds until the pool is full.
+ *
+ * Both directions are a series of frames: a type byte, a 32-bit little
+ * endian length, then that many bytes.
+ *
+ * Client to daemon:
+ *	'P'	path of the program to load, as the daemon sees it
+ *	'A'	one guest argument, repeated for each argument in order
+ *	'I'	keyboard input script, appended to if repeated
+ *	'B'	instruction budget, 64-bit little endian, 0 for none
+ *	'R'	run, with no payload, which ends the job
+ *
+ * Daemon to client:
+ *	'O'	console output
+ *	'X'	how the run ended (SERVE_EXIT_*) and the DOS return code, a byte each
+ */
+
+#define FRAME_MAX (16u << 20) /* largest frame accepted from a client */
+#define JOB_STEP 100 /* instructions per system_tick() */
+#define SPAWN_RETRY 1 /* seconds between attempts to refill the pool */
+
+static volatile sig_atomic_t stopping;
+
+static int
+read_full(int fd, void *buf, size_t len)
+{
+	ssize_t r;
+
+	while (len) {
+		r = read(fd, buf, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		buf = (char*)buf + r;
+		len -= r;
+	}
+
+	return 0;
+}
+
+static int
+write_full(int fd, const void *buf, size_t len)
+{
+	ssize_t r;
+
+	while (len) {
+		r = write(fd, buf, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		buf = (const char*)buf + r;
+		len -= r;
+	}
+
+	return 0;
+}
+
+static int
+frame_write(int fd, char type, const void *buf, size_t len)
+{
+	unsigned char h[5] = { type, len, len >> 8, len >> 16, len >> 24 };
+
+	if (write_full(fd, h, sizeof(h)) || write_full(fd, buf, len))
+		return -1;
+	return 0;
+}
+
+/* read one frame into a buffer the caller frees */
+static int
+frame_read(int fd, char *type, char **buf, size_t *len)
+{
+	unsigned char h[5];
+
+	if (read_full(fd, h, sizeof(h)))
+		return -1;
+	*type = h[0];
+	*len = h[1] | ((size_t)h[2] << 8) | ((size_t)h[3] << 16) | ((size_t)h[4] << 24);
+	if (*len > FRAME_MAX)
+		return -1;
+	*buf = malloc(*len + 1);
+	if (!*buf)
+		return -1;
+	if (read_full(fd, *buf, *len)) {
+		free(*buf);
+		return -1;
+	}
+	(*buf)[*len] = 0;
+
+	return 0;
+}
+
+/* console output becomes 'O' frames, one per stdio buffer flush */
+static ssize_t
+console_write(void *cookie, const char *buf, size_t len)
+{
+	return frame_write(*(int*)cookie, 'O', buf, len) ? -1 : (ssize_t)len;
+}
+
+static void
+job(int fd, int loaded)
+{
+	static const cookie_io_functions_t io = { .write = console_write };
+	char type, *buf, *path = NULL, **args = NULL, **a;
+	int input = -1, nargs = 0, result = -1;
+	unsigned long long budget = 0, left;
+	unsigned i, step;
+	size_t len;
+	FILE *out;
+
+	for (;;) {
+		if (frame_read(fd, &type, &buf, &len))
+			return;
+		if (type == 'R') {
+			free(buf);
+			break;
+		}
+		switch (type) {
+		case 'P':
+			free(path);
+			path = buf;
+			continue;
+		case 'A':
+			a = realloc(args, (nargs + 1) * sizeof(*args));
+			if (!a)
+				return;
+			args = a;
+			args[nargs++] = buf;
+			continue;
+		case 'I':
+			if (input < 0)
+				input = memfd_create("input", 0);
+			if (input < 0 || write_full(input, buf, len))
+				return;
+			break;
+		case 'B':
+			for (i = len < 8 ? len : 8, budget = 0; i--; )
+				budget = (budget << 8) | (unsigned char)buf[i];
+			break;
+		default:
+			fprintf(stderr, "serve: unknown frame '%c'\n", type);
+			free(buf);
+			return;
+		}
+		free(buf);
+	}
+
+	if (input >= 0)
+		lseek(input, 0, SEEK_SET);
+	system_setinput(input);
+	out = fopencookie(&fd, "w", io);
+	if (!out)
+		return;
+	system_setconsole(out);
+
+	if (path ? system_loadfile(path) : !loaded) {
+		fprintf(out, "serve: nothing to run\n");
+	} else {
+		if (path || nargs)
+			system_setargs(nargs, args);
+		left = budget;
+		do {
+			step = budget && left < JOB_STEP ? left : JOB_STEP;
+			result = system_tick(step);
+			left -= step;
+		} while (!result && (!budget || left));
+	}
+	fclose(out);
+
+	{
+		unsigned char x[2];
+
+		x[0] = result > 0 ? SERVE_EXIT_DONE : result < 0 ? SERVE_EXIT_ERROR : SERVE_EXIT_BUDGET;
+		x[1] = system_exitcode();
+		frame_write(fd, 'X', x, sizeof(x));
+	}
+}
+
+static pid_t
+spawn(int lfd, int loaded)
+{
+	pid_t pid;
+	int fd;
+
+	fflush(NULL); /* or the worker writes out our buffers again */
+	pid = fork();
+	if (pid < 0)
+		perror("fork");
+	if (pid)
+		return pid;
+
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+	do
+		fd = accept(lfd, NULL, NULL);
+	while (fd < 0 && errno == EINTR);
+	close(lfd);
+	if (fd < 0)
+		_exit(1);
+	job(fd, loaded);
+	close(fd);
+	/* not exit(), which would write the job's disk sectors back */
+	fflush(NULL);
+	_exit(0);
+}
+
+static void
+stop(int sig)
+{
+	(void)sig;
+	stopping = 1;
+}
+
+/* Serve jobs on a Unix socket at path until told to stop. If loaded is set
+ * the machine already holds a program, and jobs may leave out 'P' to run it.
+ */
+int
+serve(const char *path, unsigned workers, int loaded)
+{
+	struct sockaddr_un sa;
+	struct sigaction act;
+	pid_t *pool, pid;
+	unsigned i, missing;
+	int lfd;
+
+	if (strlen(path) >= sizeof(sa.sun_path)) {
+		fprintf(stderr, "%s: socket path too long\n", path);
+		return -1;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+	unlink(path);
+	lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (lfd < 0 || bind(lfd, (struct sockaddr*)&sa, sizeof(sa)) || listen(lfd, 64)) {
+		perror(path);
+		if (lfd >= 0)
+			close(lfd);
+		return -1;
+	}
+
+	pool = calloc(workers, sizeof(*pool));
+	if (!pool) {
+		close(lfd);
+		return -1;
+	}
+
+	/* no SA_RESTART, so that wait() gives up when asked to stop */
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = stop;
+	sigaction(SIGTERM, &act, NULL);
+	sigaction(SIGINT, &act, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	for (i = 0; i < workers; i++)
+		pool[i] = -1;
+	fprintf(stderr, "Serving on %s with %u workers\n", path, workers);
+
+	while (!stopping) {
+		for (i = missing = 0; i < workers; i++)
+			if (pool[i] < 0 && (pool[i] = spawn(lfd, loaded)) < 0)
+				missing++;
+		/* with the pool short, poll for exits and retry the forks */
+		pid = waitpid(-1, NULL, missing ? WNOHANG : 0);
+		if (pid > 0) {
+			for (i = 0; i < workers; i++)
+				if (pool[i] == pid)
+					pool[i] = -1;
+		} else if (!pid || errno == ECHILD) {
+			sleep(SPAWN_RETRY);
+		} else if (errno != EINTR) {
+			break;
+		}
+	}
+
+	for (i = 0; i < workers; i++)
+		if (pool[i] > 0)
+			kill(pool[i], SIGTERM);
+	while (wait(NULL) > 0 || errno == EINTR)
+		;
+	close(lfd);
+	unlink(path);
+	free(pool);
+
+	return 0;
+}
@@ -0,0 +1,10 @@
+#ifndef SERVE_H_
+#define SERVE_H_
+
+/* how a job ended, the first byte of its 'X' frame */
+#define SERVE_EXIT_DONE 0 /* the program terminated */
+#define SERVE_EXIT_ERROR 1 /* emulation stopped on an error */
+#define SERVE_EXIT_BUDGET 2 /* the instruction budget ran out */
+
+int serve(const char *path, unsigned workers, int loaded);
+#endif
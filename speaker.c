@@ -0,0 +1,276 @@
+#include "speaker.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/* PC Speaker
+ *
+ * The CPU thread only logs what the speaker is doing, stamped with the
+ * virtual clock, into a ring with one writer and one reader. It never waits
+ * on the ring: if it is full the event is dropped and counted. A worker
+ * thread turns the log into 16-bit mono PCM. Each sample is the average
+ * level of the speaker over its own stretch of time, so an edge between two
+ * samples lands between them instead of snapping to one, and the square
+ * waves it makes do not alias into noise. A high-pass filter then takes out
+ * DC, as the speaker cone does.
+ *
+ * Samples are placed by virtual time alone, so the sound keeps in step with
+ * the guest however fast it runs. Unthrottled, the audio simply arrives
+ * faster than it plays.
+ */
+
+#define SPEAKER_RATE 44100
+#define QUEUE_SIZE 65536u /* events, a power of two */
+#define IDLE_NS 2000000 /* the worker's nap when there is nothing to do */
+#define AMPLITUDE 8000
+#define DC_POLE 0.995 /* high-pass pole, about 35 Hz */
+
+enum event_kind {
+	EVENT_SET, /* the speaker changed */
+	EVENT_SYNC, /* the guest reached this time */
+	EVENT_STOP, /* no more events */
+};
+
+struct event {
+	uint64_t cycles;
+	uint32_t period; /* clocks per square wave cycle, 0 for a steady level */
+	uint8_t on;
+	uint8_t kind;
+};
+
+static struct event queue[QUEUE_SIZE];
+static atomic_size_t head, tail; /* written by the CPU thread and the worker */
+static unsigned long dropped;
+static int active;
+static int last_on;
+static unsigned long last_period;
+static pthread_t worker;
+static FILE *out;
+static unsigned long hz;
+
+/* the worker's view */
+static struct event cur;
+static uint64_t pos; /* clock the next sample continues from */
+static uint64_t nsample; /* samples written */
+static double area; /* level integrated over the current sample so far */
+static double prev_in, prev_out;
+static int failed;
+
+static void
+put32(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+/* a WAV header, for data bytes of samples or unknown if it is 0xFFFFFFFF */
+static void
+wav_header(unsigned char h[44], uint32_t data)
+{
+	memcpy(h, "RIFF\0\0\0\0WAVEfmt ", 16);
+	put32(h + 4, data == 0xffffffffu ? data : 36 + data);
+	put32(h + 16, 16);
+	put32(h + 20, 1 | (1u << 16)); /* PCM, mono */
+	put32(h + 24, SPEAKER_RATE);
+	put32(h + 28, SPEAKER_RATE * 2);
+	put32(h + 32, 2 | (16u << 16)); /* 2 bytes per frame, 16 bits */
+	memcpy(h + 36, "data", 4);
+	put32(h + 40, data);
+}
+
+/* clock at which sample n starts */
+static uint64_t
+sample_start(uint64_t n)
+{
+	return n * hz / SPEAKER_RATE;
+}
+
+/* time the speaker spends on between a and b */
+static uint64_t
+on_time(uint64_t a, uint64_t b)
+{
+	uint64_t half, ta, tb;
+
+	if (!cur.on)
+		return 0;
+	if (!cur.period)
+		return b - a;
+	/* a square wave, high for the first half of each period */
+	half = cur.period / 2;
+	ta = (a - cur.cycles) / cur.period * half + ((a - cur.cycles) % cur.period < half ? (a - cur.cycles) % cur.period : half);
+	tb = (b - cur.cycles) / cur.period * half + ((b - cur.cycles) % cur.period < half ? (b - cur.cycles) % cur.period : half);
+	return tb - ta;
+}
+
+static void
+emit(double level)
+{
+	double x = (level * 2 - 1) * AMPLITUDE, y;
+	unsigned char s[2];
+	int v;
+
+	y = x - prev_in + DC_POLE * prev_out;
+	prev_in = x;
+	prev_out = y;
+	v = y > 32767 ? 32767 : y < -32768 ? -32768 : (int)y;
+	s[0] = v;
+	s[1] = v >> 8;
+	if (!failed && fwrite(s, 2, 1, out) != 1) {
+		perror("speaker");
+		failed = 1;
+	}
+	nsample++;
+}
+
+/* write out every sample that ends before t */
+static void
+render(uint64_t t)
+{
+	uint64_t start, end, b;
+
+	while (pos < t) {
+		start = sample_start(nsample);
+		end = sample_start(nsample + 1);
+		b = end < t ? end : t;
+		area += on_time(pos, b);
+		pos = b;
+		if (pos == end) {
+			emit(area / (end - start));
+			area = 0;
+		}
+	}
+}
+
+static void *
+speaker_thread(void *arg)
+{
+	const struct timespec nap = { 0, IDLE_NS };
+	struct event e;
+	size_t t;
+
+	(void)arg;
+	for (;;) {
+		t = atomic_load_explicit(&tail, memory_order_relaxed);
+		if (t == atomic_load_explicit(&head, memory_order_acquire)) {
+			fflush(out);
+			nanosleep(&nap, NULL);
+			continue;
+		}
+		e = queue[t % QUEUE_SIZE];
+		atomic_store_explicit(&tail, t + 1, memory_order_release);
+		render(e.cycles);
+		if (e.kind == EVENT_STOP)
+			break;
+		if (e.kind == EVENT_SET) {
+			cur = e;
+			if (cur.cycles < pos) /* the guest went back in time */
+				cur.cycles = pos;
+		}
+	}
+
+	return NULL;
+}
+
+/* called from the CPU thread only */
+static int
+push(uint64_t now, int kind, int on, unsigned long period)
+{
+	size_t h = atomic_load_explicit(&head, memory_order_relaxed);
+	struct event *e;
+
+	if (h - atomic_load_explicit(&tail, memory_order_acquire) == QUEUE_SIZE) {
+		dropped++;
+		return -1;
+	}
+	e = &queue[h % QUEUE_SIZE];
+	e->cycles = now;
+	e->period = period;
+	e->on = on;
+	e->kind = kind;
+	atomic_store_explicit(&head, h + 1, memory_order_release);
+
+	return 0;
+}
+
+/* start writing speaker output as a WAV file, "-" for stdout */
+int
+speaker_open(const char *filename, unsigned long clock_hz)
+{
+	unsigned char h[44];
+
+	out = strcmp(filename, "-") ? fopen(filename, "wb") : stdout;
+	if (!out) {
+		perror(filename);
+		return -1;
+	}
+	/* the length is filled in at the end, if the file can seek */
+	wav_header(h, 0xffffffffu);
+	fwrite(h, sizeof(h), 1, out);
+	hz = clock_hz;
+	pos = nsample = 0;
+	area = prev_in = prev_out = 0;
+	memset(&cur, 0, sizeof(cur));
+	last_on = 0;
+	last_period = 0;
+	failed = 0;
+	if (pthread_create(&worker, NULL, speaker_thread, NULL)) {
+		perror("speaker");
+		if (out != stdout)
+			fclose(out);
+		out = NULL;
+		return -1;
+	}
+	active = 1;
+
+	return 0;
+}
+
+/* finish the output at now, and wait for the worker to write it all */
+void
+speaker_close(uint64_t now)
+{
+	const struct timespec nap = { 0, IDLE_NS };
+	unsigned char h[44];
+
+	if (!active)
+		return;
+	while (push(now, EVENT_STOP, 0, 0))
+		nanosleep(&nap, NULL);
+	pthread_join(worker, NULL);
+	active = 0;
+	if (dropped)
+		fprintf(stderr, "Speaker: %lu events dropped\n", dropped);
+
+	wav_header(h, nsample * 2);
+	if (out != stdout && !fseek(out, 0, SEEK_SET))
+		fwrite(h, sizeof(h), 1, out);
+	if (out == stdout)
+		fflush(out);
+	else if (fclose(out))
+		perror("speaker");
+	out = NULL;
+}
+
+/* The speaker is now off, on, or a square wave of period clocks from now. */
+void
+speaker_set(uint64_t now, int on, unsigned long period)
+{
+	if (!active || (on == last_on && period == last_period))
+		return;
+	if (!push(now, EVENT_SET, on, period)) {
+		last_on = on;
+		last_period = period;
+	}
+}
+
+/* let the worker catch up with the guest, even if the speaker is quiet */
+void
+speaker_sync(uint64_t now)
+{
+	if (active)
+		push(now, EVENT_SYNC, 0, 0);
+}
@@ -0,0 +1,9 @@
+#ifndef SPEAKER_H_
+#define SPEAKER_H_
+#include <stdint.h>
+
+int speaker_open(const char *filename, unsigned long clock_hz);
+void speaker_close(uint64_t now);
+void speaker_set(uint64_t now, int on, unsigned long period);
+void speaker_sync(uint64_t now);
+#endif
@@ -1,5 +1,25 @@
 #include "system.h"
+#include "bios.h"
+#include "biosimage.h"
+#include "delta.h"
+#include "disk.h"
+#include "dosfile.h"
+#include "ems.h"
+#include "kbd.h"
+#include "probe.h"
+#include "replay.h"
+#include "speaker.h"
+#include "video.h"
+#include "xms.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 /* Memory Map
  *
@@ -9,18 +29,24 @@
  * 9000:FC00	9000:FFFF	extended BIOS Data Area
  * A000:0000	B000:FFFF	video card
  * C000:0000	C000:7FFF	EGA & VGA BIOS
- * C800:0000	E000:FFFF	not used
+ * C800:0000	D000:FFFF	not used
+ * E000:0000	E000:FFFF	EMS page frame
  * F000:0000	F000:FFFF	system BIOS
  *
  * I/O Map
  *
- * T.B.D.
+ * 0040		0043		Programmable Interval Timer
+ * 0061		0061		system control port B (speaker, timer 2 gate)
+ * 03C0		03DA		video adapter
  *
  */
 
+typedef size_t ADDR;
+
 struct cpu {
 	unsigned errors, done;
 	WORD ip;
+	WORD op_ip; /* IP of the first byte of the current instruction */
 	WORD segs[8]; /* ES CS SS DS */
 	WORD regs[8]; /* AX    CX    DX    BX    SP    BP    SI    DI */
 	WORD flags;
@@ -32,10 +58,19 @@ struct cpu {
 		OVERRIDE_DS,
 	} segment_override;
 	struct {
-		void *p;
+		void *p; /* register operand */
+		ADDR a; /* memory operand */
 		BYTE n;
 		BYTE modrm;
 	} pending; // Pending/temporary memory access (kept in host byte order)
+	uint64_t insns; /* instructions retired */
+	uint64_t cycles; /* virtual clock, in CPU clocks */
+	uint64_t next_tick; /* value of cycles at the next BIOS timer tick */
+	uint64_t idle_cycles; /* portion of cycles the guest spent waiting */
+	uint64_t skipped_cycles; /* cycles fast-forwarded over busy-wait loops */
+	unsigned long effects; /* guest stores and other visible side effects */
+	BYTE timer_read; /* timer state was read since the last backward branch */
+	uint64_t timer_until; /* value of cycles by which what was read may change */
 };
 
 static const BYTE implied_seg[8] = {
@@ -44,8 +79,8 @@ static const BYTE implied_seg[8] = {
 	[2] = 2, // (BP) + (SI) + DISP
 	[3] = 2, // (BP) + (DI) + DISP
 	[4] = 3, // (SI) + DISP
-	[5] = 0, // (DI) + DISP  ... might be DS or ES
-	[6] = 2, // (BP) + DISP or disp-high:disp-low
+	[5] = 3, // (DI) + DISP
+	[6] = 2, // (BP) + DISP, but DS for disp-high:disp-low
 	[7] = 3, // (BX) + DISP
 };
 
@@ -76,7 +111,7 @@ static const BYTE implied_seg[8] = {
 #define DI REG16(7)
 
 /* AL    CL    DL    BL    AH    CH    DH    BH */
-#define REG8(n) (((BYTE*)(void*)&cpu.regs[(n) & 3])[((n) >> 3) ^ LOW_BYTE])
+#define REG8(n) (((BYTE*)(void*)&cpu.regs[(n) & 3])[((n) >> 2) ^ LOW_BYTE])
 #define AL REG8(0)
 #define AH REG8(4)
 #define CL REG8(1)
@@ -97,35 +132,438 @@ static const BYTE implied_seg[8] = {
 #define MODRM_N(b) (((BYTE)(b) & 0x38) >> 3)
 
 #define FLAG_VALUE_CF (1)
+#define FLAG_VALUE_PF (4)
 #define FLAG_VALUE_AF (16)
 #define FLAG_VALUE_ZF (64)
 #define FLAG_VALUE_SF (128)
+#define FLAG_VALUE_IF (512)
+#define FLAG_VALUE_OF (2048)
+#define FLAGS_STATUS (FLAG_VALUE_CF | FLAG_VALUE_PF | FLAG_VALUE_AF | FLAG_VALUE_ZF | FLAG_VALUE_SF | FLAG_VALUE_OF)
 
 #define FLAG_CF (cpu.flags & FLAG_VALUE_CF) /* Carry Flag */
-#define FLAG_PF (cpu.flags & 4) /* Parity Flag */
+#define FLAG_PF (cpu.flags & FLAG_VALUE_PF) /* Parity Flag */
 #define FLAG_AF (cpu.flags & FLAG_VALUE_AF) /* Aux Carry Flag */
 #define FLAG_ZF (cpu.flags & FLAG_VALUE_ZF) /* Zero Flag */
 #define FLAG_SF (cpu.flags & FLAG_VALUE_SF) /* Sign Flag */
 #define FLAG_TF (cpu.flags & 256) /* Trap Flag */
 #define FLAG_IF (cpu.flags & 512) /* Interrupt Enable */
 #define FLAG_DF (cpu.flags & 1024) /* Direction */
-#define FLAG_OF (cpu.flags & 2048) /* Overflow Flag */
+#define FLAG_OF (cpu.flags & FLAG_VALUE_OF) /* Overflow Flag */
 
-typedef size_t ADDR;
+/* CPU Models
+ *
+ * The model is fixed when this file is compiled, with CPU_MODEL set to one
+ * of these, and each gets an interpreter of its own: what differs between
+ * them is which cases the instruction switch has, so there is nothing to
+ * test as instructions run.
+ *
+ * 8088		60h-6Fh repeat the conditional jumps at 70h-7Fh, 0Fh is POP CS,
+ *		and shifts go by all 8 bits of the count
+ * 80186	adds PUSHA, POPA, PUSH immediate, shifts by an immediate,
+ *		ENTER and LEAVE, and masks shift counts to 5 bits
+ * V20		the 80186 instructions, and NEC's own bit instructions at 0Fh,
+ *		but shifts go by all 8 bits of the count, as on the 8088
+ *
+ * All three push SP as it is after the push, unlike the 286 and later.
+ */
+#define CPU_8088 0
+#define CPU_80186 1
+#define CPU_V20 2
+#ifndef CPU_MODEL
+#define CPU_MODEL CPU_8088
+#endif
+#define CPU_186 (CPU_MODEL != CPU_8088) /* has the 80186 instructions */
+#define SHIFT_MASK (CPU_MODEL == CPU_80186 ? 0x1fu : 0xffu) /* bits of a shift count used */
 
-#if 0 /// TODO: use this for readbyte()/writebyte() etc
-enum peripherial_address {
-	PERIPH_RAM0,	/* 0000:0000 to 9000:FFFF -- Main system RAM */
-	PERIPH_VIDEO,	/* A000:0000 to B000:FFFF -- Video card */
-	PERIPH_VBIOS,	/* C000:0000 to C000:7FFF -- Video BIOS */
-	PERIPH_SYSBIOS,	/* F000:0000 to F000:FFFF -- System BIOS */
-};
+/* an extra case label on the 8088, for opcodes the 80186 gave other uses */
+#if CPU_186
+#define CASE_8088(op)
+#else
+#define CASE_8088(op) case op:
+#endif
+
+/* Virtual Clock
+ *
+ * Guest time is counted in CPU clocks. Everything time-related the guest can
+ * observe is derived from this count rather than from the host clock, so a
+ * run behaves the same no matter how fast the host is. The host only sleeps
+ * when the guest is idle, and then the clock skips ahead by however much
+ * time the guest would have spent waiting.
+ */
+#define CPU_HZ 4772727ul /* 14.31818 MHz crystal / 3 */
+#define TICK_CYCLES (65536ul * 4) /* PIT runs at CPU_HZ / 4, channel 0 divides by 65536 */
+#define OP_CYCLES 8 /* flat cost per instruction until real timings are tracked */
+#define TICKS_PER_DAY 0x1800B0ul
+
+/* Programmable Interval Timer
+ *
+ * The PIT counts at CPU_HZ / 4. Channel 0 is the BIOS tick, which stays at
+ * the rate the virtual clock assumes whatever it is programmed with, and
+ * channel 2, gated by bit 0 of port 61h, drives the speaker together with
+ * bit 1. Counts are worked out from the virtual clock when they are read
+ * rather than stepped.
+ */
+#define PIT_DIVIDE 4 /* CPU clocks per PIT clock */
+#define PIT_RW_LOW 1 /* access the low byte only */
+#define PIT_RW_HIGH 2 /* access the high byte only */
+#define PIT_RW_BOTH 3 /* low byte, then high byte */
+#define PIT_SQUARE 3 /* mode 3, square wave generator */
+#define REFRESH_CYCLES 72 /* DRAM refresh every 15us, seen in port 61h bit 4 */
+
+#define PORT61_GATE2 0x01
+#define PORT61_SPEAKER 0x02
+#define PORT61_REFRESH 0x10
+#define PORT61_OUT2 0x20
+
+/* Idle Detection
+ *
+ * A guest that is waiting for something keeps the host busy unless we notice.
+ * These limits decide when a guest counts as idle, at which point the clock
+ * skips to the next timer tick, or to a key arriving if that is sooner.
+ *
+ * A busy-wait loop is a short backward branch that arrives at the same loop
+ * head with registers, flags and memory unchanged, having read nothing but
+ * the timer on the way round. Nothing but the timer can get it out, so all
+ * iterations until what it read can next change are skipped without running
+ * them: the next tick for the BIOS tick count, the next edge of the byte
+ * read for a PIT counter, the next edge of the refresh or channel 2 bit for
+ * port 61h, and the next start or end of retrace or blanking for the CGA
+ * status port.
+ */
+#define IDLE_KEYPOLLS 64 /* keyboard status checks without a key, per tick */
+#define LOOP_MAXBYTES 32 /* longest backward branch taken as a loop */
+#define LOOP_MAXINSNS 32 /* most instructions in one iteration */
+#define LOOP_REPEATS 4 /* identical iterations before skipping ahead */
+
+/* Page Table
+ *
+ * The address space is split into 16K pages, each pointing at whatever host
+ * memory backs it: RAM, the BIOS ROM, or an EMS page mapped into the frame.
+ * Bank switching only swaps pointers in the table. Pages with nothing behind
+ * them are NULL, and any access to them is an error.
+ *
+ * FFFF:FFFF reaches 64K past the first megabyte. Those pages wrap around to
+ * the bottom of memory, as they do on an 8086.
+ */
+#define PAGE_SHIFT 14
+#define PAGE_SIZE (1u << PAGE_SHIFT)
+#define PAGE_MASK (PAGE_SIZE - 1)
+#define PAGES ((0x100000u >> PAGE_SHIFT) + 4)
+#define PAGE_ROM 1 /* writes are ignored */
+#define PAGE_CODE 2 /* holds code the flag liveness cache knows, see code_written() */
+#define PAGE_BREAK 4 /* has breakpoints in debug.breakmap */
+#define PAGE_WATCH 8 /* has watched bytes, see watch_written() */
+#define PAGE_DEBUG (PAGE_BREAK | PAGE_WATCH) /* kept when the page is remapped */
+#define PAGE_HASH 16 /* RAM in the lockstep hash, see hash_written() */
+
+/* each consumer of pagedirty[] clears its own bit */
+#define DIRTY_REWIND 1
+#define DIRTY_VIDEO 2
+#define DIRTY_ALL 0xffu
+
+#define VIDEO_START 0xA0000u /* video memory, A000:0000 to BFFF:FFFF */
+#define VIDEO_END 0xC0000u
+
+#define EMS_FRAME 0xE000u /* segment of the EMS page frame */
+#define EMS_PAGES 256 /* 4M of expanded memory */
+#define XMS_KB 8192 /* 8M of extended memory */
+
+/* Flag Liveness
+ *
+ * Most status flags an instruction computes are overwritten by a later one
+ * before anything reads them. The first time an instruction that writes
+ * flags runs, the straight-line code from there on is scanned, up to the
+ * next jump, call, interrupt, PUSHF or anything not understood, at all of
+ * which every flag counts as read. Working backwards gives, for each
+ * instruction in the run, whether any flag it writes will be read, and
+ * those that will not skip computing them. Results are cached by address.
+ *
+ * The 16-byte lines scanned are marked, and their pages flagged PAGE_CODE
+ * so that stores to them leave the fast path and can check for a mark.
+ * Storing into a marked line, remapping pages or loading new memory
+ * forgets the whole cache.
+ *
+ * An interrupt that arrives between an instruction and the one overwriting
+ * its flags pushes the stale ones, which only a handler that inspects its
+ * caller's flags could notice.
+ */
+#define FLAGS_SCAN 32 /* most instructions looked at in one run */
+#define FLAGS_CACHE 4096 /* instructions remembered, a power of two */
+#define CODE_LINE_SHIFT 4
+#define CODE_LINES ((PAGES << PAGE_SHIFT) >> CODE_LINE_SHIFT)
+
+/* Debugging
+ *
+ * Breakpoints and watchpoints cost nothing until one is set. A page holding
+ * a breakpoint is flagged PAGE_BREAK, and only there is the instruction
+ * about to run looked up in the page's bitmap. A page holding any watched
+ * byte is flagged PAGE_WATCH, which sends stores to it down the slow path
+ * of writebyte() like PAGE_ROM and PAGE_CODE do, and there they are checked
+ * against the watched ranges. A watchpoint stops the guest after the store,
+ * by making the next event due at once, which is already checked every
+ * instruction. Only stores are watched: loads have no slow path to use.
+ *
+ * Like the 386's resume flag, the instruction a breakpoint stopped before
+ * runs without stopping again the next time round. While a debugger is
+ * attached every flag is computed, so that whatever stop it looks at the
+ * flags are the real ones.
+ */
+#define WATCH_MAX 16
+
+/* Lockstep
+ *
+ * To check fast paths against the plain interpreter, two copies of one
+ * machine run the same guest side by side, a reference that computes every
+ * flag and one that skips dead ones, and compare hashes of their state at
+ * the end of every basic block. That is where the flag liveness scan stops
+ * and counts every flag as read, so the two must agree exactly there.
+ * Busy-wait loops are run in both rather than skipped, as skipping them
+ * changes the instruction count on purpose.
+ *
+ * The hash of RAM is a sum over its bytes of a hash of each byte and its
+ * offset, so a store only takes out what the old byte added and adds in
+ * the new one. RAM pages are flagged PAGE_HASH to send stores down the slow
+ * path of writebyte(), where this is done. The vectors and BIOS data below
+ * HASH_LOW are written by the BIOS emulation directly, and hashed whole
+ * each time instead, along with the registers.
+ */
+#define HASH_LOW 0x500u
+
+/* I/O Ports
+ *
+ * Every port has a handler for reads and one for writes, and a context
+ * pointer handed back to them, found through a two-level table: 256 pages
+ * of 256 ports, where every page with no device on it is the one page of
+ * handlers for nothing there. An IN or OUT costs two loads and an indirect
+ * call, whichever device it is for and however often it is polled. Devices
+ * take their ports with port_register() when the machine is set up.
+ */
+#define PORT_PAGE_SHIFT 8
+#define PORT_PAGE (1u << PORT_PAGE_SHIFT)
+#define PORT_PAGES (0x10000u >> PORT_PAGE_SHIFT)
+
+/* Heatmap
+ *
+ * Built with HEATMAP set to a region size, as a shift (8 for 256 bytes, 12
+ * for 4K), every byte the CPU fetches, reads or writes is counted against
+ * its region, and the regions touched are counted over each stretch of
+ * HEAT_INTERVAL instructions for a working set over time. Devices moving
+ * data in bulk through host_span() are not counted. system_done() writes
+ * the counts, if system_setheatmap() asked for them, as prefix-heat.csv
+ * and as prefix-heat.ppm, a row of pixels per 64K with red for writes,
+ * green for reads and blue for fetches, and the working set as
+ * prefix-ws.csv. Built without it, none of this is compiled in.
+ */
+#ifdef HEATMAP
+#if HEATMAP < 6 || HEATMAP > 16
+#error "HEATMAP is the region size as a shift, from 6 to 16"
+#endif
+#define HEAT_SHIFT HEATMAP
+#define HEAT_REGIONS ((PAGES << PAGE_SHIFT) >> HEAT_SHIFT)
+#define HEAT_ROW (0x10000u >> HEAT_SHIFT) /* regions per row of the image */
+#define HEAT_INTERVAL_SHIFT 20
+#define HEAT_INTERVAL (1ull << HEAT_INTERVAL_SHIFT) /* instructions per working set sample */
+#define HEAT_WIDTH 1024 /* pixels across the image */
+#define HEAT(a, n, kind) heat_touch(a, n, kind)
+#else
+#define HEAT(a, n, kind) ((void)0)
 #endif
 
-static BYTE sysmem[1 << 18]; /* 256K RAM */
-static BYTE *basemem = sysmem + 0x500; /* conventional RAM at 0050:0000 */
-static size_t topmem;
+/* Templates
+ *
+ * A template is guest memory and registers saved right after a program was
+ * loaded. Instances started from one map it MAP_PRIVATE over their memory,
+ * so every page the guest never writes is shared with all other instances
+ * through the page cache, and only the pages it dirties are its own. The
+ * file is in host byte order, meant for the host that made it.
+ */
+#define TEMPLATE_MAGIC "MONKTPL1"
+#define TEMPLATE_HEADER 0x10000u /* memory starts here, aligned for any page size */
+
+struct template_header {
+	char magic[8];
+	DWORD ram, rom;
+	WORD ip, flags, segs[4], regs[8];
+	WORD dta_seg, dta_ofs;
+};
+
+#define RAM_SIZE (BIOS_MEMORY_KB * 1024u) /* 256K RAM */
+#define ROM_SIZE 0x10000u
+#define IMAGE_SIZE (RAM_SIZE + ROM_SIZE)
+
+/* Rewind
+ *
+ * Every so many guest milliseconds the machine is saved in a checkpoint:
+ * registers, the timer and port 61h, the keyboard buffer, the DOS file
+ * pointers, the little else the BIOS and DOS keep, and how RAM changed since
+ * the checkpoint before, as the XOR of each page written in between. A
+ * shadow copy of RAM holds memory as of the newest checkpoint. XOR undoes
+ * itself, so applying deltas newest first takes the shadow back to any older
+ * checkpoint. The oldest checkpoints are dropped to stay within the budget.
+ *
+ * Going back to an instruction restores the last checkpoint before it and
+ * runs forward from there, unthrottled. That only comes out the same if the
+ * guest sees the same input, so a rewind is refused if, since that
+ * checkpoint, a key has come from the host, which cannot be read again, or a
+ * file or disk has been written, opened or closed, which cannot be undone.
+ * Reads and seeks are fine, as the file pointers go back too. Expanded,
+ * extended and video memory are left as they are, and console output in
+ * between is written again.
+ */
+#define REWIND_MAX 1024 /* most checkpoints kept, however small */
+#define REWIND_OFF UINT64_MAX
+
+struct pit {
+	WORD reload[3]; /* 0 counts 65536 */
+	BYTE rw[3], mode[3];
+	BYTE high[3]; /* the next byte read or written is the high byte */
+	BYTE latched[3];
+	WORD latch[3];
+	uint64_t start[3]; /* clock the count was loaded at */
+};
+
+struct checkpoint {
+	struct cpu cpu;
+	struct pit pit;
+	BYTE port61;
+	struct kbd_state kbd;
+	struct dosfile_state files;
+	unsigned long diskwrites;
+	unsigned keypolls;
+	WORD dta_seg, dta_ofs;
+	BYTE a20, exitcode, disk_status;
+	size_t size;
+	BYTE *delta; /* each page: its number, 4 bytes of size, then delta_encode() */
+};
+
+static BYTE *image; /* RAM then ROM, in one mapping a template can replace */
+static BYTE *sysmem;
+static BYTE *basemem; /* conventional RAM at 0050:0000 */
+static BYTE *biosrom; /* F000:0000 */
+static BYTE openbus[PAGE_SIZE]; /* unmapped EMS pages read as FFh */
+static BYTE *pagemap[PAGES];
+static BYTE pageflags[PAGES];
+static BYTE pagedirty[PAGES]; /* DIRTY_* bits of who has not seen a write yet */
+static BYTE a20; /* A20 state reported to XMS clients */
+static FILE *console; /* where the guest's console output goes */
+static BYTE exitcode; /* DOS return code */
+static char exitmessage[32]; /* what was said on stderr when it terminated */
 static struct cpu cpu;
+static unsigned keypolls; /* empty keyboard polls since the last tick */
+static BYTE disk_status; /* INT 13h status of the last operation */
+static unsigned long diskwrites; /* INT 13h writes, which a rewind cannot undo */
+static struct pit pit;
+static BYTE port61;
+static WORD dta_seg, dta_ofs; /* DOS disk transfer area */
+static int throttle = 1; /* sleep the host while the guest is idle */
+static struct {
+	ADDR at; /* linear address of the loop head */
+	uint64_t insns;
+	unsigned long effects;
+	WORD regs[8], segs[4], flags;
+	unsigned count;
+} busyloop;
+
+/* Waiting
+ *
+ * When the guest has nothing to do until a timer tick, a key or a disk,
+ * system_run() hands control back to the host with the reason and how long
+ * the wait may last, so that one host thread can look after other things
+ * meanwhile. The clock catches up when the guest is resumed: by the whole
+ * wait, or by the host time that passed if a key cut it short, which is the
+ * same passage of time the guest would have seen spinning. Without
+ * throttling nothing waits and the clock goes straight to the end.
+ */
+static struct {
+	enum system_reason reason; /* SYSTEM_BUDGET if not waiting */
+	uint64_t cycles; /* longest the wait lasts */
+	struct timespec start; /* host time it began */
+	uint64_t stamp; /* instruction it began on */
+	BYTE keys; /* a key ends it early */
+	BYTE busyloop; /* time skipped over a busy-wait loop */
+} waiting;
+
+static struct {
+	uint64_t interval; /* clocks between checkpoints, 0 if off */
+	uint64_t next; /* value of cycles at the next checkpoint */
+	size_t budget, used; /* bytes of deltas */
+	BYTE *shadow; /* RAM as of the newest checkpoint */
+	BYTE *scratch;
+	struct checkpoint *ring;
+	unsigned first, count;
+} history = { .next = REWIND_OFF };
+
+static struct {
+	ADDR a;
+	unsigned gen;
+	WORD live; /* flags the instruction writes that are read later, 0 if none */
+} flagcache[FLAGS_CACHE];
+static unsigned codegen = 1; /* cache entries from other generations are stale */
+static BYTE codeline[CODE_LINES]; /* lines the cache has entries for */
+
+/* Metrics are plain counters bumped where the work is already being done,
+ * as a machine only ever runs on one thread. Instructions and cycles come
+ * from cpu when asked for, so the instruction loop itself does no more. A
+ * rewind takes those back, but the rest count all the work done, rewound
+ * or not.
+ */
+static struct system_metrics metrics;
+
+static struct {
+	BYTE *breakmap[PAGES]; /* a bit per byte, for pages with breakpoints */
+	struct {
+		ADDR a;
+		DWORD len;
+	} watch[WATCH_MAX];
+	unsigned watches;
+	int stop; /* a breakpoint or watchpoint was hit */
+	int resuming; /* the breakpoint at resume_insns was already stopped at */
+	uint64_t resume_insns;
+	int watched; /* the stop was a watchpoint, at watch_addr */
+	ADDR watch_addr;
+	int attached; /* a debugger may look at the flags after any instruction */
+} debug;
+
+static struct {
+	int on;
+	int reference; /* compute every flag, the plain interpreter */
+	int stop; /* at the end of a block */
+	uint64_t at; /* instruction last stopped before */
+	uint64_t mem; /* sum of hash_byte() over RAM from HASH_LOW up */
+	BYTE *span; /* RAM from host_span() for storing, to add back once stored */
+	size_t spanlen;
+} lockstep;
+
+struct port {
+	BYTE (*in)(void *ctx, WORD port);
+	void (*out)(void *ctx, WORD port, BYTE b);
+	void *ctx;
+};
+static struct port portnone[PORT_PAGE]; /* the page of ports with nothing there */
+static struct port *portmap[PORT_PAGES];
+
+#ifdef HEATMAP
+enum { HEAT_WRITE, HEAT_READ, HEAT_FETCH, HEAT_KINDS }; /* red, green, blue */
+struct heat_sample {
+	uint64_t insns; /* at the end of the interval */
+	unsigned live; /* regions touched during it */
+	unsigned ever; /* regions touched since the start */
+};
+static struct {
+	const char *prefix; /* where to write them, NULL if nowhere */
+	uint64_t count[HEAT_REGIONS][HEAT_KINDS]; /* bytes */
+	uint64_t stamp[HEAT_REGIONS]; /* interval last touched in, 0 if never */
+	uint64_t interval; /* the current one, counting from 1 */
+	unsigned live, ever;
+	struct heat_sample *samples;
+	size_t nsamples, size;
+} heat;
+#endif
+static int ports_init(void);
+static void ports_done(void);
+
+static uint64_t video_next; /* value of cycles at the next vertical retrace */
+static uint64_t next_event; /* the soonest of history.next and video_next */
 
 /* sign extend 8-bits to 16-bits */
 static inline WORD
@@ -137,7 +575,7 @@ signext(BYTE b)
 static inline ADDR
 segofs_to_addr(WORD seg, WORD ofs)
 {
-	return ((ADDR)seg << 4) | ofs;
+	return ((ADDR)seg << 4) + ofs;
 }
 
 static inline void
@@ -147,45 +585,218 @@ addr_to_segofs(ADDR a, WORD *seg, WORD *ofs)
 	*ofs = a & 0xffffu;
 }
 
+static inline void
+guest_error(enum system_error kind)
+{
+	cpu.errors++;
+	metrics.errors[kind]++;
+}
+
+/* Pages with nothing behind them, except the planar video window, which
+ * is left unmapped so that the adapter sees every access to it.
+ */
+static BYTE
+unmapped_read(ADDR a)
+{
+	if (a - VIDEO_START < 0x10000u && video_mode()->format == SCREEN_PLANAR4)
+		return video_read(a - VIDEO_START);
+	guest_error(SYSTEM_ERROR_MEMORY);
+	return 0xffu;
+}
+
+static void
+unmapped_write(ADDR a, BYTE b)
+{
+	if (a - VIDEO_START < 0x10000u && video_mode()->format == SCREEN_PLANAR4) {
+		cpu.effects++;
+		video_write(a - VIDEO_START, b);
+		return;
+	}
+	guest_error(SYSTEM_ERROR_MEMORY);
+}
+
+#ifdef HEATMAP
+/* close the working set sample for the interval before iv */
+static void
+heat_roll(uint64_t iv)
+{
+	struct heat_sample *p;
+	size_t size;
+
+	if (heat.interval) {
+		if (heat.nsamples == heat.size) {
+			size = heat.size ? heat.size * 2 : 1024;
+			p = realloc(heat.samples, size * sizeof(*p));
+			if (!p)
+				return;
+			heat.samples = p;
+			heat.size = size;
+		}
+		p = &heat.samples[heat.nsamples++];
+		p->insns = cpu.insns;
+		p->live = heat.live;
+		p->ever = heat.ever;
+	}
+	heat.interval = iv;
+	heat.live = 0;
+}
+
+static inline void
+heat_touch(ADDR a, unsigned n, int kind)
+{
+	size_t r = a >> HEAT_SHIFT;
+	uint64_t iv = (cpu.insns >> HEAT_INTERVAL_SHIFT) + 1;
+
+	heat.count[r][kind] += n;
+	if (heat.stamp[r] != iv) {
+		if (iv != heat.interval)
+			heat_roll(iv);
+		if (!heat.stamp[r])
+			heat.ever++;
+		heat.stamp[r] = iv;
+		heat.live++;
+	}
+}
+#endif
+
+/* the guest read timer state that stays the same until cycle t */
+static inline void
+timer_seen(uint64_t t)
+{
+	cpu.timer_read = 1;
+	if (t < cpu.timer_until)
+		cpu.timer_until = t;
+}
+
+/* a byte of guest memory, without being counted as an access */
+static inline BYTE
+loadbyte(ADDR a)
+{
+	BYTE *p = pagemap[a >> PAGE_SHIFT];
+
+	if (!p)
+		return unmapped_read(a);
+	if (a - BDA_TICK < 4)
+		timer_seen(cpu.next_tick);
+	return p[a & PAGE_MASK];
+}
+
+static inline WORD
+loadword(ADDR a)
+{
+	BYTE *p = pagemap[a >> PAGE_SHIFT];
+
+	if ((a & PAGE_MASK) == PAGE_MASK || !p)
+		return loadbyte(a) | ((WORD)loadbyte(a + 1) << 8);
+	if (a - (BDA_TICK - 1) < 4)
+		timer_seen(cpu.next_tick);
+	p += a & PAGE_MASK;
+	return p[0] | ((WORD)p[1] << 8);
+}
+
 static inline BYTE
 readbyte(ADDR a)
 {
-	if (a >= topmem) {
-		cpu.errors++;
-		return 0xffu;
-	}
-	return sysmem[a];
+	HEAT(a, 1, HEAT_READ);
+	return loadbyte(a);
 }
 
 static inline WORD
 readword(ADDR a)
 {
-	if ((a | 1) >= topmem) {
-		cpu.errors++;
-		return 0xffffu;
-	}
-	return sysmem[a] | ((WORD)sysmem[a + 1] << 8);
+	HEAT(a, 2, HEAT_READ);
+	return loadword(a);
 }
 
+static void code_written(ADDR a, size_t len);
+static void watch_written(ADDR a, size_t len);
+static void hash_written(BYTE *p, BYTE b);
+static void hash_span(BYTE *p, size_t len);
+
 static inline void
 writebyte(ADDR a, BYTE b)
 {
-	if (a >= topmem) {
-		cpu.errors++;
+	BYTE *p = pagemap[a >> PAGE_SHIFT];
+
+	HEAT(a, 1, HEAT_WRITE);
+	if (!p) {
+		unmapped_write(a, b);
 		return;
 	}
-	sysmem[a] = b;
+	if (pageflags[a >> PAGE_SHIFT] & PAGE_ROM)
+		return;
+	if (pageflags[a >> PAGE_SHIFT] & PAGE_CODE)
+		code_written(a, 1);
+	if (pageflags[a >> PAGE_SHIFT] & PAGE_WATCH)
+		watch_written(a, 1);
+	if (pageflags[a >> PAGE_SHIFT] & PAGE_HASH)
+		hash_written(p + (a & PAGE_MASK), b);
+	cpu.effects++;
+	pagedirty[a >> PAGE_SHIFT] = DIRTY_ALL;
+	p[a & PAGE_MASK] = b;
 }
 
 static inline void
 writeword(ADDR a, WORD w)
 {
-	if ((a | 1) >= topmem) {
-		cpu.errors++;
+	BYTE *p = pagemap[a >> PAGE_SHIFT];
+
+	if ((a & PAGE_MASK) == PAGE_MASK || !p || pageflags[a >> PAGE_SHIFT]) {
+		writebyte(a, w & 0xffu);
+		writebyte(a + 1, (w & 0xff00u) >> 8);
 		return;
 	}
-	sysmem[a] = w & 0xffu;
-	sysmem[a + 1] = (w & 0xff00u) >> 8;
+	HEAT(a, 2, HEAT_WRITE);
+	cpu.effects++;
+	pagedirty[a >> PAGE_SHIFT] = DIRTY_ALL;
+	p += a & PAGE_MASK;
+	p[0] = w & 0xffu;
+	p[1] = (w & 0xff00u) >> 8;
+}
+
+static void clock_wait(unsigned long us);
+static void history_drop(void);
+
+/* Host pointer to the linear range at a, which is contiguous in host memory
+ * for only *len bytes of it, and NULL if the start is not backed by anything
+ * or, when storing, is read-only.
+ */
+static BYTE *
+host_span(ADDR a, size_t *len, int store)
+{
+	size_t i = a >> PAGE_SHIFT, n = PAGE_SIZE - (a & PAGE_MASK);
+
+	if (i >= PAGES || !pagemap[i] || (store && pageflags[i] & PAGE_ROM))
+		return NULL;
+	while (n < *len && i + 1 < PAGES && pagemap[i + 1] == pagemap[i] + PAGE_SIZE &&
+		pageflags[i + 1] == pageflags[i])
+		i++, n += PAGE_SIZE;
+	if (*len > n)
+		*len = n;
+	if (store) {
+		memset(pagedirty + (a >> PAGE_SHIFT), DIRTY_ALL, i - (a >> PAGE_SHIFT) + 1);
+		if (*len && pageflags[a >> PAGE_SHIFT] & PAGE_CODE)
+			code_written(a, *len);
+		if (*len && pageflags[a >> PAGE_SHIFT] & PAGE_WATCH)
+			watch_written(a, *len);
+		if (*len && pageflags[a >> PAGE_SHIFT] & PAGE_HASH)
+			hash_span(pagemap[a >> PAGE_SHIFT] + (a & PAGE_MASK), *len);
+	}
+	return pagemap[a >> PAGE_SHIFT] + (a & PAGE_MASK);
+}
+
+/* Host pointer to the guest buffer at seg:ofs, for devices that move data
+ * in bulk. Only *len bytes of it are contiguous: a buffer that runs off the
+ * end of its segment wraps back to offset 0, and one that crosses into a
+ * differently mapped page continues elsewhere, so callers move it in pieces.
+ * Returns NULL if the buffer is not in memory the transfer can use.
+ */
+static BYTE *
+guest_span(WORD seg, WORD ofs, size_t *len, int store)
+{
+	if (*len > 0x10000u - ofs)
+		*len = 0x10000u - ofs;
+	return host_span(segofs_to_addr(seg, ofs), len, store);
 }
 
 /* read byte and increment IP */
@@ -195,8 +806,9 @@ fetchbyte(void)
 	ADDR a = segofs_to_addr(CS, IP);
 
 	IP++;
+	HEAT(a, 1, HEAT_FETCH);
 
-	return readbyte(a);
+	return loadbyte(a);
 }
 
 /* read opcode and increment IP */
@@ -214,23 +826,23 @@ fetchword(void)
 	ADDR a = segofs_to_addr(CS, IP);
 
 	IP += 2;
+	HEAT(a, 2, HEAT_FETCH);
 
-	return readword(a);
+	return loadword(a);
 }
 
 static void
 pushword(WORD w)
 {
-	ADDR a = segofs_to_addr(SS, SP);
 	SP -= 2;
-	writeword(a, w);
+	writeword(segofs_to_addr(SS, SP), w);
 }
 
 static WORD
 popword(void)
 {
 	ADDR a = segofs_to_addr(SS, SP);
-	SS += 2;
+	SP += 2;
 	return readword(a);
 }
 
@@ -271,7 +883,7 @@ modrm_begin(int w)
 		a += BP + SI;
 		break;
 	case 3: // (BP) + (DI) + DISP
-		a += BP;
+		a += BP + DI;
 		break;
 	case 4: // (SI) + DISP
 		a += SI;
@@ -292,7 +904,10 @@ modrm_begin(int w)
 
 	switch (cpu.segment_override) {
 	case OVERRIDE_NONE:
-		a = segofs_to_addr(cpu.segs[implied_seg[MODRM_RM(cpu.pending.modrm)]], a);
+		if (MODRM_MOD(cpu.pending.modrm) == 0 && MODRM_RM(cpu.pending.modrm) == 6)
+			a = segofs_to_addr(DS, a);
+		else
+			a = segofs_to_addr(cpu.segs[implied_seg[MODRM_RM(cpu.pending.modrm)]], a);
 		break;
 	case OVERRIDE_ES:
 		a = segofs_to_addr(ES, a);
@@ -308,24 +923,24 @@ modrm_begin(int w)
 		break;
 	}
 
-	if (a >= topmem) {
-		cpu.errors++;
-		return;
-	}
-
-	cpu.pending.p = &sysmem[a];
+	cpu.pending.a = a;
+	PROBE3(modrm, cpu.pending.modrm, a, w);
 }
 
 static void
 modrm_end(void)
 {
-	// useful for debugging code
+	PROBE1(modrm_end, cpu.pending.modrm);
 }
 
 static BYTE
 modrm_readbyte(void)
 {
-	return *(BYTE*)cpu.pending.p;
+	if (MODRM_MOD(cpu.pending.modrm) == 3) {
+		return *(BYTE*)cpu.pending.p;
+	} else {
+		return readbyte(cpu.pending.a);
+	}
 }
 
 static WORD
@@ -334,14 +949,18 @@ modrm_readword(void)
 	if (MODRM_MOD(cpu.pending.modrm) == 3) {
 		return *(WORD*)cpu.pending.p;
 	} else {
-		return readword((BYTE*)cpu.pending.p - sysmem);
+		return readword(cpu.pending.a);
 	}
 }
 
 static void
 modrm_writebyte(BYTE b)
 {
-	*(BYTE*)cpu.pending.p = b;
+	if (MODRM_MOD(cpu.pending.modrm) == 3) {
+		*(BYTE*)cpu.pending.p = b;
+	} else {
+		writebyte(cpu.pending.a, b);
+	}
 }
 
 static void
@@ -350,210 +969,2555 @@ modrm_writeword(WORD w)
 	if (MODRM_MOD(cpu.pending.modrm) == 3) {
 		*(WORD*)cpu.pending.p = w;
 	} else {
-		writeword((BYTE*)cpu.pending.p - sysmem, w);
+		writeword(cpu.pending.a, w);
 	}
 }
 
+/* forget every flag liveness result, for memory that changed under them */
 static void
-cpu_reset(void)
+flags_flush(void)
 {
-	cpu.done = 0;
-	cpu.errors = 0;
-	CS = 0xffffu;
-	IP = 0x0000u;
+	size_t i;
+
+	codegen++;
+	memset(codeline, 0, sizeof(codeline));
+	for (i = 0; i < PAGES; i++)
+		pageflags[i] &= ~PAGE_CODE;
 }
 
-static int
-loadfile_com(const char *filename)
+/* The first 64K past the megabyte wraps around to the bottom of memory,
+ * so lines there are marked at their low address.
+ */
+static size_t
+code_line(ADDR a)
 {
-	unsigned char *out;
-	size_t count, size;
-	FILE *f;
-	WORD psp_seg;
-
-	f = fopen(filename, "rb");
-	if (!f) {
-		perror(filename);
-		return -1;
-	}
+	if (a >= 0x100000u)
+		a -= 0x100000u;
+	return a >> CODE_LINE_SHIFT;
+}
 
-	psp_seg = (ADDR)(basemem - sysmem) >> 4;
-	fprintf(stderr, "PSP @ %04hhX:0000\n", psp_seg);
-	out = basemem + 0x100u; /* start writing .COM file after PSP */
-	for (out = basemem, size = 0; size < topmem && !feof(f); out += count, size += count) {
-		size_t rem = topmem - size;
-		count = fread(out, 1, rem, f);
-		if (!count)
-			break;
+/* note len bytes at a as scanned, so that writing them forgets the scan */
+static void
+code_mark(ADDR a, unsigned len)
+{
+	ADDR end = a + len;
+
+	for (; a < end; a = (a | ((1u << CODE_LINE_SHIFT) - 1)) + 1) {
+		codeline[code_line(a)] = 1;
+		pageflags[a >> PAGE_SHIFT] |= PAGE_CODE;
+		if (a < 0x10000u)
+			pageflags[(a + 0x100000u) >> PAGE_SHIFT] |= PAGE_CODE;
+		else if (a >= 0x100000u)
+			pageflags[(a - 0x100000u) >> PAGE_SHIFT] |= PAGE_CODE;
 	}
+}
 
-	fclose(f);
-
-	/* .COM file register and memory layout
-	 * CS:IP = PSP:0100
-	 * DS,ES,SS = PSP
-	 * SP = end of 64K segment
-	 * TODO: AL,AH = drive letter status
-	 */
-	DS = ES = SS = CS = psp_seg;
-	IP = 0x0100u;
-	SP = 0xfffeu; // TODO: is this correct?
+static void
+code_written(ADDR a, size_t len)
+{
+	size_t i, last = code_line(a + len - 1);
 
-	return 0;
+	for (i = code_line(a); i <= last && i < CODE_LINES; i++) {
+		if (codeline[i]) {
+			codeline[i] = 0;
+			codegen++;
+		}
+	}
 }
 
-int
-system_init(void)
+/* stop after this instruction if a store to len bytes at a touched a watchpoint */
+static void
+watch_written(ADDR a, size_t len)
 {
-	topmem = sizeof(sysmem) - (basemem - sysmem);
+	unsigned i;
+
+	for (i = 0; i < debug.watches; i++) {
+		if (a < debug.watch[i].a + debug.watch[i].len && debug.watch[i].a < a + len) {
+			debug.stop = 1;
+			debug.watched = 1;
+			debug.watch_addr = a > debug.watch[i].a ? a : debug.watch[i].a;
+			next_event = 0;
+			return;
+		}
+	}
+}
 
-	cpu_reset();
+/* what a byte of RAM adds to the lockstep hash */
+static inline uint64_t
+hash_byte(size_t off, BYTE b)
+{
+	uint64_t x = (((uint64_t)off << 8) | b) * 0x9e3779b97f4a7c15ull;
 
-	return 0;
+	x ^= x >> 29;
+	x *= 0xbf58476d1ce4e5b9ull;
+	return x ^ (x >> 32);
 }
 
-void
-system_done(void)
+/* what len bytes at p add to the hash, of those that are hashed RAM */
+static uint64_t
+hash_sum(const BYTE *p, size_t len)
 {
+	const BYTE *end = p + len;
+	uint64_t h = 0;
+
+	if (p < sysmem + HASH_LOW)
+		p = sysmem + HASH_LOW;
+	if (end > sysmem + RAM_SIZE)
+		end = sysmem + RAM_SIZE;
+	for (; p < end; p++)
+		h += hash_byte(p - sysmem, *p);
+	return h;
 }
 
-int
-system_loadfile(const char *filename)
+/* add back the span handed out for storing, which has been stored by now */
+static void
+hash_settle(void)
 {
-	// TODO: check for .COM vs .EXE
-	if (loadfile_com(filename))
-		return -1;
-	return 0;
+	lockstep.mem += hash_sum(lockstep.span, lockstep.spanlen);
+	lockstep.spanlen = 0;
 }
 
-int
-system_setargs(int argc, char *argv[])
+/* b is about to be stored at p */
+static void
+hash_written(BYTE *p, BYTE b)
 {
-	WORD psp_seg;
-	ADDR a;
-	int i, j;
-	size_t total_len;
-
-	// TODO: check for .COM vs .EXE
-	psp_seg = (ADDR)(basemem - sysmem) >> 4;
+	hash_settle();
+	if (p >= sysmem + HASH_LOW && p < sysmem + RAM_SIZE)
+		lockstep.mem += hash_byte(p - sysmem, b) - hash_byte(p - sysmem, *p);
+}
 
-	/* length of command line arguments */
-	a = segofs_to_addr(psp_seg, 0x80);
-	fprintf(stderr, "Command-line at @ %06hX\n", a);
+/* len bytes at p are about to be stored by a device */
+static void
+hash_span(BYTE *p, size_t len)
+{
+	hash_settle();
+	lockstep.mem -= hash_sum(p, len);
+	lockstep.span = p;
+	lockstep.spanlen = len;
+}
 
-	a++;
-	for (i = 0, total_len = 0; i < argc; i++) {
-		const char *s = argv[i];
+/* whether to stop before the instruction at a, on a page with breakpoints */
+static int
+breakpoint_hit(ADDR a)
+{
+	BYTE *map = debug.breakmap[a >> PAGE_SHIFT];
 
-		for (j = 0; s[j]; j++) {
-			if (total_len < 126) {
-				writebyte(a + total_len, s[j]);
-				total_len++;
-			}
-		}
-		if (total_len < 126 && i + 1 != argc) {
-			writebyte(a + total_len, ' ');
-			total_len++;
-		}
-	}
-	if (total_len < 127) {
-		writebyte(a + total_len, '\r');
-		total_len++;
+	if (!map || !(map[(a & PAGE_MASK) >> 3] & (1u << (a & 7))))
+		return 0;
+	if (debug.resuming && debug.resume_insns == cpu.insns) {
+		debug.resuming = 0;
+		return 0;
 	}
-
-	writebyte(a - 1, total_len);
-
-	return 0; // TODO: return error on overflow
+	debug.resuming = 1;
+	debug.resume_insns = cpu.insns;
+	debug.stop = 1;
+	debug.watched = 0;
+	return 1;
 }
 
-static void
-print_cpu(const char *prefix)
+/* a byte of code for scanning, without the side effects of readbyte() */
+static int
+peekbyte(ADDR a)
 {
-	if (prefix)
-		fprintf(stderr, "%s: ", prefix);
-	fprintf(stderr, "CS: %04hX IP: %04hX\n", CS, IP);
-
-	if (prefix)
-		fprintf(stderr, "%s: ", prefix);
-	fprintf(stderr, "AX: %04hX CX: %04hX DX: %04hX BX: %04hX\n", AX, CX, DX, BX);
+	BYTE *p = pagemap[a >> PAGE_SHIFT];
 
-	if (prefix)
-		fprintf(stderr, "%s: ", prefix);
-	fprintf(stderr, "AL: %04hhX AH: %04hhX\n", AL, AH);
+	return p ? p[a & PAGE_MASK] : -1;
 }
 
-static void
-console_out(BYTE b)
+/* bytes in a ModR/M byte and its displacement */
+static unsigned
+modrm_len(int m)
 {
-	if (b == '\r')
-		return;
-	fputc(b, stdout);
+	switch (MODRM_MOD(m)) {
+	case 0:
+		return MODRM_RM(m) == 6 ? 3 : 1;
+	case 1:
+		return 2;
+	case 2:
+		return 3;
+	}
+	return 1;
 }
 
-static void
-dosirq(void)
+/* Find the status flags the instruction at cs:ip reads and writes, and
+ * return its length, or 0 if it ends a straight-line run.
+ */
+static unsigned
+flags_use(WORD cs, WORD ip, WORD *read, WORD *write)
+{
+	int op = peekbyte(segofs_to_addr(cs, ip)), m = peekbyte(segofs_to_addr(cs, ip + 1u));
+
+	*read = *write = 0;
+	if (op < 0)
+		return 0;
+	if (op < 0x40 && (op & 7) < 6) { /* ADD, OR, ADC, SBB, AND, SUB, XOR, CMP */
+		*write = FLAGS_STATUS;
+		if (op >> 3 == 2 || op >> 3 == 3)
+			*read = FLAG_VALUE_CF;
+		if ((op & 7) == 4)
+			return 2;
+		if ((op & 7) == 5)
+			return 3;
+		return m < 0 ? 0 : 1 + modrm_len(m);
+	}
+	if (op >= 0x40 && op <= 0x4F) { /* INC, DEC */
+		*write = FLAGS_STATUS & ~FLAG_VALUE_CF;
+		return 1;
+	}
+	if ((op >= 0x50 && op <= 0x5F) || (op >= 0xEC && op <= 0xEF))
+		return 1;
+	if (op >= 0xB0 && op <= 0xB7)
+		return 2;
+	if (op >= 0xB8 && op <= 0xBF)
+		return 3;
+
+	switch (op) {
+	case 0x06: case 0x07: case 0x0E: case 0x16: case 0x17: case 0x1E: case 0x1F:
+	case 0x26: case 0x2E: case 0x36: case 0x3E:
+	case 0xFA: case 0xFB: case 0xFC: case 0xFD:
+		return 1;
+#if CPU_186
+	case 0x60: case 0x61: case 0xC9:
+		return 1;
+	case 0x68:
+		return 3;
+	case 0x6A:
+		return 2;
+	case 0xC8:
+		return 4;
+#endif
+	case 0xE4: case 0xE5: case 0xE6: case 0xE7:
+		return 2;
+	case 0x80: case 0x81: case 0x82: case 0x83:
+		if (m < 0)
+			return 0;
+		*write = FLAGS_STATUS;
+		if (MODRM_N(m) == 2 || MODRM_N(m) == 3)
+			*read = FLAG_VALUE_CF;
+		return 1 + modrm_len(m) + (op == 0x81 ? 2 : 1);
+	case 0x84: case 0x85:
+		*write = FLAGS_STATUS;
+		/* fall through */
+	case 0x86: case 0x87: case 0x88: case 0x89: case 0x8A: case 0x8B:
+	case 0x8C: case 0x8D: case 0x8E: case 0x8F:
+		return m < 0 ? 0 : 1 + modrm_len(m);
+	case 0xA0: case 0xA1: case 0xA2: case 0xA3:
+		return 3;
+	case 0xA8:
+		*write = FLAGS_STATUS;
+		return 2;
+	case 0xA9:
+		*write = FLAGS_STATUS;
+		return 3;
+	case 0xF5: /* CMC */
+		*read = FLAG_VALUE_CF;
+		/* fall through */
+	case 0xF8: case 0xF9: /* CLC, STC */
+		*write = FLAG_VALUE_CF;
+		return 1;
+	case 0xFE: case 0xFF:
+		if (m < 0)
+			return 0;
+		if (MODRM_N(m) < 2) { /* INC, DEC */
+			*write = FLAGS_STATUS & ~FLAG_VALUE_CF;
+			return 1 + modrm_len(m);
+		}
+		if (op == 0xFF && MODRM_N(m) == 6) /* PUSH */
+			return 1 + modrm_len(m);
+		return 0;
+	}
+
+	return 0; /* control transfers, and anything unknown or rare */
+}
+
+/* scan the run starting at cs:ip into the cache, returning the first result */
+static WORD
+flags_scan(WORD cs, WORD ip)
+{
+	WORD ips[FLAGS_SCAN], reads[FLAGS_SCAN], writes[FLAGS_SCAN];
+	WORD live = FLAGS_STATUS, first = FLAGS_STATUS;
+	unsigned n, len;
+	ADDR a;
+
+	for (n = 0; n < FLAGS_SCAN; n++) {
+		len = flags_use(cs, ip, &reads[n], &writes[n]);
+		if (!len)
+			break;
+		code_mark(segofs_to_addr(cs, ip), len);
+		ips[n] = ip;
+		ip += len;
+	}
+	while (n--) {
+		/* a lockstep reference or a debugger sees every flag, read or not */
+		if (lockstep.reference || debug.attached)
+			live = FLAGS_STATUS;
+		if (writes[n]) {
+			a = segofs_to_addr(cs, ips[n]);
+			flagcache[a & (FLAGS_CACHE - 1)].a = a;
+			flagcache[a & (FLAGS_CACHE - 1)].gen = codegen;
+			flagcache[a & (FLAGS_CACHE - 1)].live = live & writes[n];
+			if (!n)
+				first = live & writes[n];
+		}
+		live = (live & ~writes[n]) | reads[n];
+	}
+
+	return first;
+}
+
+/* whether the flags the current instruction writes are read before being written again */
+static int
+flags_wanted(void)
+{
+	ADDR a = segofs_to_addr(CS, cpu.op_ip);
+	WORD live;
+
+	if (flagcache[a & (FLAGS_CACHE - 1)].a == a && flagcache[a & (FLAGS_CACHE - 1)].gen == codegen)
+		live = flagcache[a & (FLAGS_CACHE - 1)].live;
+	else
+		live = flags_scan(CS, cpu.op_ip);
+	if (!live) {
+		metrics.flags_skipped++;
+		return 0;
+	}
+	metrics.flags_computed++;
+	return 1;
+}
+
+/* set the status flags to f, with SF, ZF and PF taken from r */
+static void
+flags_result(unsigned r, int w, WORD f)
+{
+	if (!(r & (w ? 0xffffu : 0xffu)))
+		f |= FLAG_VALUE_ZF;
+	if (r & (w ? 0x8000u : 0x80u))
+		f |= FLAG_VALUE_SF;
+	if (!__builtin_parity(r & 0xffu))
+		f |= FLAG_VALUE_PF;
+	cpu.flags = (cpu.flags & ~FLAGS_STATUS) | f;
+}
+
+/* a + b + carry, of a byte or a word */
+static unsigned
+alu_add(unsigned a, unsigned b, unsigned carry, int w)
+{
+	unsigned r = a + b + carry, sign = w ? 0x8000u : 0x80u;
+	WORD f = 0;
+
+	if (!flags_wanted())
+		return r;
+	if (r & (sign << 1))
+		f |= FLAG_VALUE_CF;
+	if ((a ^ b ^ r) & 0x10)
+		f |= FLAG_VALUE_AF;
+	if (~(a ^ b) & (a ^ r) & sign)
+		f |= FLAG_VALUE_OF;
+	flags_result(r, w, f);
+	return r;
+}
+
+/* a - b - borrow, of a byte or a word */
+static unsigned
+alu_sub(unsigned a, unsigned b, unsigned borrow, int w)
+{
+	unsigned r = a - b - borrow, sign = w ? 0x8000u : 0x80u;
+	WORD f = 0;
+
+	if (!flags_wanted())
+		return r;
+	if (r & (sign << 1))
+		f |= FLAG_VALUE_CF;
+	if ((a ^ b ^ r) & 0x10)
+		f |= FLAG_VALUE_AF;
+	if ((a ^ b) & (a ^ r) & sign)
+		f |= FLAG_VALUE_OF;
+	flags_result(r, w, f);
+	return r;
+}
+
+/* the result of AND, OR, XOR or TEST, which clear CF, OF and AF */
+static unsigned
+alu_logic(unsigned r, int w)
+{
+	if (flags_wanted())
+		flags_result(r, w, 0);
+	return r;
+}
+
+/* INC and DEC, which leave CF alone */
+static unsigned
+alu_incdec(unsigned a, int w, int dec)
+{
+	WORD cf = cpu.flags & FLAG_VALUE_CF;
+	unsigned r = dec ? alu_sub(a, 1, 0, w) : alu_add(a, 1, 0, w);
+
+	cpu.flags = (cpu.flags & ~FLAG_VALUE_CF) | cf;
+	return r;
+}
+
+/* the operation selected by bits 3-5 of an opcode or ModR/M byte */
+static unsigned
+alu(int n, unsigned a, unsigned b, int w)
+{
+	switch (n) {
+	case 0:
+		return alu_add(a, b, 0, w);
+	case 1:
+		return alu_logic(a | b, w);
+	case 2:
+		return alu_add(a, b, FLAG_CF, w);
+	case 3:
+		return alu_sub(a, b, FLAG_CF, w);
+	case 4:
+		return alu_logic(a & b, w);
+	case 6:
+		return alu_logic(a ^ b, w);
+	default: /* SUB and CMP */
+		return alu_sub(a, b, 0, w);
+	}
+}
+
+/* Shift or rotate a byte or word count times, the operation selected by
+ * bits 3-5 of the ModR/M byte. The count is masked as the model does, and
+ * one of 0 leaves the flags alone. Rotates only touch CF and OF.
+ */
+static unsigned
+shift(int n, unsigned v, unsigned count, int w)
+{
+	unsigned sign = w ? 0x8000u : 0x80u, mask = (sign << 1) - 1;
+	unsigned cf = FLAG_CF ? 1 : 0, prev = v, i, out;
+	WORD f;
+
+	count &= SHIFT_MASK;
+	if (!count)
+		return v;
+	for (i = 0; i < count; i++) {
+		prev = v;
+		switch (n) {
+		case 0: /* ROL */
+			cf = !!(v & sign);
+			v = ((v << 1) | cf) & mask;
+			break;
+		case 1: /* ROR */
+			cf = v & 1;
+			v = (v >> 1) | (cf ? sign : 0);
+			break;
+		case 2: /* RCL */
+			out = !!(v & sign);
+			v = ((v << 1) | cf) & mask;
+			cf = out;
+			break;
+		case 3: /* RCR */
+			out = v & 1;
+			v = (v >> 1) | (cf ? sign : 0);
+			cf = out;
+			break;
+		case 4: /* SHL */
+		case 6: /* undocumented, the same as SHL */
+			cf = !!(v & sign);
+			v = (v << 1) & mask;
+			break;
+		case 5: /* SHR */
+			cf = v & 1;
+			v >>= 1;
+			break;
+		case 7: /* SAR */
+			cf = v & 1;
+			v = (v >> 1) | (v & sign);
+			break;
+		}
+	}
+
+	f = cf ? FLAG_VALUE_CF : 0;
+	switch (n) {
+	case 0:
+	case 2:
+	case 4:
+	case 6: /* the top bit changed on the last step */
+		if (!(v & sign) != !cf)
+			f |= FLAG_VALUE_OF;
+		break;
+	case 1:
+	case 3: /* the top two bits differ */
+		if (!(v & sign) != !(v & (sign >> 1)))
+			f |= FLAG_VALUE_OF;
+		break;
+	case 5: /* the top bit before the last step */
+		if (prev & sign)
+			f |= FLAG_VALUE_OF;
+		break;
+	}
+	if (n < 4)
+		cpu.flags = (cpu.flags & ~(FLAG_VALUE_CF | FLAG_VALUE_OF)) | f;
+	else
+		flags_result(v, w, f);
+
+	return v;
+}
+
+#if CPU_MODEL == CPU_V20
+/* NEC TEST1, CLR1, SET1 and NOT1, the opcode after 0Fh in op. 10h-17h take
+ * the bit number from CL and 18h-1Fh from an immediate byte, and even ones
+ * work on a byte, odd ones on a word. Returns -1 for anything else.
+ */
+static int
+nec_bitop(BYTE op)
+{
+	int w = op & 1;
+	unsigned v, bit;
+
+	if (op < 0x10 || op > 0x1F)
+		return -1;
+	modrm_begin(w);
+	bit = (op & 8 ? fetchbyte() : CL) & (w ? 15 : 7);
+	v = w ? modrm_readword() : modrm_readbyte();
+	switch ((op >> 1) & 3) {
+	case 0: /* TEST1: ZF if the bit is clear */
+		cpu.flags &= ~(FLAG_VALUE_CF | FLAG_VALUE_OF | FLAG_VALUE_ZF);
+		if (!(v & (1u << bit)))
+			cpu.flags |= FLAG_VALUE_ZF;
+		modrm_end();
+		return 0;
+	case 1: /* CLR1 */
+		v &= ~(1u << bit);
+		break;
+	case 2: /* SET1 */
+		v |= 1u << bit;
+		break;
+	case 3: /* NOT1 */
+		v ^= 1u << bit;
+		break;
+	}
+	if (w)
+		modrm_writeword(v);
+	else
+		modrm_writebyte(v);
+	modrm_end();
+
+	return 0;
+}
+#endif
+
+static void
+cpu_reset(void)
+{
+	cpu.done = 0;
+	cpu.errors = 0;
+	CS = 0xffffu;
+	IP = 0x0000u;
+	cpu.cycles = 0;
+	cpu.next_tick = TICK_CYCLES;
+	cpu.timer_read = 0;
+	cpu.timer_until = UINT64_MAX;
+}
+
+static int
+loadfile_com(const char *filename)
+{
+	unsigned char *out;
+	size_t count, size;
+	FILE *f;
+	WORD psp_seg;
+
+	f = fopen(filename, "rb");
+	if (!f) {
+		perror(filename);
+		return -1;
+	}
+
+	psp_seg = (ADDR)(basemem - sysmem) >> 4;
+	fprintf(stderr, "PSP @ %04hhX:0000\n", psp_seg);
+	/* start writing .COM file after PSP, and leave room for the stack */
+	for (out = basemem + 0x100u, size = 0; size < 0xff00u - 0x100u && !feof(f); out += count, size += count) {
+		size_t rem = 0xff00u - 0x100u - size;
+		count = fread(out, 1, rem, f);
+		if (!count)
+			break;
+	}
+
+	fclose(f);
+
+	/* .COM file register and memory layout
+	 * CS:IP = PSP:0100
+	 * DS,ES,SS = PSP
+	 * SP = end of 64K segment
+	 * TODO: AL,AH = drive letter status
+	 */
+	DS = ES = SS = CS = psp_seg;
+	IP = 0x0100u;
+	dta_seg = psp_seg;
+	dta_ofs = 0x0080u; /* shared with the command tail, as in DOS */
+	SP = 0xfffeu; // TODO: is this correct?
+	cpu.flags = FLAG_VALUE_IF; /* DOS starts programs with interrupts on */
+	flags_flush();
+
+	return 0;
+}
+
+/* point a run of pages at host memory, or at nothing */
+static void
+map_pages(ADDR a, size_t len, BYTE *mem, BYTE flags)
+{
+	size_t i;
+	BYTE *p;
+
+	for (i = 0; i < len >> PAGE_SHIFT; i++) {
+		p = mem ? mem + i * PAGE_SIZE : NULL;
+		pagemap[(a >> PAGE_SHIFT) + i] = p;
+		pageflags[(a >> PAGE_SHIFT) + i] = flags | (pageflags[(a >> PAGE_SHIFT) + i] & PAGE_DEBUG);
+		if (lockstep.on && p >= sysmem && p < sysmem + RAM_SIZE)
+			pageflags[(a >> PAGE_SHIFT) + i] |= PAGE_HASH;
+	}
+	flags_flush();
+}
+
+/* bring the page frame in line with what EMS has mapped there */
+static void
+ems_remap(void)
+{
+	unsigned i;
+	BYTE *p;
+
+	for (i = 0; i < EMS_FRAME_PAGES; i++) {
+		p = ems_frame(i);
+		map_pages(segofs_to_addr(EMS_FRAME, i * EMS_PAGE), EMS_PAGE,
+			p ? p : openbus, p ? 0 : PAGE_ROM);
+	}
+}
+
+/* map the window of the current video mode, and nothing elsewhere */
+static void
+video_remap(void)
+{
+	const struct video_mode *m = video_mode();
+
+	map_pages(VIDEO_START, VIDEO_END - VIDEO_START, openbus, PAGE_ROM);
+	if (m->format == SCREEN_PLANAR4)
+		map_pages(segofs_to_addr(m->seg, 0), 0x10000u, NULL, 0);
+	else
+		map_pages(segofs_to_addr(m->seg, 0), m->size ? m->size : 0x10000u, video_memory(), 0);
+	video_next = next_event = 0;
+}
+
+/* tell the guest about the video mode in the BIOS data area */
+static void
+bda_video(void)
+{
+	const struct video_mode *m = video_mode();
+
+	sysmem[BDA_VIDEO_MODE] = m->mode;
+	sysmem[BDA_COLUMNS] = m->format == SCREEN_NONE ? m->width : m->width / 8;
+	sysmem[BDA_COLUMNS + 1] = 0;
+	sysmem[BDA_ROWS] = (m->format == SCREEN_NONE ? m->height : m->height / 8) - 1;
+	memset(sysmem + BDA_CURSOR, 0, 16);
+	sysmem[BDA_PAGE] = 0;
+}
+
+static void
+setvector(BYTE n, WORD seg, WORD ofs)
+{
+	sysmem[n * 4] = ofs;
+	sysmem[n * 4 + 1] = ofs >> 8;
+	sysmem[n * 4 + 2] = seg;
+	sysmem[n * 4 + 3] = seg >> 8;
+}
+
+int
+system_init(void)
+{
+	/* untouched pages stay unallocated, as they do in a template */
+	image = mmap(NULL, IMAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (image == MAP_FAILED) {
+		image = NULL;
+		perror("guest memory");
+		return -1;
+	}
+	sysmem = image;
+	basemem = sysmem + 0x500;
+	biosrom = image + RAM_SIZE;
+
+	memcpy(sysmem, bios_low, sizeof(bios_low));
+	memcpy(biosrom, bios_rom, sizeof(bios_rom));
+	memcpy(biosrom + BIOS_RESET, bios_reset, sizeof(bios_reset));
+
+	map_pages(0, RAM_SIZE, sysmem, 0);
+	map_pages(segofs_to_addr(BIOS_SEG, 0), ROM_SIZE, biosrom, PAGE_ROM);
+	map_pages(0x100000u, 0x10000u, sysmem, 0);
+	memset(openbus, 0xff, sizeof(openbus));
+	video_init(CPU_HZ);
+	video_remap();
+	bda_video();
+
+	if (ems_init(EMS_PAGES) || xms_init(XMS_KB))
+		return -1;
+	ems_remap();
+
+	if (ports_init())
+		return -1;
+	cpu_reset();
+	console = stdout;
+	memset(&pit, 0, sizeof(pit));
+	memset(pit.rw, PIT_RW_BOTH, sizeof(pit.rw));
+	memset(pit.mode, PIT_SQUARE, sizeof(pit.mode));
+	port61 = 0;
+
+	if (history.interval) {
+		history.shadow = calloc(1, RAM_SIZE);
+		history.scratch = malloc(DELTA_MAX(PAGE_SIZE));
+		history.ring = calloc(REWIND_MAX, sizeof(*history.ring));
+		if (!history.shadow || !history.scratch || !history.ring) {
+			perror("rewind");
+			return -1;
+		}
+		history.next = 0;
+	}
+	next_event = 0;
+
+	if (kbd_init())
+		return -1;
+
+	return 0;
+}
+
+#ifdef HEATMAP
+/* a count as a shade from 0 to 255, on a log scale up to the largest */
+static unsigned
+heat_shade(uint64_t n, uint64_t max)
+{
+	return n ? 64 + (unsigned)(191 * (63 - __builtin_clzll(n)) / (63 - __builtin_clzll(max) + 1)) : 0;
+}
+
+static int
+heat_write(void)
+{
+	static const unsigned scale = HEAT_WIDTH / HEAT_ROW; /* pixels a side per region */
+	uint64_t max[HEAT_KINDS] = { 1, 1, 1 };
+	char name[4096];
+	unsigned x, y, k;
+	size_t i, r;
+	FILE *f;
+	int bad;
+
+	heat_roll(0);
+	snprintf(name, sizeof(name), "%s-heat.csv", heat.prefix);
+	f = fopen(name, "w");
+	if (!f)
+		goto fail;
+	fprintf(f, "address,bytes,fetches,reads,writes\n");
+	for (r = 0; r < HEAT_REGIONS; r++) {
+		for (k = 0; k < HEAT_KINDS; k++)
+			if (heat.count[r][k] > max[k])
+				max[k] = heat.count[r][k];
+		if (heat.stamp[r])
+			fprintf(f, "%05zX,%u,%llu,%llu,%llu\n", r << HEAT_SHIFT, 1u << HEAT_SHIFT,
+				(unsigned long long)heat.count[r][HEAT_FETCH],
+				(unsigned long long)heat.count[r][HEAT_READ],
+				(unsigned long long)heat.count[r][HEAT_WRITE]);
+	}
+	if (fclose(f))
+		goto fail;
+
+	snprintf(name, sizeof(name), "%s-heat.ppm", heat.prefix);
+	f = fopen(name, "wb");
+	if (!f)
+		goto fail;
+	fprintf(f, "P6\n%u %u\n255\n", HEAT_ROW * scale, (unsigned)(HEAT_REGIONS / HEAT_ROW) * scale);
+	for (y = 0; y < HEAT_REGIONS / HEAT_ROW * scale; y++) {
+		for (x = 0; x < HEAT_ROW * scale; x++) {
+			r = y / scale * HEAT_ROW + x / scale;
+			for (k = 0; k < HEAT_KINDS; k++)
+				putc(heat_shade(heat.count[r][k], max[k]), f);
+		}
+	}
+	if (fclose(f))
+		goto fail;
+
+	snprintf(name, sizeof(name), "%s-ws.csv", heat.prefix);
+	f = fopen(name, "w");
+	if (!f)
+		goto fail;
+	fprintf(f, "insns,working_set_bytes,touched_bytes\n");
+	for (i = 0; i < heat.nsamples; i++)
+		fprintf(f, "%llu,%llu,%llu\n", (unsigned long long)heat.samples[i].insns,
+			(unsigned long long)heat.samples[i].live << HEAT_SHIFT,
+			(unsigned long long)heat.samples[i].ever << HEAT_SHIFT);
+	bad = ferror(f);
+	if (fclose(f) | bad)
+		goto fail;
+	return 0;
+
+fail:
+	perror(name);
+	return -1;
+}
+#endif
+
+/* write guest memory access counts to files starting with prefix when the
+ * machine is done, if built with HEATMAP
+ */
+int
+system_setheatmap(const char *prefix)
+{
+#ifdef HEATMAP
+	heat.prefix = prefix;
+	return 0;
+#else
+	(void)prefix;
+	fprintf(stderr, "Heatmap: not built in, make with HEATMAP=8 or HEATMAP=12\n");
+	return -1;
+#endif
+}
+
+void
+system_done(void)
+{
+	disk_detach(0x00);
+	disk_detach(0x01);
+	disk_detach(0x80);
+	disk_detach(0x81);
+	speaker_close(cpu.cycles);
+	dosfile_done();
+	kbd_done();
+	replay_done();
+	ems_done();
+	xms_done();
+	ports_done();
+#ifdef HEATMAP
+	if (heat.prefix)
+		heat_write();
+	heat.prefix = NULL;
+	free(heat.samples);
+	heat.samples = NULL;
+	heat.nsamples = heat.size = 0;
+#endif
+	while (history.ring && history.count)
+		history_drop();
+	free(history.shadow);
+	free(history.scratch);
+	free(history.ring);
+	history.shadow = history.scratch = NULL;
+	history.ring = NULL;
+	history.next = REWIND_OFF;
+	if (image)
+		munmap(image, IMAGE_SIZE);
+	image = NULL;
+}
+
+int
+system_setroot(const char *dir)
+{
+	return dosfile_setroot(dir);
+}
+
+/* tell the guest which disks are attached in the BIOS data area */
+static void
+bda_disks(void)
+{
+	unsigned floppies, hds;
+
+	floppies = disk_present(0x00) + disk_present(0x01);
+	hds = disk_present(0x80) + disk_present(0x81);
+	sysmem[BDA_EQUIPMENT] &= 0x3e;
+	if (floppies)
+		sysmem[BDA_EQUIPMENT] |= EQUIPMENT_FLOPPY | ((floppies - 1) << 6);
+	sysmem[BDA_HARDDISKS] = hds;
+}
+
+int
+system_attachdisk(int drive, const char *filename)
+{
+	if (disk_attach(drive, filename))
+		return -1;
+	bda_disks();
+
+	return 0;
+}
+
+void
+system_setdisklatency(int realistic)
+{
+	disk_setlatency(realistic);
+}
+
+/* load the boot sector at 0000:7C00 and jump to it */
+int
+system_boot(int drive)
+{
+	const BYTE *boot = disk_map(drive, 0, 1);
+
+	if (!boot) {
+		fprintf(stderr, "Drive %02X: not attached\n", drive);
+		return -1;
+	}
+	if (boot[510] != 0x55 || boot[511] != 0xAA)
+		fprintf(stderr, "Drive %02X: no boot signature\n", drive);
+
+	memcpy(sysmem + 0x7c00u, boot, DISK_SECTOR);
+	clock_wait(disk_seek(drive, 0, 1));
+	CS = DS = ES = SS = 0x0000u;
+	IP = 0x7c00u;
+	SP = 0x7c00u;
+	DL = drive;
+	cpu.flags = FLAG_VALUE_IF;
+	flags_flush();
+
+	return 0;
+}
+
+int
+system_loadfile(const char *filename)
+{
+	// TODO: check for .COM vs .EXE
+	if (loadfile_com(filename))
+		return -1;
+	return 0;
+}
+
+/* Save memory and registers as a template. Pages that are all zero are
+ * left as holes, so the file only takes space for what was loaded.
+ */
+int
+system_savetemplate(const char *filename)
+{
+	static const BYTE zero[PAGE_SIZE];
+	struct template_header h;
+	size_t i;
+	int fd;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, TEMPLATE_MAGIC, sizeof(h.magic));
+	h.ram = RAM_SIZE;
+	h.rom = ROM_SIZE;
+	h.ip = IP;
+	h.flags = cpu.flags;
+	memcpy(h.segs, cpu.segs, sizeof(h.segs));
+	memcpy(h.regs, cpu.regs, sizeof(h.regs));
+	h.dta_seg = dta_seg;
+	h.dta_ofs = dta_ofs;
+
+	fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		perror(filename);
+		return -1;
+	}
+	if (pwrite(fd, &h, sizeof(h), 0) != sizeof(h) ||
+		ftruncate(fd, TEMPLATE_HEADER + IMAGE_SIZE))
+		goto fail;
+	for (i = 0; i < IMAGE_SIZE; i += PAGE_SIZE) {
+		if (!memcmp(image + i, zero, PAGE_SIZE))
+			continue;
+		if (pwrite(fd, image + i, PAGE_SIZE, TEMPLATE_HEADER + i) != PAGE_SIZE)
+			goto fail;
+	}
+	if (close(fd)) {
+		perror(filename);
+		return -1;
+	}
+
+	return 0;
+fail:
+	perror(filename);
+	close(fd);
+	return -1;
+}
+
+/* map a template over guest memory, copy-on-write, and take its registers */
+int
+system_loadtemplate(const char *filename)
+{
+	struct template_header h;
+	struct stat st;
+	void *p;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		perror(filename);
+		return -1;
+	}
+	if (pread(fd, &h, sizeof(h), 0) != sizeof(h) || fstat(fd, &st) ||
+		memcmp(h.magic, TEMPLATE_MAGIC, sizeof(h.magic)) ||
+		h.ram != RAM_SIZE || h.rom != ROM_SIZE ||
+		st.st_size < (off_t)(TEMPLATE_HEADER + IMAGE_SIZE)) {
+		fprintf(stderr, "%s: not a template\n", filename);
+		close(fd);
+		return -1;
+	}
+	p = mmap(image, IMAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+		fd, TEMPLATE_HEADER);
+	close(fd);
+	if (p == MAP_FAILED) {
+		perror(filename);
+		return -1;
+	}
+
+	IP = h.ip;
+	cpu.flags = h.flags;
+	memcpy(cpu.segs, h.segs, sizeof(h.segs));
+	memcpy(cpu.regs, h.regs, sizeof(h.regs));
+	dta_seg = h.dta_seg;
+	dta_ofs = h.dta_ofs;
+	bda_disks();
+	flags_flush();
+
+	return 0;
+}
+
+/* Log every input from outside the guest, for a replay. Call before
+ * system_init(). If the log cannot be written the guest stops with
+ * SYSTEM_ERROR_REPLAY.
+ */
+int
+system_record(const char *filename)
+{
+	return replay_record(filename, &cpu.insns);
+}
+
+/* take every input from outside the guest from a recording, without the host */
+int
+system_replay(const char *filename)
+{
+	return replay_play(filename, &cpu.insns);
+}
+
+/* write what the PC speaker plays to a WAV file, or stdout if "-" */
+int
+system_setspeaker(const char *filename)
+{
+	return speaker_open(filename, CPU_HZ);
+}
+
+/* send console output somewhere other than stdout */
+void
+system_setconsole(FILE *f)
+{
+	console = f;
+}
+
+/* take keyboard input from a descriptor instead of stdin, or none if -1 */
+void
+system_setinput(int fd)
+{
+	kbd_setinput(fd);
+}
+
+/* return code of a program that has terminated */
+int
+system_exitcode(void)
+{
+	return exitcode;
+}
+
+/* the line written to stderr when the program terminated, or "" */
+const char *
+system_exitmessage(void)
+{
+	return exitmessage;
+}
+
+void
+system_setthrottle(int on)
+{
+	throttle = on;
+}
+
+/* checkpoint every ms of guest time, keeping up to kb of memory changes,
+ * or never if ms is 0; call before system_init()
+ */
+void
+system_setrewind(unsigned ms, unsigned long kb)
+{
+	history.interval = (uint64_t)ms * CPU_HZ / 1000u;
+	history.budget = (size_t)kb * 1024u;
+}
+
+int
+system_setargs(int argc, char *argv[])
+{
+	WORD psp_seg;
+	ADDR a;
+	int i, j;
+	size_t total_len;
+
+	// TODO: check for .COM vs .EXE
+	psp_seg = (ADDR)(basemem - sysmem) >> 4;
+
+	/* length of command line arguments */
+	a = segofs_to_addr(psp_seg, 0x80);
+	fprintf(stderr, "Command-line at @ %06hX\n", a);
+
+	a++;
+	for (i = 0, total_len = 0; i < argc; i++) {
+		const char *s = argv[i];
+
+		for (j = 0; s[j]; j++) {
+			if (total_len < 126) {
+				writebyte(a + total_len, s[j]);
+				total_len++;
+			}
+		}
+		if (total_len < 126 && i + 1 != argc) {
+			writebyte(a + total_len, ' ');
+			total_len++;
+		}
+	}
+	if (total_len < 127) {
+		writebyte(a + total_len, '\r');
+		total_len++;
+	}
+
+	writebyte(a - 1, total_len);
+
+	return 0; // TODO: return error on overflow
+}
+
+static void
+print_cpu(const char *prefix)
+{
+	if (prefix)
+		fprintf(stderr, "%s: ", prefix);
+	fprintf(stderr, "CS: %04hX IP: %04hX\n", CS, IP);
+
+	if (prefix)
+		fprintf(stderr, "%s: ", prefix);
+	fprintf(stderr, "AX: %04hX CX: %04hX DX: %04hX BX: %04hX\n", AX, CX, DX, BX);
+
+	if (prefix)
+		fprintf(stderr, "%s: ", prefix);
+	fprintf(stderr, "AL: %04hhX AH: %04hhX\n", AL, AH);
+}
+
+/* advance the BIOS tick count for every tick the virtual clock has passed */
+static void
+timer_tick(void)
+{
+	DWORD t;
+
+	while (cpu.cycles >= cpu.next_tick) {
+		cpu.next_tick += TICK_CYCLES;
+		metrics.interrupts[0x08]++;
+		t = sysmem[BDA_TICK] | ((DWORD)sysmem[BDA_TICK + 1] << 8) |
+			((DWORD)sysmem[BDA_TICK + 2] << 16) | ((DWORD)sysmem[BDA_TICK + 3] << 24);
+		if (++t >= TICKS_PER_DAY) {
+			t = 0;
+			sysmem[BDA_MIDNIGHT] = 1;
+		}
+		sysmem[BDA_TICK] = t;
+		sysmem[BDA_TICK + 1] = t >> 8;
+		sysmem[BDA_TICK + 2] = t >> 16;
+		sysmem[BDA_TICK + 3] = t >> 24;
+	}
+	keypolls = 0;
+	speaker_sync(cpu.cycles);
+}
+
+/* time passed since the current wait began, in CPU clocks */
+static uint64_t
+wait_elapsed(void)
+{
+	struct timespec now;
+	uint64_t us;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = (uint64_t)(now.tv_sec - waiting.start.tv_sec) * 1000000u +
+		(now.tv_nsec - waiting.start.tv_nsec) / 1000;
+	return us * CPU_HZ / 1000000u;
+}
+
+/* the wait is over: the clock moves forward by however long it lasted */
+static void
+wait_end(uint64_t dt)
+{
+	if (replay_mode() == REPLAY_RECORD && replay_put(REPLAY_WAIT, waiting.stamp, 0, &dt, sizeof(dt)))
+		guest_error(SYSTEM_ERROR_REPLAY);
+	cpu.cycles += dt;
+	cpu.idle_cycles += dt;
+	if (waiting.busyloop)
+		cpu.skipped_cycles += dt;
+	timer_tick();
+	waiting.reason = SYSTEM_BUDGET;
+}
+
+/* Begin waiting for dt clocks, or less if keys is set and a key arrives.
+ * The current instruction finishes and system_run() returns to the host.
+ * A replay takes the length from the log and is done at once.
+ */
+static void
+wait_begin(enum system_reason reason, uint64_t dt, int keys, int busyloop)
+{
+	uint64_t t;
+
+	if (waiting.reason) { /* already waiting, so wait longer */
+		waiting.cycles += dt;
+		return;
+	}
+	waiting.reason = reason;
+	waiting.cycles = dt;
+	waiting.keys = keys;
+	waiting.busyloop = busyloop;
+	waiting.stamp = cpu.insns;
+	if (replay_mode() == REPLAY_PLAY) {
+		/* a wait that was made longer in the recording has no record */
+		dt = 0;
+		if (!replay_next(REPLAY_WAIT, &t) && t <= cpu.insns) {
+			if (t < cpu.insns) {
+				replay_diverged("wait");
+				guest_error(SYSTEM_ERROR_REPLAY);
+			}
+			replay_take(REPLAY_WAIT, &dt, sizeof(dt));
+		}
+		wait_end(dt);
+		return;
+	}
+	if (!throttle) {
+		wait_end(dt);
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &waiting.start);
+}
+
+/* see whether the wait is over, returning 0 once the guest can run again */
+static int
+wait_resume(void)
+{
+	uint64_t elapsed = wait_elapsed();
+
+	if (elapsed < waiting.cycles) {
+		if (!waiting.keys || !kbd_poll())
+			return -1;
+		waiting.cycles = elapsed;
+	}
+	wait_end(waiting.cycles);
+
+	return 0;
+}
+
+/* tell the host what the guest is waiting for */
+static enum system_reason
+wait_info(struct system_wait *w)
+{
+	uint64_t elapsed = wait_elapsed();
+
+	w->fd = waiting.keys ? kbd_fd() : -1;
+	w->timeout_us = 0;
+	if (elapsed < waiting.cycles)
+		w->timeout_us = ((waiting.cycles - elapsed) * 1000000u + CPU_HZ - 1) / CPU_HZ;
+
+	return waiting.reason;
+}
+
+/* let time pass while the guest waits on a device */
+static void
+clock_wait(unsigned long us)
+{
+	wait_begin(SYSTEM_WAIT_DISK, (uint64_t)us * CPU_HZ / 1000000u, 0, 0);
+}
+
+/* wait until the next timer tick, or until a key arrives if that is sooner */
+static void
+idle_wait(enum system_reason reason, int busyloop)
+{
+	wait_begin(reason, cpu.next_tick - cpu.cycles, 1, busyloop);
+}
+
+/* skip a busy-wait loop until cycle t, or a key, if t has not passed */
+static void
+busyloop_wait(uint64_t t)
+{
+	if (t > cpu.next_tick)
+		t = cpu.next_tick;
+	if (t > cpu.cycles)
+		wait_begin(SYSTEM_WAIT_TIMER, t - cpu.cycles, 1, 1);
+}
+
+/* Called on every short backward branch, with IP at the loop head. */
+static void
+busyloop_check(void)
+{
+	ADDR at = segofs_to_addr(CS, IP);
+	int timer_read = cpu.timer_read;
+	uint64_t until = cpu.timer_until;
+
+	cpu.timer_read = 0;
+	cpu.timer_until = UINT64_MAX;
+	if (lockstep.on)
+		return;
+	if (timer_read && at == busyloop.at && cpu.effects == busyloop.effects &&
+		cpu.insns - busyloop.insns <= LOOP_MAXINSNS &&
+		cpu.flags == busyloop.flags &&
+		!memcmp(cpu.regs, busyloop.regs, sizeof(busyloop.regs)) &&
+		!memcmp(cpu.segs, busyloop.segs, sizeof(busyloop.segs))) {
+		busyloop.insns = cpu.insns;
+		if (++busyloop.count >= LOOP_REPEATS) {
+			busyloop.count = 0;
+			busyloop_wait(until);
+		}
+		return;
+	}
+
+	busyloop.at = at;
+	busyloop.insns = cpu.insns;
+	busyloop.effects = cpu.effects;
+	busyloop.flags = cpu.flags;
+	memcpy(busyloop.regs, cpu.regs, sizeof(busyloop.regs));
+	memcpy(busyloop.segs, cpu.segs, sizeof(busyloop.segs));
+	busyloop.count = 0;
+}
+
+/* take a short jump */
+static inline void
+jump_short(BYTE disp)
+{
+	IP += signext(disp);
+	if ((int8_t)disp < 0 && (int8_t)disp >= -LOOP_MAXBYTES)
+		busyloop_check();
+}
+
+/* the guest checked for a key and there was none */
+static void
+keypoll_empty(void)
+{
+	if (++keypolls >= IDLE_KEYPOLLS)
+		idle_wait(SYSTEM_WAIT_KEY, 0);
+}
+
+/* The guest is blocked reading a key and there is none. Back up to restart
+ * the INT instruction once we have waited, the same way the BIOS would spin
+ * inside its handler.
+ */
+static void
+keywait(void)
+{
+	if (kbd_eof()) {
+		guest_error(SYSTEM_ERROR_INPUT);
+		fprintf(stderr, "Keyboard input exhausted\n");
+		return;
+	}
+	IP -= 2;
+	idle_wait(SYSTEM_WAIT_KEY, 0);
+}
+
+static void
+console_out(BYTE b)
+{
+	if (b == '\r')
+		return;
+	fputc(b, console);
+}
+
+/* finish a DOS call that returns an error code in AX with CF set */
+static int
+dos_return(long result)
+{
+	if (result < 0) {
+		cpu.flags |= FLAG_VALUE_CF;
+		AX = -result;
+		return 0;
+	}
+	cpu.flags &= ~FLAG_VALUE_CF;
+	return 1;
+}
+
+/* copy an ASCIZ string out of the guest, always terminating it */
+static void
+read_asciz(ADDR a, char *s, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + 1 < len && (s[i] = readbyte(a + i)); i++)
+		;
+	s[i] = 0;
+}
+
+/* Move CX bytes between file handle BX and DS:DX. The file is read or
+ * written straight from guest RAM, in one piece unless the buffer wraps
+ * around the end of its segment or crosses into a mapped EMS page.
+ */
+static long
+dos_transfer(int write)
+{
+	WORD ofs = DX;
+	size_t len = CX, n;
+	long total = 0, r;
+	BYTE *g;
+
+	while (len) {
+		n = len;
+		g = guest_span(DS, ofs, &n, !write);
+		if (!g)
+			return -DOSERR_ACCESS;
+		if (write)
+			r = dosfile_write(BX, g, n);
+		else
+			r = dosfile_read(BX, g, n);
+		if (r < 0)
+			return r;
+		total += r;
+		if ((size_t)r < n)
+			break;
+		len -= n;
+		ofs += n;
+	}
+
+	return total;
+}
+
+/* read a line from the keyboard for handle 0 */
+static void
+dos_readstdin(void)
+{
+	WORD key, i = 0;
+	BYTE c;
+
+	if (!kbd_peek(&key)) {
+		keywait();
+		return;
+	}
+	while (i < CX && kbd_read(&key)) {
+		c = key & 0xffu;
+		console_out(c);
+		writebyte(segofs_to_addr(DS, DX + i++), c);
+		if (c == '\r') {
+			if (i < CX)
+				writebyte(segofs_to_addr(DS, DX + i++), '\n');
+			break;
+		}
+	}
+	dos_return(0);
+	AX = i;
+}
+
+static void
+dosirq(void)
 {
 	BYTE service = AH;
 
+	metrics.doscalls[service]++;
+	PROBE3(dos, service, AX, segofs_to_addr(DS, DX));
 	switch (service) {
+		case 0x01: /* Read character from stdin with echo */
+		case 0x07: /* Direct read character from stdin */
+		case 0x08: { /* Read character from stdin */
+			WORD key;
+
+			if (!kbd_read(&key)) {
+				keywait();
+				break;
+			}
+			AL = key & 0xffu;
+			if (service == 0x01)
+				console_out(AL);
+			break;
+		}
 		case 0x02: /* Write character to stdout */
 			console_out(DL);
 			AL = DL == '\t' ? ' ' : DL;
 			break;
+		case 0x06: { /* Direct console I/O */
+			WORD key;
+
+			if (DL != 0xff) {
+				console_out(DL);
+				AL = DL;
+			} else if (kbd_read(&key)) {
+				AL = key & 0xffu;
+				cpu.flags &= ~FLAG_VALUE_ZF;
+			} else {
+				AL = 0;
+				cpu.flags |= FLAG_VALUE_ZF;
+				keypoll_empty();
+			}
+			break;
+		}
 		case 0x09: { /* Write string to stdout */
 			ADDR m = segofs_to_addr(DS, DX);
 			BYTE b;
-			fprintf(stdout, "Console: \"");
+			fprintf(console, "Console: \"");
 			for (; '$' != (b = readbyte(m)); m++) {
 				console_out(b);
 			}
-			fprintf(stdout, "\"\n");
+			fprintf(console, "\"\n");
 			AL = '$';
 			break;
 		}
-		case 0x40: { /* Write file handle */
-			if (BX == 1) { /* stdout */
-				BYTE b;
-				WORD i;
-				ADDR m;
+		case 0x0B: { /* Check stdin status */
+			WORD key;
+
+			if (kbd_peek(&key)) {
+				AL = 0xff;
+			} else {
+				AL = 0x00;
+				keypoll_empty();
+			}
+			break;
+		}
+		case 0x1A: /* Set disk transfer area */
+			dta_seg = DS;
+			dta_ofs = DX;
+			break;
+		case 0x25: /* Set interrupt vector */
+			setvector(AL, DS, DX);
+			break;
+		case 0x2F: /* Get disk transfer area */
+			ES = dta_seg;
+			BX = dta_ofs;
+			break;
+		case 0x35: /* Get interrupt vector */
+			BX = sysmem[AL * 4] | ((WORD)sysmem[AL * 4 + 1] << 8);
+			ES = sysmem[AL * 4 + 2] | ((WORD)sysmem[AL * 4 + 3] << 8);
+			break;
+		case 0x3C: { /* Create file */
+			char path[128];
+			int h;
+
+			read_asciz(segofs_to_addr(DS, DX), path, sizeof(path));
+			h = dosfile_create(path);
+			if (dos_return(h))
+				AX = h;
+			break;
+		}
+		case 0x3D: { /* Open file */
+			char path[128];
+			int h;
+
+			read_asciz(segofs_to_addr(DS, DX), path, sizeof(path));
+			h = dosfile_open(path, AL & 7);
+			if (dos_return(h))
+				AX = h;
+			break;
+		}
+		case 0x3E: /* Close file handle */
+			if (BX < DOSFILE_FIRST)
+				dos_return(0);
+			else
+				dos_return(dosfile_close(BX));
+			break;
+		case 0x3F: { /* Read file handle */
+			long n;
+
+			if (BX == DOSFILE_STDIN) {
+				dos_readstdin();
+				break;
+			}
+			n = BX < DOSFILE_FIRST ? 0 : dos_transfer(0);
+			if (dos_return(n))
+				AX = n;
+			break;
+		}
+		case 0x40: { /* Write file handle */
+			if (BX == DOSFILE_STDOUT || BX == DOSFILE_STDERR) {
+				BYTE b;
+				WORD i;
+				ADDR m;
+
+				fprintf(console, "Console: \"");
+				for (i = 0; i < CX; i++) {
+					m = segofs_to_addr(DS, DX + i);
+					b = readbyte(m);
+					console_out(b);
+					m++;
+				}
+				fprintf(console, "\"\n");
+				dos_return(0);
+				AX = i;
+			} else if (BX < DOSFILE_FIRST) { /* AUX and PRN go nowhere */
+				dos_return(0);
+				AX = CX;
+			} else if (!CX) {
+				if (dos_return(dosfile_truncate(BX)))
+					AX = 0;
+			} else {
+				long n = dos_transfer(1);
+
+				if (dos_return(n))
+					AX = n;
+			}
+			break;
+		}
+		case 0x42: { /* Move file pointer */
+			long pos = dosfile_seek(BX, (int32_t)((DWORD)CX << 16 | DX), AL);
+
+			if (dos_return(pos)) {
+				DX = pos >> 16;
+				AX = pos & 0xffffu;
+			}
+			break;
+		}
+		case 0x4C: /* Terminate with return code */
+			cpu.done = 1;
+			exitcode = AL;
+			snprintf(exitmessage, sizeof(exitmessage), "Terminated with code %u", AL);
+			fprintf(stderr, "%s\n", exitmessage);
+			break;
+		case 0x4E: /* Find first matching file */
+		case 0x4F: { /* Find next matching file */
+			ADDR a = segofs_to_addr(dta_seg, dta_ofs);
+			BYTE dta[DOSFIND_SIZE];
+			char spec[128];
+			unsigned i;
+			int r;
+
+			for (i = 0; i < sizeof(dta); i++)
+				dta[i] = readbyte(a + i);
+			if (service == 0x4E) {
+				read_asciz(segofs_to_addr(DS, DX), spec, sizeof(spec));
+				r = dosfile_findfirst(spec, CX, dta);
+			} else {
+				r = dosfile_findnext(dta);
+			}
+			if (dos_return(r)) {
+				for (i = 0; i < sizeof(dta); i++)
+					writebyte(a + i, dta[i]);
+				AX = 0;
+			}
+			break;
+		}
+		default:
+			guest_error(SYSTEM_ERROR_SERVICE);
+			fprintf(stderr, "DOSIRQ: Unknown service %02hhX\n", service);
+			print_cpu("DOSIRQ");
+	}
+}
+
+/* Move count sectors between a disk and the guest buffer at seg:ofs.
+ * Returns an INT 13h status.
+ */
+static BYTE
+disk_transfer(int drive, unsigned long lba, unsigned count, WORD seg, WORD ofs, int write)
+{
+	size_t len = (size_t)count * DISK_SECTOR, n;
+	BYTE *d, *g;
+
+	if (write)
+		d = disk_mapwrite(drive, lba, count);
+	else
+		d = (BYTE*)disk_map(drive, lba, count);
+	if (!d)
+		return write && disk_readonly(drive) ? 0x03 : 0x04;
+	diskwrites += write;
+
+	while (len) {
+		n = len;
+		g = guest_span(seg, ofs, &n, !write);
+		if (!g)
+			return 0x09; /* DMA overrun */
+		if (write)
+			memcpy(d, g, n);
+		else
+			memcpy(g, d, n);
+		d += n;
+		len -= n;
+		ofs += n;
+	}
+
+	clock_wait(disk_seek(drive, lba, count));
+
+	return 0x00;
+}
+
+/* text cell at column x, row y of the current mode */
+static ADDR
+video_cell(BYTE x, BYTE y)
+{
+	const struct video_mode *m = video_mode();
+
+	return segofs_to_addr(m->seg, (y * m->width + x) * 2u);
+}
+
+static void
+video_scroll(int up)
+{
+	const struct video_mode *m = video_mode();
+	BYTE x, y, lines = AL, height = DH - CH + 1;
+
+	if (m->format != SCREEN_NONE || CL > DL || CH > DH || DL >= m->width || DH >= m->height)
+		return;
+	if (!lines || lines > height)
+		lines = height;
+	for (y = 0; y < height; y++) {
+		BYTE to = up ? CH + y : DH - y, from = up ? to + lines : to - lines;
+
+		for (x = CL; x <= DL; x++) {
+			if (y + lines < height) {
+				writeword(video_cell(x, to), readword(video_cell(x, from)));
+			} else {
+				writebyte(video_cell(x, to), ' ');
+				writebyte(video_cell(x, to) + 1, BH);
+			}
+		}
+	}
+}
+
+static void
+videoirq(void)
+{
+	const struct video_mode *m = video_mode();
+	BYTE r, g, b;
+	WORD i;
+
+	switch (AH) {
+	case 0x00: /* Set video mode */
+		if (video_setmode(AL & 0x7f, !(AL & 0x80))) {
+			fprintf(stderr, "VIDEOIRQ: Unsupported mode %02hhX\n", AL);
+			break;
+		}
+		video_remap();
+		bda_video();
+		break;
+	case 0x01: /* Set cursor shape */
+	case 0x05: /* Select active page */
+		break;
+	case 0x02: /* Set cursor position */
+		sysmem[BDA_CURSOR + (BH & 7) * 2] = DL;
+		sysmem[BDA_CURSOR + (BH & 7) * 2 + 1] = DH;
+		break;
+	case 0x03: /* Get cursor position and shape */
+		DL = sysmem[BDA_CURSOR + (BH & 7) * 2];
+		DH = sysmem[BDA_CURSOR + (BH & 7) * 2 + 1];
+		CX = 0x0607u;
+		break;
+	case 0x06: /* Scroll up */
+	case 0x07: /* Scroll down */
+		video_scroll(AH == 0x06);
+		break;
+	case 0x08: /* Read character and attribute */
+		if (m->format == SCREEN_NONE)
+			AX = readword(video_cell(sysmem[BDA_CURSOR], sysmem[BDA_CURSOR + 1]));
+		break;
+	case 0x09: /* Write character and attribute */
+	case 0x0A: /* Write character */
+		if (m->format != SCREEN_NONE)
+			break;
+		for (i = 0; i < CX; i++) {
+			ADDR a = video_cell(sysmem[BDA_CURSOR], sysmem[BDA_CURSOR + 1]) + i * 2u;
+
+			writebyte(a, AL);
+			if (AH == 0x09)
+				writebyte(a + 1, BL);
+		}
+		break;
+	case 0x0C: /* Write pixel */
+		video_setpixel(CX, DX, AL);
+		break;
+	case 0x0D: /* Read pixel */
+		AL = video_getpixel(CX, DX);
+		break;
+	case 0x0E: /* Teletype output */
+		console_out(AL);
+		break;
+	case 0x0F: /* Get video mode */
+		AL = m->mode;
+		AH = sysmem[BDA_COLUMNS];
+		BH = sysmem[BDA_PAGE];
+		break;
+	case 0x10: /* Palette */
+		switch (AL) {
+		case 0x10: /* Set one DAC register */
+			video_setdac(BL, DH, CH, CL);
+			break;
+		case 0x12: /* Set a block of DAC registers from ES:DX */
+			for (i = 0; i < CX; i++)
+				video_setdac(BX + i, readbyte(segofs_to_addr(ES, DX + i * 3)),
+					readbyte(segofs_to_addr(ES, DX + i * 3 + 1)),
+					readbyte(segofs_to_addr(ES, DX + i * 3 + 2)));
+			break;
+		case 0x15: /* Read one DAC register */
+			video_getdac(BL, &r, &g, &b);
+			DH = r;
+			CH = g;
+			CL = b;
+			break;
+		case 0x17: /* Read a block of DAC registers to ES:DX */
+			for (i = 0; i < CX; i++) {
+				video_getdac(BX + i, &r, &g, &b);
+				writebyte(segofs_to_addr(ES, DX + i * 3), r);
+				writebyte(segofs_to_addr(ES, DX + i * 3 + 1), g);
+				writebyte(segofs_to_addr(ES, DX + i * 3 + 2), b);
+			}
+			break;
+		default:
+			fprintf(stderr, "VIDEOIRQ: Unknown palette service %02hhX\n", AL);
+		}
+		break;
+	default:
+		fprintf(stderr, "VIDEOIRQ: Unknown service %02hhX\n", AH);
+	}
+}
+
+static void
+diskirq(void)
+{
+	BYTE status = 0x00, drive = DL;
+	unsigned cyls, heads, spt, cyl, head, sec;
+	unsigned long lba;
+
+	disk_geometry(drive, &cyls, &heads, &spt);
+
+	switch (AH) {
+	case 0x00: /* Reset disk system */
+		break;
+	case 0x01: /* Get status of last operation */
+		status = disk_status;
+		break;
+	case 0x02: /* Read sectors */
+	case 0x03: /* Write sectors */
+	case 0x04: /* Verify sectors */
+		cyl = CH | ((CL & 0xC0u) << 2);
+		head = DH;
+		sec = CL & 0x3Fu;
+		if (!disk_present(drive)) {
+			status = 0x80; /* timeout, not ready */
+		} else if (!AL || !sec || sec > spt || head >= heads || cyl >= cyls) {
+			status = 0x04; /* sector not found */
+		} else {
+			lba = ((unsigned long)cyl * heads + head) * spt + sec - 1;
+			if (AH == 0x04)
+				status = disk_map(drive, lba, AL) ? 0x00 : 0x04;
+			else
+				status = disk_transfer(drive, lba, AL, ES, BX, AH == 0x03);
+		}
+		if (status)
+			AL = 0;
+		break;
+	case 0x08: /* Get drive parameters */
+		if (!disk_present(drive)) {
+			status = 0x07;
+			break;
+		}
+		CH = (cyls - 1) & 0xffu;
+		CL = spt | (((cyls - 1) >> 2) & 0xC0u);
+		DH = heads - 1;
+		if (drive < 0x80) {
+			DL = disk_present(0x00) + disk_present(0x01);
+			BL = spt >= 36 ? 5 : spt == 18 ? 4 : spt == 15 ? 2 : cyls == 80 ? 3 : 1;
+		} else {
+			DL = disk_present(0x80) + disk_present(0x81);
+		}
+		ES = DI = 0; /* no diskette parameter table */
+		break;
+	case 0x15: /* Get disk type */
+		AL = 0;
+		if (!disk_present(drive)) {
+			AH = 0x00;
+		} else if (drive < 0x80) {
+			AH = 0x01; /* floppy without change-line */
+		} else {
+			lba = disk_sectors(drive);
+			CX = lba >> 16;
+			DX = lba & 0xffffu;
+			AH = 0x03;
+		}
+		cpu.flags &= ~FLAG_VALUE_CF;
+		return;
+	case 0x41: /* Check extensions present */
+		if (drive < 0x80 || !disk_present(drive) || BX != 0x55AAu) {
+			status = 0x01;
+			break;
+		}
+		BX = 0xAA55u;
+		CX = 0x0001u; /* packet access */
+		cpu.flags &= ~FLAG_VALUE_CF;
+		AH = 0x01; /* version 1.x */
+		disk_status = 0x00;
+		return;
+	case 0x42: /* Extended read */
+	case 0x43: { /* Extended write */
+		/* disk address packet: size, 0, count, offset, segment, 64-bit LBA */
+		ADDR dap = segofs_to_addr(DS, SI);
+		WORD count = readword(dap + 2);
+
+		lba = readword(dap + 8) | ((unsigned long)readword(dap + 10) << 16);
+		if (drive < 0x80 || !disk_present(drive)) {
+			status = 0x01;
+		} else if (readword(dap + 12) || readword(dap + 14)) {
+			status = 0x04; /* beyond what we can address */
+		} else {
+			status = disk_transfer(drive, lba, count, readword(dap + 6),
+				readword(dap + 4), AH == 0x43);
+		}
+		if (status)
+			writeword(dap + 2, 0);
+		break;
+	}
+	default:
+		status = 0x01; /* invalid function */
+		fprintf(stderr, "DISKIRQ: Unknown service %02hhX\n", AH);
+	}
+
+	disk_status = status;
+	AH = status;
+	if (status)
+		cpu.flags |= FLAG_VALUE_CF;
+	else
+		cpu.flags &= ~FLAG_VALUE_CF;
+}
+
+static void
+kbdirq(void)
+{
+	WORD key;
+
+	switch (AH) {
+	case 0x00: /* Read key */
+	case 0x10: /* Read extended key */
+		if (!kbd_read(&key)) {
+			keywait();
+			break;
+		}
+		AX = key;
+		break;
+	case 0x01: /* Check for key */
+	case 0x11: /* Check for extended key */
+		if (kbd_peek(&key)) {
+			AX = key;
+			cpu.flags &= ~FLAG_VALUE_ZF;
+		} else {
+			cpu.flags |= FLAG_VALUE_ZF;
+			keypoll_empty();
+		}
+		break;
+	case 0x02: /* Get shift flags */
+		AL = sysmem[0x417];
+		break;
+	default:
+		guest_error(SYSTEM_ERROR_SERVICE);
+		fprintf(stderr, "KBDIRQ: Unknown service %02hhX\n", AH);
+		print_cpu("KBDIRQ");
+	}
+}
+
+static void
+timeirq(void)
+{
+	switch (AH) {
+	case 0x00: /* Read tick count */
+		timer_seen(cpu.next_tick);
+		CX = sysmem[BDA_TICK + 2] | ((WORD)sysmem[BDA_TICK + 3] << 8);
+		DX = sysmem[BDA_TICK] | ((WORD)sysmem[BDA_TICK + 1] << 8);
+		AL = sysmem[BDA_MIDNIGHT];
+		sysmem[BDA_MIDNIGHT] = 0;
+		break;
+	case 0x01: /* Set tick count */
+		sysmem[BDA_TICK] = DL;
+		sysmem[BDA_TICK + 1] = DH;
+		sysmem[BDA_TICK + 2] = CL;
+		sysmem[BDA_TICK + 3] = CH;
+		sysmem[BDA_MIDNIGHT] = 0;
+		break;
+	default:
+		guest_error(SYSTEM_ERROR_SERVICE);
+		fprintf(stderr, "TIMEIRQ: Unknown service %02hhX\n", AH);
+		print_cpu("TIMEIRQ");
+	}
+}
+
+/* set AH to an EMS status, and return the result if it is not an error */
+static int
+ems_return(int r)
+{
+	AH = r < 0 ? -r : 0;
+	return r >= 0;
+}
+
+static void
+emsirq(void)
+{
+	int r;
+
+	switch (AH) {
+	case 0x40: /* Get status */
+		AH = 0;
+		break;
+	case 0x41: /* Get page frame segment */
+		AH = 0;
+		BX = EMS_FRAME;
+		break;
+	case 0x42: /* Get number of pages */
+		AH = 0;
+		BX = ems_free();
+		DX = ems_total();
+		break;
+	case 0x43: /* Allocate pages */
+		r = ems_alloc(BX);
+		if (ems_return(r))
+			DX = r;
+		break;
+	case 0x44: /* Map or unmap page */
+		ems_return(ems_map(AL, DX, BX));
+		ems_remap();
+		break;
+	case 0x45: /* Release handle and memory */
+		ems_return(ems_release(DX));
+		ems_remap();
+		break;
+	case 0x46: /* Get version */
+		AH = 0;
+		AL = 0x40;
+		break;
+	case 0x47: /* Save page map */
+		ems_return(ems_save(DX));
+		break;
+	case 0x48: /* Restore page map */
+		ems_return(ems_restore(DX));
+		ems_remap();
+		break;
+	case 0x4B: /* Get number of handles */
+		AH = 0;
+		BX = ems_handles();
+		break;
+	case 0x4C: /* Get pages owned by handle */
+		r = ems_pages(DX);
+		if (ems_return(r))
+			BX = r;
+		break;
+	case 0x4D: { /* Get pages for all handles */
+		ADDR a = segofs_to_addr(ES, DI);
+		int h;
+
+		for (h = 0, BX = 0; BX < ems_handles(); h++) {
+			if ((r = ems_pages(h)) < 0)
+				continue;
+			writeword(a, h);
+			writeword(a + 2, r);
+			a += 4;
+			BX++;
+		}
+		AH = 0;
+		break;
+	}
+	case 0x50: { /* Map multiple pages */
+		ADDR a = segofs_to_addr(DS, SI);
+		WORD i, phys;
 
-				fprintf(stdout, "Console: \"");
-				for (i = 0; i < CX; i++) {
-					m = segofs_to_addr(DS, DX + i);
-					b = readbyte(m);
-					console_out(b);
-					m++;
+		if (AL > 1) {
+			AH = EMSERR_FUNCTION;
+			break;
+		}
+		for (i = 0, r = 0; i < CX && r >= 0; i++, a += 4) {
+			phys = readword(a + 2);
+			if (AL == 1) { /* by segment rather than page number */
+				if (phys < EMS_FRAME || (phys - EMS_FRAME) % (EMS_PAGE >> 4) ||
+					(phys - EMS_FRAME) / (EMS_PAGE >> 4) >= EMS_FRAME_PAGES) {
+					r = -EMSERR_PHYSICAL;
+					break;
 				}
-				fprintf(stdout, "\"\n");
-				AX = i;
-			} else { /* error - handle not found or not value for writing */
-				cpu.flags |= FLAG_VALUE_CF;
-				AX = 0x05; // TODO: use the right error code here
+				phys = (phys - EMS_FRAME) / (EMS_PAGE >> 4);
+			}
+			r = ems_map(phys, DX, readword(a));
+		}
+		ems_return(r);
+		ems_remap();
+		break;
+	}
+	case 0x51: /* Reallocate pages */
+		r = ems_realloc(DX, BX);
+		ems_return(r);
+		r = ems_pages(DX);
+		if (r >= 0)
+			BX = r;
+		ems_remap();
+		break;
+	case 0x58: { /* Get mappable physical address array */
+		ADDR a = segofs_to_addr(ES, DI);
+		WORD i;
+
+		if (AL == 0) {
+			for (i = 0; i < EMS_FRAME_PAGES; i++, a += 4) {
+				writeword(a, EMS_FRAME + i * (EMS_PAGE >> 4));
+				writeword(a + 2, i);
 			}
+		} else if (AL != 1) {
+			AH = EMSERR_FUNCTION;
 			break;
 		}
-		default:
-			cpu.errors++;
-			fprintf(stderr, "DOSIRQ: Unknown service %02hhX\n", service);
-			print_cpu("DOSIRQ");
+		AH = 0;
+		CX = EMS_FRAME_PAGES;
+		break;
+	}
+	default:
+		guest_error(SYSTEM_ERROR_SERVICE);
+		fprintf(stderr, "EMSIRQ: Unknown service %02hhX\n", AH);
+		AH = EMSERR_FUNCTION;
+	}
+}
+
+/* the guest's view of an XMS move operand: conventional memory for handle 0 */
+static BYTE *
+xms_span(WORD handle, DWORD offset, size_t *len, int store)
+{
+	if (handle)
+		return xms_block(handle, offset, *len);
+	return host_span(offset, len, store);
+}
+
+/* Move an extended memory block described at DS:SI. Both ends are host
+ * memory, so it is a single memmove() unless one end is conventional memory
+ * crossing into the EMS page frame.
+ */
+static int
+xms_move(void)
+{
+	ADDR m = segofs_to_addr(DS, SI);
+	DWORD len = readword(m) | ((DWORD)readword(m + 2) << 16);
+	WORD srch = readword(m + 4), dsth = readword(m + 10);
+	DWORD src = readword(m + 6) | ((DWORD)readword(m + 8) << 16);
+	DWORD dst = readword(m + 12) | ((DWORD)readword(m + 14) << 16);
+	unsigned kb, locks;
+	size_t n, k;
+	BYTE *s, *d;
+
+	if (len & 1)
+		return -XMSERR_LENGTH;
+	if (srch && xms_info(srch, &kb, &locks))
+		return -0xA3;
+	if (dsth && xms_info(dsth, &kb, &locks))
+		return -0xA5;
+	if (!srch)
+		src = segofs_to_addr(src >> 16, src & 0xffffu);
+	if (!dsth)
+		dst = segofs_to_addr(dst >> 16, dst & 0xffffu);
+
+	while (len) {
+		n = k = len;
+		s = xms_span(srch, src, &n, 0);
+		if (!s)
+			return -0xA4;
+		d = xms_span(dsth, dst, &k, 1);
+		if (!d)
+			return -0xA6;
+		if (n > k)
+			n = k;
+		memmove(d, s, n);
+		len -= n;
+		src += n;
+		dst += n;
+	}
+
+	return 0;
+}
+
+/* set AX and BL to an XMS result, and return the result if it is not an error */
+static int
+xms_return(int r)
+{
+	AX = r >= 0;
+	BL = r < 0 ? -r : 0;
+	return r >= 0;
+}
+
+static void
+xmsentry(void)
+{
+	unsigned kb, locks;
+	DWORD addr;
+	int r;
+
+	switch (AH) {
+	case 0x00: /* Get version */
+		AX = 0x0300;
+		BX = 0x0100;
+		DX = 0; /* no HMA */
+		break;
+	case 0x01: /* Request HMA */
+	case 0x02: /* Release HMA */
+		xms_return(-0x90);
+		break;
+	case 0x03: /* Global enable A20 */
+	case 0x05: /* Local enable A20 */
+		a20 = 1;
+		xms_return(0);
+		break;
+	case 0x04: /* Global disable A20 */
+	case 0x06: /* Local disable A20 */
+		a20 = 0;
+		xms_return(0);
+		break;
+	case 0x07: /* Query A20 */
+		xms_return(0);
+		AX = a20;
+		break;
+	case 0x08: /* Query free extended memory */
+		/* blocks are host allocations, so free memory is never fragmented */
+		AX = DX = xms_free();
+		BL = AX ? 0 : XMSERR_FULL;
+		break;
+	case 0x09: /* Allocate extended memory block */
+		r = xms_alloc(DX);
+		if (xms_return(r))
+			DX = r;
+		break;
+	case 0x0A: /* Free extended memory block */
+		xms_return(xms_release(DX));
+		break;
+	case 0x0B: /* Move extended memory block */
+		xms_return(xms_move());
+		break;
+	case 0x0C: /* Lock extended memory block */
+		if (xms_return(xms_lock(DX, &addr))) {
+			DX = addr >> 16;
+			BX = addr & 0xffffu;
+		}
+		break;
+	case 0x0D: /* Unlock extended memory block */
+		xms_return(xms_unlock(DX));
+		break;
+	case 0x0E: /* Get handle information */
+		if (xms_return(xms_info(DX, &kb, &locks))) {
+			BH = locks;
+			BL = xms_handles();
+			DX = kb;
+		}
+		break;
+	case 0x0F: /* Reallocate extended memory block */
+		xms_return(xms_realloc(DX, BX));
+		break;
+	case 0x10: /* Request upper memory block */
+	case 0x11: /* Release upper memory block */
+	case 0x12: /* Reallocate upper memory block */
+		xms_return(-XMSERR_NOUMB);
+		DX = 0;
+		break;
+	default:
+		fprintf(stderr, "XMS: Unknown service %02hhX\n", AH);
+		xms_return(-XMSERR_FUNCTION);
+	}
+}
+
+static void
+multiplexirq(void)
+{
+	switch (AX) {
+	case 0x4300: /* XMS installation check */
+		AL = 0x80;
+		break;
+	case 0x4310: /* Get XMS driver entry point */
+		ES = BIOS_SEG;
+		BX = BIOS_XMS;
+		break;
+	default:
+		break; /* nothing else is installed, and AL is left alone to say so */
 	}
 }
 
 static void
 initiate_irq(BYTE irq)
 {
+	/* anything but reading the clock might be seen outside the guest */
+	if (irq != 0x1A || AH != 0x00)
+		cpu.effects++;
+	metrics.interrupts[irq]++;
+	PROBE4(irq, irq, AX, CS, IP);
+
 	switch (irq) {
+	case 0x10: // Video
+		videoirq();
+		break;
+	case 0x13: // Disk
+		diskirq();
+		break;
+	case 0x16: // Keyboard
+		kbdirq();
+		break;
+	case 0x1A: // Time of day
+		timeirq();
+		break;
 	case 0x20: // Terminate
 		cpu.done = 1;
-		fprintf(stderr, "Successful Termination\n");
+		exitcode = 0;
+		snprintf(exitmessage, sizeof(exitmessage), "Successful Termination");
+		fprintf(stderr, "%s\n", exitmessage);
 		break;
 	case 0x21: // DOS
 		dosirq();
 		break;
+	case 0x2F: // Multiplex
+		multiplexirq();
+		break;
+	case 0x67: // EMS
+		emsirq();
+		break;
 	default:
-		cpu.errors++;
+		guest_error(SYSTEM_ERROR_SERVICE);
 		fprintf(stderr, "IRQ: Unknown interrupt %02hhX\n", irq);
 	}
+	if (replay_failed())
+		guest_error(SYSTEM_ERROR_REPLAY);
+}
+
+static unsigned long
+pit_period(unsigned ch)
+{
+	return pit.reload[ch] ? pit.reload[ch] : 0x10000ul;
+}
+
+/* the count of channel ch, from pit_period() down to 1 */
+static unsigned long
+pit_left(unsigned ch)
+{
+	return pit_period(ch) - (cpu.cycles - pit.start[ch]) / PIT_DIVIDE % pit_period(ch);
+}
+
+static WORD
+pit_count(unsigned ch)
+{
+	return pit_left(ch);
+}
+
+/* value of cycles once channel ch has counted down k more times */
+static uint64_t
+pit_after(unsigned ch, unsigned long k)
+{
+	return pit.start[ch] + ((cpu.cycles - pit.start[ch]) / PIT_DIVIDE + k) * PIT_DIVIDE;
+}
+
+/* the output of channel 2, which is high while it is not gated */
+static int
+pit_out2(void)
+{
+	if (!(port61 & PORT61_GATE2) || (pit.mode[2] & 3) != PIT_SQUARE)
+		return 1;
+	return pit_count(2) > pit_period(2) / 2;
+}
+
+/* tell the speaker what channel 2 and port 61h make it do now */
+static void
+speaker_update(void)
+{
+	if (!(port61 & PORT61_SPEAKER))
+		speaker_set(cpu.cycles, 0, 0);
+	else if ((port61 & PORT61_GATE2) && (pit.mode[2] & 3) == PIT_SQUARE)
+		speaker_set(cpu.cycles, 1, pit_period(2) * PIT_DIVIDE);
+	else
+		speaker_set(cpu.cycles, 1, 0);
+}
+
+static BYTE
+port_none_in(void *ctx, WORD port)
+{
+	(void)ctx;
+	(void)port;
+	return 0xffu;
+}
+
+static void
+port_none_out(void *ctx, WORD port, BYTE b)
+{
+	(void)ctx;
+	(void)port;
+	(void)b;
+}
+
+/* point every port from first to last at a device, leaving reads or
+ * writes with nothing there if in or out is NULL
+ */
+static int
+port_register(WORD first, WORD last, BYTE (*in)(void *, WORD), void (*out)(void *, WORD, BYTE), void *ctx)
+{
+	struct port *page;
+	unsigned p;
+
+	for (p = first; p <= last; p++) {
+		page = portmap[p >> PORT_PAGE_SHIFT];
+		if (page == portnone) {
+			page = malloc(sizeof(portnone));
+			if (!page) {
+				perror("ports");
+				return -1;
+			}
+			memcpy(page, portnone, sizeof(portnone));
+			portmap[p >> PORT_PAGE_SHIFT] = page;
+		}
+		page += p & (PORT_PAGE - 1);
+		page->in = in ? in : port_none_in;
+		page->out = out ? out : port_none_out;
+		page->ctx = ctx;
+	}
+
+	return 0;
+}
+
+static void
+ports_done(void)
+{
+	unsigned i;
+
+	for (i = 0; i < PORT_PAGES; i++) {
+		if (portmap[i] != portnone)
+			free(portmap[i]);
+		portmap[i] = portnone;
+	}
+}
+
+static inline BYTE
+port_in(WORD port)
+{
+	const struct port *p = &portmap[port >> PORT_PAGE_SHIFT][port & (PORT_PAGE - 1)];
+
+	return p->in(p->ctx, port);
+}
+
+static inline void
+port_out(WORD port, BYTE b)
+{
+	const struct port *p = &portmap[port >> PORT_PAGE_SHIFT][port & (PORT_PAGE - 1)];
+
+	cpu.effects++;
+	p->out(p->ctx, port, b);
+}
+
+/* PIT counters */
+static BYTE
+pit_in(void *ctx, WORD port)
+{
+	unsigned ch = port - 0x40;
+	unsigned long c, k;
+	int high;
+	WORD v;
+	BYTE b;
+
+	(void)ctx;
+	high = pit.rw[ch] == PIT_RW_HIGH || (pit.rw[ch] == PIT_RW_BOTH && pit.high[ch]);
+	if (pit.latched[ch]) {
+		v = pit.latch[ch];
+	} else {
+		/* the low byte changes with every count, the high one when it carries or reloads */
+		c = pit_left(ch);
+		v = c;
+		k = 1;
+		if (high)
+			k = (c & 0xff) + 1 < c ? (c & 0xff) + 1 : c;
+		timer_seen(pit_after(ch, k));
+	}
+	b = high ? v >> 8 : v;
+	if (pit.rw[ch] == PIT_RW_BOTH)
+		pit.high[ch] ^= 1;
+	if (!pit.high[ch])
+		pit.latched[ch] = 0;
+	return b;
+}
+
+static void
+pit_out(void *ctx, WORD port, BYTE b)
+{
+	unsigned ch = port - 0x40;
+
+	(void)ctx;
+	if (pit.rw[ch] == PIT_RW_LOW)
+		pit.reload[ch] = b;
+	else if (pit.rw[ch] == PIT_RW_HIGH)
+		pit.reload[ch] = b << 8;
+	else if (!pit.high[ch])
+		pit.reload[ch] = (pit.reload[ch] & 0xff00u) | b;
+	else
+		pit.reload[ch] = (pit.reload[ch] & 0x00ffu) | (b << 8);
+	if (pit.rw[ch] == PIT_RW_BOTH)
+		pit.high[ch] ^= 1;
+	if (!pit.high[ch]) { /* the count is complete */
+		pit.start[ch] = cpu.cycles;
+		if (ch == 2)
+			speaker_update();
+	}
+}
+
+/* PIT mode control */
+static void
+pit_control(void *ctx, WORD port, BYTE b)
+{
+	unsigned ch = b >> 6;
+
+	(void)ctx;
+	(void)port;
+	if (ch == 3) /* read-back, 8254 only */
+		return;
+	if (!(b & 0x30)) { /* latch the count */
+		pit.latch[ch] = pit_count(ch);
+		pit.latched[ch] = 1;
+		return;
+	}
+	pit.rw[ch] = (b >> 4) & 3;
+	pit.mode[ch] = (b >> 1) & 7;
+	pit.high[ch] = 0;
+	pit.latched[ch] = 0;
+	if (ch == 2)
+		speaker_update();
+}
+
+/* system control port B */
+static BYTE
+port61_in(void *ctx, WORD port)
+{
+	BYTE b = port61;
+	unsigned long c;
+
+	(void)ctx;
+	(void)port;
+	timer_seen((cpu.cycles / REFRESH_CYCLES + 1) * REFRESH_CYCLES);
+	if ((port61 & PORT61_GATE2) && (pit.mode[2] & 3) == PIT_SQUARE) {
+		/* OUT2 falls halfway through the count and rises when it reloads */
+		c = pit_left(2);
+		timer_seen(pit_after(2, c > pit_period(2) / 2 ? c - pit_period(2) / 2 : c));
+	}
+	if ((cpu.cycles / REFRESH_CYCLES) & 1)
+		b |= PORT61_REFRESH;
+	if (pit_out2())
+		b |= PORT61_OUT2;
+	return b;
+}
+
+static void
+port61_out(void *ctx, WORD port, BYTE b)
+{
+	(void)ctx;
+	(void)port;
+	if (b & ~port61 & PORT61_GATE2) /* the gate going high restarts the count */
+		pit.start[2] = cpu.cycles;
+	port61 = b & 0x0f;
+	speaker_update();
+}
+
+static BYTE
+video_port_in(void *ctx, WORD port)
+{
+	(void)ctx;
+	if (port == 0x3DA)
+		timer_seen(video_status_until(cpu.cycles));
+	return video_in(port, cpu.cycles);
+}
+
+static void
+video_port_out(void *ctx, WORD port, BYTE b)
+{
+	(void)ctx;
+	video_out(port, b);
+}
+
+/* the devices, as in the I/O map at the top */
+static int
+ports_init(void)
+{
+	unsigned i;
+
+	for (i = 0; i < PORT_PAGE; i++) {
+		portnone[i].in = port_none_in;
+		portnone[i].out = port_none_out;
+		portnone[i].ctx = NULL;
+	}
+	ports_done();
+	return port_register(0x40, 0x42, pit_in, pit_out, NULL) ||
+		port_register(0x43, 0x43, NULL, pit_control, NULL) ||
+		port_register(0x61, 0x61, port61_in, port61_out, NULL) ||
+		port_register(0x3C0, 0x3DA, video_port_in, video_port_out, NULL) ? -1 : 0;
+}
+
+static void
+trap(BYTE n)
+{
+	if (n == TRAP_XMS) {
+		cpu.effects++;
+		xmsentry();
+	} else {
+		initiate_irq(n);
+	}
 }
 
 static void
@@ -566,23 +3530,190 @@ unknown2(BYTE a, BYTE b) {
 	fprintf(stderr, "Unknown opcode %02hhX %02hhX\n", a, b);
 }
 
-int
-system_tick(int n)
+/* nothing is ever restored from the oldest checkpoint's delta */
+static void
+history_forget(struct checkpoint *c)
+{
+	history.used -= c->size;
+	free(c->delta);
+	c->delta = NULL;
+	c->size = 0;
+}
+
+static void
+history_drop(void)
+{
+	history.first = (history.first + 1) % REWIND_MAX;
+	history.count--;
+	history_forget(&history.ring[history.first]);
+}
+
+/* the RAM pages written since the last checkpoint */
+static void
+history_dirty(BYTE dirty[RAM_SIZE >> PAGE_SHIFT])
 {
-	BYTE bt, wt; /* temp byte and temp word */
+	size_t i;
+
+	memset(dirty, 0, RAM_SIZE >> PAGE_SHIFT);
+	dirty[0] = 1; /* the BIOS writes the vectors and its data area directly */
+	for (i = 0; i < PAGES; i++) {
+		if (!(pagedirty[i] & DIRTY_REWIND))
+			continue;
+		pagedirty[i] &= ~DIRTY_REWIND;
+		if (pagemap[i] >= sysmem && pagemap[i] < sysmem + RAM_SIZE)
+			dirty[(pagemap[i] - sysmem) >> PAGE_SHIFT] = 1;
+	}
+}
+
+static void
+checkpoint(void)
+{
+	BYTE dirty[RAM_SIZE >> PAGE_SHIFT], *delta = NULL, *p;
+	struct checkpoint *c;
+	size_t i, n, size = 0;
+
+	history.next = cpu.cycles + history.interval;
+	history_dirty(dirty);
+	if (!history.count) {
+		/* loading wrote memory behind our back, so start from all of it */
+		memcpy(history.shadow, sysmem, RAM_SIZE);
+	} else {
+		for (i = 0; i < RAM_SIZE >> PAGE_SHIFT; i++) {
+			if (!dirty[i])
+				continue;
+			n = delta_encode(history.scratch, sysmem + i * PAGE_SIZE,
+				history.shadow + i * PAGE_SIZE, PAGE_SIZE);
+			if (!n)
+				continue;
+			p = realloc(delta, size + 5 + n);
+			if (!p) {
+				/* a gap in the deltas makes everything older useless */
+				free(delta);
+				delta = NULL;
+				size = 0;
+				while (history.count)
+					history_drop();
+				memcpy(history.shadow, sysmem, RAM_SIZE);
+				break;
+			}
+			delta = p;
+			delta[size] = i;
+			memcpy(delta + size + 1, &(DWORD){ n }, 4);
+			memcpy(delta + size + 5, history.scratch, n);
+			size += 5 + n;
+			memcpy(history.shadow + i * PAGE_SIZE, sysmem + i * PAGE_SIZE, PAGE_SIZE);
+		}
+	}
+
+	if (history.count == REWIND_MAX)
+		history_drop();
+	c = &history.ring[(history.first + history.count++) % REWIND_MAX];
+	c->cpu = cpu;
+	c->pit = pit;
+	c->port61 = port61;
+	kbd_save(&c->kbd);
+	dosfile_save(&c->files);
+	c->diskwrites = diskwrites;
+	c->keypolls = keypolls;
+	c->dta_seg = dta_seg;
+	c->dta_ofs = dta_ofs;
+	c->a20 = a20;
+	c->exitcode = exitcode;
+	c->disk_status = disk_status;
+	c->delta = delta;
+	c->size = size;
+	history.used += size;
+	if (history.count == 1)
+		history_forget(c);
+	while (history.count > 1 && history.used > history.budget)
+		history_drop();
+}
+
+/* at vertical retrace, let the screen have a frame if anything changed */
+static void
+vsync(void)
+{
+	uint64_t frame = video_frametime();
+	int dirty = 0;
+	size_t i;
+
+	for (i = VIDEO_START >> PAGE_SHIFT; i < VIDEO_END >> PAGE_SHIFT; i++) {
+		dirty |= pagedirty[i] & DIRTY_VIDEO;
+		pagedirty[i] &= ~DIRTY_VIDEO;
+	}
+	video_frame(cpu.cycles, dirty);
+	video_next = (cpu.cycles / frame + 1) * frame;
+}
+
+/* run whatever has come due on the virtual clock, between two instructions */
+static void
+clock_events(void)
+{
+	if (cpu.cycles >= history.next)
+		checkpoint();
+	if (cpu.cycles >= video_next)
+		vsync();
+	next_event = history.next < video_next ? history.next : video_next;
+	if (lockstep.on)
+		next_event = 0;
+}
+
+/* in lockstep, whether the instruction about to run ends a basic block,
+ * the first time round
+ */
+static int
+lockstep_boundary(void)
+{
+	WORD r, w;
+
+	if (cpu.insns == lockstep.at || flags_use(CS, IP, &r, &w))
+		return 0;
+	lockstep.at = cpu.insns;
+	lockstep.stop = 1;
+	return 1;
+}
+
+/* Run up to budget instructions and return why it stopped. For the wait
+ * reasons *w says what would end the wait, and calling again any time
+ * after resumes the guest, or returns the same reason if it is not over.
+ */
+enum system_reason
+system_run(unsigned long budget, struct system_wait *w)
+{
+	unsigned long n = budget;
+	BYTE bt; /* temp byte */
+	WORD wt; /* temp word */
+	struct timespec start, end;
+
+	if (waiting.reason && wait_resume())
+		return wait_info(w);
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
-	while (!cpu.done && !cpu.errors && n > 0) {
-		BYTE op = fetchop();
+	while (!cpu.done && !cpu.errors && !waiting.reason && n > 0) {
+		BYTE op;
 
+		if (cpu.cycles >= next_event) {
+			if (debug.stop)
+				break;
+			clock_events();
+			if (lockstep.on && lockstep_boundary())
+				break;
+		}
+		cpu.op_ip = IP;
+		if (pageflags[segofs_to_addr(CS, IP) >> PAGE_SHIFT] & PAGE_BREAK &&
+			breakpoint_hit(segofs_to_addr(CS, IP)))
+			break;
 		/* reset some state at the start of each instruction */
 		cpu.segment_override = OVERRIDE_NONE;
+		op = fetchop();
 
+	prefixed:
 		switch (op) {
 		// 00 /r      ADD eb,rb   2,mem=7    Add byte register into EA byte
 		case 0x00:
 			modrm_begin(0);
 			bt = modrm_readbyte();
-			modrm_writebyte(bt + REG8(cpu.pending.n));
+			modrm_writebyte(alu(0, bt, REG8(cpu.pending.n), 0));
 			modrm_end();
 			break;
 
@@ -590,7 +3721,7 @@ system_tick(int n)
 		case 0x01:
 			modrm_begin(1);
 			wt = modrm_readword();
-			modrm_writeword(wt + REG16(cpu.pending.n));
+			modrm_writeword(alu(0, wt, REG16(cpu.pending.n), 1));
 			modrm_end();
 			break;
 
@@ -598,7 +3729,7 @@ system_tick(int n)
 		case 0x02:
 			modrm_begin(0);
 			bt = modrm_readbyte();
-			REG8(cpu.pending.n) = bt + REG8(cpu.pending.n);
+			REG8(cpu.pending.n) = alu(0, REG8(cpu.pending.n), bt, 0);
 			modrm_end();
 			break;
 
@@ -606,18 +3737,20 @@ system_tick(int n)
 		case 0x03:
 			modrm_begin(1);
 			wt = modrm_readword();
-			REG16(cpu.pending.n) = wt + REG16(cpu.pending.n);
+			REG16(cpu.pending.n) = alu(0, REG16(cpu.pending.n), wt, 1);
 			modrm_end();
 			break;
 
 		// 04 db      ADD AL,db   3          Add immediate byte into AL
 		case 0x04:
-			AL += fetchbyte();
+			bt = fetchbyte();
+			AL = alu(0, AL, bt, 0);
 			break;
 
 		// 05 dw      ADD AX,dw   3          Add immediate word into AX
 		case 0x05:
-			AX += fetchword();
+			wt = fetchword();
+			AX = alu(0, AX, wt, 1);
 			break;
 
 		// 06         PUSH ES      3         Push ES
@@ -634,7 +3767,7 @@ system_tick(int n)
 		case 0x08:
 			modrm_begin(0);
 			bt = modrm_readbyte();
-			modrm_writebyte(bt | REG8(cpu.pending.n));
+			modrm_writebyte(alu(1, bt, REG8(cpu.pending.n), 0));
 			modrm_end();
 			break;
 
@@ -642,7 +3775,7 @@ system_tick(int n)
 		case 0x09:
 			modrm_begin(1);
 			wt = modrm_readword();
-			modrm_writeword(wt | REG16(cpu.pending.n));
+			modrm_writeword(alu(1, wt, REG16(cpu.pending.n), 1));
 			modrm_end();
 			break;
 
@@ -650,7 +3783,7 @@ system_tick(int n)
 		case 0x0A:
 			modrm_begin(0);
 			bt = modrm_readbyte();
-			REG8(cpu.pending.n) = bt | REG8(cpu.pending.n);
+			REG8(cpu.pending.n) = alu(1, REG8(cpu.pending.n), bt, 0);
 			modrm_end();
 			break;
 
@@ -658,18 +3791,20 @@ system_tick(int n)
 		case 0x0B:
 			modrm_begin(1);
 			wt = modrm_readword();
-			REG16(cpu.pending.n) = wt | REG16(cpu.pending.n);
+			REG16(cpu.pending.n) = alu(1, REG16(cpu.pending.n), wt, 1);
 			modrm_end();
 			break;
 
 		// 0C db      OR AL,db       3         Logical-OR immediate byte into AL
 		case 0x0C:
-			AL = AL | fetchbyte();
+			bt = fetchbyte();
+			AL = alu(1, AL, bt, 0);
 			break;
 
 		// 0D dw      OR AX,dw       3         Logical-OR immediate word into AX
 		case 0x0D:
-			AX = AX | fetchword();
+			wt = fetchword();
+			AX = alu(1, AX, wt, 1);
 			break;
 
 		// 0E         PUSH CS      3         Push CS
@@ -681,7 +3816,7 @@ system_tick(int n)
 		case 0x10:
 			modrm_begin(0);
 			bt = modrm_readbyte();
-			modrm_writebyte(bt + REG8(cpu.pending.n) + FLAG_CF);
+			modrm_writebyte(alu(2, bt, REG8(cpu.pending.n), 0));
 			modrm_end();
 			break;
 
@@ -689,7 +3824,7 @@ system_tick(int n)
 		case 0x11:
 			modrm_begin(1);
 			wt = modrm_readword();
-			modrm_writeword(wt + REG16(cpu.pending.n) + FLAG_CF);
+			modrm_writeword(alu(2, wt, REG16(cpu.pending.n), 1));
 			modrm_end();
 			break;
 
@@ -697,7 +3832,7 @@ system_tick(int n)
 		case 0x12:
 			modrm_begin(0);
 			bt = modrm_readbyte();
-			REG8(cpu.pending.n) = bt + REG8(cpu.pending.n) + FLAG_CF;
+			REG8(cpu.pending.n) = alu(2, REG8(cpu.pending.n), bt, 0);
 			modrm_end();
 			break;
 
@@ -705,18 +3840,20 @@ system_tick(int n)
 		case 0x13:
 			modrm_begin(1);
 			wt = modrm_readword();
-			REG16(cpu.pending.n) = wt + REG16(cpu.pending.n) + FLAG_CF;
+			REG16(cpu.pending.n) = alu(2, REG16(cpu.pending.n), wt, 1);
 			modrm_end();
 			break;
 
 		// 14 db      ADC AL,db   3          Add with carry immediate byte into AL
 		case 0x14:
-			AL += fetchbyte() + FLAG_CF;
+			bt = fetchbyte();
+			AL = alu(2, AL, bt, 0);
 			break;
 
 		// 15 dw      ADC AX,dw   3          Add with carry immediate word into AX
 		case 0x15:
-			AX += fetchword() + FLAG_CF;
+			wt = fetchword();
+			AX = alu(2, AX, wt, 1);
 			break;
 
 
@@ -734,7 +3871,7 @@ system_tick(int n)
 		case 0x18:
 			modrm_begin(0);
 			bt = modrm_readbyte();
-			modrm_writebyte(bt - (REG8(cpu.pending.n) + FLAG_CF));
+			modrm_writebyte(alu(3, bt, REG8(cpu.pending.n), 0));
 			modrm_end();
 			break;
 
@@ -742,7 +3879,7 @@ system_tick(int n)
 		case 0x19:
 			modrm_begin(1);
 			wt = modrm_readword();
-			modrm_writeword(wt - (REG16(cpu.pending.n) + FLAG_CF));
+			modrm_writeword(alu(3, wt, REG16(cpu.pending.n), 1));
 			modrm_end();
 			break;
 
@@ -750,7 +3887,7 @@ system_tick(int n)
 		case 0x1A:
 			modrm_begin(0);
 			bt = modrm_readbyte();
-			REG8(cpu.pending.n) = bt - (REG8(cpu.pending.n) + FLAG_CF);
+			REG8(cpu.pending.n) = alu(3, REG8(cpu.pending.n), bt, 0);
 			modrm_end();
 			break;
 
@@ -758,18 +3895,20 @@ system_tick(int n)
 		case 0x1B:
 			modrm_begin(1);
 			wt = modrm_readword();
-			REG16(cpu.pending.n) = wt - (REG16(cpu.pending.n) - FLAG_CF);
+			REG16(cpu.pending.n) = alu(3, REG16(cpu.pending.n), wt, 1);
 			modrm_end();
 			break;
 
 		// 1C db       SBB AL,db    3         Subtract with borrow imm.  byte from AL
 		case 0x1C:
-			AL -= fetchbyte() + FLAG_CF;
+			bt = fetchbyte();
+			AL = alu(3, AL, bt, 0);
 			break;
 
 		// 1D dw       SBB AX,dw    3         Subtract with borrow imm.  word from AX
 		case 0x1D:
-			AX -= fetchword() + FLAG_CF;
+			wt = fetchword();
+			AX = alu(3, AX, wt, 1);
 			break;
 
 		// 1E         PUSH DS      3         Push DS
@@ -786,7 +3925,7 @@ system_tick(int n)
 		case 0x20:
 			modrm_begin(0);
 			bt = modrm_readbyte();
-			modrm_writebyte(bt & REG8(cpu.pending.n));
+			modrm_writebyte(alu(4, bt, REG8(cpu.pending.n), 0));
 			modrm_end();
 			break;
 
@@ -794,7 +3933,7 @@ system_tick(int n)
 		case 0x21:
 			modrm_begin(1);
 			wt = modrm_readword();
-			modrm_writeword(wt & REG16(cpu.pending.n));
+			modrm_writeword(alu(4, wt, REG16(cpu.pending.n), 1));
 			modrm_end();
 			break;
 
@@ -802,7 +3941,7 @@ system_tick(int n)
 		case 0x22:
 			modrm_begin(0);
 			bt = modrm_readbyte();
-			REG8(cpu.pending.n) = bt & REG8(cpu.pending.n);
+			REG8(cpu.pending.n) = alu(4, REG8(cpu.pending.n), bt, 0);
 			modrm_end();
 			break;
 
@@ -810,23 +3949,27 @@ system_tick(int n)
 		case 0x23:
 			modrm_begin(1);
 			wt = modrm_readword();
-			REG16(cpu.pending.n) = wt & REG16(cpu.pending.n);
+			REG16(cpu.pending.n) = alu(4, REG16(cpu.pending.n), wt, 1);
 			modrm_end();
 			break;
 
 		// 24 db      AND AL,db     3          Logical-AND immediate byte into AL
 		case 0x24:
-			AL = AL & fetchbyte();
+			bt = fetchbyte();
+			AL = alu(4, AL, bt, 0);
 			break;
 
 		// 25 dw      AND AX,dw     3          Logical-AND immediate word into AX
 		case 0x25:
-			AX = AX & fetchword();
+			wt = fetchword();
+			AX = alu(4, AX, wt, 1);
 			break;
 
+		// 26        ES:             2          Segment override for the next instruction
 		case 0x26:
 			cpu.segment_override = OVERRIDE_ES;
-			break;
+			op = fetchop();
+			goto prefixed;
 
 		// 27      DAA            3         Decimal adjust AL after addition
 		case 0x27:
@@ -851,7 +3994,7 @@ system_tick(int n)
 		case 0x28:
 			modrm_begin(0);
 			bt = modrm_readbyte();
-			modrm_writebyte(bt - REG8(cpu.pending.n));
+			modrm_writebyte(alu(5, bt, REG8(cpu.pending.n), 0));
 			modrm_end();
 			break;
 
@@ -859,7 +4002,7 @@ system_tick(int n)
 		case 0x29:
 			modrm_begin(1);
 			wt = modrm_readword();
-			modrm_writeword(wt - REG16(cpu.pending.n));
+			modrm_writeword(alu(5, wt, REG16(cpu.pending.n), 1));
 			modrm_end();
 			break;
 
@@ -867,7 +4010,7 @@ system_tick(int n)
 		case 0x2A:
 			modrm_begin(0);
 			bt = modrm_readbyte();
-			REG8(cpu.pending.n) = bt - REG8(cpu.pending.n);
+			REG8(cpu.pending.n) = alu(5, REG8(cpu.pending.n), bt, 0);
 			modrm_end();
 			break;
 
@@ -875,23 +4018,27 @@ system_tick(int n)
 		case 0x2B:
 			modrm_begin(1);
 			wt = modrm_readword();
-			REG16(cpu.pending.n) = wt - REG16(cpu.pending.n);
+			REG16(cpu.pending.n) = alu(5, REG16(cpu.pending.n), wt, 1);
 			modrm_end();
 			break;
 
 		// 2C db      SUB AL,db      3           Subtract immediate byte from AL
 		case 0x2C:
-			AL -= fetchbyte();
+			bt = fetchbyte();
+			AL = alu(5, AL, bt, 0);
 			break;
 
 		// 2D dw      SUB AX,dw      3           Subtract immediate word from AX
 		case 0x2D:
-			AX -= fetchword();
+			wt = fetchword();
+			AX = alu(5, AX, wt, 1);
 			break;
 
+		// 2E        CS:             2          Segment override for the next instruction
 		case 0x2E:
 			cpu.segment_override = OVERRIDE_CS;
-			break;
+			op = fetchop();
+			goto prefixed;
 
 		// 2F        DAS             3          Decimal adjust AL after subtraction
 		case 0x2F:
@@ -912,46 +4059,114 @@ system_tick(int n)
 			}
 			break;
 
-		// 30 /r     XOR eb,rb   2,mem=7   Exclusive-OR byte register into EA byte
-		case 0x30:
+		// 30 /r     XOR eb,rb   2,mem=7   Exclusive-OR byte register into EA byte
+		case 0x30:
+			modrm_begin(0);
+			bt = modrm_readbyte();
+			modrm_writebyte(alu(6, bt, REG8(cpu.pending.n), 0));
+			modrm_end();
+			break;
+
+		// 31 /r     XOR ew,rw   2,mem=7   Exclusive-OR word register into EA word
+		case 0x31:
+			modrm_begin(1);
+			wt = modrm_readword();
+			modrm_writeword(alu(6, wt, REG16(cpu.pending.n), 1));
+			modrm_end();
+			break;
+
+		// 32 /r     XOR rb,eb   2,mem=7   Exclusive-OR EA byte into byte register
+		case 0x32:
+			modrm_begin(0);
+			bt = modrm_readbyte();
+			REG8(cpu.pending.n) = alu(6, REG8(cpu.pending.n), bt, 0);
+			modrm_end();
+			break;
+
+		// 33 /r     XOR rw,ew   2,mem=7   Exclusive-OR EA word into word register
+		case 0x33:
+			modrm_begin(1);
+			wt = modrm_readword();
+			REG16(cpu.pending.n) = alu(6, REG16(cpu.pending.n), wt, 1);
+			modrm_end();
+			break;
+
+		// 34 db     XOR AL,db   3         Exclusive-OR immediate byte into AL
+		case 0x34:
+			bt = fetchbyte();
+			AL = alu(6, AL, bt, 0);
+			break;
+
+		// 35 dw     XOR AX,dw   3         Exclusive-OR immediate word into AX
+		case 0x35:
+			wt = fetchword();
+			AX = alu(6, AX, wt, 1);
+			break;
+
+		// 36        SS:             2          Segment override for the next instruction
+		case 0x36:
+			cpu.segment_override = OVERRIDE_SS;
+			op = fetchop();
+			goto prefixed;
+
+		// 38 /r      CMP eb,rb      2,mem=7     Compare byte register from EA byte
+		case 0x38:
 			modrm_begin(0);
 			bt = modrm_readbyte();
-			modrm_writebyte(bt ^ REG8(cpu.pending.n));
+			alu_sub(bt, REG8(cpu.pending.n), 0, 0);
 			modrm_end();
 			break;
 
-		// 31 /r     XOR ew,rw   2,mem=7   Exclusive-OR word register into EA word
-		case 0x31:
+		// 39 /r      CMP ew,rw      2,mem=7     Compare word register from EA word
+		case 0x39:
 			modrm_begin(1);
 			wt = modrm_readword();
-			modrm_writeword(wt ^ REG16(cpu.pending.n));
+			alu_sub(wt, REG16(cpu.pending.n), 0, 1);
 			modrm_end();
 			break;
 
-		// 32 /r     XOR rb,eb   2,mem=7   Exclusive-OR EA byte into byte register
-		case 0x32:
+		// 3A /r      CMP rb,eb      2,mem=6     Compare EA byte from byte register
+		case 0x3A:
 			modrm_begin(0);
 			bt = modrm_readbyte();
-			REG8(cpu.pending.n) = bt ^ REG8(cpu.pending.n);
+			alu_sub(REG8(cpu.pending.n), bt, 0, 0);
 			modrm_end();
 			break;
 
-		// 33 /r     XOR rw,ew   2,mem=7   Exclusive-OR EA word into word register
-		case 0x33:
+		// 3B /r      CMP rw,ew      2,mem=6     Compare EA word from word register
+		case 0x3B:
 			modrm_begin(1);
 			wt = modrm_readword();
-			REG16(cpu.pending.n) = wt ^ REG16(cpu.pending.n);
+			alu_sub(REG16(cpu.pending.n), wt, 0, 1);
 			modrm_end();
 			break;
 
-		// 34 db     XOR AL,db   3         Exclusive-OR immediate byte into AL
-		case 0x34:
-			AL = AL ^ fetchbyte();
+		// 3C db      CMP AL,db      3           Compare immediate byte from AL
+		case 0x3C:
+			alu_sub(AL, fetchbyte(), 0, 0);
 			break;
 
-		// 35 dw     XOR AX,dw   3         Exclusive-OR immediate word into AX
-		case 0x35:
-			AX = AX ^ fetchword();
+		// 3D dw      CMP AX,dw      3           Compare immediate word from AX
+		case 0x3D:
+			alu_sub(AX, fetchword(), 0, 1);
+			break;
+
+		// 3E        DS:             2          Segment override for the next instruction
+		case 0x3E:
+			cpu.segment_override = OVERRIDE_DS;
+			op = fetchop();
+			goto prefixed;
+
+		// 40+ rw     INC rw         2           Increment word register by 1
+		case 0x40: case 0x41: case 0x42: case 0x43:
+		case 0x44: case 0x45: case 0x46: case 0x47:
+			REG16(op - 0x40) = alu_incdec(REG16(op - 0x40), 1, 0);
+			break;
+
+		// 48+ rw     DEC rw         2           Decrement word register by 1
+		case 0x48: case 0x49: case 0x4A: case 0x4B:
+		case 0x4C: case 0x4D: case 0x4E: case 0x4F:
+			REG16(op - 0x48) = alu_incdec(REG16(op - 0x48), 1, 1);
 			break;
 
 		// 50+ rw     PUSH rw      3         Push word register
@@ -960,13 +4175,8 @@ system_tick(int n)
 			pushword(REG16(op - 0x50));
 			break;
 		case 0x54: // PUSH SP
-#if 1
-			/* behavior on 8088/8086 */
+			/* behavior on 8088/8086, 80186 and V20; a 286 pushes SP as it was */
 			pushword(SP - 2);
-#else
-			/* behavior on 286+ */
-			pushword(SP);
-#endif
 			break;
 
 		// 58+rw       POP rw           5          Pop top of stack into word register
@@ -975,6 +4185,32 @@ system_tick(int n)
 			REG16(op - 0x58) = popword();
 			break;
 
+#if CPU_186
+		// 60         PUSHA        36        Push AX, CX, DX, BX, original SP, BP, SI, DI
+		case 0x60:
+			wt = SP;
+			pushword(AX);
+			pushword(CX);
+			pushword(DX);
+			pushword(BX);
+			pushword(wt);
+			pushword(BP);
+			pushword(SI);
+			pushword(DI);
+			break;
+
+		// 61         POPA         51        Pop DI, SI, BP, SP, BX, DX, CX, AX
+		case 0x61:
+			DI = popword();
+			SI = popword();
+			BP = popword();
+			popword(); /* SP is not restored */
+			BX = popword();
+			DX = popword();
+			CX = popword();
+			AX = popword();
+			break;
+
 		// 68  dw     PUSH dw      3         Push immediate word
 		case 0x68:
 			pushword(fetchword());
@@ -984,154 +4220,213 @@ system_tick(int n)
 		case 0x6A:
 			pushword(signext(fetchbyte()));
 			break;
+#endif
 
 		// 70  cb     JO cb      7,noj=3   Jump short if overflow (OF=1)
-		case 0x70: {
-			int a = signext(fetchbyte());
+		case 0x70: CASE_8088(0x60) {
+			BYTE a = fetchbyte();
 			if (FLAG_OF)
-				IP += a;
+				jump_short(a);
 			break;
 		}
 
 		// 71  cb     JNO cb     7,noj=3   Jump short if notoverflow (OF=0)
-		case 0x71: {
-			int a = signext(fetchbyte());
-			if (!FLAG_PF)
-				IP += a;
+		case 0x71: CASE_8088(0x61) {
+			BYTE a = fetchbyte();
+			if (!FLAG_OF)
+				jump_short(a);
 			break;
 		}
 
 		// 72  cb     JB cb      7,noj=3   Jump short if below (CF=1)
 		// 72  cb     JC cb      7,noj=3   Jump short if carry (CF=1)
-		case 0x72: {
-			int a = signext(fetchbyte());
+		case 0x72: CASE_8088(0x62) {
+			BYTE a = fetchbyte();
 			if (FLAG_CF)
-				IP += a;
+				jump_short(a);
 			break;
 		}
 
 		// 73  cb     JNB cb     7,noj=3   Jump short if not below (CF=0)
 		// 73  cb     JNC cb     7,noj=3   Jump short if not carry (CF=0)
-		case 0x73: {
-			int a = signext(fetchbyte());
+		case 0x73: CASE_8088(0x63) {
+			BYTE a = fetchbyte();
 			if (!FLAG_CF)
-				IP += a;
+				jump_short(a);
 			break;
 		}
 
 		// 74  cb     JE cb      7,noj=3   Jump short if equal (ZF=1)
 		// 74  cb     JZ cb      7,noj=3   Jump short if zero (ZF=1)
-		case 0x74: {
-			int a = signext(fetchbyte());
+		case 0x74: CASE_8088(0x64) {
+			BYTE a = fetchbyte();
 			if (FLAG_ZF)
-				IP += a;
+				jump_short(a);
 			break;
 		}
 
 		// 75  cb     JNE cb     7,noj=3   Jump short if not equal (ZF=0)
 		// 75  cb     JNZ cb     7,noj=3   Jump short if not zero (ZF=0)
-		case 0x75: {
-			int a = signext(fetchbyte());
+		case 0x75: CASE_8088(0x65) {
+			BYTE a = fetchbyte();
 			if (!FLAG_ZF)
-				IP += a;
+				jump_short(a);
 			break;
 		}
 
 		// 76  cb     JBE cb     7,noj=3   Jump short if below or equal (CF=1 or ZF=1)
 		// 76  cb     JNA cb     7,noj=3   Jump short if not above (CF=1 or ZF=1)
-		case 0x76: {
-			int a = signext(fetchbyte());
+		case 0x76: CASE_8088(0x66) {
+			BYTE a = fetchbyte();
 			if (FLAG_CF | FLAG_ZF)
-				IP += a;
+				jump_short(a);
 			break;
 		}
 
 		// 77  cb     JA cb      7,noj=3   Jump short if above (CF=0 and ZF=0)
 		// 77  cb     JNBE cb    7,noj=3   Jump short if not below/equal (CF=0 and ZF=0)
-		case 0x77: {
-			int a = signext(fetchbyte());
-			if (FLAG_CF & FLAG_ZF)
-				IP += a;
+		case 0x77: CASE_8088(0x67) {
+			BYTE a = fetchbyte();
+			if (!FLAG_CF && !FLAG_ZF)
+				jump_short(a);
 			break;
 		}
 
 		// 78  cb     JS cb      7,noj=3   Jump short if sign (SF=1)
-		case 0x78: {
-			int a = signext(fetchbyte());
+		case 0x78: CASE_8088(0x68) {
+			BYTE a = fetchbyte();
 			if (FLAG_SF)
-				IP += a;
+				jump_short(a);
 			break;
 		}
 
 		// 79  cb     JNS cb     7,noj=3   Jump short if not sign (SF=0)
-		case 0x79: {
-			int a = signext(fetchbyte());
+		case 0x79: CASE_8088(0x69) {
+			BYTE a = fetchbyte();
 			if (!FLAG_SF)
-				IP += a;
+				jump_short(a);
 			break;
 		}
 
 		// 7A  cb     JP cb      7,noj=3   Jump short if parity (PF=1)
 		// 7A  cb     JPE cb     7,noj=3   Jump short if parity even (PF=1)
-		case 0x7A: {
-			int a = signext(fetchbyte());
+		case 0x7A: CASE_8088(0x6A) {
+			BYTE a = fetchbyte();
 			if (FLAG_PF)
-				IP += a;
+				jump_short(a);
 			break;
 		}
 
 		// 7B  cb     JPO cb     7,noj=3   Jump short if parity odd (PF=0)
 		// 7B  cb     JNP cb     7,noj=3   Jump short if not parity (PF=0)
-		case 0x7B: {
-			int a = signext(fetchbyte());
+		case 0x7B: CASE_8088(0x6B) {
+			BYTE a = fetchbyte();
 			if (!FLAG_PF)
-				IP += a;
+				jump_short(a);
 			break;
 		}
 
 		// 7C  cb     JL cb      7,noj=3   Jump short if less (SF/=OF)
 		// 7C  cb     JNGE cb    7,noj=3   Jump short if not greater/equal (SF/=OF)
-		case 0x7C: {
-			int a = signext(fetchbyte());
+		case 0x7C: CASE_8088(0x6C) {
+			BYTE a = fetchbyte();
 			if (!FLAG_SF != !FLAG_OF)
-				IP += a;
+				jump_short(a);
 			break;
 		}
 
 		// 7D  cb     JGE cb     7,noj=3   Jump short if greater or equal (SF=OF)
 		// 7D  cb     JNL cb     7,noj=3   Jump short if not less (SF=OF)
-		case 0x7D: {
-			int a = signext(fetchbyte());
+		case 0x7D: CASE_8088(0x6D) {
+			BYTE a = fetchbyte();
 			if (!FLAG_SF == !FLAG_OF)
-				IP += a;
+				jump_short(a);
 			break;
 		}
 
 		// 7E  cb     JLE cb     7,noj=3   Jump short if less or equal (ZF=1 or SF/=OF)
 		// 7E  cb     JNG cb     7,noj=3   Jump short if not greater (ZF=1 or SF/=OF)
-		case 0x7E: {
-			int a = signext(fetchbyte());
+		case 0x7E: CASE_8088(0x6E) {
+			BYTE a = fetchbyte();
 			if (FLAG_ZF || (!FLAG_SF != !FLAG_OF))
-				IP += a;
+				jump_short(a);
 			break;
 		}
 
 		// 7F  cb     JG cb      7,noj=3   Jump short if greater (ZF=0 and SF=OF)
 		// 7F  cb     JNLE cb    7,noj=3   Jump short if not less/equal (ZF=0 and SF=OF)
-		case 0x7F: {
-			int a = signext(fetchbyte());
+		case 0x7F: CASE_8088(0x6F) {
+			BYTE a = fetchbyte();
 			if (!FLAG_ZF && (!FLAG_SF == !FLAG_OF))
-				IP += a;
+				jump_short(a);
 			break;
 		}
 
+		// 80 /0 db  ADD  eb,db  3,mem=7   Add immediate byte into EA byte
+		// 80 /1 db  OR   eb,db  3,mem=7   Logical-OR immediate byte into EA byte
+		// 80 /2 db  ADC  eb,db  3,mem=7   Add with carry immediate byte into EA byte
+		// 80 /3 db  SBB  eb,db  3,mem=7   Subtract with borrow imm. byte from EA byte
+		// 80 /4 db  AND  eb,db  3,mem=7   Logical-AND immediate byte into EA byte
+		// 80 /5 db  SUB  eb,db  3,mem=7   Subtract immediate byte from EA byte
+		// 80 /6 db  XOR  eb,db  3,mem=7   Exclusive-OR immediate byte into EA byte
+		// 80 /7 db  CMP  eb,db  3,mem=6   Compare immediate byte from EA byte
+		case 0x80:
+		case 0x82:
+			modrm_begin(0);
+			bt = modrm_readbyte();
+			bt = alu(cpu.pending.n, bt, fetchbyte(), 0);
+			if (cpu.pending.n != 7)
+				modrm_writebyte(bt);
+			modrm_end();
+			break;
+
+		// 81 /0 dw  ADD  ew,dw  4,mem=7   Add immediate word into EA word
+		// 81 /1 dw  OR   ew,dw  4,mem=7   Logical-OR immediate word into EA word
+		// 81 /2 dw  ADC  ew,dw  4,mem=7   Add with carry immediate word into EA word
+		// 81 /3 dw  SBB  ew,dw  4,mem=7   Subtract with borrow imm. word from EA word
+		// 81 /4 dw  AND  ew,dw  4,mem=7   Logical-AND immediate word into EA word
+		// 81 /5 dw  SUB  ew,dw  4,mem=7   Subtract immediate word from EA word
+		// 81 /6 dw  XOR  ew,dw  4,mem=7   Exclusive-OR immediate word into EA word
+		// 81 /7 dw  CMP  ew,dw  4,mem=6   Compare immediate word from EA word
+		// 83 /0 db  ADD  ew,db  4,mem=7   Add immediate byte (sign extended) into EA word
+		// 83 /1 db  OR   ew,db  4,mem=7   Logical-OR immediate byte (sign extended) into EA word
+		// 83 /2 db  ADC  ew,db  4,mem=7   Add with carry immediate byte (sign extended) into EA word
+		// 83 /3 db  SBB  ew,db  4,mem=7   Subtract with borrow imm. byte (sign extended) from EA word
+		// 83 /4 db  AND  ew,db  4,mem=7   Logical-AND immediate byte (sign extended) into EA word
+		// 83 /5 db  SUB  ew,db  4,mem=7   Subtract immediate byte (sign extended) from EA word
+		// 83 /6 db  XOR  ew,db  4,mem=7   Exclusive-OR immediate byte (sign extended) into EA word
+		// 83 /7 db  CMP  ew,db  4,mem=6   Compare immediate byte (sign extended) from EA word
+		case 0x81:
+		case 0x83:
+			modrm_begin(1);
+			wt = modrm_readword();
+			wt = alu(cpu.pending.n, wt, op == 0x81 ? fetchword() : signext(fetchbyte()), 1);
+			if (cpu.pending.n != 7)
+				modrm_writeword(wt);
+			modrm_end();
+			break;
+
+		// 84 /r     TEST eb,rb     2,mem=6     AND byte register into EA byte for flags only
+		case 0x84:
+			modrm_begin(0);
+			alu_logic(modrm_readbyte() & REG8(cpu.pending.n), 0);
+			modrm_end();
+			break;
+
+		// 85 /r     TEST ew,rw     2,mem=6     AND word register into EA word for flags only
+		case 0x85:
+			modrm_begin(1);
+			alu_logic(modrm_readword() & REG16(cpu.pending.n), 1);
+			modrm_end();
+			break;
+
 		// 86 /r     XCHG eb,rb     3,mem=5     Exchange byte register with EA byte
 		// 86 /r     XCHG rb,eb     3,mem=5     Exchange EA byte with byte register
 		// 87 /r     XCHG ew,rw     3,mem=5     Exchange word register with EA word
 		// 87 /r     XCHG rw,ew     3,mem=5     Exchange EA word with word register
 		case 0x86:
 		case 0x87:
-			cpu.errors++;
+			guest_error(SYSTEM_ERROR_OPCODE);
 			unknown(op); // TODO: implement this
 			goto out;
 			break;
@@ -1145,9 +4440,8 @@ system_tick(int n)
 
 		// 89 /r      MOV ew,rw   2,mem=3       Move word register into EA word
 		case 0x89:
-			modrm_begin(0);
-			wt = modrm_readword();
-			REG16(cpu.pending.n) = wt;
+			modrm_begin(1);
+			modrm_writeword(REG16(cpu.pending.n));
 			modrm_end();
 			break;
 
@@ -1161,8 +4455,9 @@ system_tick(int n)
 
 		// 8B /r      MOV rw,ew   2,mem=5       Move EA word into word register
 		case 0x8B:
-			modrm_begin(0);
-			modrm_writeword(REG16(cpu.pending.n));
+			modrm_begin(1);
+			wt = modrm_readword();
+			REG16(cpu.pending.n) = wt;
 			modrm_end();
 			break;
 
@@ -1171,7 +4466,7 @@ system_tick(int n)
 		// 8C /1      MOV ew,CS   2,mem=3       Move CS into EA word
 		// 8C /2      MOV ew,SS   2,mem=3       Move SS into EA word
 		// 8C /3      MOV ew,DS   2,mem=3       Move DS into EA word
-			cpu.errors++;
+			guest_error(SYSTEM_ERROR_OPCODE);
 			unknown(op); // TODO: implement this
 			goto out;
 			break;
@@ -1183,11 +4478,34 @@ system_tick(int n)
 		// 8E /2      MOV SS,rw   2,pm=17       Move word register into SS
 		// 8E /3      MOV DS,mw   5,pm=19       Move memory word into DS
 		// 8E /3      MOV DS,rw   2,pm=17       Move word register into DS
-			cpu.errors++;
+			guest_error(SYSTEM_ERROR_OPCODE);
 			unknown(op); // TODO: implement this
 			goto out;
 			break;
 
+		// 9A cd      CALL cd     28,pm=26      Call far segment, immediate 4-byte address
+		case 0x9A: {
+			WORD seg, ofs;
+
+			ofs = fetchword();
+			seg = fetchword();
+			pushword(CS);
+			pushword(IP);
+			CS = seg;
+			IP = ofs;
+			break;
+		}
+
+
+		// A8 db     TEST AL,db     3           AND immediate byte into AL for flags only
+		case 0xA8:
+			alu_logic(AL & fetchbyte(), 0);
+			break;
+
+		// A9 dw     TEST AX,dw     3           AND immediate word into AX for flags only
+		case 0xA9:
+			alu_logic(AX & fetchword(), 1);
+			break;
 
 		// B0+ rb db  MOV rb,db   2             Move immediate byte into byte register
 		case 0xB0: case 0xB1: case 0xB2: case 0xB3:
@@ -1203,65 +4521,235 @@ system_tick(int n)
 			// TODO: what side-effects?
 			break;
 
+#if CPU_186
+		// C0 /n ib   ROL..SAR eb,ib  5+n    Shift or rotate EA byte by immediate count
+		case 0xC0:
+			modrm_begin(0);
+			bt = modrm_readbyte();
+			modrm_writebyte(shift(cpu.pending.n, bt, fetchbyte(), 0));
+			modrm_end();
+			break;
+
+		// C1 /n ib   ROL..SAR ew,ib  5+n    Shift or rotate EA word by immediate count
+		case 0xC1:
+			modrm_begin(1);
+			wt = modrm_readword();
+			modrm_writeword(shift(cpu.pending.n, wt, fetchbyte(), 1));
+			modrm_end();
+			break;
+
+		// C8 dw db   ENTER dw,db  15        Make stack frame for procedure parameters
+		case 0xC8: {
+			WORD frame;
+			BYTE level;
+
+			wt = fetchword();
+			level = fetchbyte() & 31;
+			pushword(BP);
+			frame = SP;
+			for (bt = 1; bt < level; bt++) {
+				BP -= 2;
+				pushword(readword(segofs_to_addr(SS, BP)));
+			}
+			if (level)
+				pushword(frame);
+			BP = frame;
+			SP -= wt;
+			break;
+		}
+
+		// C9         LEAVE        8         Set SP to BP, then POP BP
+		case 0xC9:
+			SP = BP;
+			BP = popword();
+			break;
+#endif
+
+		// CA dw      RET dw      25,pm=25      RET (far), pop dw bytes
+		case 0xCA: CASE_8088(0xC8)
+			wt = fetchword();
+			IP = popword();
+			CS = popword();
+			SP += wt;
+			break;
+
+		// CB         RET         18,pm=23      Return to far caller
+		case 0xCB: CASE_8088(0xC9)
+			IP = popword();
+			CS = popword();
+			break;
+
 		case 0xCD: /* INT */
 			initiate_irq(fetchbyte());
 			break;
 
+		// CF         IRET        22,pm=31      Interrupt return (far return and pop flags)
+		case 0xCF:
+			IP = popword();
+			CS = popword();
+			cpu.flags = popword();
+			break;
+
+		// D0 /n      ROL..SAR eb,1   2,mem=15   Shift or rotate EA byte once
+		// D1 /n      ROL..SAR ew,1   2,mem=15   Shift or rotate EA word once
+		// D2 /n      ROL..SAR eb,CL  8+4n       Shift or rotate EA byte CL times
+		// D3 /n      ROL..SAR ew,CL  8+4n       Shift or rotate EA word CL times
+		//            /0 ROL, /1 ROR, /2 RCL, /3 RCR, /4 SHL, /5 SHR, /6 SHL, /7 SAR
+		case 0xD0:
+		case 0xD2:
+			modrm_begin(0);
+			bt = modrm_readbyte();
+			modrm_writebyte(shift(cpu.pending.n, bt, op == 0xD0 ? 1 : CL, 0));
+			modrm_end();
+			break;
+
+		case 0xD1:
+		case 0xD3:
+			modrm_begin(1);
+			wt = modrm_readword();
+			modrm_writeword(shift(cpu.pending.n, wt, op == 0xD1 ? 1 : CL, 1));
+			modrm_end();
+			break;
+
 		case 0XE2: { /* LOOP cb */
-			WORD disp = signext(fetchbyte());
+			BYTE disp = fetchbyte();
 			CX--;
 			if (CX != 0)
-				IP += disp;
+				jump_short(disp);
 			break;
 		}
 
+		// E4 ib      IN AL,ib     10        Input byte from immediate port into AL
+		case 0xE4:
+			AL = port_in(fetchbyte());
+			break;
+
+		// E5 ib      IN AX,ib     14        Input word from immediate port into AX
+		case 0xE5:
+			bt = fetchbyte();
+			AL = port_in(bt);
+			AH = port_in(bt + 1u);
+			break;
+
+		// E6 ib      OUT ib,AL    10        Output byte AL to immediate port
+		case 0xE6:
+			port_out(fetchbyte(), AL);
+			break;
+
+		// E7 ib      OUT ib,AX    14        Output word AX to immediate port
+		case 0xE7:
+			bt = fetchbyte();
+			port_out(bt, AL);
+			port_out(bt + 1u, AH);
+			break;
+
+		// EA cd      JMP cd      15,pm=23      Jump far direct
+		case 0xEA:
+			wt = fetchword();
+			CS = fetchword();
+			IP = wt;
+			break;
+
+		// EC         IN AL,DX      8        Input byte from port DX into AL
+		case 0xEC:
+			AL = port_in(DX);
+			break;
+
+		// ED         IN AX,DX     12        Input word from port DX into AX
+		case 0xED:
+			AL = port_in(DX);
+			AH = port_in(DX + 1u);
+			break;
+
+		// EE         OUT DX,AL     8        Output byte AL to port DX
+		case 0xEE:
+			port_out(DX, AL);
+			break;
+
+		// EF         OUT DX,AX    12        Output word AX to port DX
+		case 0xEF:
+			port_out(DX, AL);
+			port_out(DX + 1u, AH);
+			break;
+
+		// F1 ib      (emulator trap, see TRAP_XMS)
+		case 0xF1:
+			trap(fetchbyte());
+			break;
+
+		// F4         HLT          2         Halt
+		case 0xF4:
+			if (!FLAG_IF) {
+				guest_error(SYSTEM_ERROR_HALT);
+				fprintf(stderr, "HLT with interrupts disabled\n");
+				goto out;
+			}
+			idle_wait(SYSTEM_WAIT_TIMER, 0); /* the next interrupt is a tick or a key */
+			break;
+
+		// FA         CLI          2         Clear interrupt enable flag
+		case 0xFA:
+			cpu.flags &= ~FLAG_VALUE_IF;
+			break;
+
+		// FB         STI          2         Set interrupt enable flag
+		case 0xFB:
+			cpu.flags |= FLAG_VALUE_IF;
+			break;
+
 		case 0xFE: /* misc eb */
 			modrm_begin(0);
 			switch (cpu.pending.n) {
 			case 0: /* INC eb */
-				bt = modrm_readbyte();
-				modrm_writebyte(bt + 1);
-				// TODO: what side-effects?
-				break;
 			case 1: /* DEC eb */
 				bt = modrm_readbyte();
-				modrm_writebyte(bt - 1);
-				// TODO: what side-effects?
+				modrm_writebyte(alu_incdec(bt, 0, cpu.pending.n));
 				break;
 			default:
-				cpu.errors++;
+				guest_error(SYSTEM_ERROR_OPCODE);
 				unknown2(op, cpu.pending.modrm);
 				goto out;
 			}
 			modrm_end();
+			break;
 
 		case 0xFF: { /* misc eb */
 			modrm_begin(1);
 			switch (cpu.pending.n) {
 			case 0: /* INC ew */
-				wt = modrm_readword();
-				modrm_writebyte(wt + 1);
-				// TODO: what side-effects?
-				break;
 			case 1: /* DEC ew */
 				wt = modrm_readword();
-				modrm_writebyte(wt - 1);
-				// TODO: what side-effects?
+				modrm_writeword(alu_incdec(wt, 1, cpu.pending.n));
 				break;
 			case 2: /* CALL r/m16 */
+				wt = modrm_readword();
+				pushword(IP);
+				IP = wt;
+				break;
 			case 3: /* CALL m32 */
-			case 4: /* JMP r/m16 */
 			case 5: /* JMP m32 */
-				// TODO: implement this
-				cpu.errors++;
-				unknown2(op, cpu.pending.modrm);
-				goto out;
+				if (MODRM_MOD(cpu.pending.modrm) == 3) {
+					guest_error(SYSTEM_ERROR_OPCODE);
+					unknown2(op, cpu.pending.modrm);
+					goto out;
+				}
+				wt = readword(cpu.pending.a);
+				if (cpu.pending.n == 3) {
+					pushword(CS);
+					pushword(IP);
+				}
+				CS = readword(cpu.pending.a + 2);
+				IP = wt;
+				break;
+			case 4: /* JMP r/m16 */
+				IP = modrm_readword();
+				break;
 			case 6: /* PUSH r/m16 */
 				pushword(modrm_readword());
 				break;
 			case 7: /* invalid ... */
 			default:
-				cpu.errors++;
+				guest_error(SYSTEM_ERROR_OPCODE);
 				unknown2(op, cpu.pending.modrm);
 				goto out;
 			}
@@ -1270,18 +4758,422 @@ system_tick(int n)
 
 		}
 
-		case 0x0F: /* undefined on 8086/8088 */
-		default:
-			cpu.errors++;
+#if CPU_MODEL == CPU_8088
+		// 0F         POP CS       8         Pop top of stack into CS (8088 only)
+		case 0x0F:
+			CS = popword();
+			break;
+#elif CPU_MODEL == CPU_V20
+		// 0F 10-1F   TEST1, CLR1, SET1, NOT1   NEC bit instructions, see nec_bitop()
+		case 0x0F:
+			bt = fetchbyte();
+			if (nec_bitop(bt)) {
+				guest_error(SYSTEM_ERROR_OPCODE);
+				unknown2(op, bt);
+				goto out;
+			}
+			break;
+#endif
+
+		default: /* including 0F, which the 80186 has no use for */
+			guest_error(SYSTEM_ERROR_OPCODE);
 			unknown(op);
 			goto out;
 		}
 		n--;
+		cpu.insns++;
+		PROBE4(insn, cpu.insns, CS, cpu.op_ip, op);
+		cpu.cycles += OP_CYCLES;
+		if (cpu.cycles >= cpu.next_tick)
+			timer_tick();
 	}
 out:
-	if (1 /*cpu.errors*/) {
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	metrics.host_ns += (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000u + end.tv_nsec - start.tv_nsec;
+	if (cpu.errors || cpu.done) {
 		print_cpu(0);
+		fprintf(stderr, "Cycles: %llu run, %llu idle, %llu skipped in busy-wait loops\n",
+			(unsigned long long)(cpu.cycles - cpu.idle_cycles),
+			(unsigned long long)cpu.idle_cycles,
+			(unsigned long long)cpu.skipped_cycles);
+		fprintf(stderr, "Flags: %llu computed, %llu skipped as dead\n",
+			(unsigned long long)metrics.flags_computed,
+			(unsigned long long)metrics.flags_skipped);
+	}
+
+	if (cpu.errors)
+		return SYSTEM_ERROR;
+	if (cpu.done)
+		return SYSTEM_HALTED;
+	if (debug.stop) {
+		debug.stop = 0;
+		return SYSTEM_BREAK;
+	}
+	if (lockstep.stop) {
+		lockstep.stop = 0;
+		return SYSTEM_BLOCK;
+	}
+	if (waiting.reason)
+		return wait_info(w);
+	return SYSTEM_BUDGET;
+}
+
+/* Run n instructions, blocking the host through any waits. Returns 1 if
+ * the program has terminated, -1 on error and 0 otherwise.
+ */
+int
+system_tick(int n)
+{
+	uint64_t end = cpu.insns + n;
+	enum system_reason r;
+	struct system_wait w;
+	struct pollfd pfd;
+
+	while ((r = system_run(end - cpu.insns, &w)) != SYSTEM_BUDGET &&
+		r != SYSTEM_HALTED && r != SYSTEM_ERROR) {
+		if (r == SYSTEM_BREAK)
+			continue;
+		pfd.fd = w.fd;
+		pfd.events = POLLIN;
+		poll(&pfd, w.fd >= 0, (w.timeout_us + 999) / 1000);
+	}
+
+	return r == SYSTEM_ERROR ? -1 : r == SYSTEM_HALTED;
+}
+
+/* instructions retired since the machine started */
+uint64_t
+system_insns(void)
+{
+	return cpu.insns;
+}
+
+void
+system_metrics(struct system_metrics *m)
+{
+	*m = metrics;
+	m->insns = cpu.insns;
+	m->cycles = cpu.cycles;
+	m->idle_cycles = cpu.idle_cycles;
+	m->skipped_cycles = cpu.skipped_cycles;
+}
+
+/* Write the metrics as "name value" lines, leaving out interrupts and DOS
+ * calls never made. Returns -1 if writing failed.
+ */
+int
+system_writemetrics(FILE *f)
+{
+	static const char *const errors[SYSTEM_ERROR_KINDS] = {
+		"opcode", "memory", "service", "halt", "input", "replay",
+	};
+	struct system_metrics m;
+	unsigned i;
+
+	system_metrics(&m);
+	fprintf(f, "insns %llu\n", (unsigned long long)m.insns);
+	fprintf(f, "cycles %llu\n", (unsigned long long)m.cycles);
+	fprintf(f, "idle_cycles %llu\n", (unsigned long long)m.idle_cycles);
+	fprintf(f, "skipped_cycles %llu\n", (unsigned long long)m.skipped_cycles);
+	fprintf(f, "host_ns %llu\n", (unsigned long long)m.host_ns);
+	fprintf(f, "cpu_hz %lu\n", CPU_HZ);
+	fprintf(f, "flags_computed %llu\n", (unsigned long long)m.flags_computed);
+	fprintf(f, "flags_skipped %llu\n", (unsigned long long)m.flags_skipped);
+	for (i = 0; i < 256; i++)
+		if (m.interrupts[i])
+			fprintf(f, "interrupt_%02X %llu\n", i, (unsigned long long)m.interrupts[i]);
+	for (i = 0; i < 256; i++)
+		if (m.doscalls[i])
+			fprintf(f, "doscall_%02X %llu\n", i, (unsigned long long)m.doscalls[i]);
+	for (i = 0; i < SYSTEM_ERROR_KINDS; i++)
+		fprintf(f, "error_%s %llu\n", errors[i], (unsigned long long)m.errors[i]);
+
+	return ferror(f) ? -1 : 0;
+}
+
+/* Go back to just before instruction insns ran, which must be no older than
+ * the oldest checkpoint. Returns 0, or -1 if it is out of reach, if input
+ * has arrived or a file has changed since the checkpoint before it, or if the
+ * run forward from the checkpoint failed.
+ */
+int
+system_rewind(uint64_t insns)
+{
+	BYTE dirty[RAM_SIZE >> PAGE_SHIFT];
+	struct checkpoint *c;
+	struct system_wait w;
+	enum system_reason r = SYSTEM_BUDGET;
+	int throttled = throttle;
+	size_t i, n;
+	unsigned k;
+	DWORD len;
+
+	/* a log cannot go back with us */
+	if (replay_mode() != REPLAY_OFF)
+		return -1;
+	for (k = history.count; k && history.ring[(history.first + k - 1) % REWIND_MAX].cpu.insns > insns; k--)
+		;
+	if (!k || insns > cpu.insns)
+		return -1;
+	c = &history.ring[(history.first + k - 1) % REWIND_MAX];
+	if (kbd_changed(&c->kbd) || dosfile_changed(&c->files) || c->diskwrites != diskwrites)
+		return -1;
+
+	/* back to the newest checkpoint, then a delta at a time to the one wanted */
+	history_dirty(dirty);
+	for (i = 0; i < RAM_SIZE >> PAGE_SHIFT; i++)
+		if (dirty[i])
+			memcpy(sysmem + i * PAGE_SIZE, history.shadow + i * PAGE_SIZE, PAGE_SIZE);
+	while (history.count > k) {
+		c = &history.ring[(history.first + --history.count) % REWIND_MAX];
+		for (i = 0; i < c->size; i += 5 + n) {
+			memcpy(&len, c->delta + i + 1, 4);
+			n = len;
+			delta_apply(sysmem + c->delta[i] * PAGE_SIZE, c->delta + i + 5, n);
+			delta_apply(history.shadow + c->delta[i] * PAGE_SIZE, c->delta + i + 5, n);
+		}
+		history_forget(c);
+	}
+
+	c = &history.ring[(history.first + k - 1) % REWIND_MAX];
+	cpu = c->cpu;
+	pit = c->pit;
+	port61 = c->port61;
+	kbd_restore(&c->kbd);
+	dosfile_restore(&c->files);
+	keypolls = c->keypolls;
+	dta_seg = c->dta_seg;
+	dta_ofs = c->dta_ofs;
+	a20 = c->a20;
+	exitcode = c->exitcode;
+	disk_status = c->disk_status;
+	waiting.reason = SYSTEM_BUDGET;
+	memset(&busyloop, 0, sizeof(busyloop));
+	history.next = cpu.cycles + history.interval;
+	video_next = next_event = 0;
+	flags_flush();
+
+	/* and forward again to the instruction asked for, without waiting */
+	throttle = 0;
+	while (cpu.insns < insns && (r = system_run(insns - cpu.insns, &w)) != SYSTEM_HALTED &&
+		r != SYSTEM_ERROR)
+		;
+	throttle = throttled;
+
+	return r == SYSTEM_ERROR ? -1 : 0;
+}
+
+/* Registers in the order GDB numbers them for the i386, zero extended: AX,
+ * CX, DX, BX, SP, BP, SI, DI, IP, FLAGS, CS, SS, DS, ES, then FS and GS,
+ * which an 8086 does not have and read as 0.
+ */
+void
+system_getregs(DWORD regs[SYSTEM_REGS])
+{
+	unsigned i;
+
+	for (i = 0; i < 8; i++)
+		regs[i] = cpu.regs[i];
+	regs[8] = IP;
+	regs[9] = cpu.flags;
+	regs[10] = CS;
+	regs[11] = SS;
+	regs[12] = DS;
+	regs[13] = ES;
+	regs[14] = regs[15] = 0;
+}
+
+void
+system_setregs(const DWORD regs[SYSTEM_REGS])
+{
+	unsigned i;
+
+	for (i = 0; i < 8; i++)
+		cpu.regs[i] = regs[i];
+	IP = regs[8];
+	cpu.flags = regs[9];
+	CS = regs[10];
+	SS = regs[11];
+	DS = regs[12];
+	ES = regs[13];
+}
+
+/* Copy up to len bytes of guest memory from linear address a, stopping at
+ * anything unmapped. Returns the number copied.
+ */
+size_t
+system_peek(DWORD a, void *buf, size_t len)
+{
+	size_t done = 0, n;
+	BYTE *p;
+
+	while (done < len) {
+		n = len - done;
+		p = host_span(a + done, &n, 0);
+		if (!p)
+			break;
+		memcpy((BYTE*)buf + done, p, n);
+		done += n;
+	}
+
+	return done;
+}
+
+/* Store up to len bytes at linear address a for a debugger, stopping at ROM
+ * or anything unmapped, and without setting off watchpoints. Returns the
+ * number stored.
+ */
+size_t
+system_poke(DWORD a, const void *buf, size_t len)
+{
+	size_t done;
+	ADDR x;
+	BYTE *p;
+
+	for (done = 0; done < len; done++) {
+		x = a + done;
+		p = x < PAGES << PAGE_SHIFT ? pagemap[x >> PAGE_SHIFT] : NULL;
+		if (!p || pageflags[x >> PAGE_SHIFT] & PAGE_ROM)
+			break;
+		if (pageflags[x >> PAGE_SHIFT] & PAGE_CODE)
+			code_written(x, 1);
+		if (pageflags[x >> PAGE_SHIFT] & PAGE_HASH)
+			hash_written(p + (x & PAGE_MASK), ((const BYTE*)buf)[done]);
+		pagedirty[x >> PAGE_SHIFT] = DIRTY_ALL;
+		p[x & PAGE_MASK] = ((const BYTE*)buf)[done];
+	}
+
+	return done;
+}
+
+/* set or clear a breakpoint before the instruction at linear address a */
+int
+system_setbreak(DWORD a, int on)
+{
+	size_t i = a >> PAGE_SHIFT, k;
+	BYTE **map;
+
+	if (i >= PAGES)
+		return -1;
+	map = &debug.breakmap[i];
+	if (!*map) {
+		if (!on)
+			return 0;
+		*map = calloc(PAGE_SIZE / 8, 1);
+		if (!*map)
+			return -1;
+	}
+	if (on)
+		(*map)[(a & PAGE_MASK) >> 3] |= 1u << (a & 7);
+	else
+		(*map)[(a & PAGE_MASK) >> 3] &= ~(1u << (a & 7));
+
+	/* a page with none left goes back to being checked for nothing */
+	for (k = 0; k < PAGE_SIZE / 8 && !(*map)[k]; k++)
+		;
+	if (k == PAGE_SIZE / 8) {
+		free(*map);
+		*map = NULL;
+		pageflags[i] &= ~PAGE_BREAK;
+	} else {
+		pageflags[i] |= PAGE_BREAK;
 	}
 
-	return cpu.errors ? -1 : !!cpu.done;
+	return 0;
+}
+
+/* Watch stores to len bytes at linear address a, or stop watching a range
+ * set before. Returns -1 if there are too many, or no such range.
+ */
+int
+system_setwatch(DWORD a, DWORD len, int on)
+{
+	unsigned i;
+	ADDR x;
+
+	if (!len || a >= PAGES << PAGE_SHIFT)
+		return -1;
+	if (len > (PAGES << PAGE_SHIFT) - a)
+		len = (PAGES << PAGE_SHIFT) - a;
+	if (on) {
+		if (debug.watches == WATCH_MAX)
+			return -1;
+		debug.watch[debug.watches].a = a;
+		debug.watch[debug.watches++].len = len;
+	} else {
+		for (i = 0; i < debug.watches && (debug.watch[i].a != a || debug.watch[i].len != len); i++)
+			;
+		if (i == debug.watches)
+			return -1;
+		debug.watch[i] = debug.watch[--debug.watches];
+	}
+
+	for (i = 0; i < PAGES; i++)
+		pageflags[i] &= ~PAGE_WATCH;
+	for (i = 0; i < debug.watches; i++)
+		for (x = debug.watch[i].a & ~PAGE_MASK; x < debug.watch[i].a + debug.watch[i].len; x += PAGE_SIZE)
+			pageflags[x >> PAGE_SHIFT] |= PAGE_WATCH;
+
+	return 0;
+}
+
+/* Whether the last SYSTEM_BREAK was a watchpoint, and if so the first
+ * watched byte the store reached.
+ */
+int
+system_watchhit(DWORD *a)
+{
+	if (debug.watched)
+		*a = debug.watch_addr;
+	return debug.watched;
+}
+
+/* with a debugger attached, compute every flag instead of only live ones */
+void
+system_setdebugger(int attached)
+{
+	debug.attached = attached;
+	flags_flush();
+}
+
+/* Run in lockstep with another copy of this machine: system_run() returns
+ * SYSTEM_BLOCK before the instruction ending each basic block, where
+ * system_statehash() can be compared. A reference computes every flag.
+ * Call once the guest is loaded, before running it.
+ */
+void
+system_setlockstep(int reference)
+{
+	size_t i;
+
+	lockstep.on = 1;
+	lockstep.reference = reference;
+	lockstep.at = UINT64_MAX;
+	lockstep.mem = hash_sum(sysmem, RAM_SIZE);
+	for (i = 0; i < PAGES; i++)
+		if (pagemap[i] >= sysmem && pagemap[i] < sysmem + RAM_SIZE)
+			pageflags[i] |= PAGE_HASH;
+	flags_flush();
+	next_event = 0;
+}
+
+/* hash of the registers, flags and RAM, kept up to date in lockstep */
+uint64_t
+system_statehash(void)
+{
+	uint64_t h = 0, x;
+	size_t i;
+
+	hash_settle();
+	for (i = 0; i < HASH_LOW; i += sizeof(x)) {
+		memcpy(&x, sysmem + i, sizeof(x));
+		h = (h ^ x) * 0x100000001b3ull;
+	}
+	for (i = 0; i < 8; i++)
+		h = (h ^ cpu.regs[i]) * 0x100000001b3ull;
+	for (i = 0; i < 4; i++)
+		h = (h ^ cpu.segs[i]) * 0x100000001b3ull;
+	h = (h ^ IP) * 0x100000001b3ull;
+	h = (h ^ cpu.flags) * 0x100000001b3ull;
+	return (h ^ lockstep.mem) * 0x100000001b3ull;
 }
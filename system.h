@@ -1,14 +1,91 @@
 #ifndef SYSTEM_H_
 #define SYSTEM_H_
 #include <stdint.h>
+#include <stdio.h>
 
 typedef uint8_t BYTE;
 typedef uint16_t WORD;
 typedef uint32_t DWORD;
 
+/* why system_run() returned */
+enum system_reason {
+	SYSTEM_BUDGET, /* ran all the instructions it was given */
+	SYSTEM_WAIT_KEY, /* waiting for a key */
+	SYSTEM_WAIT_TIMER, /* idle until the next timer tick */
+	SYSTEM_WAIT_DISK, /* waiting for a disk to seek */
+	SYSTEM_HALTED, /* the program terminated */
+	SYSTEM_ERROR, /* emulation stopped on an error */
+	SYSTEM_BREAK, /* stopped at a breakpoint, or after a watched store */
+	SYSTEM_BLOCK, /* at the end of a basic block, in lockstep */
+};
+
+/* what went wrong, for the error counts in struct system_metrics */
+enum system_error {
+	SYSTEM_ERROR_OPCODE, /* an instruction that is unknown or not emulated */
+	SYSTEM_ERROR_MEMORY, /* an access to memory with nothing there */
+	SYSTEM_ERROR_SERVICE, /* an interrupt or BIOS or DOS call not emulated */
+	SYSTEM_ERROR_HALT, /* HLT with interrupts disabled */
+	SYSTEM_ERROR_INPUT, /* waiting on keyboard input that has ended */
+	SYSTEM_ERROR_REPLAY, /* the guest strayed from the log being replayed, or the log being recorded failed */
+	SYSTEM_ERROR_KINDS
+};
+
+/* counters of what the machine did, since system_init() */
+struct system_metrics {
+	uint64_t insns; /* instructions retired */
+	uint64_t cycles; /* CPU clocks gone by, idle or not */
+	uint64_t idle_cycles; /* of those, spent waiting */
+	uint64_t skipped_cycles; /* of those, skipped over busy-wait loops */
+	uint64_t host_ns; /* host time spent in system_run() */
+	uint64_t flags_computed, flags_skipped;
+	uint64_t interrupts[256]; /* by vector, counting timer ticks as 08h */
+	uint64_t doscalls[256]; /* INT 21h by AH */
+	uint64_t errors[SYSTEM_ERROR_KINDS];
+};
+
+/* what ends a wait: input on fd, if not -1, or timeout_us going by */
+struct system_wait {
+	int fd;
+	unsigned long timeout_us;
+};
+
 int system_init(void);
 void system_done(void);
 int system_loadfile(const char *filename);
 int system_setargs(int argc, char *argv[]);
+int system_savetemplate(const char *filename);
+int system_loadtemplate(const char *filename);
+void system_setthrottle(int on);
+void system_setrewind(unsigned ms, unsigned long kb);
+int system_record(const char *filename);
+int system_replay(const char *filename);
+int system_setspeaker(const char *filename);
+void system_setconsole(FILE *f);
+void system_setinput(int fd);
+int system_exitcode(void);
+const char *system_exitmessage(void);
+int system_attachdisk(int drive, const char *filename);
+void system_setdisklatency(int realistic);
+int system_boot(int drive);
+int system_setroot(const char *dir);
 int system_tick(int n);
+enum system_reason system_run(unsigned long budget, struct system_wait *w);
+uint64_t system_insns(void);
+void system_metrics(struct system_metrics *m);
+int system_writemetrics(FILE *f);
+int system_rewind(uint64_t insns);
+void system_setlockstep(int reference);
+uint64_t system_statehash(void);
+int system_setheatmap(const char *prefix);
+
+/* for debuggers, see system_getregs() for the order */
+#define SYSTEM_REGS 16
+void system_getregs(DWORD regs[SYSTEM_REGS]);
+void system_setregs(const DWORD regs[SYSTEM_REGS]);
+size_t system_peek(DWORD a, void *buf, size_t len);
+size_t system_poke(DWORD a, const void *buf, size_t len);
+int system_setbreak(DWORD a, int on);
+int system_setwatch(DWORD a, DWORD len, int on);
+int system_watchhit(DWORD *a);
+void system_setdebugger(int attached);
 #endif
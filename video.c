@@ -0,0 +1,371 @@
+#include "video.h"
+#include <string.h>
+
+/* Video Adapter
+ *
+ * A VGA cut down to what programs reach through the BIOS and a handful of
+ * registers: the CGA, EGA and VGA graphics modes, the DAC palette and the
+ * retrace bits of the status register. Text modes have their memory at
+ * B800 but nothing is drawn from it yet.
+ *
+ * Linear modes are plain memory that the page table points at. Planar
+ * modes are four planes of 64K that the CPU only reaches through here:
+ * writes go to the planes enabled in the sequencer map mask, merged with
+ * the latches under the graphics controller bit mask (write mode 0 only),
+ * and reads load the latches and return the plane chosen by read map select.
+ */
+
+static const struct video_mode modes[] = {
+	{ 0x00, SCREEN_NONE, 40, 25, 80, 0xB800, 0x8000, 0, 70 },
+	{ 0x01, SCREEN_NONE, 40, 25, 80, 0xB800, 0x8000, 0, 70 },
+	{ 0x02, SCREEN_NONE, 80, 25, 160, 0xB800, 0x8000, 0, 70 },
+	{ 0x03, SCREEN_NONE, 80, 25, 160, 0xB800, 0x8000, 0, 70 },
+	{ 0x04, SCREEN_2BPP, 320, 200, 80, 0xB800, 0x8000, 0x2000, 60 },
+	{ 0x05, SCREEN_2BPP, 320, 200, 80, 0xB800, 0x8000, 0x2000, 60 },
+	{ 0x06, SCREEN_1BPP, 640, 200, 80, 0xB800, 0x8000, 0x2000, 60 },
+	{ 0x07, SCREEN_NONE, 80, 25, 160, 0xB000, 0x8000, 0, 70 },
+	{ 0x0D, SCREEN_PLANAR4, 320, 200, 40, 0xA000, 0, 0, 70 },
+	{ 0x0E, SCREEN_PLANAR4, 640, 200, 80, 0xA000, 0, 0, 70 },
+	{ 0x10, SCREEN_PLANAR4, 640, 350, 80, 0xA000, 0, 0, 70 },
+	{ 0x12, SCREEN_PLANAR4, 640, 480, 80, 0xA000, 0, 0, 60 },
+	{ 0x13, SCREEN_8BPP, 320, 200, 320, 0xA000, 0, 0, 70 },
+};
+
+/* the 16 colors of the CGA and EGA, as 6-bit DAC values */
+static const BYTE ega[16][3] = {
+	{ 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0x2A }, { 0x00, 0x2A, 0x00 }, { 0x00, 0x2A, 0x2A },
+	{ 0x2A, 0x00, 0x00 }, { 0x2A, 0x00, 0x2A }, { 0x2A, 0x15, 0x00 }, { 0x2A, 0x2A, 0x2A },
+	{ 0x15, 0x15, 0x15 }, { 0x15, 0x15, 0x3F }, { 0x15, 0x3F, 0x15 }, { 0x15, 0x3F, 0x3F },
+	{ 0x3F, 0x15, 0x15 }, { 0x3F, 0x15, 0x3F }, { 0x3F, 0x3F, 0x15 }, { 0x3F, 0x3F, 0x3F },
+};
+
+/* CGA palette 1, high intensity: black, cyan, magenta, white */
+static const BYTE cga4[4] = { 0, 11, 13, 15 };
+
+#define RETRACE_PART 20 /* vertical retrace is the first 1/20 of a frame */
+#define FRAME_LINES 449 /* lines in a frame, for the horizontal blanking bit */
+
+#define STATUS_BLANK 0x01
+#define STATUS_RETRACE 0x08
+
+static BYTE vram[SCREEN_VRAM];
+static const struct video_mode *cur = &modes[3];
+static unsigned long cpu_hz;
+static BYTE seq_index, map_mask = 0x0f;
+static BYTE gc_index, read_map, bit_mask = 0xff;
+static BYTE latch[4];
+static BYTE dac[256][3];
+static BYTE dac_write, dac_read, dac_write_rgb, dac_read_rgb;
+static int changed = 1; /* mode or palette changed since the last frame */
+
+void
+video_init(unsigned long clock_hz)
+{
+	unsigned i;
+
+	cpu_hz = clock_hz;
+	memcpy(dac, ega, sizeof(ega));
+	/* the BIOS default has a grey ramp next, then hue rings this only approximates */
+	for (i = 16; i < 32; i++)
+		dac[i][0] = dac[i][1] = dac[i][2] = (i - 16) * 63 / 15;
+	for (i = 32; i < 248; i++) {
+		dac[i][0] = (i - 32) / 36 * 63 / 5;
+		dac[i][1] = (i - 32) / 6 % 6 * 63 / 5;
+		dac[i][2] = (i - 32) % 6 * 63 / 5;
+	}
+	video_setmode(0x03, 1);
+}
+
+/* Returns 0, or -1 if the mode is not one we have. */
+int
+video_setmode(BYTE mode, int clear)
+{
+	unsigned i;
+
+	for (i = 0; i < sizeof(modes) / sizeof(*modes); i++)
+		if (modes[i].mode == mode)
+			break;
+	if (i == sizeof(modes) / sizeof(*modes))
+		return -1;
+	cur = &modes[i];
+	if (clear)
+		memset(vram, 0, sizeof(vram));
+	map_mask = 0x0f;
+	bit_mask = 0xff;
+	read_map = 0;
+	changed = 1;
+
+	return 0;
+}
+
+const struct video_mode *
+video_mode(void)
+{
+	return cur;
+}
+
+/* memory behind the window of a linear mode */
+BYTE *
+video_memory(void)
+{
+	return vram;
+}
+
+/* CPU clocks from one vertical retrace to the next */
+uint64_t
+video_frametime(void)
+{
+	return cpu_hz / cur->hz;
+}
+
+/* read from a planar window, loading the latches */
+BYTE
+video_read(WORD ofs)
+{
+	unsigned p;
+
+	for (p = 0; p < 4; p++)
+		latch[p] = vram[p * SCREEN_PLANE + ofs];
+	return latch[read_map & 3];
+}
+
+void
+video_write(WORD ofs, BYTE b)
+{
+	unsigned p;
+
+	for (p = 0; p < 4; p++)
+		if (map_mask & (1u << p))
+			vram[p * SCREEN_PLANE + ofs] = (b & bit_mask) | (latch[p] & ~bit_mask);
+	changed = 1;
+}
+
+BYTE
+video_in(WORD port, uint64_t now)
+{
+	uint64_t frame = video_frametime(), phase = now % frame;
+	BYTE b;
+
+	switch (port) {
+	case 0x3C5:
+		return seq_index == 2 ? map_mask : 0;
+	case 0x3C9: /* DAC data */
+		b = dac[dac_read][dac_read_rgb];
+		if (++dac_read_rgb == 3) {
+			dac_read_rgb = 0;
+			dac_read++;
+		}
+		return b;
+	case 0x3CF:
+		return gc_index == 4 ? read_map : gc_index == 8 ? bit_mask : 0;
+	case 0x3DA: /* input status 1 */
+		b = 0;
+		if (phase < frame / RETRACE_PART)
+			b |= STATUS_RETRACE | STATUS_BLANK;
+		else if (phase % (frame / FRAME_LINES) >= frame / FRAME_LINES * 4 / 5)
+			b |= STATUS_BLANK;
+		return b;
+	}
+
+	return 0xffu;
+}
+
+/* the clock at which what port 3DAh reads next changes: the end of vertical
+ * retrace, or the start or end of the next horizontal blank
+ */
+uint64_t
+video_status_until(uint64_t now)
+{
+	uint64_t frame = video_frametime(), line = frame / FRAME_LINES;
+	uint64_t base = now - now % frame, phase = now % frame, next;
+
+	if (phase < frame / RETRACE_PART)
+		return base + frame / RETRACE_PART;
+	next = phase - phase % line + (phase % line < line * 4 / 5 ? line * 4 / 5 : line);
+	return base + (next < frame ? next : frame);
+}
+
+/* Returns 0, or -1 if the port is not the video adapter's. */
+int
+video_out(WORD port, BYTE b)
+{
+	switch (port) {
+	case 0x3C4:
+		seq_index = b;
+		break;
+	case 0x3C5:
+		if (seq_index == 2)
+			map_mask = b & 0x0f;
+		break;
+	case 0x3C7: /* DAC read index */
+		dac_read = b;
+		dac_read_rgb = 0;
+		break;
+	case 0x3C8: /* DAC write index */
+		dac_write = b;
+		dac_write_rgb = 0;
+		break;
+	case 0x3C9: /* DAC data */
+		dac[dac_write][dac_write_rgb] = b & 0x3f;
+		if (++dac_write_rgb == 3) {
+			dac_write_rgb = 0;
+			dac_write++;
+		}
+		changed = 1;
+		break;
+	case 0x3CE:
+		gc_index = b;
+		break;
+	case 0x3CF:
+		if (gc_index == 4)
+			read_map = b & 3;
+		else if (gc_index == 8)
+			bit_mask = b;
+		break;
+	case 0x3C0: /* attribute controller, CRTC and CGA registers are not kept */
+	case 0x3D4:
+	case 0x3D5:
+	case 0x3D8:
+	case 0x3D9:
+		break;
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+/* where pixel x,y is, and its shift within the byte */
+static BYTE *
+pixel_at(WORD x, WORD y, unsigned *shift)
+{
+	unsigned bits = cur->format == SCREEN_1BPP ? 1 : cur->format == SCREEN_2BPP ? 2 :
+		cur->format == SCREEN_8BPP ? 8 : 1;
+	unsigned perbyte = 8 / bits;
+	BYTE *p = vram;
+
+	if (cur->interleave)
+		p += (y & 1) * cur->interleave + (y >> 1) * cur->pitch;
+	else
+		p += y * cur->pitch;
+	*shift = (perbyte - 1 - x % perbyte) * bits;
+	return p + x / perbyte;
+}
+
+BYTE
+video_getpixel(WORD x, WORD y)
+{
+	unsigned shift, p;
+	BYTE *b, c = 0;
+
+	if (cur->format == SCREEN_NONE || x >= cur->width || y >= cur->height)
+		return 0;
+	b = pixel_at(x, y, &shift);
+	switch (cur->format) {
+	case SCREEN_1BPP:
+		return (*b >> shift) & 1;
+	case SCREEN_2BPP:
+		return (*b >> shift) & 3;
+	case SCREEN_PLANAR4:
+		for (p = 0; p < 4; p++)
+			c |= ((b[p * SCREEN_PLANE] >> shift) & 1) << p;
+		return c;
+	default:
+		return *b;
+	}
+}
+
+/* set a pixel as INT 10h does, XORing it in if bit 7 of the color is set */
+void
+video_setpixel(WORD x, WORD y, BYTE color)
+{
+	unsigned shift, p, mask;
+	BYTE *b, c;
+
+	if (cur->format == SCREEN_NONE || x >= cur->width || y >= cur->height)
+		return;
+	b = pixel_at(x, y, &shift);
+	c = color & 0x7f;
+	changed = 1;
+	if (cur->format == SCREEN_8BPP) {
+		*b = color & 0x80 ? *b ^ c : color;
+		return;
+	}
+	if (color & 0x80)
+		c ^= video_getpixel(x, y);
+	switch (cur->format) {
+	case SCREEN_1BPP:
+	case SCREEN_2BPP:
+		mask = (cur->format == SCREEN_1BPP ? 1 : 3) << shift;
+		*b = (*b & ~mask) | ((c << shift) & mask);
+		break;
+	case SCREEN_PLANAR4:
+		for (p = 0; p < 4; p++)
+			b[p * SCREEN_PLANE] = (b[p * SCREEN_PLANE] & ~(1u << shift)) | (((c >> p) & 1) << shift);
+		break;
+	default:
+		break;
+	}
+}
+
+void
+video_setdac(BYTE index, BYTE r, BYTE g, BYTE b)
+{
+	dac[index][0] = r & 0x3f;
+	dac[index][1] = g & 0x3f;
+	dac[index][2] = b & 0x3f;
+	changed = 1;
+}
+
+void
+video_getdac(BYTE index, BYTE *r, BYTE *g, BYTE *b)
+{
+	*r = dac[index][0];
+	*g = dac[index][1];
+	*b = dac[index][2];
+}
+
+static uint32_t
+dac_rgb(BYTE i)
+{
+	return (uint32_t)((dac[i][0] << 2) | (dac[i][0] >> 4)) << 16 |
+		(uint32_t)((dac[i][1] << 2) | (dac[i][1] >> 4)) << 8 |
+		((dac[i][2] << 2) | (dac[i][2] >> 4));
+}
+
+/* At vertical retrace: hand a snapshot to the screen if anything changed,
+ * dirty saying whether the CPU wrote to the linear window since the last.
+ */
+void
+video_frame(uint64_t now, int dirty)
+{
+	struct screen_frame *f;
+	unsigned i, p, len;
+
+	if (cur->format == SCREEN_NONE || (!dirty && !changed))
+		return;
+	changed = 0;
+
+	f = screen_back();
+	f->format = cur->format;
+	f->width = cur->width;
+	f->height = cur->height;
+	f->pitch = cur->pitch;
+	f->interleave = cur->interleave;
+	f->cycles = now;
+	f->clock_hz = cpu_hz;
+	if (cur->format == SCREEN_2BPP) {
+		for (i = 0; i < 4; i++)
+			f->palette[i] = dac_rgb(cga4[i]);
+	} else if (cur->format == SCREEN_1BPP) {
+		f->palette[0] = dac_rgb(0);
+		f->palette[1] = dac_rgb(15);
+	} else {
+		for (i = 0; i < 256; i++)
+			f->palette[i] = dac_rgb(i);
+	}
+	len = cur->interleave ? cur->interleave * 2 : cur->pitch * cur->height;
+	for (p = 0; p < (cur->format == SCREEN_PLANAR4 ? 4u : 1u); p++)
+		memcpy(f->vram + p * SCREEN_PLANE, vram + p * SCREEN_PLANE, len);
+	screen_publish();
+}
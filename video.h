@@ -0,0 +1,32 @@
+#ifndef VIDEO_H_
+#define VIDEO_H_
+#include "screen.h"
+#include "system.h"
+
+struct video_mode {
+	BYTE mode;
+	enum screen_format format;
+	WORD width, height; /* pixels, or characters in text modes */
+	WORD pitch; /* bytes per line */
+	WORD seg; /* where the CPU sees it */
+	WORD size; /* bytes of window at seg, up to 64K (0) */
+	WORD interleave; /* offset of the odd lines, 0 if they follow the even ones */
+	BYTE hz; /* refresh rate */
+};
+
+void video_init(unsigned long clock_hz);
+int video_setmode(BYTE mode, int clear);
+const struct video_mode *video_mode(void);
+BYTE *video_memory(void);
+uint64_t video_frametime(void);
+BYTE video_read(WORD ofs);
+void video_write(WORD ofs, BYTE b);
+BYTE video_in(WORD port, uint64_t now);
+uint64_t video_status_until(uint64_t now);
+int video_out(WORD port, BYTE b);
+BYTE video_getpixel(WORD x, WORD y);
+void video_setpixel(WORD x, WORD y, BYTE color);
+void video_setdac(BYTE index, BYTE r, BYTE g, BYTE b);
+void video_getdac(BYTE index, BYTE *r, BYTE *g, BYTE *b);
+void video_frame(uint64_t now, int dirty);
+#endif
@@ -0,0 +1,94 @@
+	; Extended memory through the XMS driver: allocate a block, copy a
+	; string into it and back out, and free it. Prints a line and exits
+	; with code 0, or exits with the number of the check that failed.
+	;	monk xms.com
+	org 100h
+
+%macro	expect 2		; condition that has to hold, else exit with code %2
+	j%1 %%ok
+	mov ax, 4c00h + %2
+	int 21h
+%%ok:
+%endmacro
+
+	mov ax, 4300h		; installed
+	int 2fh
+	cmp al, 80h
+	expect e, 1
+	mov ax, 4310h		; entry point
+	int 2fh
+	mov [xms], bx
+	push es			; no MOV from a segment register yet
+	pop cx
+	mov [xms + 2], cx
+	mov ah, 0		; version 2 or later
+	call far [xms]
+	cmp ah, 2
+	expect ae, 2
+	mov ah, 9		; 1K block
+	mov dx, 1
+	call far [xms]
+	cmp ax, 1
+	expect e, 3
+	mov [toxms + 10], dx
+	mov [fromxms + 4], dx
+	mov [odd + 10], dx
+	push ds
+	pop cx
+	mov [toxms + 8], cx
+	mov [fromxms + 14], cx
+	mov [odd + 8], cx
+	mov ah, 0bh		; into the block
+	mov si, toxms
+	call far [xms]
+	cmp ax, 1
+	expect e, 4
+	mov ah, 0bh		; and back
+	mov si, fromxms
+	call far [xms]
+	cmp ax, 1
+	expect e, 5
+	mov si, data
+	mov di, buf
+	mov cx, datalen
+compare:
+	mov al, [si]
+	cmp al, [di]
+	expect e, 6
+	inc si
+	inc di
+	loop compare
+	mov ah, 0bh		; an odd length is refused
+	mov si, odd
+	call far [xms]
+	cmp ax, 0
+	expect e, 7
+	cmp bl, 0a7h
+	expect e, 7
+	mov ah, 0bh		; before the handles are looked at
+	mov si, oddhandle
+	call far [xms]
+	cmp bl, 0a7h
+	expect e, 7
+	mov ah, 0ah		; free
+	mov dx, [toxms + 10]
+	call far [xms]
+	cmp ax, 1
+	expect e, 8
+	mov ah, 9
+	mov dx, pass
+	int 21h
+	mov ax, 4c00h
+	int 21h
+
+	; moves: length, source handle and offset, destination handle and
+	; offset, where handle 0 is conventional memory at segment:offset
+toxms:	dw datalen, 0, 0, data, 0, 0, 0, 0
+fromxms:	dw datalen, 0, 0, 0, 0, 0, buf, 0
+odd:	dw 3, 0, 0, data, 0, 0, 0, 0
+oddhandle:	dw 3, 0, 0ffffh, 0, 0, 0, 0, 0
+xms:	dw 0, 0
+data:	db "monk XMS test..."
+datalen	equ $ - data
+buf:	times datalen db 0
+pass:	db "XMS OK", 13, 10, "$"
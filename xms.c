@@ -0,0 +1,189 @@
+#include "xms.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Extended Memory (XMS 3.0)
+ *
+ * Extended memory blocks are plain host allocations, so a move between two
+ * of them or to and from conventional memory comes down to one memmove()
+ * by the caller. There is no HMA and no UMBs.
+ */
+
+#define XMS_HANDLES 32
+
+struct block {
+	int used;
+	unsigned kb;
+	unsigned locks;
+	BYTE *mem;
+};
+
+static struct block blocks[XMS_HANDLES];
+static unsigned total_kb, free_kb;
+
+int
+xms_init(unsigned kb)
+{
+	xms_done();
+	total_kb = free_kb = kb;
+
+	return 0;
+}
+
+void
+xms_done(void)
+{
+	unsigned i;
+
+	for (i = 0; i < XMS_HANDLES; i++) {
+		free(blocks[i].mem);
+		memset(&blocks[i], 0, sizeof(blocks[i]));
+	}
+	total_kb = free_kb = 0;
+}
+
+unsigned
+xms_free(void)
+{
+	return free_kb;
+}
+
+unsigned
+xms_handles(void)
+{
+	unsigned i, n = 0;
+
+	for (i = 1; i < XMS_HANDLES; i++)
+		n += !blocks[i].used;
+	return n;
+}
+
+/* handle 0 stands for conventional memory in a move, so it is never given out */
+static struct block *
+block_get(int handle)
+{
+	if (handle <= 0 || handle >= XMS_HANDLES || !blocks[handle].used)
+		return NULL;
+	return &blocks[handle];
+}
+
+static int
+block_resize(struct block *b, unsigned kb)
+{
+	BYTE *mem;
+
+	if (kb > b->kb && kb - b->kb > free_kb)
+		return -XMSERR_FULL;
+	mem = realloc(b->mem, kb ? (size_t)kb * 1024 : 1);
+	if (!mem)
+		return -XMSERR_FULL;
+	if (kb > b->kb)
+		memset(mem + (size_t)b->kb * 1024, 0, (size_t)(kb - b->kb) * 1024);
+	b->mem = mem;
+	free_kb = free_kb + b->kb - kb;
+	b->kb = kb;
+
+	return 0;
+}
+
+int
+xms_alloc(unsigned kb)
+{
+	int i, e;
+
+	for (i = 1; i < XMS_HANDLES && blocks[i].used; i++)
+		;
+	if (i == XMS_HANDLES)
+		return -XMSERR_NOHANDLES;
+	e = block_resize(&blocks[i], kb);
+	if (e)
+		return e;
+	blocks[i].used = 1;
+
+	return i;
+}
+
+int
+xms_realloc(int handle, unsigned kb)
+{
+	struct block *b = block_get(handle);
+
+	if (!b)
+		return -XMSERR_HANDLE;
+	if (b->locks)
+		return -XMSERR_LOCKED;
+	return block_resize(b, kb);
+}
+
+int
+xms_release(int handle)
+{
+	struct block *b = block_get(handle);
+
+	if (!b)
+		return -XMSERR_HANDLE;
+	if (b->locks)
+		return -XMSERR_LOCKED;
+	free_kb += b->kb;
+	free(b->mem);
+	memset(b, 0, sizeof(*b));
+
+	return 0;
+}
+
+int
+xms_info(int handle, unsigned *kb, unsigned *locks)
+{
+	struct block *b = block_get(handle);
+
+	if (!b)
+		return -XMSERR_HANDLE;
+	*kb = b->kb;
+	*locks = b->locks;
+
+	return 0;
+}
+
+int
+xms_lock(int handle, DWORD *addr)
+{
+	struct block *b = block_get(handle);
+
+	if (!b)
+		return -XMSERR_HANDLE;
+	if (b->locks == 0xff)
+		return -XMSERR_LOCKED;
+	b->locks++;
+	*addr = XMS_BASE + (DWORD)handle * 0x1000000ul;
+
+	return 0;
+}
+
+int
+xms_unlock(int handle)
+{
+	struct block *b = block_get(handle);
+
+	if (!b)
+		return -XMSERR_HANDLE;
+	if (!b->locks)
+		return -XMSERR_NOTLOCKED;
+	b->locks--;
+
+	return 0;
+}
+
+/* host memory for part of a block, NULL if it runs past the end */
+BYTE *
+xms_block(int handle, DWORD offset, size_t len)
+{
+	struct block *b = block_get(handle);
+	size_t size;
+
+	if (!b)
+		return NULL;
+	size = (size_t)b->kb * 1024;
+	if (offset > size || len > size - offset)
+		return NULL;
+	return b->mem + offset;
+}
@@ -0,0 +1,30 @@
+#ifndef XMS_H_
+#define XMS_H_
+#include <stddef.h>
+#include "system.h"
+
+/* XMS error codes, returned negated */
+#define XMSERR_FUNCTION 0x80
+#define XMSERR_FULL 0xA0
+#define XMSERR_NOHANDLES 0xA1
+#define XMSERR_HANDLE 0xA2
+#define XMSERR_LENGTH 0xA7
+#define XMSERR_LOCKED 0xAB
+#define XMSERR_NOTLOCKED 0xAA
+#define XMSERR_NOUMB 0xB1
+
+/* locked blocks are reported at made up addresses above the HMA */
+#define XMS_BASE 0x110000ul
+
+int xms_init(unsigned kb);
+void xms_done(void);
+unsigned xms_free(void);
+unsigned xms_handles(void);
+int xms_alloc(unsigned kb);
+int xms_realloc(int handle, unsigned kb);
+int xms_release(int handle);
+int xms_info(int handle, unsigned *kb, unsigned *locks);
+int xms_lock(int handle, DWORD *addr);
+int xms_unlock(int handle);
+BYTE *xms_block(int handle, DWORD offset, size_t len);
+#endif